@@ -0,0 +1,230 @@
+#include "BindlessHeap.h"
+#include "Debug.h"
+
+BindlessHeap::BindlessHeap()
+{
+}
+
+BindlessHeap::~BindlessHeap()
+{
+	Destroy();
+}
+
+bool BindlessHeap::Init(VkDevice heapDevice, uint32_t bufferCapacity, uint32_t imageCapacity)
+{
+	device = heapDevice;
+	buffers.capacity = bufferCapacity;
+	images.capacity = imageCapacity;
+
+	//Every stage can index the heap, the push constants say which slots a draw uses
+	VkDescriptorSetLayoutBinding bindings[2]{};
+	bindings[0].binding = bufferBinding;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	bindings[0].descriptorCount = bufferCapacity;
+	bindings[0].stageFlags = VK_SHADER_STAGE_ALL;
+	bindings[0].pImmutableSamplers = nullptr;
+	bindings[1].binding = imageBinding;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[1].descriptorCount = imageCapacity;
+	bindings[1].stageFlags = VK_SHADER_STAGE_ALL;
+	bindings[1].pImmutableSamplers = nullptr;
+
+	//Slots that were never written, or were released, are fine as long as no shader reads them
+	VkDescriptorBindingFlagsEXT bindingFlags[2] = {
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT,
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT,
+	};
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsCreateInfo{};
+	bindingFlagsCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+	bindingFlagsCreateInfo.pNext = nullptr;
+	bindingFlagsCreateInfo.bindingCount = 2;
+	bindingFlagsCreateInfo.pBindingFlags = bindingFlags;
+
+	VkDescriptorSetLayoutCreateInfo setLayoutCreateInfo{};
+	setLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setLayoutCreateInfo.pNext = &bindingFlagsCreateInfo;
+	setLayoutCreateInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+	setLayoutCreateInfo.bindingCount = 2;
+	setLayoutCreateInfo.pBindings = bindings;
+
+	auto err = vkCreateDescriptorSetLayout(device, &setLayoutCreateInfo, nullptr, &setLayout);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create bindless descriptor set layout", DebugLevel::Error);
+		return false;
+	}
+
+	VkDescriptorPoolSize poolSizes[2]{};
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizes[0].descriptorCount = bufferCapacity;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[1].descriptorCount = imageCapacity;
+
+	VkDescriptorPoolCreateInfo poolCreateInfo{};
+	poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolCreateInfo.pNext = nullptr;
+	poolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+	poolCreateInfo.maxSets = 1;
+	poolCreateInfo.poolSizeCount = 2;
+	poolCreateInfo.pPoolSizes = poolSizes;
+
+	err = vkCreateDescriptorPool(device, &poolCreateInfo, nullptr, &pool);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create bindless descriptor pool", DebugLevel::Error);
+		return false;
+	}
+
+	VkDescriptorSetAllocateInfo setAllocateInfo{};
+	setAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	setAllocateInfo.pNext = nullptr;
+	setAllocateInfo.descriptorPool = pool;
+	setAllocateInfo.descriptorSetCount = 1;
+	setAllocateInfo.pSetLayouts = &setLayout;
+
+	err = vkAllocateDescriptorSets(device, &setAllocateInfo, &set);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Allocate bindless descriptor set", DebugLevel::Error);
+		return false;
+	}
+
+	Debug::Log(string("Bindless heap: ") + to_string(bufferCapacity) + " buffers, " + to_string(imageCapacity) + " images");
+	return true;
+}
+
+void BindlessHeap::Destroy()
+{
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	vkDestroyDescriptorPool(device, pool, nullptr);
+	vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+	pool = VK_NULL_HANDLE;
+	setLayout = VK_NULL_HANDLE;
+	set = VK_NULL_HANDLE;
+
+	buffers = SlotAllocator();
+	images = SlotAllocator();
+	device = VK_NULL_HANDLE;
+}
+
+uint32_t BindlessHeap::SlotAllocator::Allocate()
+{
+	if (!freeIndices.empty())
+	{
+		uint32_t index = freeIndices.back();
+		freeIndices.pop_back();
+		return index;
+	}
+
+	return used < capacity ? used++ : invalidIndex;
+}
+
+uint32_t BindlessHeap::AddBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+{
+	uint32_t index;
+	{
+		lock_guard<mutex> lock(slotsMutex);
+		index = buffers.Allocate();
+	}
+	if (index == invalidIndex)
+	{
+		Debug::Log("Bindless heap is out of buffer slots", DebugLevel::Error);
+		return invalidIndex;
+	}
+
+	VkDescriptorBufferInfo bufferInfo{};
+	bufferInfo.buffer = buffer;
+	bufferInfo.offset = offset;
+	bufferInfo.range = range;
+
+	VkWriteDescriptorSet write{};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.pNext = nullptr;
+	write.dstSet = set;
+	write.dstBinding = bufferBinding;
+	write.dstArrayElement = index;
+	write.descriptorCount = 1;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	write.pBufferInfo = &bufferInfo;
+
+	//Each slot is only ever written by its owner
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+	return index;
+}
+
+uint32_t BindlessHeap::AddImage(VkImageView imageView, VkSampler sampler, VkImageLayout imageLayout)
+{
+	uint32_t index;
+	{
+		lock_guard<mutex> lock(slotsMutex);
+		index = images.Allocate();
+	}
+	if (index == invalidIndex)
+	{
+		Debug::Log("Bindless heap is out of image slots", DebugLevel::Error);
+		return invalidIndex;
+	}
+
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.sampler = sampler;
+	imageInfo.imageView = imageView;
+	imageInfo.imageLayout = imageLayout;
+
+	VkWriteDescriptorSet write{};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.pNext = nullptr;
+	write.dstSet = set;
+	write.dstBinding = imageBinding;
+	write.dstArrayElement = index;
+	write.descriptorCount = 1;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	write.pImageInfo = &imageInfo;
+
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+	return index;
+}
+
+void BindlessHeap::ReleaseBuffer(uint32_t index)
+{
+	Release(buffers, index);
+}
+
+void BindlessHeap::ReleaseImage(uint32_t index)
+{
+	Release(images, index);
+}
+
+void BindlessHeap::Release(SlotAllocator& slots, uint32_t index)
+{
+	if (index == invalidIndex)
+		return;
+
+	lock_guard<mutex> lock(slotsMutex);
+	SlotAllocator::Released released;
+	released.index = index;
+	released.submissionValue = submissionValue;
+	slots.released.push_back(released);
+}
+
+void BindlessHeap::BeginFrame(uint64_t frameSubmissionValue, uint64_t completedValue)
+{
+	lock_guard<mutex> lock(slotsMutex);
+	submissionValue = frameSubmissionValue;
+
+	for (SlotAllocator* slots : { &buffers, &images })
+	{
+		auto& released = slots->released;
+		size_t kept = 0;
+		for (size_t i = 0; i < released.size(); ++i)
+		{
+			if (released[i].submissionValue <= completedValue)
+				slots->freeIndices.push_back(released[i].index);
+			else
+				released[kept++] = released[i];
+		}
+		released.resize(kept);
+	}
+}
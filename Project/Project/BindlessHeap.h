@@ -0,0 +1,70 @@
+#pragma once
+#include "vulkan\vulkan.h"
+#include <mutex>
+#include <vector>
+using namespace std;
+
+//One descriptor set holding every storage buffer and every sampled image, for VK_EXT_descriptor_indexing.
+//Shaders declare the arrays as runtime sized in the bindless set and are handed indices (in push constants)
+//rather than having sets bound per draw. The set is bound once per command buffer.
+//
+//	layout (set = N, binding = 0) buffer Buffers { ... } buffers[];
+//	layout (set = N, binding = 1) uniform sampler2D images[];
+//
+//Slots are written as resources are added, which update-after-bind allows while the set is in use.
+//Released slots are reused once the submissions that could still read them have completed. Thread safe.
+class BindlessHeap
+{
+public:
+	static const uint32_t bufferBinding { 0 };
+	static const uint32_t imageBinding { 1 };
+	static const uint32_t invalidIndex { 0xffffffff };
+
+	BindlessHeap();
+	~BindlessHeap();
+
+	//Capacities are clamped by the caller to the device's update-after-bind limits
+	bool				Init(VkDevice device, uint32_t bufferCapacity, uint32_t imageCapacity);
+	void				Destroy();
+
+	VkDescriptorSetLayout	GetSetLayout() const { return setLayout; }
+	VkDescriptorSet			GetSet() const { return set; }
+
+	//invalidIndex when the heap is full
+	uint32_t			AddBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range);
+	uint32_t			AddImage(VkImageView imageView, VkSampler sampler, VkImageLayout imageLayout);
+	void				ReleaseBuffer(uint32_t index);
+	void				ReleaseImage(uint32_t index);
+
+	//Call before recording a frame, with the submission queue's value it will be submitted as and the completed value
+	void				BeginFrame(uint64_t submissionValue, uint64_t completedValue);
+
+private:
+	//Free indices into one of the arrays, released ones wait out the frames in flight
+	struct SlotAllocator
+	{
+		struct Released
+		{
+			uint32_t	index;
+			uint64_t	submissionValue;	//the last that could read it
+		};
+		uint32_t			capacity { 0 };
+		uint32_t			used { 0 };		//indices below this have been handed out at some point
+		vector<uint32_t>	freeIndices;
+		vector<Released>	released;
+
+		uint32_t			Allocate();
+	};
+
+	VkDevice				device { VK_NULL_HANDLE };
+	VkDescriptorSetLayout	setLayout { VK_NULL_HANDLE };
+	VkDescriptorPool		pool { VK_NULL_HANDLE };
+	VkDescriptorSet			set { VK_NULL_HANDLE };
+
+	mutex					slotsMutex;
+	SlotAllocator			buffers;
+	SlotAllocator			images;
+	uint64_t				submissionValue { 0 };
+
+	void				Release(SlotAllocator& slots, uint32_t index);
+};
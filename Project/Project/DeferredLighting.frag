@@ -0,0 +1,50 @@
+#version 450
+
+//Deferred shading's second subpass: every pixel is lit once from the G-buffer, read at this pixel as input attachments
+
+const uint LightCount = 3;
+
+struct Light
+{
+	vec4 position;	//clip space, w is the radius
+	vec4 colour;
+};
+
+//Matches Renderer::DeferredLightingConstants
+layout (push_constant) uniform LightingConstants
+{
+	Light lights[LightCount];
+	vec4 ambient;
+	vec2 viewportSize;
+} lighting;
+
+layout (input_attachment_index = 0, set = 0, binding = 0) uniform subpassInput i_Albedo;
+layout (input_attachment_index = 1, set = 0, binding = 1) uniform subpassInput i_Normal;
+layout (input_attachment_index = 2, set = 0, binding = 2) uniform subpassInput i_Depth;
+
+layout(location = 0) out vec4 o_Color;
+
+void main(){
+	vec4 albedo = subpassLoad(i_Albedo);
+	float depth = subpassLoad(i_Depth).r;
+
+	//Nothing drawn here, the clear colour passes through unlit
+	if (depth >= 1.0f)
+	{
+		o_Color = albedo;
+		return;
+	}
+
+	vec3 normal = normalize(subpassLoad(i_Normal).xyz * 2.0f - 1.0f);
+	vec3 position = vec3(gl_FragCoord.xy / lighting.viewportSize * 2.0f - 1.0f, depth);
+
+	vec3 colour = albedo.rgb * lighting.ambient.rgb;
+	for (uint i = 0; i < LightCount; ++i)
+	{
+		vec3 toLight = lighting.lights[i].position.xyz - position;
+		float distance = length(toLight);
+		float attenuation = clamp(1.0f - distance / lighting.lights[i].position.w, 0.0f, 1.0f);
+		colour += albedo.rgb * lighting.lights[i].colour.rgb * max(dot(normal, toLight / distance), 0.0f) * attenuation * attenuation;
+	}
+	o_Color = vec4(colour, albedo.a);
+}
@@ -0,0 +1,333 @@
+#include "DescriptorAllocator.h"
+#include "Debug.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace
+{
+	//Descriptors of each type per set a pool is sized for. Pools are sized for the mix of sets rather than any
+	//one layout, running out of any type moves on to the next pool.
+	struct PoolRatio
+	{
+		VkDescriptorType	descriptorType;
+		float				perSet;
+	};
+	const PoolRatio poolRatios[] = {
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,			1.0f },
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,	1.0f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,			2.0f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,	0.5f },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,	2.0f },
+		{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,				1.0f },
+		{ VK_DESCRIPTOR_TYPE_SAMPLER,					0.5f },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,				0.5f },
+		{ VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,			0.5f },
+	};
+	const uint32_t maxSetsPerPool { 4096 };
+}
+
+DescriptorSetBindings::DescriptorSetBindings(VkDescriptorSetLayout setLayout)
+{
+	memset(this, 0, sizeof(DescriptorSetBindings));
+	layout = setLayout;
+}
+
+void DescriptorSetBindings::BindBuffer(uint32_t binding, VkDescriptorType descriptorType, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+{
+	if (bindingCount == maxBindings)
+	{
+		Debug::Log("Too many bindings in descriptor set", DebugLevel::Error);
+		return;
+	}
+
+	bindings[bindingCount].binding = binding;
+	bindings[bindingCount].descriptorType = descriptorType;
+	bindings[bindingCount].buffer = buffer;
+	bindings[bindingCount].offset = offset;
+	bindings[bindingCount].range = range;
+	++bindingCount;
+}
+
+void DescriptorSetBindings::BindImage(uint32_t binding, VkDescriptorType descriptorType, VkImageView imageView, VkImageLayout imageLayout, VkSampler sampler)
+{
+	if (bindingCount == maxBindings)
+	{
+		Debug::Log("Too many bindings in descriptor set", DebugLevel::Error);
+		return;
+	}
+
+	bindings[bindingCount].binding = binding;
+	bindings[bindingCount].descriptorType = descriptorType;
+	bindings[bindingCount].imageView = imageView;
+	bindings[bindingCount].sampler = sampler;
+	bindings[bindingCount].imageLayout = imageLayout;
+	++bindingCount;
+}
+
+uint64_t DescriptorSetBindings::Hash() const
+{
+	return HashBytes(this, sizeof(DescriptorSetBindings));
+}
+
+bool DescriptorSetBindings::operator==(const DescriptorSetBindings& other) const
+{
+	return memcmp(this, &other, sizeof(DescriptorSetBindings)) == 0;
+}
+
+DescriptorPoolChain::DescriptorPoolChain()
+{
+}
+
+DescriptorPoolChain::~DescriptorPoolChain()
+{
+	Destroy();
+}
+
+void DescriptorPoolChain::Init(VkDevice poolDevice, uint32_t initialSetsPerPool, VkDescriptorPoolCreateFlags flags)
+{
+	device = poolDevice;
+	nextPoolSize = initialSetsPerPool;
+	poolFlags = flags;
+}
+
+void DescriptorPoolChain::Destroy()
+{
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	for (auto pool : usedPools)
+	{
+		vkDestroyDescriptorPool(device, pool, nullptr);
+	}
+	usedPools.clear();
+
+	for (auto pool : freePools)
+	{
+		vkDestroyDescriptorPool(device, pool, nullptr);
+	}
+	freePools.clear();
+
+	device = VK_NULL_HANDLE;
+}
+
+VkDescriptorSet DescriptorPoolChain::Allocate(VkDescriptorSetLayout layout, VkDescriptorPool* outPool)
+{
+	lock_guard<mutex> lock(poolsMutex);
+	if (usedPools.empty() && !NextPool())
+		return VK_NULL_HANDLE;
+
+	VkDescriptorSetAllocateInfo setAllocateInfo{};
+	setAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	setAllocateInfo.pNext = nullptr;
+	setAllocateInfo.descriptorPool = usedPools.back();
+	setAllocateInfo.descriptorSetCount = 1;
+	setAllocateInfo.pSetLayouts = &layout;
+
+	VkDescriptorSet set = VK_NULL_HANDLE;
+	auto err = vkAllocateDescriptorSets(device, &setAllocateInfo, &set);
+	if (err == VK_ERROR_OUT_OF_POOL_MEMORY_KHR || err == VK_ERROR_FRAGMENTED_POOL)
+	{
+		//Full, a fresh pool can only fail if the layout is bigger than a whole pool
+		if (!NextPool())
+			return VK_NULL_HANDLE;
+
+		setAllocateInfo.descriptorPool = usedPools.back();
+		err = vkAllocateDescriptorSets(device, &setAllocateInfo, &set);
+	}
+
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Allocate descriptor set", DebugLevel::Error);
+		return VK_NULL_HANDLE;
+	}
+
+	if (outPool)
+		*outPool = usedPools.back();
+	return set;
+}
+
+void DescriptorPoolChain::Free(VkDescriptorPool pool, VkDescriptorSet set)
+{
+	lock_guard<mutex> lock(poolsMutex);
+	vkFreeDescriptorSets(device, pool, 1, &set);
+}
+
+void DescriptorPoolChain::Reset()
+{
+	lock_guard<mutex> lock(poolsMutex);
+	for (auto pool : usedPools)
+	{
+		vkResetDescriptorPool(device, pool, 0);
+		freePools.push_back(pool);
+	}
+	usedPools.clear();
+}
+
+bool DescriptorPoolChain::NextPool()
+{
+	if (!freePools.empty())
+	{
+		usedPools.push_back(freePools.back());
+		freePools.pop_back();
+		return true;
+	}
+
+	VkDescriptorPoolSize poolSizes[sizeof(poolRatios) / sizeof(poolRatios[0])];
+	uint32_t poolSizeCount = sizeof(poolRatios) / sizeof(poolRatios[0]);
+	for (uint32_t i = 0; i < poolSizeCount; ++i)
+	{
+		poolSizes[i].type = poolRatios[i].descriptorType;
+		poolSizes[i].descriptorCount = static_cast<uint32_t>(poolRatios[i].perSet * nextPoolSize) + 1;
+	}
+
+	VkDescriptorPoolCreateInfo poolCreateInfo{};
+	poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolCreateInfo.pNext = nullptr;
+	poolCreateInfo.flags = poolFlags;
+	poolCreateInfo.maxSets = nextPoolSize;
+	poolCreateInfo.poolSizeCount = poolSizeCount;
+	poolCreateInfo.pPoolSizes = poolSizes;
+
+	VkDescriptorPool pool = VK_NULL_HANDLE;
+	auto err = vkCreateDescriptorPool(device, &poolCreateInfo, nullptr, &pool);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create descriptor pool", DebugLevel::Error);
+		return false;
+	}
+
+	usedPools.push_back(pool);
+	nextPoolSize = min(nextPoolSize * 2, maxSetsPerPool);
+	return true;
+}
+
+DescriptorAllocator::DescriptorAllocator()
+{
+}
+
+DescriptorAllocator::~DescriptorAllocator()
+{
+	Destroy();
+}
+
+void DescriptorAllocator::Init(VkDevice allocatorDevice, uint32_t framesInFlight)
+{
+	device = allocatorDevice;
+
+	//Frame sets are rewritten every frame, cached sets are few but may be freed individually
+	frameChains.resize(framesInFlight);
+	for (auto& frameChain : frameChains)
+	{
+		frameChain.reset(new DescriptorPoolChain());
+		frameChain->Init(device, 64, 0);
+	}
+	cachedChain.Init(device, 16, VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT);
+}
+
+void DescriptorAllocator::Destroy()
+{
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	frameChains.clear();
+	cachedSets.clear();
+	cachedChain.Destroy();
+	device = VK_NULL_HANDLE;
+}
+
+void DescriptorAllocator::BeginFrame(uint32_t index)
+{
+	frameIndex = index;
+	frameChains[frameIndex]->Reset();
+}
+
+VkDescriptorSet DescriptorAllocator::AllocateFrameSet(const DescriptorSetBindings& bindings)
+{
+	VkDescriptorSet set = frameChains[frameIndex]->Allocate(bindings.layout);
+	if (set != VK_NULL_HANDLE)
+		WriteSet(set, bindings);
+	return set;
+}
+
+VkDescriptorSet DescriptorAllocator::GetCachedSet(const DescriptorSetBindings& bindings)
+{
+	lock_guard<mutex> lock(cacheMutex);
+	auto found = cachedSets.find(bindings);
+	if (found != cachedSets.end())
+		return found->second.set;
+
+	CachedSet cachedSet{};
+	cachedSet.set = cachedChain.Allocate(bindings.layout, &cachedSet.pool);
+	if (cachedSet.set == VK_NULL_HANDLE)
+		return VK_NULL_HANDLE;
+
+	WriteSet(cachedSet.set, bindings);
+	cachedSets.emplace(bindings, cachedSet);
+	return cachedSet.set;
+}
+
+void DescriptorAllocator::EvictCachedSets(VkBuffer buffer)
+{
+	lock_guard<mutex> lock(cacheMutex);
+	for (auto it = cachedSets.begin(); it != cachedSets.end();)
+	{
+		const DescriptorSetBindings& bindings = it->first;
+		bool referenced = false;
+		for (uint32_t i = 0; i < bindings.bindingCount; ++i)
+		{
+			referenced |= bindings.bindings[i].buffer == buffer;
+		}
+
+		if (referenced)
+		{
+			cachedChain.Free(it->second.pool, it->second.set);
+			it = cachedSets.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+size_t DescriptorAllocator::GetCachedSetCount()
+{
+	lock_guard<mutex> lock(cacheMutex);
+	return cachedSets.size();
+}
+
+void DescriptorAllocator::WriteSet(VkDescriptorSet set, const DescriptorSetBindings& bindings)
+{
+	VkDescriptorBufferInfo bufferInfos[DescriptorSetBindings::maxBindings]{};
+	VkDescriptorImageInfo imageInfos[DescriptorSetBindings::maxBindings]{};
+	VkWriteDescriptorSet writes[DescriptorSetBindings::maxBindings]{};
+	for (uint32_t i = 0; i < bindings.bindingCount; ++i)
+	{
+		const DescriptorSetBindings::Binding& binding = bindings.bindings[i];
+		writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[i].pNext = nullptr;
+		writes[i].dstSet = set;
+		writes[i].dstBinding = binding.binding;
+		writes[i].dstArrayElement = 0;
+		writes[i].descriptorCount = 1;
+		writes[i].descriptorType = static_cast<VkDescriptorType>(binding.descriptorType);
+
+		if (binding.buffer != VK_NULL_HANDLE)
+		{
+			bufferInfos[i].buffer = binding.buffer;
+			bufferInfos[i].offset = binding.offset;
+			bufferInfos[i].range = binding.range;
+			writes[i].pBufferInfo = &bufferInfos[i];
+		}
+		else
+		{
+			imageInfos[i].sampler = binding.sampler;
+			imageInfos[i].imageView = binding.imageView;
+			imageInfos[i].imageLayout = static_cast<VkImageLayout>(binding.imageLayout);
+			writes[i].pImageInfo = &imageInfos[i];
+		}
+	}
+
+	vkUpdateDescriptorSets(device, bindings.bindingCount, writes, 0, nullptr);
+}
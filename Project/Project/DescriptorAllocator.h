@@ -0,0 +1,123 @@
+#pragma once
+#include "vulkan\vulkan.h"
+#include "Hash.h"
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+//The resources written to one descriptor set. Plain data, zeroed on construction (padding included)
+//so it can be hashed and compared bytewise.
+struct DescriptorSetBindings
+{
+	static const uint32_t maxBindings { 8 };
+
+	explicit DescriptorSetBindings(VkDescriptorSetLayout setLayout);
+
+	//For dynamic uniform and storage buffers, offset is the base the dynamic offset is added to
+	//and range the size of one element
+	void BindBuffer(uint32_t binding, VkDescriptorType descriptorType, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range);
+	void BindImage(uint32_t binding, VkDescriptorType descriptorType, VkImageView imageView, VkImageLayout imageLayout, VkSampler sampler);
+
+	uint64_t Hash() const;
+	bool operator==(const DescriptorSetBindings& other) const;
+
+	struct Binding
+	{
+		uint32_t		binding;
+		uint32_t		descriptorType;
+		VkBuffer		buffer;
+		VkDeviceSize	offset;
+		VkDeviceSize	range;
+		VkImageView		imageView;
+		VkSampler		sampler;
+		uint32_t		imageLayout;
+	};
+
+	VkDescriptorSetLayout	layout;
+	uint32_t				bindingCount;
+	Binding					bindings[maxBindings];
+};
+
+//Descriptor pools of one lifetime. When a pool runs out another is taken, each new one twice the size of the last.
+//Thread safe.
+class DescriptorPoolChain
+{
+public:
+	DescriptorPoolChain();
+	~DescriptorPoolChain();
+
+	//VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT in flags allows Free
+	void				Init(VkDevice device, uint32_t initialSetsPerPool, VkDescriptorPoolCreateFlags flags);
+	void				Destroy();
+
+	//VK_NULL_HANDLE on failure. outPool is the pool it came from, for Free.
+	VkDescriptorSet		Allocate(VkDescriptorSetLayout layout, VkDescriptorPool* outPool = nullptr);
+	void				Free(VkDescriptorPool pool, VkDescriptorSet set);
+
+	//Every set from the chain is released at once, the pools are kept for reuse
+	void				Reset();
+
+private:
+	VkDevice					device { VK_NULL_HANDLE };
+	VkDescriptorPoolCreateFlags	poolFlags { 0 };
+	uint32_t					nextPoolSize { 0 };
+	mutex						poolsMutex;
+	vector<VkDescriptorPool>	usedPools;		//the last one is allocated from
+	vector<VkDescriptorPool>	freePools;		//reset, ready to be used again
+
+	bool				NextPool();
+};
+
+//Descriptor sets by lifetime:
+//	Frame sets come from a chain per frame in flight, reset wholesale with vkResetDescriptorPool once the GPU is done with the frame.
+//	Cached sets live until evicted, one per unique DescriptorSetBindings, so unchanged resources are only ever written once.
+//Per object data belongs in a dynamic uniform buffer bound through a cached set, with the object picked by the dynamic
+//offset at bind time rather than by a set of its own.
+//Thread safe, apart from BeginFrame.
+class DescriptorAllocator
+{
+public:
+	DescriptorAllocator();
+	~DescriptorAllocator();
+
+	void				Init(VkDevice device, uint32_t framesInFlight);
+	void				Destroy();
+
+	//Call once the GPU has finished with the frame in flight, before anything allocates for it
+	void				BeginFrame(uint32_t frameIndex);
+
+	//Written with bindings, valid until this frame in flight comes round again
+	VkDescriptorSet		AllocateFrameSet(const DescriptorSetBindings& bindings);
+
+	//The set written with these bindings, allocated and written the first time they are seen
+	VkDescriptorSet		GetCachedSet(const DescriptorSetBindings& bindings);
+
+	//Frees cached sets referencing the buffer. Call before destroying it, once no frame in flight uses the sets.
+	void				EvictCachedSets(VkBuffer buffer);
+
+	size_t				GetCachedSetCount();
+
+private:
+	struct DescriptorSetBindingsHasher
+	{
+		size_t operator()(const DescriptorSetBindings& bindings) const { return static_cast<size_t>(bindings.Hash()); }
+	};
+
+	struct CachedSet
+	{
+		VkDescriptorSet		set;
+		VkDescriptorPool	pool;
+	};
+
+	VkDevice					device { VK_NULL_HANDLE };
+	vector<unique_ptr<DescriptorPoolChain>>	frameChains;
+	uint32_t					frameIndex { 0 };
+
+	DescriptorPoolChain			cachedChain;
+	mutex						cacheMutex;
+	unordered_map<DescriptorSetBindings, CachedSet, DescriptorSetBindingsHasher> cachedSets;
+
+	void				WriteSet(VkDescriptorSet set, const DescriptorSetBindings& bindings);
+};
@@ -0,0 +1,37 @@
+#include "EmbeddedShaders.h"
+
+#include <string.h>
+
+//Generated next to each shader by its CustomBuild step, listed by the GenerateEmbeddedShaderTable target in Project.vcxproj
+#include "EmbeddedShaderIncludes.inc"
+
+namespace
+{
+	struct EmbeddedShader
+	{
+		const char*		filename;
+		const uint32_t*	code;
+		size_t			size;	//bytes
+	};
+
+	//One entry per shader the project compiles, named as the loose SPIR-V would be. Generated from the same
+	//CustomBuild items, so a shader added to the project is embedded without touching this file.
+	const EmbeddedShader embeddedShaders[] =
+	{
+#include "EmbeddedShaderTable.inc"
+	};
+}
+
+bool FindEmbeddedShader(const char* filename, const uint32_t*& outCode, size_t& outSize)
+{
+	for (auto& shader : embeddedShaders)
+	{
+		if (strcmp(shader.filename, filename) == 0)
+		{
+			outCode = shader.code;
+			outSize = shader.size;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+//SPIR-V compiled into the executable by the shader build step (glslangValidator --vn), looked up by the
+//file name it would otherwise be loaded from. Static storage, nothing to free.
+bool FindEmbeddedShader(const char* filename, const uint32_t*& outCode, size_t& outSize);
@@ -2,10 +2,20 @@
 
 layout (location = 0) in vec4 i_Position;
 
-//layout (binding = 1) uniform UBO
-//{
-//	vec4 u_Colour;
-//} ubo;
+//Specialization constants, ids match ShaderConstants.h
+layout (constant_id = 0) const bool c_QuantizedPositions = false;
+layout (constant_id = 1) const float c_PositionScale = 1.0f;
+layout (constant_id = 2) const float c_ColourR = 1.0f;
+layout (constant_id = 3) const float c_ColourG = 1.0f;
+layout (constant_id = 4) const float c_ColourB = 0.0f;
+layout (constant_id = 5) const float c_ColourA = 1.0f;
+layout (constant_id = 6) const bool c_UniformColour = false;
+
+//Per draw, picked with a dynamic offset
+layout (set = 0, binding = 0) uniform BatchData
+{
+	vec4 u_Colour;
+} batch;
 
 out gl_PerVertex
 {
@@ -16,6 +26,10 @@ layout(location = 0) out vec4 v_Color;
 
 void main()
 {
-	gl_Position = i_Position;
-	v_Color = vec4(1.0f, 1.0f, 0, 1.0f); //ubo.u_Colour;
+	vec4 position = i_Position;
+	if (c_QuantizedPositions)
+		position.xyz *= c_PositionScale;
+
+	gl_Position = position;
+	v_Color = c_UniformColour ? batch.u_Colour : vec4(c_ColourR, c_ColourG, c_ColourB, c_ColourA);
 }
\ No newline at end of file
@@ -0,0 +1,45 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+layout (location = 0) in vec4 i_Position;
+
+//Specialization constants, ids match ShaderConstants.h
+layout (constant_id = 0) const bool c_QuantizedPositions = false;
+layout (constant_id = 1) const float c_PositionScale = 1.0f;
+
+//Bindless heap, see BindlessHeap.h. Each view of the buffer array aliases the same binding.
+layout (set = 1, binding = 0) readonly buffer InstanceBuffer
+{
+	mat4 transforms[];
+} instanceBuffers[];
+
+layout (set = 1, binding = 0) readonly buffer ColourBuffer
+{
+	vec4 colours[];
+} colourBuffers[];
+
+//Heap slots this draw reads, matches Renderer::BindlessDrawConstants
+layout (push_constant) uniform DrawConstants
+{
+	uint instanceBuffer;
+	uint colourBuffer;
+	uint colourIndex;
+} draw;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+layout(location = 0) out vec4 v_Color;
+
+void main()
+{
+	vec4 position = i_Position;
+	if (c_QuantizedPositions)
+		position.xyz *= c_PositionScale;
+
+	//gl_InstanceIndex includes firstInstance, so it indexes the whole instance buffer, or with GPU culling the packed visible instances
+	gl_Position = instanceBuffers[draw.instanceBuffer].transforms[gl_InstanceIndex] * position;
+	v_Color = colourBuffers[draw.colourBuffer].colours[draw.colourIndex];
+}
\ No newline at end of file
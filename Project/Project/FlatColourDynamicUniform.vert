@@ -0,0 +1,23 @@
+#version 450
+
+layout (location = 0) in vec4 i_Position;
+
+//Per draw data, picked with a dynamic offset into a set bound per draw. Matches Renderer::DrawData.
+layout (set = 0, binding = 0) uniform DrawUniforms
+{
+	mat4 transform;
+	vec4 colour;
+} draw;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+layout(location = 0) out vec4 v_Color;
+
+void main()
+{
+	gl_Position = draw.transform * i_Position;
+	v_Color = draw.colour;
+}
\ No newline at end of file
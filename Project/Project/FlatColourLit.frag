@@ -0,0 +1,59 @@
+#version 450
+
+//FlatColour.frag lit by clustered lights: the froxel a fragment falls in lists the only lights that can reach it,
+//built each frame by LightCull.comp
+
+struct Light
+{
+	vec4 position;	//clip space, w is the radius
+	vec4 colour;
+};
+
+layout (set = 3, binding = 0) uniform ClusterParams
+{
+	uvec4 gridSize;		//tiles across, down, depth slices, then the light count
+	vec4 viewportSize;
+} params;
+
+layout (std430, set = 3, binding = 1) readonly buffer Lights
+{
+	Light lights[];
+};
+
+layout (std430, set = 3, binding = 2) readonly buffer LightGrid
+{
+	uvec2 clusters[];	//offset, count
+};
+
+layout (std430, set = 3, binding = 3) readonly buffer LightIndices
+{
+	uint indexCount;
+	uint indices[];
+};
+
+const vec3 Ambient = vec3(0.1f);
+
+layout(location = 0) in vec4 v_Color;
+
+layout(location = 0) out vec4 o_Color;
+
+void main(){
+	vec2 screen = gl_FragCoord.xy / params.viewportSize.xy;
+	uvec3 coord = min(uvec3(vec3(screen * vec2(params.gridSize.xy), gl_FragCoord.z * float(params.gridSize.z))), params.gridSize.xyz - 1);
+	uvec2 cluster = clusters[(coord.z * params.gridSize.y + coord.y) * params.gridSize.x + coord.x];
+
+	//Meshes carry no normals yet, everything faces the viewer
+	vec3 position = vec3(screen * 2.0f - 1.0f, gl_FragCoord.z);
+	vec3 normal = vec3(0.0f, 0.0f, -1.0f);
+
+	vec3 colour = v_Color.rgb * Ambient;
+	for (uint i = 0; i < cluster.y; ++i)
+	{
+		Light light = lights[indices[cluster.x + i]];
+		vec3 toLight = light.position.xyz - position;
+		float distance = length(toLight);
+		float attenuation = clamp(1.0f - distance / light.position.w, 0.0f, 1.0f);
+		colour += v_Color.rgb * light.colour.rgb * max(dot(normal, toLight / max(distance, 1e-5f)), 0.0f) * attenuation * attenuation;
+	}
+	o_Color = vec4(colour, v_Color.a);
+}
@@ -0,0 +1,23 @@
+#version 450
+
+layout (location = 0) in vec4 i_Position;
+
+//Per draw data straight from the command buffer, matches Renderer::DrawData
+layout (push_constant) uniform DrawConstants
+{
+	mat4 transform;
+	vec4 colour;
+} draw;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+layout(location = 0) out vec4 v_Color;
+
+void main()
+{
+	gl_Position = draw.transform * i_Position;
+	v_Color = draw.colour;
+}
\ No newline at end of file
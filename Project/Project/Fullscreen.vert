@@ -0,0 +1,14 @@
+#version 450
+
+//One triangle covering the screen, from the vertex index alone so no vertex buffer is bound
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+void main()
+{
+	vec2 position = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+	gl_Position = vec4(position * 2.0f - 1.0f, 0.0f, 1.0f);
+}
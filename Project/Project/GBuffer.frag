@@ -0,0 +1,15 @@
+#version 450
+
+//Deferred shading's first subpass: surface attributes only, lighting reads them back in DeferredLighting.frag
+
+layout(location = 0) in vec4 v_Color;
+
+layout(location = 0) out vec4 o_Albedo;
+layout(location = 1) out vec4 o_Normal;	//packed into 0-1
+
+void main(){
+	o_Albedo = v_Color;
+
+	//Meshes carry no normals yet, everything faces the viewer
+	o_Normal = vec4(vec3(0.0f, 0.0f, -1.0f) * 0.5f + 0.5f, 0.0f);
+}
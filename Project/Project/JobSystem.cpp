@@ -0,0 +1,427 @@
+#include "JobSystem.h"
+#include "Debug.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <math.h>
+
+namespace
+{
+	//Which job system (if any) the current thread works for
+	thread_local const JobSystem*	currentJobSystem	{ nullptr };
+	thread_local int				currentWorkerIndex	{ -1 };
+}
+
+bool JobDeque::Push(Job* job)
+{
+	int64_t b = bottom.load(memory_order_relaxed);
+	int64_t t = top.load(memory_order_acquire);
+	if (b - t >= capacity)
+	{
+		return false;
+	}
+
+	jobs[b & (capacity - 1)].store(job, memory_order_relaxed);
+	bottom.store(b + 1, memory_order_release);
+	return true;
+}
+
+Job* JobDeque::Pop()
+{
+	int64_t b = bottom.load(memory_order_relaxed) - 1;
+	bottom.store(b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t t = top.load(memory_order_relaxed);
+
+	if (t > b)
+	{
+		//Empty
+		bottom.store(b + 1, memory_order_relaxed);
+		return nullptr;
+	}
+
+	Job* job = jobs[b & (capacity - 1)].load(memory_order_relaxed);
+	if (t == b)
+	{
+		//Last job, race any thieves for it
+		if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+		{
+			job = nullptr;
+		}
+		bottom.store(b + 1, memory_order_relaxed);
+	}
+	return job;
+}
+
+Job* JobDeque::Steal()
+{
+	int64_t t = top.load(memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = bottom.load(memory_order_acquire);
+
+	if (t >= b)
+	{
+		return nullptr;
+	}
+
+	Job* job = jobs[t & (capacity - 1)].load(memory_order_relaxed);
+	if (!top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+	{
+		return nullptr;
+	}
+	return job;
+}
+
+int64_t JobDeque::Size() const
+{
+	int64_t b = bottom.load(memory_order_relaxed);
+	int64_t t = top.load(memory_order_relaxed);
+	return b > t ? b - t : 0;
+}
+
+JobSystem::JobSystem()
+{
+	externalWorker.jobRing.reset(new Job[jobRingSize]);
+}
+
+JobSystem::~JobSystem()
+{
+	Stop();
+}
+
+void JobSystem::Start(uint32_t count)
+{
+	threadCount = max(1u, count);
+	running = true;
+
+	workers.resize(threadCount);
+	for (auto& worker : workers)
+	{
+		worker.reset(new Worker());
+		worker->jobRing.reset(new Job[jobRingSize]);
+	}
+
+	currentJobSystem = this;
+	currentWorkerIndex = 0;
+
+	for (uint32_t i = 1; i < threadCount; ++i)
+	{
+		threads.push_back(thread(&JobSystem::WorkerLoop, this, i));
+	}
+
+	Debug::Log(string("Job system started with ") + to_string(threadCount) + " threads");
+}
+
+void JobSystem::Stop()
+{
+	if (!running)
+		return;
+
+	{
+		lock_guard<mutex> lock(wakeMutex);
+		running = false;
+	}
+	wakeCondition.notify_all();
+
+	for (auto& workerThread : threads)
+	{
+		workerThread.join();
+	}
+	threads.clear();
+
+	if (currentJobSystem == this)
+	{
+		currentJobSystem = nullptr;
+		currentWorkerIndex = -1;
+	}
+}
+
+int JobSystem::WorkerIndex() const
+{
+	return currentJobSystem == this ? currentWorkerIndex : -1;
+}
+
+Job* JobSystem::AllocateJob()
+{
+	int workerIndex = WorkerIndex();
+	Worker& worker = workerIndex >= 0 ? *workers[workerIndex] : externalWorker;
+	unique_lock<mutex> lock(externalRingMutex, defer_lock);
+	if (workerIndex < 0)
+	{
+		lock.lock();
+	}
+
+	for (;;)
+	{
+		//Usually the next slot along is free. One held by a long running or blocked job is skipped over.
+		//nextJob is reread each time, a job run while waiting may have allocated slots itself.
+		for (uint32_t i = 0; i < jobRingSize; ++i)
+		{
+			Job* job = &worker.jobRing[worker.nextJob];
+			worker.nextJob = (worker.nextJob + 1) & (jobRingSize - 1);
+			if (job->finished.load(memory_order_acquire))
+			{
+				job->finished.store(false, memory_order_relaxed);
+				return job;
+			}
+		}
+
+		//Ring full, every job is still queued or running. Workers help them along, external threads (holding the ring lock) only wait.
+		Job* other = workerIndex >= 0 ? FindJob(workerIndex) : nullptr;
+		if (other)
+		{
+			Execute(other, workerIndex);
+		}
+		else
+		{
+			this_thread::yield();
+		}
+	}
+}
+
+void JobSystem::Run(function<void()> work, JobCounter* counter, const JobCounter* dependency)
+{
+	//Allocated before the counter is raised, as queued jobs waiting on the counter may need to run to free a slot
+	Job* job = AllocateJob();
+	if (counter)
+	{
+		counter->fetch_add(1, memory_order_relaxed);
+	}
+
+	int workerIndex = WorkerIndex();
+	if (workerIndex < 0)
+	{
+		job->work = move(work);
+		job->counter = counter;
+		job->dependency = dependency;
+		lock_guard<mutex> lock(externalMutex);
+		externalJobs.push_back(job);
+		externalJobCount.fetch_add(1, memory_order_release);
+	}
+	else
+	{
+		job->work = move(work);
+		job->counter = counter;
+		job->dependency = dependency;
+		if (!workers[workerIndex]->deque.Push(job))
+		{
+			//Deque is full, so there is plenty to steal already
+			pendingJobs.fetch_add(1, memory_order_relaxed);
+			Execute(job, workerIndex);
+			return;
+		}
+	}
+
+	pendingJobs.fetch_add(1, memory_order_release);
+	wakeCondition.notify_one();
+}
+
+Job* JobSystem::FindJob(int workerIndex)
+{
+	if (workerIndex >= 0)
+	{
+		if (Job* job = workers[workerIndex]->deque.Pop())
+			return job;
+	}
+
+	//Steal, starting with the next worker along so thieves spread out
+	for (uint32_t i = 1; i <= threadCount; ++i)
+	{
+		uint32_t victim = (workerIndex + i) % threadCount;
+		if (victim == static_cast<uint32_t>(workerIndex))
+			continue;
+		if (Job* job = workers[victim]->deque.Steal())
+			return job;
+	}
+
+	if (externalJobCount.load(memory_order_acquire) > 0)
+	{
+		lock_guard<mutex> lock(externalMutex);
+		if (!externalJobs.empty())
+		{
+			Job* job = externalJobs.front();
+			externalJobs.erase(externalJobs.begin());
+			externalJobCount.fetch_sub(1, memory_order_relaxed);
+			return job;
+		}
+	}
+
+	if (blockedJobCount.load(memory_order_acquire) > 0)
+	{
+		lock_guard<mutex> lock(blockedMutex);
+		for (auto it = blockedJobs.begin(); it != blockedJobs.end(); ++it)
+		{
+			if ((*it)->dependency->load(memory_order_acquire) <= 0)
+			{
+				Job* job = *it;
+				blockedJobs.erase(it);
+				blockedJobCount.fetch_sub(1, memory_order_relaxed);
+				pendingJobs.fetch_add(1, memory_order_relaxed);
+				return job;
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+bool JobSystem::Execute(Job* job, int workerIndex)
+{
+	if (job->dependency && job->dependency->load(memory_order_acquire) > 0)
+	{
+		//Not ready. Parked rather than pushed back onto the deque, where the next Pop would return it straight away
+		//and a lone worker would spin on it instead of running the work it waits for. It stops counting as pending
+		//until released, so idle workers sleep rather than spin on it. The worker finishing its dependency looks
+		//for work next and releases it, others find it at the latest when their wait times out.
+		lock_guard<mutex> lock(blockedMutex);
+		blockedJobs.push_back(job);
+		blockedJobCount.fetch_add(1, memory_order_release);
+		pendingJobs.fetch_sub(1, memory_order_relaxed);
+		return false;
+	}
+
+	pendingJobs.fetch_sub(1, memory_order_relaxed);
+
+	job->work();
+	job->work = nullptr;
+	JobCounter* counter = job->counter;
+
+	//The slot may be reallocated as soon as this is set, so nothing touches the job after it
+	job->finished.store(true, memory_order_release);
+	if (counter)
+	{
+		counter->fetch_sub(1, memory_order_release);
+	}
+	return true;
+}
+
+void JobSystem::WorkerLoop(int workerIndex)
+{
+	currentJobSystem = this;
+	currentWorkerIndex = workerIndex;
+
+	uint32_t idleSpins = 0;
+	while (running)
+	{
+		if (Job* job = FindJob(workerIndex))
+		{
+			if (Execute(job, workerIndex))
+			{
+				idleSpins = 0;
+				continue;
+			}
+		}
+
+		//Spin briefly before sleeping, frames hand out work in bursts
+		if (++idleSpins < 64)
+		{
+			this_thread::yield();
+			continue;
+		}
+
+		unique_lock<mutex> lock(wakeMutex);
+		wakeCondition.wait_for(lock, chrono::milliseconds(1), [this]() { return !running || pendingJobs.load(memory_order_acquire) > 0; });
+	}
+}
+
+void JobSystem::Wait(const JobCounter& counter)
+{
+	int workerIndex = WorkerIndex();
+	while (counter.load(memory_order_acquire) > 0)
+	{
+		Job* job = FindJob(workerIndex);
+		if (job)
+		{
+			Execute(job, workerIndex);
+		}
+		else
+		{
+			this_thread::yield();
+		}
+	}
+}
+
+void JobSystem::SplitRange(uint32_t begin, uint32_t end, uint32_t grain, shared_ptr<function<void(uint32_t, uint32_t)>> work, JobCounter* counter)
+{
+	//Lazy binary splitting: only hand off half the range while the local deque is running dry
+	int workerIndex = WorkerIndex();
+	while (end - begin > grain && (workerIndex < 0 || workers[workerIndex]->deque.Size() < 2))
+	{
+		uint32_t middle = begin + (end - begin) / 2;
+		Run([this, middle, end, grain, work, counter]() { SplitRange(middle, end, grain, work, counter); }, counter);
+		end = middle;
+	}
+
+	(*work)(begin, end);
+}
+
+void JobSystem::ParallelFor(uint32_t count, function<void(uint32_t, uint32_t)> work, JobCounter* counter)
+{
+	if (count == 0)
+		return;
+
+	uint32_t grain = max(1u, count / (threadCount * 16));
+	auto sharedWork = make_shared<function<void(uint32_t, uint32_t)>>(move(work));
+	Run([this, count, grain, sharedWork, counter]() { SplitRange(0, count, grain, sharedWork, counter); }, counter);
+}
+
+void JobSystem::ParallelFor(uint32_t count, function<void(uint32_t, uint32_t)> work)
+{
+	JobCounter counter { 0 };
+	ParallelFor(count, move(work), &counter);
+	Wait(counter);
+}
+
+void JobSystem::Benchmark()
+{
+	const uint32_t itemCount = 1 << 22;
+	const uint32_t iterations = 10;
+	vector<float> data(itemCount);
+
+	auto kernel = [&data](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			data[i] = sqrtf(static_cast<float>(i)) * sinf(static_cast<float>(i));
+		}
+	};
+
+	uint32_t maxThreads = max(1u, thread::hardware_concurrency());
+	for (uint32_t threads = 1; threads <= maxThreads; ++threads)
+	{
+		//Same chunk count for both, so the difference is scheduling overhead
+		uint32_t chunkCount = threads * 16;
+
+		auto start = chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < iterations; ++i)
+		{
+			vector<future<void>> results;
+			results.reserve(chunkCount);
+			for (uint32_t chunk = 0; chunk < chunkCount; ++chunk)
+			{
+				uint32_t begin = uint64_t(itemCount) * chunk / chunkCount;
+				uint32_t end = uint64_t(itemCount) * (chunk + 1) / chunkCount;
+				results.push_back(async(launch::async, kernel, begin, end));
+			}
+			for (auto& result : results)
+			{
+				result.get();
+			}
+		}
+		double asyncMilliseconds = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / iterations;
+
+		JobSystem jobSystem;
+		jobSystem.Start(threads);
+		start = chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < iterations; ++i)
+		{
+			jobSystem.ParallelFor(itemCount, kernel);
+		}
+		double jobMilliseconds = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / iterations;
+		jobSystem.Stop();
+
+		Debug::Log(string("Job benchmark: ") + to_string(threads) + " threads, job system " + to_string(itemCount / jobMilliseconds / 1000.0) + " Mitems/s, std::async "
+			+ to_string(itemCount / asyncMilliseconds / 1000.0) + " Mitems/s");
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+//Incremented when a job is queued against it, decremented when the job finishes
+typedef atomic<int32_t> JobCounter;
+
+struct Job
+{
+	function<void()>	work;
+	JobCounter*			counter		{ nullptr };	//signalled on completion
+	const JobCounter*	dependency	{ nullptr };	//job will not start until this reaches zero
+	atomic<bool>		finished	{ true };		//its ring slot can be reused
+};
+
+//Chase-Lev work stealing deque. The owning thread pushes and pops at the bottom, other threads steal from the top.
+class JobDeque
+{
+public:
+	static const int64_t capacity { 4096 };
+
+	bool	Push(Job* job);
+	Job*	Pop();
+	Job*	Steal();
+	int64_t	Size() const;
+
+private:
+	atomic<int64_t>		top		{ 0 };
+	atomic<int64_t>		bottom	{ 0 };
+	atomic<Job*>		jobs[capacity];
+};
+
+class JobSystem
+{
+public:
+	JobSystem();
+	~JobSystem();
+
+	//The calling thread becomes worker 0 and helps out whenever it waits
+	void		Start(uint32_t threadCount);
+	void		Stop();
+	uint32_t	GetThreadCount() const { return threadCount; }
+
+	void		Run(function<void()> work, JobCounter* counter = nullptr, const JobCounter* dependency = nullptr);
+	void		Wait(const JobCounter& counter);
+
+	//Calls work(begin, end) over [0, count), splitting the range only while other workers are short of work
+	void		ParallelFor(uint32_t count, function<void(uint32_t, uint32_t)> work, JobCounter* counter);
+	void		ParallelFor(uint32_t count, function<void(uint32_t, uint32_t)> work);
+
+	//Throughput and scaling against a std::async baseline, written to the debug log
+	static void	Benchmark();
+
+private:
+	static const uint32_t jobRingSize { 4096 };	//jobs in flight allocated by one thread, more waits for the oldest to finish
+
+	struct Worker
+	{
+		JobDeque		deque;
+		unique_ptr<Job[]>	jobRing;
+		uint32_t		nextJob { 0 };
+	};
+
+	uint32_t				threadCount { 0 };
+	vector<unique_ptr<Worker>> workers;
+	vector<thread>			threads;
+	atomic<bool>			running { false };
+
+	//Jobs queued from threads that are not workers
+	mutex					externalMutex;
+	vector<Job*>			externalJobs;
+	atomic<int32_t>			externalJobCount { 0 };
+	mutex					externalRingMutex;	//externalWorker's ring is shared by every external thread
+	Worker					externalWorker;
+
+	//Jobs whose dependency was not ready when they were picked up, handed out again only once it is
+	mutex					blockedMutex;
+	vector<Job*>			blockedJobs;
+	atomic<int32_t>			blockedJobCount { 0 };
+
+	atomic<int32_t>			pendingJobs { 0 };
+	mutex					wakeMutex;
+	condition_variable		wakeCondition;
+
+	int		WorkerIndex() const;
+	Job*	AllocateJob();
+	Job*	FindJob(int workerIndex);
+	bool	Execute(Job* job, int workerIndex);
+	void	WorkerLoop(int workerIndex);
+	void	SplitRange(uint32_t begin, uint32_t end, uint32_t grain, shared_ptr<function<void(uint32_t, uint32_t)>> work, JobCounter* counter);
+};
@@ -0,0 +1,98 @@
+#include "LightClusters.h"
+#include "Debug.h"
+
+#include <algorithm>
+
+LightClusters::LightClusters(uint32_t tilesX, uint32_t tilesY, uint32_t slices)
+{
+	size[0] = tilesX;
+	size[1] = tilesY;
+	size[2] = slices;
+}
+
+void LightClusters::GetClusterBounds(uint32_t cluster, float outMin[3], float outMax[3]) const
+{
+	//Computed exactly as LightCull.comp does, so both sides agree on lights that only graze a box
+	uint32_t coord[3] = { cluster % size[0], (cluster / size[0]) % size[1], cluster / (size[0] * size[1]) };
+	for (uint32_t axis = 0; axis < 2; ++axis)
+	{
+		outMin[axis] = float(coord[axis]) / float(size[axis]) * 2.0f - 1.0f;
+		outMax[axis] = float(coord[axis] + 1) / float(size[axis]) * 2.0f - 1.0f;
+	}
+	outMin[2] = float(coord[2]) / float(size[2]);
+	outMax[2] = float(coord[2] + 1) / float(size[2]);
+}
+
+bool LightClusters::SphereIntersectsBox(const float sphere[4], const float boxMin[3], const float boxMax[3])
+{
+	//Distance from the centre to the nearest point of the box
+	float distanceSquared = 0.0f;
+	for (uint32_t axis = 0; axis < 3; ++axis)
+	{
+		float d = sphere[axis] - std::min(std::max(sphere[axis], boxMin[axis]), boxMax[axis]);
+		distanceSquared += d * d;
+	}
+	return distanceSquared <= sphere[3] * sphere[3];
+}
+
+void LightClusters::Bin(const vector<ClusterLight>& lights, uint32_t indexCapacity, vector<uint32_t>& outGrid, vector<uint32_t>& outIndices) const
+{
+	uint32_t clusterCount = GetClusterCount();
+	outGrid.assign(clusterCount * 2, 0);
+	outIndices.clear();
+
+	for (uint32_t cluster = 0; cluster < clusterCount; ++cluster)
+	{
+		float boxMin[3], boxMax[3];
+		GetClusterBounds(cluster, boxMin, boxMax);
+
+		uint32_t offset = static_cast<uint32_t>(outIndices.size());
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < lights.size() && count < maxClusterLights && offset + count < indexCapacity; ++i)
+		{
+			if (SphereIntersectsBox(lights[i].position, boxMin, boxMax))
+			{
+				outIndices.push_back(i);
+				++count;
+			}
+		}
+		outGrid[cluster * 2] = offset;
+		outGrid[cluster * 2 + 1] = count;
+	}
+}
+
+bool LightClusters::Validate(const vector<ClusterLight>& lights, uint32_t indexCapacity, const uint32_t* grid, const uint32_t* indices, uint32_t indexCount) const
+{
+	//Without a capacity, so lists cut short for want of room show up
+	vector<uint32_t> referenceGrid;
+	vector<uint32_t> referenceIndices;
+	Bin(lights, UINT32_MAX, referenceGrid, referenceIndices);
+	if (referenceIndices.size() > indexCapacity)
+	{
+		Debug::Log("Light clusters: " + to_string(referenceIndices.size()) + " indices needed, room for " + to_string(indexCapacity), DebugLevel::Warning);
+	}
+
+	uint32_t mismatches = 0;
+	for (uint32_t cluster = 0; cluster < GetClusterCount(); ++cluster)
+	{
+		uint32_t offset = grid[cluster * 2];
+		uint32_t count = grid[cluster * 2 + 1];
+		uint32_t referenceOffset = referenceGrid[cluster * 2];
+		uint32_t referenceCount = referenceGrid[cluster * 2 + 1];
+
+		//Lights go into each list in index order on both sides
+		bool match = count == referenceCount && offset + count <= indexCount &&
+			std::equal(indices + offset, indices + offset + count, referenceIndices.begin() + referenceOffset);
+		if (!match && mismatches++ == 0)
+		{
+			Debug::Log("Light clusters: cluster " + to_string(cluster) + " has " + to_string(count) + " lights, the reference " + to_string(referenceCount), DebugLevel::Error);
+		}
+	}
+
+	if (mismatches > 0)
+	{
+		Debug::Log("Light clusters: " + to_string(mismatches) + " of " + to_string(GetClusterCount()) + " clusters differ from the reference", DebugLevel::Error);
+		return false;
+	}
+	return true;
+}
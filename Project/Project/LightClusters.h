@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+//A light as the clustered lighting shaders see it
+struct ClusterLight	//matches LightCull.comp and FlatColourLit.frag, std430
+{
+	float		position[4];	//clip space, w is the radius
+	float		colour[4];
+};
+
+//Clustered forward lighting's froxel grid: screen tiles across and down, cut into depth slices. Each froxel gets a
+//compact list of the lights whose spheres touch its box, so a fragment loops over only the few that can reach it.
+//LightCull.comp builds the lists every frame, Bin is the same test on the CPU: the reference the GPU's lists are
+//validated against, and the lists themselves when the renderer bins on the host instead (Renderer::hostLightBinning).
+//There is no camera yet, so boxes are in clip space and slices are even in depth. A perspective camera would want
+//them exponential in view depth instead.
+class LightClusters
+{
+public:
+	static const uint32_t maxClusterLights { 128 };	//longer lists are cut short, on both sides
+
+	LightClusters(uint32_t tilesX, uint32_t tilesY, uint32_t slices);
+
+	const uint32_t*	GetSize() const { return size; }
+	uint32_t	GetClusterCount() const { return size[0] * size[1] * size[2]; }
+	void		GetClusterBounds(uint32_t cluster, float outMin[3], float outMax[3]) const;
+	static bool	SphereIntersectsBox(const float sphere[4], const float boxMin[3], const float boxMax[3]);
+
+	//outGrid is an (offset, count) pair per cluster into outIndices, which holds at most indexCapacity
+	void		Bin(const vector<ClusterLight>& lights, uint32_t indexCapacity, vector<uint32_t>& outGrid, vector<uint32_t>& outIndices) const;
+
+	//The GPU packs lists in whatever order its invocations reserve space, so each cluster's list is compared rather
+	//than the buffers. Lights dropped for want of capacity are a failure too.
+	bool		Validate(const vector<ClusterLight>& lights, uint32_t indexCapacity, const uint32_t* grid, const uint32_t* indices, uint32_t indexCount) const;
+
+private:
+	uint32_t	size[3];
+};
@@ -5,6 +5,9 @@
 int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstancee, LPSTR mCommandline, int commandShow)
 {
 	Renderer r;
-	r.Init(hInstance);
+	if (!r.Init(hInstance))
+		return 1;
+
+	return r.Run();
 
 }
\ No newline at end of file
@@ -1,8 +1,24 @@
 #pragma once
+#include "vulkan\vulkan.h"
+
 class MeshObject
 {
 public:
 	MeshObject();
 	~MeshObject();
+
+	VkBuffer		vertexBuffer	{ VK_NULL_HANDLE };
+	VkDeviceMemory	vertexMemory	{ VK_NULL_HANDLE };
+	uint32_t		vertexCount		{ 0 };
+
+	VkBuffer		indexBuffer		{ VK_NULL_HANDLE };
+	VkDeviceMemory	indexMemory		{ VK_NULL_HANDLE };
+	uint32_t		indexCount		{ 0 };
+
+	float			boundingRadius	{ 0.0f };
+	float			positionScale	{ 1.0f };	//quantized meshes, what their SNORM positions are multiplied by
+
+	//For pipelines using ShaderConstantUniformColour
+	float			colour[4]		{ 1.0f, 1.0f, 0.0f, 1.0f };
 };
 
@@ -0,0 +1,1415 @@
+#include <Windows.h>
+#include "PipelineManager.h"
+#include "Debug.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+	const uint32_t manifestMagic { 0x4e4d4950 };	//"PIMN"
+	const uint32_t manifestVersion { 6 };
+	const uint32_t maxManifestPipelines { 65536 };
+
+	struct ManifestHeader
+	{
+		uint32_t	magic;
+		uint32_t	version;
+		uint32_t	descriptionSize;
+		uint32_t	count;
+	};
+
+	int64_t Now()
+	{
+		return chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now().time_since_epoch()).count();
+	}
+}
+
+PipelineDescription::PipelineDescription()
+{
+	memset(this, 0, sizeof(PipelineDescription));
+
+	topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	polygonMode = VK_POLYGON_MODE_FILL;
+	cullMode = VK_CULL_MODE_BACK_BIT;
+	frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	colourWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+	colourAttachmentCount = 1;
+}
+
+void PipelineDescription::SetShaders(const char* vertexShaderName, const char* fragmentShaderName)
+{
+	//Unused characters stay zero so the names hash consistently
+	memset(vertexShader, 0, sizeof(vertexShader));
+	memset(fragmentShader, 0, sizeof(fragmentShader));
+	strncpy(vertexShader, vertexShaderName, maxShaderName - 1);
+	strncpy(fragmentShader, fragmentShaderName, maxShaderName - 1);
+}
+
+void PipelineDescription::AddVertexBinding(uint32_t binding, uint32_t stride, VkVertexInputRate inputRate)
+{
+	if (bindingCount == maxVertexBindings)
+	{
+		Debug::Log("Too many vertex bindings in pipeline description", DebugLevel::Error);
+		return;
+	}
+
+	bindings[bindingCount].binding = binding;
+	bindings[bindingCount].stride = stride;
+	bindings[bindingCount].inputRate = inputRate;
+	++bindingCount;
+}
+
+void PipelineDescription::AddVertexAttribute(uint32_t location, uint32_t binding, VkFormat format, uint32_t offset)
+{
+	if (attributeCount == maxVertexAttributes)
+	{
+		Debug::Log("Too many vertex attributes in pipeline description", DebugLevel::Error);
+		return;
+	}
+
+	attributes[attributeCount].location = location;
+	attributes[attributeCount].binding = binding;
+	attributes[attributeCount].format = format;
+	attributes[attributeCount].offset = offset;
+	++attributeCount;
+}
+
+void PipelineDescription::SetSpecialization(uint32_t constantId, uint32_t value)
+{
+	if (constantId >= maxSpecializationConstants)
+	{
+		Debug::Log("Specialization constant id out of range in pipeline description", DebugLevel::Error);
+		return;
+	}
+
+	specialization[constantId] = value;
+	specializationMask |= 1u << constantId;
+}
+
+void PipelineDescription::SetSpecialization(uint32_t constantId, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	SetSpecialization(constantId, bits);
+}
+
+uint64_t PipelineDescription::Hash() const
+{
+	return HashBytes(this, sizeof(PipelineDescription));
+}
+
+bool PipelineDescription::operator==(const PipelineDescription& other) const
+{
+	return memcmp(this, &other, sizeof(PipelineDescription)) == 0;
+}
+
+bool PipelineManager::SetLayoutKey::operator==(const SetLayoutKey& other) const
+{
+	return flags == other.flags && bindings.size() == other.bindings.size() &&
+		(bindings.empty() || memcmp(bindings.data(), other.bindings.data(), sizeof(VkDescriptorSetLayoutBinding) * bindings.size()) == 0);
+}
+
+size_t PipelineManager::SetLayoutKeyHasher::operator()(const SetLayoutKey& key) const
+{
+	uint64_t hash = HashBytes(&key.flags, sizeof(key.flags));
+	hash = key.bindings.empty() ? hash : HashBytes(key.bindings.data(), sizeof(VkDescriptorSetLayoutBinding) * key.bindings.size(), hash);
+	return static_cast<size_t>(hash);
+}
+
+bool PipelineManager::PipelineLayoutKey::operator==(const PipelineLayoutKey& other) const
+{
+	return setLayouts == other.setLayouts && memcmp(&pushConstantRange, &other.pushConstantRange, sizeof(VkPushConstantRange)) == 0;
+}
+
+size_t PipelineManager::PipelineLayoutKeyHasher::operator()(const PipelineLayoutKey& key) const
+{
+	uint64_t hash = HashBytes(&key.pushConstantRange, sizeof(key.pushConstantRange));
+	hash = key.setLayouts.empty() ? hash : HashBytes(key.setLayouts.data(), sizeof(VkDescriptorSetLayout) * key.setLayouts.size(), hash);
+	return static_cast<size_t>(hash);
+}
+
+bool PipelineManager::LibraryPartKey::operator==(const LibraryPartKey& other) const
+{
+	return part == other.part && description == other.description && shaderVersion == other.shaderVersion && layout == other.layout;
+}
+
+size_t PipelineManager::LibraryPartKeyHasher::operator()(const LibraryPartKey& key) const
+{
+	uint64_t hash = HashBytes(&key.shaderVersion, sizeof(key.shaderVersion), key.description.Hash());
+	hash = HashBytes(&key.layout, sizeof(key.layout), hash);
+	return static_cast<size_t>(HashBytes(&key.part, sizeof(key.part), hash));
+}
+
+PipelineManager::PipelineManager()
+{
+}
+
+PipelineManager::~PipelineManager()
+{
+	Destroy();
+}
+
+void PipelineManager::Init(VkDevice pipelineDevice, VkPipelineCache cache, ShaderLoader loader, JobSystem* jobs)
+{
+	device = pipelineDevice;
+	pipelineCache = cache;
+	shaderLoader = loader;
+	jobSystem = jobs;
+	dynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+}
+
+void PipelineManager::Destroy()
+{
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	WaitIdle();
+
+	for (auto& entry : pipelines)
+	{
+		vkDestroyPipeline(device, entry.second->Get(), nullptr);
+	}
+	pipelines.clear();
+
+	for (auto& staged : stagedPipelines)
+	{
+		vkDestroyPipeline(device, staged.pipeline, nullptr);
+	}
+	stagedPipelines.clear();
+
+	for (auto& retired : retiredPipelines)
+	{
+		vkDestroyPipeline(device, retired.pipeline, nullptr);
+	}
+	retiredPipelines.clear();
+
+	for (auto& entry : libraryParts)
+	{
+		vkDestroyPipeline(device, entry.second, nullptr);
+	}
+	libraryParts.clear();
+	shaderVersions.clear();
+
+	for (auto& entry : pipelineLayouts)
+	{
+		vkDestroyPipelineLayout(device, entry.second, nullptr);
+	}
+	pipelineLayouts.clear();
+	pipelineSetLayouts.clear();
+
+	for (auto& entry : setLayouts)
+	{
+		vkDestroyDescriptorSetLayout(device, entry.second, nullptr);
+	}
+	setLayouts.clear();
+
+	renderTargets.clear();
+	device = VK_NULL_HANDLE;
+}
+
+uint8_t PipelineManager::RegisterRenderPass(VkRenderPass renderPass, VkSampleCountFlagBits samples)
+{
+	lock_guard<mutex> lock(pipelinesMutex);
+	for (size_t i = 0; i < renderTargets.size(); ++i)
+	{
+		if (renderTargets[i].renderPass == renderPass && renderTargets[i].samples == samples)
+			return static_cast<uint8_t>(i);
+	}
+
+	RenderTarget target{};
+	target.renderPass = renderPass;
+	target.colourFormat = VK_FORMAT_UNDEFINED;
+	target.depthFormat = VK_FORMAT_UNDEFINED;
+	target.samples = samples;
+	renderTargets.push_back(target);
+	return static_cast<uint8_t>(renderTargets.size() - 1);
+}
+
+uint8_t PipelineManager::RegisterRenderingFormats(VkFormat colourFormat, VkFormat depthFormat, VkSampleCountFlagBits samples)
+{
+	lock_guard<mutex> lock(pipelinesMutex);
+	for (size_t i = 0; i < renderTargets.size(); ++i)
+	{
+		if (renderTargets[i].renderPass == VK_NULL_HANDLE && renderTargets[i].colourFormat == colourFormat && renderTargets[i].depthFormat == depthFormat &&
+			renderTargets[i].samples == samples)
+			return static_cast<uint8_t>(i);
+	}
+
+	RenderTarget target{};
+	target.renderPass = VK_NULL_HANDLE;
+	target.colourFormat = colourFormat;
+	target.depthFormat = depthFormat;
+	target.samples = samples;
+	renderTargets.push_back(target);
+	return static_cast<uint8_t>(renderTargets.size() - 1);
+}
+
+VkPipelineRenderingCreateInfoKHR PipelineManager::RenderTarget::GetRenderingCreateInfo() const
+{
+	VkPipelineRenderingCreateInfoKHR renderingCreateInfo{};
+	renderingCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+	renderingCreateInfo.pNext = nullptr;
+	renderingCreateInfo.viewMask = 0;
+	renderingCreateInfo.colorAttachmentCount = 1;
+	renderingCreateInfo.pColorAttachmentFormats = &colourFormat;
+	renderingCreateInfo.depthAttachmentFormat = depthFormat;
+	renderingCreateInfo.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
+	return renderingCreateInfo;
+}
+
+ManagedPipeline* PipelineManager::RequestPipeline(const PipelineDescription& description)
+{
+	return FindOrQueue(description, true);
+}
+
+ManagedPipeline* PipelineManager::FindOrQueue(const PipelineDescription& requestedDescription, bool requested)
+{
+	PipelineDescription description = StripDynamicState(requestedDescription);
+	ManagedPipeline* managedPipeline = nullptr;
+	{
+		lock_guard<mutex> lock(pipelinesMutex);
+		describedHashes.insert(requestedDescription.Hash());
+		auto found = pipelines.find(description);
+		if (found != pipelines.end())
+		{
+			found->second->requested |= requested;
+			return found->second.get();
+		}
+
+		managedPipeline = new ManagedPipeline();
+		managedPipeline->description = description;
+		managedPipeline->requested = requested;
+		pipelines.emplace(description, unique_ptr<ManagedPipeline>(managedPipeline));
+
+		//Counted before the lock is released, so waiters never see a new pipeline as finished
+		managedPipeline->compileCounter.store(1, memory_order_relaxed);
+		if (pendingCompiles.fetch_add(1, memory_order_relaxed) == 0)
+		{
+			burstStart.store(Now(), memory_order_relaxed);
+		}
+	}
+
+	//The job takes over the count added above
+	jobSystem->Run([this, managedPipeline]()
+	{
+		Compile(managedPipeline);
+		managedPipeline->compileCounter.fetch_sub(1, memory_order_release);
+	});
+	return managedPipeline;
+}
+
+void PipelineManager::Compile(ManagedPipeline* managedPipeline)
+{
+	//Failures stay VK_NULL_HANDLE, so a broken description is only reported once
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	int64_t compileStart = Now();
+	CreatePipeline(managedPipeline->description, pipeline);
+	compileMicroseconds.fetch_add(Now() - compileStart, memory_order_relaxed);
+	compileCount.fetch_add(1, memory_order_relaxed);
+	managedPipeline->pipeline.store(pipeline, memory_order_release);
+
+	if (pipeline != VK_NULL_HANDLE && useGraphicsPipelineLibrary)
+	{
+		//Usable now, swapped for the optimised link once a worker gets to it
+		uint32_t version = managedPipeline->version.load(memory_order_acquire);
+		jobSystem->Run([this, managedPipeline, version]() { Relink(managedPipeline, version); }, &backgroundCounter);
+	}
+
+	if (pendingCompiles.fetch_sub(1, memory_order_acq_rel) == 1)
+	{
+		double milliseconds = (Now() - burstStart.load(memory_order_relaxed)) / 1000.0;
+		Debug::Log(string("Pipeline compiles drained in ") + to_string(milliseconds) + " ms, " + to_string(GetPipelineCount()) + " pipelines");
+	}
+}
+
+VkPipeline PipelineManager::WaitForPipeline(ManagedPipeline* managedPipeline)
+{
+	jobSystem->Wait(managedPipeline->compileCounter);
+	return managedPipeline->Get();
+}
+
+void PipelineManager::WaitIdle()
+{
+	vector<ManagedPipeline*> pending;
+	{
+		lock_guard<mutex> lock(pipelinesMutex);
+		for (auto& entry : pipelines)
+		{
+			if (entry.second->IsPending())
+				pending.push_back(entry.second.get());
+		}
+	}
+
+	for (auto managedPipeline : pending)
+	{
+		jobSystem->Wait(managedPipeline->compileCounter);
+	}
+
+	//Relinks are queued as compiles finish
+	jobSystem->Wait(backgroundCounter);
+}
+
+size_t PipelineManager::GetPipelineCount()
+{
+	lock_guard<mutex> lock(pipelinesMutex);
+	return pipelines.size();
+}
+
+void PipelineManager::LogStatistics()
+{
+	size_t described = 0;
+	size_t built = 0;
+	{
+		lock_guard<mutex> lock(pipelinesMutex);
+		described = describedHashes.size();
+		built = pipelines.size();
+	}
+
+	//Compile time is measured on the worker, so it is CPU time rather than how long anything waited
+	uint32_t compiles = compileCount.load(memory_order_relaxed);
+	double averageMilliseconds = compiles > 0 ? compileMicroseconds.load(memory_order_relaxed) / 1000.0 / compiles : 0.0;
+	size_t saved = described > built ? described - built : 0;
+	Debug::Log(string("Pipelines: ") + to_string(described) + " descriptions, " + to_string(built) + " built, " + to_string(averageMilliseconds) + " ms average compile. " +
+		"Dynamic state saved " + to_string(saved) + " pipelines, about " + to_string(saved * averageMilliseconds) + " ms of compiling");
+}
+
+void PipelineManager::EnableExtendedDynamicState(bool enableExtendedDynamicState, bool enableDynamicBlendEnable)
+{
+	extendedDynamicState = enableExtendedDynamicState;
+	dynamicBlendEnable = enableDynamicBlendEnable;
+	if (extendedDynamicState)
+	{
+		pfnCmdSetCullMode = reinterpret_cast<PFN_vkCmdSetCullModeEXT>(vkGetDeviceProcAddr(device, "vkCmdSetCullModeEXT"));
+		pfnCmdSetFrontFace = reinterpret_cast<PFN_vkCmdSetFrontFaceEXT>(vkGetDeviceProcAddr(device, "vkCmdSetFrontFaceEXT"));
+		pfnCmdSetPrimitiveTopology = reinterpret_cast<PFN_vkCmdSetPrimitiveTopologyEXT>(vkGetDeviceProcAddr(device, "vkCmdSetPrimitiveTopologyEXT"));
+		pfnCmdSetDepthTestEnable = reinterpret_cast<PFN_vkCmdSetDepthTestEnableEXT>(vkGetDeviceProcAddr(device, "vkCmdSetDepthTestEnableEXT"));
+		pfnCmdSetDepthWriteEnable = reinterpret_cast<PFN_vkCmdSetDepthWriteEnableEXT>(vkGetDeviceProcAddr(device, "vkCmdSetDepthWriteEnableEXT"));
+		pfnCmdSetDepthCompareOp = reinterpret_cast<PFN_vkCmdSetDepthCompareOpEXT>(vkGetDeviceProcAddr(device, "vkCmdSetDepthCompareOpEXT"));
+		extendedDynamicState = pfnCmdSetCullMode && pfnCmdSetFrontFace && pfnCmdSetPrimitiveTopology &&
+			pfnCmdSetDepthTestEnable && pfnCmdSetDepthWriteEnable && pfnCmdSetDepthCompareOp;
+	}
+	if (dynamicBlendEnable)
+	{
+		pfnCmdSetColorBlendEnable = reinterpret_cast<PFN_vkCmdSetColorBlendEnableEXT>(vkGetDeviceProcAddr(device, "vkCmdSetColorBlendEnableEXT"));
+		dynamicBlendEnable = pfnCmdSetColorBlendEnable != nullptr;
+	}
+
+	dynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	if (extendedDynamicState)
+	{
+		dynamicStates.insert(dynamicStates.end(), {
+			VK_DYNAMIC_STATE_CULL_MODE_EXT,
+			VK_DYNAMIC_STATE_FRONT_FACE_EXT,
+			VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT,
+			VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT,
+			VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT,
+			VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT });
+	}
+	if (dynamicBlendEnable)
+	{
+		dynamicStates.push_back(VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT);
+	}
+
+	Debug::Log(string("Extended dynamic state: ") + (extendedDynamicState ? "rasterization and depth" : "none") + (dynamicBlendEnable ? ", blend enable" : ""));
+}
+
+PipelineDescription PipelineManager::StripDynamicState(const PipelineDescription& description) const
+{
+	PipelineDescription stripped = description;
+	if (extendedDynamicState)
+	{
+		//Only the topology class is baked in, without dynamicPrimitiveTopologyUnrestricted
+		switch (description.topology)
+		{
+		case VK_PRIMITIVE_TOPOLOGY_POINT_LIST:
+			stripped.topology = VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+			break;
+		case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:
+		case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP:
+		case VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY:
+		case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY:
+			stripped.topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+			break;
+		case VK_PRIMITIVE_TOPOLOGY_PATCH_LIST:
+			break;
+		default:
+			stripped.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+			break;
+		}
+
+		stripped.cullMode = VK_CULL_MODE_NONE;
+		stripped.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+		stripped.depthTestEnable = VK_FALSE;
+		stripped.depthWriteEnable = VK_FALSE;
+		stripped.depthCompareOp = VK_COMPARE_OP_NEVER;
+	}
+
+	//Baked as enabled so the pipeline has the blend factors, whether it blends is dynamic
+	if (dynamicBlendEnable)
+		stripped.blendEnable = VK_TRUE;
+
+	return stripped;
+}
+
+void PipelineManager::SetDynamicState(VkCommandBuffer cmdBuffer, const PipelineDescription& description) const
+{
+	if (extendedDynamicState)
+	{
+		pfnCmdSetCullMode(cmdBuffer, description.cullMode);
+		pfnCmdSetFrontFace(cmdBuffer, static_cast<VkFrontFace>(description.frontFace));
+		pfnCmdSetPrimitiveTopology(cmdBuffer, static_cast<VkPrimitiveTopology>(description.topology));
+		pfnCmdSetDepthTestEnable(cmdBuffer, description.depthTestEnable ? VK_TRUE : VK_FALSE);
+		pfnCmdSetDepthWriteEnable(cmdBuffer, description.depthWriteEnable ? VK_TRUE : VK_FALSE);
+		pfnCmdSetDepthCompareOp(cmdBuffer, static_cast<VkCompareOp>(description.depthCompareOp));
+	}
+
+	if (dynamicBlendEnable)
+	{
+		VkBool32 blendEnables[PipelineDescription::maxColourAttachments];
+		uint32_t colourAttachmentCount = min<uint32_t>(description.colourAttachmentCount, PipelineDescription::maxColourAttachments);
+		for (uint32_t i = 0; i < colourAttachmentCount; ++i)
+		{
+			blendEnables[i] = description.blendEnable ? VK_TRUE : VK_FALSE;
+		}
+		pfnCmdSetColorBlendEnable(cmdBuffer, 0, colourAttachmentCount, blendEnables);
+	}
+}
+
+bool PipelineManager::Prewarm(const char* manifestFilename)
+{
+	FILE* manifestFile = fopen(manifestFilename, "rb");
+	if (manifestFile == nullptr)
+	{
+		Debug::Log("No pipeline manifest, nothing to prewarm");
+		return true;
+	}
+
+	ManifestHeader header{};
+	bool valid = fread(&header, sizeof(header), 1, manifestFile) == 1 &&
+		header.magic == manifestMagic &&
+		header.version == manifestVersion &&
+		header.descriptionSize == sizeof(PipelineDescription) &&
+		header.count <= maxManifestPipelines;
+	if (!valid)
+	{
+		fclose(manifestFile);
+		Debug::Log("Pipeline manifest is out of date, ignoring it", DebugLevel::Warning);
+		return true;
+	}
+
+	vector<PipelineDescription> descriptions(header.count);
+	size_t count = fread(descriptions.data(), sizeof(PipelineDescription), header.count, manifestFile);
+	fclose(manifestFile);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		FindOrQueue(descriptions[i], false);
+	}
+
+	Debug::Log(string("Prewarming ") + to_string(count) + " pipelines");
+	return true;
+}
+
+bool PipelineManager::SaveManifest(const char* manifestFilename)
+{
+	//Only what was actually used this run, so stale descriptions drop out
+	vector<PipelineDescription> descriptions;
+	{
+		lock_guard<mutex> lock(pipelinesMutex);
+		for (auto& entry : pipelines)
+		{
+			if (entry.second->requested && entry.second->Get() != VK_NULL_HANDLE)
+				descriptions.push_back(entry.first);
+		}
+	}
+
+	//Write then rename, as the pipeline cache is, so a crash mid-write never leaves a truncated manifest behind
+	string tempFilename = string(manifestFilename) + ".tmp";
+	FILE* manifestFile = fopen(tempFilename.c_str(), "wb");
+	if (manifestFile == nullptr)
+	{
+		Debug::Log(string("Open file: ") + tempFilename, DebugLevel::Error);
+		return false;
+	}
+
+	ManifestHeader header{};
+	header.magic = manifestMagic;
+	header.version = manifestVersion;
+	header.descriptionSize = sizeof(PipelineDescription);
+	header.count = descriptions.size();
+
+	bool written = fwrite(&header, sizeof(header), 1, manifestFile) == 1 &&
+		fwrite(descriptions.data(), sizeof(PipelineDescription), descriptions.size(), manifestFile) == descriptions.size();
+	written = fflush(manifestFile) == 0 && written;
+	fclose(manifestFile);
+	if (!written || !MoveFileExA(tempFilename.c_str(), manifestFilename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		Debug::Log("Write pipeline manifest", DebugLevel::Error);
+		DeleteFileA(tempFilename.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+VkPipelineLayout PipelineManager::GetPipelineLayout(const PipelineDescription& description)
+{
+	ResolvedPipeline resolved;
+	return Resolve(description, resolved) ? resolved.layout : VK_NULL_HANDLE;
+}
+
+VkDescriptorSetLayout PipelineManager::GetDescriptorSetLayout(const PipelineDescription& description, uint32_t set)
+{
+	ResolvedPipeline resolved;
+	if (!Resolve(description, resolved))
+		return VK_NULL_HANDLE;
+
+	lock_guard<mutex> lock(layoutsMutex);
+	auto found = pipelineSetLayouts.find(resolved.layout);
+	if (found == pipelineSetLayouts.end() || set >= found->second.size())
+		return VK_NULL_HANDLE;
+	return found->second[set];
+}
+
+VkPipelineLayout PipelineManager::GetPipelineLayout(const ShaderReflection* const* reflections, uint32_t reflectionCount)
+{
+	//Bindings declared by several stages become one binding visible to all of them
+	vector<ShaderReflection::DescriptorBinding> bindings;
+	vector<VkShaderStageFlags> bindingStages;
+	VkPushConstantRange pushConstantRange{};
+	for (uint32_t i = 0; i < reflectionCount; ++i)
+	{
+		const ShaderReflection& reflection = *reflections[i];
+		for (auto& binding : reflection.descriptorBindings)
+		{
+			size_t existing = 0;
+			while (existing < bindings.size() && (bindings[existing].set != binding.set || bindings[existing].binding != binding.binding))
+				++existing;
+
+			ShaderReflection::DescriptorBinding layoutBinding = binding;
+			if (layoutBinding.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER && binding.set < 32 && (dynamicUniformSets & (1u << binding.set)) && binding.set != pushDescriptorSet)
+				layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+
+			//The heap's own layout is used, so stages may declare its arrays with different block types
+			if (bindlessSetLayout != VK_NULL_HANDLE && binding.set == bindlessSet)
+				layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_MAX_ENUM;
+
+			if (existing == bindings.size())
+			{
+				bindings.push_back(layoutBinding);
+				bindingStages.push_back(reflection.stage);
+			}
+			else if (bindings[existing].descriptorType != layoutBinding.descriptorType)
+			{
+				Debug::Log("Shader stages disagree on the type of set " + to_string(binding.set) + " binding " + to_string(binding.binding), DebugLevel::Error);
+				return VK_NULL_HANDLE;
+			}
+			else
+			{
+				bindingStages[existing] |= reflection.stage;
+			}
+		}
+
+		//One range shared by every stage that uses push constants
+		if (reflection.pushConstantSize > 0)
+		{
+			pushConstantRange.stageFlags |= reflection.stage;
+			pushConstantRange.size = max(pushConstantRange.size, reflection.pushConstantSize);
+		}
+	}
+
+	//Sets without bindings still need a layout when a higher set is used
+	uint32_t setCount = 0;
+	for (auto& binding : bindings)
+	{
+		setCount = max(setCount, binding.set + 1);
+	}
+
+	PipelineLayoutKey key;
+	key.setLayouts.resize(setCount);
+	key.pushConstantRange = pushConstantRange;
+	vector<VkDescriptorSetLayout>& descriptorSetLayouts = key.setLayouts;
+	for (uint32_t set = 0; set < setCount; ++set)
+	{
+		//Whatever the shader declares there, it is the heap
+		if (bindlessSetLayout != VK_NULL_HANDLE && set == bindlessSet)
+		{
+			descriptorSetLayouts[set] = bindlessSetLayout;
+			continue;
+		}
+
+		vector<VkDescriptorSetLayoutBinding> setBindings;
+		for (size_t i = 0; i < bindings.size(); ++i)
+		{
+			if (bindings[i].set != set)
+				continue;
+
+			VkDescriptorSetLayoutBinding layoutBinding{};
+			layoutBinding.binding = bindings[i].binding;
+			layoutBinding.descriptorType = bindings[i].descriptorType;
+			layoutBinding.descriptorCount = bindings[i].descriptorCount;
+			layoutBinding.stageFlags = bindingStages[i];
+			layoutBinding.pImmutableSamplers = nullptr;
+			setBindings.push_back(layoutBinding);
+		}
+
+		VkDescriptorSetLayoutCreateFlags flags = set == pushDescriptorSet ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0;
+		descriptorSetLayouts[set] = CreateDescriptorSetLayout(setBindings, flags);
+		if (descriptorSetLayouts[set] == VK_NULL_HANDLE)
+			return VK_NULL_HANDLE;
+	}
+
+	lock_guard<mutex> lock(layoutsMutex);
+	auto found = pipelineLayouts.find(key);
+	if (found != pipelineLayouts.end())
+		return found->second;
+
+	VkPipelineLayoutCreateInfo layoutCreateInfo{};
+	layoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutCreateInfo.pNext = nullptr;
+	layoutCreateInfo.flags = 0;
+	layoutCreateInfo.setLayoutCount = setCount;
+	layoutCreateInfo.pSetLayouts = setCount > 0 ? descriptorSetLayouts.data() : nullptr;
+	layoutCreateInfo.pushConstantRangeCount = pushConstantRange.size > 0 ? 1 : 0;
+	layoutCreateInfo.pPushConstantRanges = pushConstantRange.size > 0 ? &pushConstantRange : nullptr;
+
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	auto err = vkCreatePipelineLayout(device, &layoutCreateInfo, nullptr, &pipelineLayout);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create Pipeline Layout", DebugLevel::Error);
+		return VK_NULL_HANDLE;
+	}
+
+	pipelineSetLayouts.emplace(pipelineLayout, descriptorSetLayouts);
+	pipelineLayouts.emplace(std::move(key), pipelineLayout);
+	return pipelineLayout;
+}
+
+VkDescriptorSetLayout PipelineManager::CreateDescriptorSetLayout(const vector<VkDescriptorSetLayoutBinding>& bindings, VkDescriptorSetLayoutCreateFlags flags)
+{
+	//Bindings are zero initialised and sorted, so equal sets compare equal
+	SetLayoutKey key;
+	key.bindings = bindings;
+	key.flags = flags;
+
+	lock_guard<mutex> lock(layoutsMutex);
+	auto found = setLayouts.find(key);
+	if (found != setLayouts.end())
+		return found->second;
+
+	VkDescriptorSetLayoutCreateInfo setLayoutCreateInfo{};
+	setLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setLayoutCreateInfo.pNext = nullptr;
+	setLayoutCreateInfo.flags = flags;
+	setLayoutCreateInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+	setLayoutCreateInfo.pBindings = bindings.empty() ? nullptr : bindings.data();
+
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	auto err = vkCreateDescriptorSetLayout(device, &setLayoutCreateInfo, nullptr, &setLayout);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create descriptor set layout", DebugLevel::Error);
+		return VK_NULL_HANDLE;
+	}
+
+	setLayouts.emplace(std::move(key), setLayout);
+	return setLayout;
+}
+
+bool PipelineManager::Resolve(const PipelineDescription& description, ResolvedPipeline& outResolved)
+{
+	outResolved.description = description;
+
+	shared_ptr<const ShaderReflection> vertexReflection;
+	shared_ptr<const ShaderReflection> fragmentReflection;
+	if (!shaderLoader(description.vertexShader, outResolved.vertexShader, vertexReflection) ||
+		!shaderLoader(description.fragmentShader, outResolved.fragmentShader, fragmentReflection))
+		return false;
+
+	if (!vertexReflection || !fragmentReflection)
+	{
+		Debug::Log("Shader loader returned no reflection", DebugLevel::Error);
+		return false;
+	}
+
+	if (!ReflectVertexAttributes(outResolved.description, *vertexReflection))
+		return false;
+
+	const ShaderReflection* reflections[2] = { vertexReflection.get(), fragmentReflection.get() };
+	outResolved.layout = GetPipelineLayout(reflections, 2);
+	return outResolved.layout != VK_NULL_HANDLE;
+}
+
+bool PipelineManager::ReflectVertexAttributes(PipelineDescription& description, const ShaderReflection& reflection)
+{
+	//Declared by hand
+	if (description.attributeCount > 0)
+		return true;
+
+	uint32_t bindingIndex = 0;
+	uint32_t offset = 0;
+	for (auto& input : reflection.vertexInputs)
+	{
+		uint32_t size = GetVertexFormatSize(input.format);
+		while (bindingIndex < description.bindingCount && offset + size > description.bindings[bindingIndex].stride)
+		{
+			++bindingIndex;
+			offset = 0;
+		}
+
+		if (bindingIndex == description.bindingCount || description.attributeCount == PipelineDescription::maxVertexAttributes)
+		{
+			Debug::Log(string("Inputs of ") + description.vertexShader + " do not fit the pipeline's vertex bindings", DebugLevel::Error);
+			return false;
+		}
+
+		description.AddVertexAttribute(input.location, description.bindings[bindingIndex].binding, input.format, offset);
+		offset += size;
+	}
+	return true;
+}
+
+namespace
+{
+	//Create info for every piece of state in a description. Shared by monolithic pipelines and library parts,
+	//and points into itself so it is built in place.
+	struct PipelineState
+	{
+		PipelineState(const PipelineDescription& description, const vector<VkDynamicState>& dynamicStates);
+		PipelineState(const PipelineState&) = delete;
+
+		void SetShaders(VkShaderModule vertexShaderModule, VkShaderModule fragmentShaderModule);
+
+		VkPipelineShaderStageCreateInfo			vertexStage;
+		VkPipelineShaderStageCreateInfo			fragmentStage;
+		VkPipelineShaderStageCreateInfo			stages[2];
+		uint32_t								specializationData[PipelineDescription::maxSpecializationConstants];
+		VkSpecializationMapEntry				specializationEntries[PipelineDescription::maxSpecializationConstants];
+		VkSpecializationInfo					specialization;
+		VkVertexInputBindingDescription			vertexBindings[PipelineDescription::maxVertexBindings];
+		VkVertexInputAttributeDescription		vertexAttributes[PipelineDescription::maxVertexAttributes];
+		VkPipelineVertexInputStateCreateInfo	vertexInput;
+		VkPipelineInputAssemblyStateCreateInfo	inputAssembly;
+		VkPipelineViewportStateCreateInfo		viewport;
+		VkPipelineDynamicStateCreateInfo		dynamic;
+		VkPipelineRasterizationStateCreateInfo	rasterization;
+		VkPipelineMultisampleStateCreateInfo	multisample;
+		VkPipelineDepthStencilStateCreateInfo	depthStencil;
+		VkPipelineColorBlendAttachmentState		colourBlendAttachments[PipelineDescription::maxColourAttachments];
+		VkPipelineColorBlendStateCreateInfo		colourBlend;
+	};
+
+	PipelineState::PipelineState(const PipelineDescription& description, const vector<VkDynamicState>& dynamicStates)
+	{
+		vertexStage = {};
+		vertexStage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		vertexStage.pNext = nullptr;
+		vertexStage.flags = 0;
+		vertexStage.stage = VK_SHADER_STAGE_VERTEX_BIT;
+		vertexStage.module = VK_NULL_HANDLE;
+		vertexStage.pName = "main";
+		vertexStage.pSpecializationInfo = nullptr;
+
+		//Each permutation is compiled branch free. Ids a shader does not declare are ignored by it.
+		uint32_t entryCount = 0;
+		for (uint32_t id = 0; id < PipelineDescription::maxSpecializationConstants; ++id)
+		{
+			if ((description.specializationMask & (1u << id)) == 0)
+				continue;
+			specializationEntries[entryCount].constantID = id;
+			specializationEntries[entryCount].offset = id * sizeof(uint32_t);
+			specializationEntries[entryCount].size = sizeof(uint32_t);
+			++entryCount;
+		}
+
+		memcpy(specializationData, description.specialization, sizeof(specializationData));
+		specialization = {};
+		specialization.mapEntryCount = entryCount;
+		specialization.pMapEntries = specializationEntries;
+		specialization.dataSize = sizeof(specializationData);
+		specialization.pData = specializationData;
+		if (entryCount > 0)
+		{
+			vertexStage.pSpecializationInfo = &specialization;
+		}
+
+		fragmentStage = vertexStage;
+		fragmentStage.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+		for (uint32_t i = 0; i < description.bindingCount; ++i)
+		{
+			vertexBindings[i].binding = description.bindings[i].binding;
+			vertexBindings[i].stride = description.bindings[i].stride;
+			vertexBindings[i].inputRate = static_cast<VkVertexInputRate>(description.bindings[i].inputRate);
+		}
+
+		for (uint32_t i = 0; i < description.attributeCount; ++i)
+		{
+			vertexAttributes[i].location = description.attributes[i].location;
+			vertexAttributes[i].binding = description.attributes[i].binding;
+			vertexAttributes[i].format = static_cast<VkFormat>(description.attributes[i].format);
+			vertexAttributes[i].offset = description.attributes[i].offset;
+		}
+
+		vertexInput = {};
+		vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+		vertexInput.pNext = nullptr;
+		vertexInput.flags = 0;
+		vertexInput.vertexBindingDescriptionCount = description.bindingCount;
+		vertexInput.pVertexBindingDescriptions = vertexBindings;
+		vertexInput.vertexAttributeDescriptionCount = description.attributeCount;
+		vertexInput.pVertexAttributeDescriptions = vertexAttributes;
+
+		inputAssembly = {};
+		inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+		inputAssembly.pNext = nullptr;
+		inputAssembly.flags = 0;
+		inputAssembly.primitiveRestartEnable = VK_FALSE;
+		inputAssembly.topology = static_cast<VkPrimitiveTopology>(description.topology);
+
+		//Viewport and scissor are always dynamic, so pipelines survive a swapchain resize. The rest is whatever
+		//extended dynamic state is enabled.
+		viewport = {};
+		viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+		viewport.pNext = nullptr;
+		viewport.flags = 0;
+		viewport.viewportCount = 1;
+		viewport.pViewports = nullptr;
+		viewport.scissorCount = 1;
+		viewport.pScissors = nullptr;
+
+		dynamic = {};
+		dynamic.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+		dynamic.pNext = nullptr;
+		dynamic.flags = 0;
+		dynamic.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+		dynamic.pDynamicStates = dynamicStates.data();
+
+		rasterization = {};
+		rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+		rasterization.pNext = nullptr;
+		rasterization.flags = 0;
+		rasterization.depthClampEnable = VK_FALSE;
+		rasterization.rasterizerDiscardEnable = VK_FALSE;
+		rasterization.polygonMode = static_cast<VkPolygonMode>(description.polygonMode);
+		rasterization.cullMode = description.cullMode;
+		rasterization.frontFace = static_cast<VkFrontFace>(description.frontFace);
+		rasterization.depthBiasEnable = VK_FALSE;
+		rasterization.depthBiasConstantFactor = 0.0f;
+		rasterization.depthBiasClamp = 0.0f;
+		rasterization.depthBiasSlopeFactor = 0.0f;
+		rasterization.lineWidth = 1.0f;
+
+		multisample = {};
+		multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+		multisample.pNext = nullptr;
+		multisample.flags = 0;
+		multisample.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+		multisample.sampleShadingEnable = VK_FALSE;
+		multisample.minSampleShading = 1.0f;
+		multisample.pSampleMask = nullptr;
+		multisample.alphaToCoverageEnable = VK_FALSE;
+		multisample.alphaToOneEnable = VK_FALSE;
+
+		depthStencil = {};
+		depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+		depthStencil.pNext = nullptr;
+		depthStencil.flags = 0;
+		depthStencil.depthTestEnable = description.depthTestEnable ? VK_TRUE : VK_FALSE;
+		depthStencil.depthWriteEnable = description.depthWriteEnable ? VK_TRUE : VK_FALSE;
+		depthStencil.depthCompareOp = static_cast<VkCompareOp>(description.depthCompareOp);
+		depthStencil.depthBoundsTestEnable = VK_FALSE;
+		depthStencil.stencilTestEnable = VK_FALSE;
+		depthStencil.minDepthBounds = 0.0f;
+		depthStencil.maxDepthBounds = 1.0f;
+
+		//Standard alpha blending when enabled
+		uint32_t colourAttachmentCount = min<uint32_t>(description.colourAttachmentCount, PipelineDescription::maxColourAttachments);
+		for (uint32_t i = 0; i < colourAttachmentCount; ++i)
+		{
+			VkPipelineColorBlendAttachmentState& colourBlendAttachment = colourBlendAttachments[i];
+			colourBlendAttachment = {};
+			colourBlendAttachment.blendEnable = description.blendEnable ? VK_TRUE : VK_FALSE;
+			colourBlendAttachment.srcColorBlendFactor = description.blendEnable ? VK_BLEND_FACTOR_SRC_ALPHA : VK_BLEND_FACTOR_ONE;
+			colourBlendAttachment.dstColorBlendFactor = description.blendEnable ? VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA : VK_BLEND_FACTOR_ZERO;
+			colourBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+			colourBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+			colourBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+			colourBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+			colourBlendAttachment.colorWriteMask = description.colourWriteMask;
+		}
+
+		colourBlend = {};
+		colourBlend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+		colourBlend.pNext = nullptr;
+		colourBlend.flags = 0;
+		colourBlend.attachmentCount = colourAttachmentCount;
+		colourBlend.pAttachments = colourBlendAttachments;
+		colourBlend.logicOpEnable = VK_FALSE;
+		colourBlend.logicOp = VK_LOGIC_OP_COPY;
+		colourBlend.blendConstants[0] = 0.0f;
+		colourBlend.blendConstants[1] = 0.0f;
+		colourBlend.blendConstants[2] = 0.0f;
+		colourBlend.blendConstants[3] = 0.0f;
+	}
+
+	void PipelineState::SetShaders(VkShaderModule vertexShaderModule, VkShaderModule fragmentShaderModule)
+	{
+		vertexStage.module = vertexShaderModule;
+		fragmentStage.module = fragmentShaderModule;
+		stages[0] = vertexStage;
+		stages[1] = fragmentStage;
+	}
+}
+
+bool PipelineManager::CreatePipeline(const PipelineDescription& description, VkPipeline& outPipeline)
+{
+	if (useGraphicsPipelineLibrary)
+		return LinkPipeline(description, false, outPipeline);
+
+	RenderTarget target;
+	if (!GetRenderTarget(description.renderPass, target))
+		return false;
+	VkPipelineRenderingCreateInfoKHR renderingCreateInfo = target.GetRenderingCreateInfo();
+
+	ResolvedPipeline resolved;
+	if (!Resolve(description, resolved))
+		return false;
+
+	PipelineState state(resolved.description, dynamicStates);
+	state.SetShaders(resolved.vertexShader, resolved.fragmentShader);
+	state.multisample.rasterizationSamples = target.samples;
+
+	VkGraphicsPipelineCreateInfo graphicsCreatePipelineInfo{};
+	graphicsCreatePipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	graphicsCreatePipelineInfo.pNext = target.renderPass == VK_NULL_HANDLE ? &renderingCreateInfo : nullptr;
+	graphicsCreatePipelineInfo.flags = 0;
+	graphicsCreatePipelineInfo.stageCount = 2;
+	graphicsCreatePipelineInfo.pStages = state.stages;
+	graphicsCreatePipelineInfo.pVertexInputState = &state.vertexInput;
+	graphicsCreatePipelineInfo.pInputAssemblyState = &state.inputAssembly;
+	graphicsCreatePipelineInfo.pTessellationState = nullptr;
+	graphicsCreatePipelineInfo.pViewportState = &state.viewport;
+	graphicsCreatePipelineInfo.pRasterizationState = &state.rasterization;
+	graphicsCreatePipelineInfo.pMultisampleState = &state.multisample;
+	graphicsCreatePipelineInfo.pDepthStencilState = &state.depthStencil;
+	graphicsCreatePipelineInfo.pColorBlendState = &state.colourBlend;
+	graphicsCreatePipelineInfo.pDynamicState = &state.dynamic;
+	graphicsCreatePipelineInfo.layout = resolved.layout;
+	graphicsCreatePipelineInfo.renderPass = target.renderPass;
+	graphicsCreatePipelineInfo.subpass = description.subpass;
+	graphicsCreatePipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	graphicsCreatePipelineInfo.basePipelineIndex = -1;
+
+	auto err = vkCreateGraphicsPipelines(device, pipelineCache, 1, &graphicsCreatePipelineInfo, nullptr, &outPipeline);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create graphics pipeline", DebugLevel::Error);
+		outPipeline = VK_NULL_HANDLE;
+		return false;
+	}
+
+	createdCount.fetch_add(1, memory_order_release);
+	return true;
+}
+
+bool PipelineManager::GetRenderTarget(uint8_t renderPassIndex, RenderTarget& outTarget)
+{
+	lock_guard<mutex> lock(pipelinesMutex);
+	if (renderPassIndex < renderTargets.size())
+	{
+		outTarget = renderTargets[renderPassIndex];
+		return true;
+	}
+
+	Debug::Log("Pipeline description uses an unregistered render pass", DebugLevel::Error);
+	return false;
+}
+
+void PipelineManager::EnableGraphicsPipelineLibrary(bool enable)
+{
+	useGraphicsPipelineLibrary = enable;
+	Debug::Log(enable ? "Pipelines are fast-linked from graphics pipeline libraries" : "Pipelines are compiled whole");
+}
+
+void PipelineManager::SetDynamicUniformSets(uint32_t setMask)
+{
+	dynamicUniformSets = setMask;
+}
+
+void PipelineManager::SetBindlessSet(uint32_t set, VkDescriptorSetLayout setLayout)
+{
+	bindlessSet = set;
+	bindlessSetLayout = setLayout;
+}
+
+void PipelineManager::SetPushDescriptorSet(uint32_t set)
+{
+	pushDescriptorSet = set;
+}
+
+PipelineManager::LibraryPartKey PipelineManager::GetLibraryPartKey(LibraryPart part, const ResolvedPipeline& resolved)
+{
+	//Only the fields a part depends on, so variants differing elsewhere share it. Attributes are the
+	//reflected ones, and shader parts depend on the layout both shaders resolve to.
+	const PipelineDescription& description = resolved.description;
+	LibraryPartKey partKey;
+	partKey.part = part;
+	partKey.shaderVersion = 0;
+	partKey.layout = VK_NULL_HANDLE;
+	PipelineDescription& key = partKey.description;
+	switch (part)
+	{
+	case LibraryPart::VertexInput:
+		key.bindingCount = description.bindingCount;
+		key.attributeCount = description.attributeCount;
+		memcpy(key.bindings, description.bindings, sizeof(key.bindings));
+		memcpy(key.attributes, description.attributes, sizeof(key.attributes));
+		key.topology = description.topology;
+		break;
+	case LibraryPart::PreRasterization:
+		memcpy(key.vertexShader, description.vertexShader, sizeof(key.vertexShader));
+		partKey.shaderVersion = GetShaderVersion(description.vertexShader);
+		key.specializationMask = description.specializationMask;
+		memcpy(key.specialization, description.specialization, sizeof(key.specialization));
+		key.polygonMode = description.polygonMode;
+		key.cullMode = description.cullMode;
+		key.frontFace = description.frontFace;
+		key.renderPass = description.renderPass;
+		key.subpass = description.subpass;
+		partKey.layout = resolved.layout;
+		break;
+	case LibraryPart::FragmentShader:
+		memcpy(key.fragmentShader, description.fragmentShader, sizeof(key.fragmentShader));
+		partKey.shaderVersion = GetShaderVersion(description.fragmentShader);
+		key.specializationMask = description.specializationMask;
+		memcpy(key.specialization, description.specialization, sizeof(key.specialization));
+		key.depthTestEnable = description.depthTestEnable;
+		key.depthWriteEnable = description.depthWriteEnable;
+		key.depthCompareOp = description.depthCompareOp;
+		key.renderPass = description.renderPass;
+		key.subpass = description.subpass;
+		partKey.layout = resolved.layout;
+		break;
+	case LibraryPart::FragmentOutput:
+		key.blendEnable = description.blendEnable;
+		key.colourWriteMask = description.colourWriteMask;
+		key.colourAttachmentCount = description.colourAttachmentCount;
+		key.renderPass = description.renderPass;
+		key.subpass = description.subpass;
+		break;
+	default:
+		break;
+	}
+
+	return partKey;
+}
+
+uint32_t PipelineManager::GetShaderVersion(const char* shaderName)
+{
+	//Parts built from a replaced shader are left in the map, a link in progress may still be using them
+	lock_guard<mutex> lock(librariesMutex);
+	auto found = shaderVersions.find(shaderName);
+	return found != shaderVersions.end() ? found->second : 0;
+}
+
+VkPipeline PipelineManager::GetLibraryPart(LibraryPart part, const ResolvedPipeline& resolved)
+{
+	LibraryPartKey key = GetLibraryPartKey(part, resolved);
+	{
+		lock_guard<mutex> lock(librariesMutex);
+		auto found = libraryParts.find(key);
+		if (found != libraryParts.end())
+			return found->second;
+	}
+
+	VkPipeline library = VK_NULL_HANDLE;
+	if (!CreateLibraryPart(part, resolved, library))
+		return VK_NULL_HANDLE;
+
+	//Another worker may have built the same part in the meantime
+	lock_guard<mutex> lock(librariesMutex);
+	auto inserted = libraryParts.emplace(key, library);
+	if (!inserted.second)
+	{
+		vkDestroyPipeline(device, library, nullptr);
+	}
+	return inserted.first->second;
+}
+
+PipelineManager::LibraryPart PipelineManager::GetDynamicStatePart(VkDynamicState dynamicState)
+{
+	//As VK_EXT_graphics_pipeline_library assigns them, for the states dynamicStates can hold
+	switch (dynamicState)
+	{
+	case VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT:
+		return LibraryPart::VertexInput;
+	case VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT:
+	case VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT:
+	case VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT:
+		return LibraryPart::FragmentShader;
+	case VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT:
+		return LibraryPart::FragmentOutput;
+	default:
+		//Viewport, scissor, cull mode and front face
+		return LibraryPart::PreRasterization;
+	}
+}
+
+bool PipelineManager::CreateLibraryPart(LibraryPart part, const ResolvedPipeline& resolved, VkPipeline& outLibrary)
+{
+	const PipelineDescription& description = resolved.description;
+	PipelineState state(description, dynamicStates);
+
+	VkGraphicsPipelineLibraryCreateInfoEXT libraryCreateInfo{};
+	libraryCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+	libraryCreateInfo.pNext = nullptr;
+
+	VkGraphicsPipelineCreateInfo graphicsCreatePipelineInfo{};
+	graphicsCreatePipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	graphicsCreatePipelineInfo.pNext = &libraryCreateInfo;
+	graphicsCreatePipelineInfo.flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR | VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+	graphicsCreatePipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	graphicsCreatePipelineInfo.basePipelineIndex = -1;
+
+	//Shader parts need their module, the layout and the render pass
+	RenderTarget target{};
+	VkPipelineRenderingCreateInfoKHR renderingCreateInfo{};
+	VkShaderModule shaderModule = VK_NULL_HANDLE;
+	if (part == LibraryPart::PreRasterization || part == LibraryPart::FragmentShader)
+	{
+		shaderModule = part == LibraryPart::PreRasterization ? resolved.vertexShader : resolved.fragmentShader;
+		graphicsCreatePipelineInfo.stageCount = 1;
+		graphicsCreatePipelineInfo.layout = resolved.layout;
+	}
+
+	if (part != LibraryPart::VertexInput)
+	{
+		if (!GetRenderTarget(description.renderPass, target))
+			return false;
+
+		graphicsCreatePipelineInfo.renderPass = target.renderPass;
+		graphicsCreatePipelineInfo.subpass = description.subpass;
+		state.multisample.rasterizationSamples = target.samples;
+		if (target.renderPass == VK_NULL_HANDLE)
+		{
+			renderingCreateInfo = target.GetRenderingCreateInfo();
+			libraryCreateInfo.pNext = &renderingCreateInfo;
+		}
+	}
+
+	//Each part only takes the dynamic states belonging to its own state, topology in vertex input, depth in the
+	//fragment shader, blend enable in fragment output. Linking combines them.
+	vector<VkDynamicState> partDynamicStates;
+	for (VkDynamicState dynamicState : dynamicStates)
+	{
+		if (GetDynamicStatePart(dynamicState) == part)
+			partDynamicStates.push_back(dynamicState);
+	}
+	state.dynamic.dynamicStateCount = static_cast<uint32_t>(partDynamicStates.size());
+	state.dynamic.pDynamicStates = partDynamicStates.data();
+	graphicsCreatePipelineInfo.pDynamicState = &state.dynamic;
+
+	switch (part)
+	{
+	case LibraryPart::VertexInput:
+		libraryCreateInfo.flags = VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT;
+		graphicsCreatePipelineInfo.pVertexInputState = &state.vertexInput;
+		graphicsCreatePipelineInfo.pInputAssemblyState = &state.inputAssembly;
+		break;
+	case LibraryPart::PreRasterization:
+		libraryCreateInfo.flags = VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT;
+		state.SetShaders(shaderModule, VK_NULL_HANDLE);
+		graphicsCreatePipelineInfo.pStages = &state.vertexStage;
+		graphicsCreatePipelineInfo.pViewportState = &state.viewport;
+		graphicsCreatePipelineInfo.pRasterizationState = &state.rasterization;
+		break;
+	case LibraryPart::FragmentShader:
+		libraryCreateInfo.flags = VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT;
+		state.SetShaders(VK_NULL_HANDLE, shaderModule);
+		graphicsCreatePipelineInfo.pStages = &state.fragmentStage;
+		graphicsCreatePipelineInfo.pMultisampleState = &state.multisample;
+		graphicsCreatePipelineInfo.pDepthStencilState = &state.depthStencil;
+		break;
+	case LibraryPart::FragmentOutput:
+		libraryCreateInfo.flags = VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT;
+		graphicsCreatePipelineInfo.pMultisampleState = &state.multisample;
+		graphicsCreatePipelineInfo.pColorBlendState = &state.colourBlend;
+		break;
+	default:
+		break;
+	}
+
+	auto err = vkCreateGraphicsPipelines(device, pipelineCache, 1, &graphicsCreatePipelineInfo, nullptr, &outLibrary);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create graphics pipeline library", DebugLevel::Error);
+		outLibrary = VK_NULL_HANDLE;
+		return false;
+	}
+
+	createdCount.fetch_add(1, memory_order_release);
+	return true;
+}
+
+bool PipelineManager::LinkPipeline(const PipelineDescription& description, bool optimise, VkPipeline& outPipeline)
+{
+	ResolvedPipeline resolved;
+	if (!Resolve(description, resolved))
+		return false;
+
+	VkPipeline libraries[static_cast<int>(LibraryPart::Count)];
+	for (int part = 0; part < static_cast<int>(LibraryPart::Count); ++part)
+	{
+		libraries[part] = GetLibraryPart(static_cast<LibraryPart>(part), resolved);
+		if (libraries[part] == VK_NULL_HANDLE)
+			return false;
+	}
+
+	VkPipelineLibraryCreateInfoKHR linkCreateInfo{};
+	linkCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+	linkCreateInfo.pNext = nullptr;
+	linkCreateInfo.libraryCount = static_cast<uint32_t>(LibraryPart::Count);
+	linkCreateInfo.pLibraries = libraries;
+
+	VkGraphicsPipelineCreateInfo graphicsCreatePipelineInfo{};
+	graphicsCreatePipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	graphicsCreatePipelineInfo.pNext = &linkCreateInfo;
+	graphicsCreatePipelineInfo.flags = optimise ? VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT : 0;
+	graphicsCreatePipelineInfo.layout = resolved.layout;
+	graphicsCreatePipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+	graphicsCreatePipelineInfo.basePipelineIndex = -1;
+
+	auto err = vkCreateGraphicsPipelines(device, pipelineCache, 1, &graphicsCreatePipelineInfo, nullptr, &outPipeline);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log(optimise ? "Optimised link of graphics pipeline" : "Fast link of graphics pipeline", DebugLevel::Error);
+		outPipeline = VK_NULL_HANDLE;
+		return false;
+	}
+
+	createdCount.fetch_add(1, memory_order_release);
+	return true;
+}
+
+void PipelineManager::Relink(ManagedPipeline* managedPipeline, uint32_t version)
+{
+	VkPipeline optimised = VK_NULL_HANDLE;
+	if (!LinkPipeline(managedPipeline->description, true, optimised))
+		return;
+
+	Stage(managedPipeline, optimised, version);
+}
+
+void PipelineManager::ReloadShader(const char* shaderName)
+{
+	if (useGraphicsPipelineLibrary)
+	{
+		lock_guard<mutex> lock(librariesMutex);
+		++shaderVersions[shaderName];
+	}
+
+	vector<ManagedPipeline*> affected;
+	{
+		lock_guard<mutex> lock(pipelinesMutex);
+		for (auto& entry : pipelines)
+		{
+			const PipelineDescription& description = entry.second->description;
+			if (strcmp(description.vertexShader, shaderName) == 0 || strcmp(description.fragmentShader, shaderName) == 0)
+				affected.push_back(entry.second.get());
+		}
+	}
+
+	for (auto managedPipeline : affected)
+	{
+		//Anything still building against the old shader is dropped when it is staged
+		uint32_t version = managedPipeline->version.fetch_add(1, memory_order_acq_rel) + 1;
+		jobSystem->Run([this, managedPipeline, version]() { Rebuild(managedPipeline, version); }, &backgroundCounter);
+	}
+
+	Debug::Log(string("Shader reloaded: ") + shaderName + ", rebuilding " + to_string(affected.size()) + " pipelines");
+}
+
+void PipelineManager::Rebuild(ManagedPipeline* managedPipeline, uint32_t version)
+{
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	if (!CreatePipeline(managedPipeline->description, pipeline))
+	{
+		Debug::Log(string("Rebuild failed, keeping the previous pipeline for ") + managedPipeline->description.vertexShader + " / " + managedPipeline->description.fragmentShader, DebugLevel::Warning);
+		return;
+	}
+
+	Stage(managedPipeline, pipeline, version);
+
+	if (useGraphicsPipelineLibrary)
+	{
+		jobSystem->Run([this, managedPipeline, version]() { Relink(managedPipeline, version); }, &backgroundCounter);
+	}
+}
+
+void PipelineManager::Stage(ManagedPipeline* managedPipeline, VkPipeline pipeline, uint32_t version)
+{
+	lock_guard<mutex> lock(stagedMutex);
+	StagedPipeline staged;
+	staged.managedPipeline = managedPipeline;
+	staged.pipeline = pipeline;
+	staged.version = version;
+	stagedPipelines.push_back(staged);
+}
+
+void PipelineManager::Retire(VkPipeline pipeline)
+{
+	if (pipeline == VK_NULL_HANDLE)
+		return;
+
+	lock_guard<mutex> lock(retiredMutex);
+	RetiredPipeline retired;
+	retired.pipeline = pipeline;
+	retired.submissionValue = submissionValue.load(memory_order_relaxed);
+	retiredPipelines.push_back(retired);
+}
+
+void PipelineManager::BeginFrame(uint64_t frameSubmissionValue, uint64_t completedValue)
+{
+	submissionValue.store(frameSubmissionValue, memory_order_relaxed);
+
+	//Swapped before any recording starts, so a frame never mixes old and new pipelines.
+	//Frames in flight may still be using the replaced ones.
+	vector<StagedPipeline> staged;
+	{
+		lock_guard<mutex> lock(stagedMutex);
+		staged.swap(stagedPipelines);
+	}
+	for (auto& entry : staged)
+	{
+		if (entry.version == entry.managedPipeline->version.load(memory_order_acquire))
+		{
+			Retire(entry.managedPipeline->pipeline.exchange(entry.pipeline, memory_order_acq_rel));
+		}
+		else
+		{
+			//Built from a shader that has since been reloaded again, never used
+			vkDestroyPipeline(device, entry.pipeline, nullptr);
+		}
+	}
+
+	lock_guard<mutex> lock(retiredMutex);
+	auto retired = retiredPipelines.begin();
+	while (retired != retiredPipelines.end())
+	{
+		if (retired->submissionValue <= completedValue)
+		{
+			vkDestroyPipeline(device, retired->pipeline, nullptr);
+			retired = retiredPipelines.erase(retired);
+		}
+		else
+		{
+			++retired;
+		}
+	}
+}
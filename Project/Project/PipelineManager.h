@@ -0,0 +1,335 @@
+#pragma once
+#include "vulkan\vulkan.h"
+#include "Hash.h"
+#include "JobSystem.h"
+#include "SpirvReflection.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+using namespace std;
+
+//Everything that distinguishes one graphics pipeline from another. Plain data, zeroed on construction
+//(padding included) so it can be hashed and compared bytewise.
+struct PipelineDescription
+{
+	static const uint32_t maxShaderName { 48 };
+	static const uint32_t maxVertexBindings { 4 };
+	static const uint32_t maxVertexAttributes { 8 };
+	static const uint32_t maxSpecializationConstants { 8 };
+	static const uint32_t maxColourAttachments { 4 };
+
+	PipelineDescription();
+
+	void SetShaders(const char* vertexShaderName, const char* fragmentShaderName);
+	void AddVertexBinding(uint32_t binding, uint32_t stride, VkVertexInputRate inputRate);
+	void AddVertexAttribute(uint32_t location, uint32_t binding, VkFormat format, uint32_t offset);
+	void SetSpecialization(uint32_t constantId, uint32_t value);
+	void SetSpecialization(uint32_t constantId, float value);
+
+	uint64_t Hash() const;
+	bool operator==(const PipelineDescription& other) const;
+
+	//Shaders, by SPIR-V file name
+	char		vertexShader[maxShaderName];
+	char		fragmentShader[maxShaderName];
+
+	//Vertex layout. With no attributes added, they are reflected from the vertex shader: inputs are
+	//packed in location order into the bindings in the order they were added, each filling its stride.
+	struct VertexBinding
+	{
+		uint32_t	binding;
+		uint32_t	stride;
+		uint32_t	inputRate;
+	};
+	struct VertexAttribute
+	{
+		uint32_t	location;
+		uint32_t	binding;
+		uint32_t	format;
+		uint32_t	offset;
+	};
+	uint32_t		bindingCount;
+	uint32_t		attributeCount;
+	VertexBinding	bindings[maxVertexBindings];
+	VertexAttribute	attributes[maxVertexAttributes];
+
+	//Fixed function state
+	uint8_t		topology;
+	uint8_t		polygonMode;
+	uint8_t		cullMode;
+	uint8_t		frontFace;
+	uint8_t		depthTestEnable;
+	uint8_t		depthWriteEnable;
+	uint8_t		depthCompareOp;
+	uint8_t		blendEnable;
+	uint8_t		colourWriteMask;	//VkColorComponentFlags, all by default. None for a depth only pass.
+	uint8_t		colourAttachmentCount;	//the subpass's, 1 by default. Every attachment is blended and masked alike.
+
+	//Shader permutation: specialization constant values by constant_id, shared by both stages (see ShaderConstants.h).
+	//Constants not in the mask keep the default declared in the shader.
+	uint32_t	specializationMask;
+	uint32_t	specialization[maxSpecializationConstants];
+
+	//Render pass, or dynamic rendering formats, as registered with the PipelineManager
+	uint8_t		renderPass;
+	uint8_t		subpass;
+};
+
+struct PipelineDescriptionHasher
+{
+	size_t operator()(const PipelineDescription& description) const { return static_cast<size_t>(description.Hash()); }
+};
+
+//A pipeline that may still be compiling. Stable for the lifetime of the PipelineManager, so it can be
+//held onto and checked every frame.
+struct ManagedPipeline
+{
+	//VK_NULL_HANDLE until compiled, and forever if compilation failed
+	VkPipeline	Get() const { return pipeline.load(memory_order_acquire); }
+	bool		IsPending() const { return compileCounter.load(memory_order_acquire) > 0; }
+
+	PipelineDescription		description;
+	atomic<VkPipeline>		pipeline		{ VK_NULL_HANDLE };
+	JobCounter				compileCounter	{ 0 };
+	atomic<uint32_t>		version			{ 0 };		//bumped when one of its shaders is reloaded
+	bool					requested		{ false };	//used this run, rather than only prewarmed
+};
+
+//Builds each unique pipeline once, compiling on job system workers, and shares pipeline layouts between them.
+//Thread safe.
+class PipelineManager
+{
+public:
+	//Modules and reflections stay owned by the loader
+	typedef function<bool(const char* filename, VkShaderModule& shaderModule, shared_ptr<const ShaderReflection>& reflection)> ShaderLoader;
+
+	PipelineManager();
+	~PipelineManager();
+
+	void		Init(VkDevice device, VkPipelineCache pipelineCache, ShaderLoader shaderLoader, JobSystem* jobSystem);
+	void		Destroy();
+
+	//VK_EXT_graphics_pipeline_library: pipelines are fast-linked from shared parts, then relinked with
+	//link time optimisation in the background. Set before requesting any pipelines.
+	void		EnableGraphicsPipelineLibrary(bool enable);
+
+	//Uniform buffers in these sets (bit per set index) are made UNIFORM_BUFFER_DYNAMIC, as GLSL cannot say so.
+	//Set before requesting any pipelines.
+	void		SetDynamicUniformSets(uint32_t setMask);
+
+	//Shaders declaring resources in this set get setLayout for it instead of a reflected one, so a bindless heap's
+	//runtime sized arrays share one layout, and one bound set, across every pipeline. Set before requesting any pipelines.
+	void		SetBindlessSet(uint32_t set, VkDescriptorSetLayout setLayout);
+
+	//VK_KHR_push_descriptor: this set's layout is made for vkCmdPushDescriptorSetKHR, so per draw bindings need no
+	//allocated sets. Its uniform buffers are never dynamic. Set before requesting any pipelines.
+	void		SetPushDescriptorSet(uint32_t set);
+
+	//VK_EXT_extended_dynamic_state covers cull mode, front face, topology (within its class) and the depth state,
+	//VK_EXT_extended_dynamic_state3 blend enable. Pipelines leave that state out, so descriptions differing only in it
+	//share one pipeline, and SetDynamicState records it instead. Set after Init, before requesting any pipelines.
+	void		EnableExtendedDynamicState(bool extendedDynamicState, bool dynamicBlendEnable);
+
+	//Records the state the bound pipeline leaves dynamic, as the description asks for it. Nothing when none is.
+	void		SetDynamicState(VkCommandBuffer cmdBuffer, const PipelineDescription& description) const;
+
+	//Call before recording starts, with the submission queue's value the frame will be submitted as and its completed value.
+	//Rebuilt pipelines are swapped in here, and replaced ones destroyed once no submission can still use them.
+	void		BeginFrame(uint64_t submissionValue, uint64_t completedValue);
+
+	//The shader's SPIR-V changed: every pipeline using it is rebuilt in the background and swapped in
+	//by a later BeginFrame. The old pipeline stays in use until then, and if the rebuild fails.
+	void		ReloadShader(const char* shaderName);
+
+	//samples is the subpass's attachments' sample count, which its pipelines rasterize with
+	uint8_t		RegisterRenderPass(VkRenderPass renderPass, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+
+	//VK_KHR_dynamic_rendering: pipelines are built against attachment formats instead of a render pass.
+	//Indices are shared with RegisterRenderPass. depthFormat is VK_FORMAT_UNDEFINED for no depth attachment.
+	uint8_t		RegisterRenderingFormats(VkFormat colourFormat, VkFormat depthFormat, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+
+	//O(1) amortised and never blocks: queues a compile the first time a description is seen.
+	//Check Get() on the result, draws using a pipeline that is not ready yet should be skipped.
+	ManagedPipeline*	RequestPipeline(const PipelineDescription& description);
+
+	//Blocks until the pipeline is compiled, helping the job system while it waits
+	VkPipeline	WaitForPipeline(ManagedPipeline* managedPipeline);
+	VkPipeline	GetPipeline(const PipelineDescription& description) { return WaitForPipeline(RequestPipeline(description)); }
+	void		WaitIdle();
+
+	//Built from the descriptor bindings and push constants the description's shaders declare. Shaders declaring
+	//the same resources share a layout, and pipeline layouts share descriptor set layouts, so sets stay bound
+	//across pipeline switches.
+	VkPipelineLayout GetPipelineLayout(const PipelineDescription& description);
+	VkPipelineLayout GetPipelineLayout(const ShaderReflection* const* reflections, uint32_t reflectionCount);
+	VkDescriptorSetLayout GetDescriptorSetLayout(const PipelineDescription& description, uint32_t set);
+
+	//Descriptions used in previous runs, compiled in the background before anything asks for them.
+	//Render pass indices must be registered in the same order every run.
+	bool		Prewarm(const char* manifestFilename);
+	bool		SaveManifest(const char* manifestFilename);
+
+	size_t		GetPipelineCount();
+
+	//Every pipeline and library part created through the pipeline cache so far, rebuilds and relinks included.
+	//Changes whenever the cache may have gained entries, so its owner knows there is something new to save.
+	uint64_t	GetCreatedCount() const { return createdCount.load(memory_order_acquire); }
+
+	//Descriptions seen against pipelines built, and the compile time dynamic state saved
+	void		LogStatistics();
+
+private:
+	VkDevice				device { VK_NULL_HANDLE };
+	VkPipelineCache			pipelineCache { VK_NULL_HANDLE };
+	ShaderLoader			shaderLoader;
+	JobSystem*				jobSystem { nullptr };
+	//A registered render pass, or the formats a dynamic rendering pass uses
+	struct RenderTarget
+	{
+		VkRenderPass	renderPass;		//VK_NULL_HANDLE for dynamic rendering
+		VkFormat		colourFormat;
+		VkFormat		depthFormat;
+		VkSampleCountFlagBits	samples;
+
+		//Chained into pipeline creation when there is no render pass. Points into this RenderTarget.
+		VkPipelineRenderingCreateInfoKHR	GetRenderingCreateInfo() const;
+	};
+	vector<RenderTarget>	renderTargets;
+	uint32_t				dynamicUniformSets { 0 };
+	uint32_t				bindlessSet { 0 };
+	VkDescriptorSetLayout	bindlessSetLayout { VK_NULL_HANDLE };
+	uint32_t				pushDescriptorSet { 0xffffffff };	//none
+
+	bool					extendedDynamicState { false };
+	bool					dynamicBlendEnable { false };
+	PFN_vkCmdSetCullModeEXT				pfnCmdSetCullMode { nullptr };
+	PFN_vkCmdSetFrontFaceEXT			pfnCmdSetFrontFace { nullptr };
+	PFN_vkCmdSetPrimitiveTopologyEXT	pfnCmdSetPrimitiveTopology { nullptr };
+	PFN_vkCmdSetDepthTestEnableEXT		pfnCmdSetDepthTestEnable { nullptr };
+	PFN_vkCmdSetDepthWriteEnableEXT		pfnCmdSetDepthWriteEnable { nullptr };
+	PFN_vkCmdSetDepthCompareOpEXT		pfnCmdSetDepthCompareOp { nullptr };
+	PFN_vkCmdSetColorBlendEnableEXT		pfnCmdSetColorBlendEnable { nullptr };
+	vector<VkDynamicState>	dynamicStates;		//left out of every pipeline, viewport and scissor first
+
+	mutex					pipelinesMutex;
+	unordered_map<PipelineDescription, unique_ptr<ManagedPipeline>, PipelineDescriptionHasher> pipelines;
+
+	//Layouts are keyed by everything they are created from, so two that only hash alike are never shared
+	struct SetLayoutKey
+	{
+		vector<VkDescriptorSetLayoutBinding>	bindings;	//zero initialised and sorted, compared bytewise
+		VkDescriptorSetLayoutCreateFlags		flags;
+		bool operator==(const SetLayoutKey& other) const;
+	};
+	struct SetLayoutKeyHasher
+	{
+		size_t operator()(const SetLayoutKey& key) const;
+	};
+	struct PipelineLayoutKey
+	{
+		vector<VkDescriptorSetLayout>	setLayouts;	//shared, so equal sets are the same handle
+		VkPushConstantRange				pushConstantRange;
+		bool operator==(const PipelineLayoutKey& other) const;
+	};
+	struct PipelineLayoutKeyHasher
+	{
+		size_t operator()(const PipelineLayoutKey& key) const;
+	};
+	mutex					layoutsMutex;
+	unordered_map<PipelineLayoutKey, VkPipelineLayout, PipelineLayoutKeyHasher> pipelineLayouts;
+	unordered_map<SetLayoutKey, VkDescriptorSetLayout, SetLayoutKeyHasher> setLayouts;
+	unordered_map<VkPipelineLayout, vector<VkDescriptorSetLayout>> pipelineSetLayouts;
+
+	//What a description resolves to once its shaders are loaded, looked up once per build
+	struct ResolvedPipeline
+	{
+		PipelineDescription	description;	//with reflected vertex attributes filled in
+		VkShaderModule		vertexShader	{ VK_NULL_HANDLE };
+		VkShaderModule		fragmentShader	{ VK_NULL_HANDLE };
+		VkPipelineLayout	layout			{ VK_NULL_HANDLE };
+	};
+
+	//Graphics pipeline library parts, keyed by only the state each one depends on
+	enum class LibraryPart
+	{
+		VertexInput,
+		PreRasterization,
+		FragmentShader,
+		FragmentOutput,
+		Count
+	};
+	struct LibraryPartKey
+	{
+		LibraryPart			part;
+		PipelineDescription	description;	//only the fields the part depends on, the rest left zeroed
+		uint32_t			shaderVersion;
+		VkPipelineLayout	layout;			//shader parts only
+		bool operator==(const LibraryPartKey& other) const;
+	};
+	struct LibraryPartKeyHasher
+	{
+		size_t operator()(const LibraryPartKey& key) const;
+	};
+	bool					useGraphicsPipelineLibrary { false };
+	mutex					librariesMutex;
+	unordered_map<LibraryPartKey, VkPipeline, LibraryPartKeyHasher> libraryParts;
+	unordered_map<string, uint32_t>		shaderVersions;	//part keys change when a shader is reloaded
+
+	//Relinks and rebuilds
+	JobCounter				backgroundCounter { 0 };
+
+	//Pipelines built to replace an existing one, swapped in at the start of a frame
+	struct StagedPipeline
+	{
+		ManagedPipeline*	managedPipeline;
+		VkPipeline			pipeline;
+		uint32_t			version;
+	};
+	mutex					stagedMutex;
+	vector<StagedPipeline>	stagedPipelines;
+
+	//Pipelines that were replaced, destroyed once the last submission that could use them has completed
+	struct RetiredPipeline
+	{
+		VkPipeline	pipeline;
+		uint64_t	submissionValue;
+	};
+	atomic<uint64_t>		submissionValue { 0 };
+	mutex					retiredMutex;
+	vector<RetiredPipeline>	retiredPipelines;
+
+	//Logs how long each burst of compiles took to drain
+	atomic<int32_t>			pendingCompiles { 0 };
+	atomic<int64_t>			burstStart { 0 };
+
+	//For LogStatistics
+	unordered_set<uint64_t>	describedHashes;	//every description asked for, before dynamic state is stripped
+	atomic<uint32_t>		compileCount { 0 };
+	atomic<int64_t>			compileMicroseconds { 0 };
+	atomic<uint64_t>		createdCount { 0 };
+
+	ManagedPipeline*	FindOrQueue(const PipelineDescription& description, bool requested);
+	PipelineDescription	StripDynamicState(const PipelineDescription& description) const;
+	void				Compile(ManagedPipeline* managedPipeline);
+	bool				CreatePipeline(const PipelineDescription& description, VkPipeline& outPipeline);
+	bool				Resolve(const PipelineDescription& description, ResolvedPipeline& outResolved);
+	bool				ReflectVertexAttributes(PipelineDescription& description, const ShaderReflection& reflection);
+	VkDescriptorSetLayout	CreateDescriptorSetLayout(const vector<VkDescriptorSetLayoutBinding>& bindings, VkDescriptorSetLayoutCreateFlags flags);
+	bool				GetRenderTarget(uint8_t renderPassIndex, RenderTarget& outTarget);
+
+	LibraryPartKey		GetLibraryPartKey(LibraryPart part, const ResolvedPipeline& resolved);
+	uint32_t			GetShaderVersion(const char* shaderName);
+	VkPipeline			GetLibraryPart(LibraryPart part, const ResolvedPipeline& resolved);
+	bool				CreateLibraryPart(LibraryPart part, const ResolvedPipeline& resolved, VkPipeline& outLibrary);
+	static LibraryPart	GetDynamicStatePart(VkDynamicState dynamicState);
+	bool				LinkPipeline(const PipelineDescription& description, bool optimise, VkPipeline& outPipeline);
+	void				Relink(ManagedPipeline* managedPipeline, uint32_t version);
+	void				Rebuild(ManagedPipeline* managedPipeline, uint32_t version);
+	void				Stage(ManagedPipeline* managedPipeline, VkPipeline pipeline, uint32_t version);
+	void				Retire(VkPipeline pipeline);
+};
@@ -0,0 +1,738 @@
+#include "RenderGraph.h"
+#include "Debug.h"
+#include "Hash.h"
+
+#include <algorithm>
+
+namespace
+{
+	const VkAccessFlags2KHR writeAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+		VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+	VkDeviceSize AlignUp(VkDeviceSize value, VkDeviceSize alignment)
+	{
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	bool LifetimesOverlap(uint32_t firstA, uint32_t lastA, uint32_t firstB, uint32_t lastB)
+	{
+		return firstA <= lastB && firstB <= lastA;
+	}
+}
+
+RenderGraph::RenderGraph()
+{
+}
+
+RenderGraph::~RenderGraph()
+{
+	Destroy();
+}
+
+void RenderGraph::Init(VkDevice graphDevice, VkPhysicalDevice physicalDevice, PFN_vkCmdPipelineBarrier2KHR cmdPipelineBarrier2)
+{
+	device = graphDevice;
+	pfnCmdPipelineBarrier2 = cmdPipelineBarrier2;
+	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+}
+
+void RenderGraph::Destroy()
+{
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	for (auto& plan : retired)
+	{
+		DestroyImages(plan.images, plan.memory);
+	}
+	retired.clear();
+	DestroyImages(physicalImages, transientMemory);
+	planHash = 0;
+
+	passes.clear();
+	resources.clear();
+	device = VK_NULL_HANDLE;
+}
+
+void RenderGraph::Reset(uint64_t frameSubmissionValue, uint64_t completedValue)
+{
+	submissionValue = frameSubmissionValue;
+
+	//Replaced plans go once the last submission that executed them has completed
+	size_t kept = 0;
+	for (size_t i = 0; i < retired.size(); ++i)
+	{
+		if (retired[i].submissionValue <= completedValue)
+			DestroyImages(retired[i].images, retired[i].memory);
+		else
+			retired[kept++] = retired[i];
+	}
+	retired.resize(kept);
+
+	passes.clear();
+	resources.clear();
+	finalBarriers.clear();
+	livePassCount = 0;
+}
+
+RenderGraph::Resource RenderGraph::ImportBuffer(const char* name, VkBuffer buffer, VkPipelineStageFlags stage, VkAccessFlags access)
+{
+	ResourceNode node{};
+	node.name = name;
+	node.buffer = buffer;
+	node.initialState.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	if (access & writeAccessMask)
+	{
+		node.initialState.writeStages = stage;
+		node.initialState.writeAccess = access & writeAccessMask;
+	}
+	else
+	{
+		node.initialState.readStages = stage;
+	}
+
+	resources.push_back(node);
+	return static_cast<Resource>(resources.size() - 1);
+}
+
+RenderGraph::Resource RenderGraph::ImportImage(const char* name, VkImage image, VkImageAspectFlags aspect, VkImageLayout layout, VkPipelineStageFlags stage, VkAccessFlags access,
+	VkImageLayout finalLayout)
+{
+	Resource resource = ImportBuffer(name, VK_NULL_HANDLE, stage, access);
+	ResourceNode& node = resources[resource];
+	node.image = image;
+	node.aspect = aspect;
+	node.initialState.layout = layout;
+	node.finalLayout = finalLayout;
+	node.output = finalLayout != VK_IMAGE_LAYOUT_UNDEFINED;
+	return resource;
+}
+
+RenderGraph::Resource RenderGraph::CreateTransientImage(const char* name, const TransientImageDescription& description)
+{
+	ResourceNode node{};
+	node.name = name;
+	node.aspect = description.aspect;
+	node.initialState.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	node.transient = true;
+	node.description = description;
+
+	resources.push_back(node);
+	return static_cast<Resource>(resources.size() - 1);
+}
+
+RenderGraph::Pass RenderGraph::AddPass(const char* name, function<void(VkCommandBuffer)> execute)
+{
+	passes.emplace_back();
+	passes.back().name = name;
+	passes.back().execute = move(execute);
+	return static_cast<Pass>(passes.size() - 1);
+}
+
+void RenderGraph::SetSideEffects(Pass pass)
+{
+	passes[pass].sideEffects = true;
+}
+
+void RenderGraph::Read(Pass pass, Resource resource, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout, VkImageLayout finalLayout)
+{
+	AddAccess(pass, resource, stage, access, layout, finalLayout, false);
+}
+
+void RenderGraph::Write(Pass pass, Resource resource, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout, VkImageLayout finalLayout)
+{
+	AddAccess(pass, resource, stage, access, layout, finalLayout, true);
+}
+
+void RenderGraph::AddAccess(Pass pass, Resource resource, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout, VkImageLayout finalLayout, bool write)
+{
+	if (finalLayout == VK_IMAGE_LAYOUT_UNDEFINED)
+		finalLayout = layout;
+
+	for (auto& existing : passes[pass].accesses)
+	{
+		if (existing.resource != resource)
+			continue;
+
+		if (existing.layout != layout || existing.finalLayout != finalLayout)
+			Debug::Log(string("Render graph pass ") + passes[pass].name + " uses " + resources[resource].name + " in two layouts", DebugLevel::Error);
+		existing.stage |= stage;
+		existing.access |= access;
+		existing.write = existing.write || write;
+		return;
+	}
+
+	Access declared{};
+	declared.resource = resource;
+	declared.stage = stage;
+	declared.access = access;
+	declared.layout = layout;
+	declared.finalLayout = finalLayout;
+	declared.write = write;
+	passes[pass].accesses.push_back(declared);
+}
+
+bool RenderGraph::Compile()
+{
+	CullPasses();
+
+	//Lifetimes in live passes, and every stage a transient is used in for whatever aliases it next
+	for (auto& resource : resources)
+	{
+		resource.firstPass = resource.lastPass = invalidIndex;
+	}
+	vector<VkPipelineStageFlags2KHR> usedStages(resources.size(), 0);
+	vector<VkAccessFlags2KHR> usedWriteAccess(resources.size(), 0);
+	for (uint32_t p = 0; p < passes.size(); ++p)
+	{
+		if (!passes[p].live)
+			continue;
+
+		for (auto& access : passes[p].accesses)
+		{
+			ResourceNode& resource = resources[access.resource];
+			if (resource.firstPass == invalidIndex)
+				resource.firstPass = p;
+			resource.lastPass = p;
+			usedStages[access.resource] |= access.stage;
+			usedWriteAccess[access.resource] |= access.access & writeAccessMask;
+		}
+	}
+
+	vector<ResourceNode*> owners;
+	uint64_t hash = HashBytes(nullptr, 0);
+	for (uint32_t r = 0; r < resources.size(); ++r)
+	{
+		ResourceNode& resource = resources[r];
+		if (!resource.transient || resource.firstPass == invalidIndex)
+			continue;
+
+		owners.push_back(&resource);
+		hash = HashBytes(&resource.description, sizeof(TransientImageDescription), hash);
+		hash = HashBytes(&resource.firstPass, sizeof(uint32_t), hash);
+		hash = HashBytes(&resource.lastPass, sizeof(uint32_t), hash);
+		hash = HashBytes(&usedStages[r], sizeof(VkPipelineStageFlags2KHR), hash);
+		hash = HashBytes(&usedWriteAccess[r], sizeof(VkAccessFlags2KHR), hash);
+	}
+
+	if (hash != planHash || owners.size() != physicalImages.size())
+	{
+		//Submissions in flight may still be using the old images
+		if (!physicalImages.empty() || !transientMemory.empty())
+		{
+			Retired plan;
+			plan.images = move(physicalImages);
+			plan.memory = move(transientMemory);
+			plan.submissionValue = planSubmissionValue;
+			retired.push_back(move(plan));
+			physicalImages.clear();
+			transientMemory.clear();
+		}
+
+		physicalImages.resize(owners.size());
+		for (uint32_t i = 0; i < owners.size(); ++i)
+		{
+			physicalImages[i].description = owners[i]->description;
+		}
+		if (!AllocateTransients(owners))
+		{
+			planHash = 0;
+			return false;
+		}
+		planHash = hash;
+	}
+
+	for (uint32_t i = 0; i < owners.size(); ++i)
+	{
+		owners[i]->physical = i;
+		owners[i]->image = physicalImages[i].image;
+		owners[i]->imageView = physicalImages[i].imageView;
+		physicalImages[i].stages = usedStages[owners[i] - resources.data()];
+		physicalImages[i].writeAccess = usedWriteAccess[owners[i] - resources.data()];
+	}
+
+	//A transient's memory was last used by whatever it aliases, earlier this frame or in the frame before on the same
+	//queue, and by itself the frame before. Its first use waits for all of them.
+	for (uint32_t i = 0; i < owners.size(); ++i)
+	{
+		const PhysicalImage& image = physicalImages[i];
+		ResourceState& state = owners[i]->initialState;
+		for (auto& other : physicalImages)
+		{
+			if (other.memoryType == image.memoryType &&
+				other.offset < image.offset + image.memoryRequirements.size && image.offset < other.offset + other.memoryRequirements.size)
+			{
+				state.writeStages |= other.stages;
+				state.writeAccess |= other.writeAccess;
+			}
+		}
+	}
+
+	BuildBarriers();
+	return true;
+}
+
+void RenderGraph::CullPasses()
+{
+	//Walking back from the outputs, a pass is live if it writes something a live pass after it reads
+	vector<bool> needed(resources.size(), false);
+	for (uint32_t r = 0; r < resources.size(); ++r)
+	{
+		needed[r] = resources[r].output;
+	}
+
+	livePassCount = 0;
+	for (uint32_t p = static_cast<uint32_t>(passes.size()); p-- > 0;)
+	{
+		PassNode& pass = passes[p];
+		pass.live = pass.sideEffects;
+		for (auto& access : pass.accesses)
+		{
+			pass.live = pass.live || (access.write && needed[access.resource]);
+		}
+		if (!pass.live)
+			continue;
+
+		++livePassCount;
+		for (auto& access : pass.accesses)
+		{
+			if (!access.write || access.access & ~writeAccessMask)
+				needed[access.resource] = true;
+		}
+	}
+}
+
+bool RenderGraph::AllocateTransients(const vector<ResourceNode*>& owners)
+{
+	for (auto& image : physicalImages)
+	{
+		if (!CreatePhysicalImage(image))
+			return false;
+	}
+
+	PlaceTransients(owners);
+
+	//One allocation per memory type, sized by the furthest placed image
+	vector<VkDeviceSize> heapSizes(memoryProperties.memoryTypeCount, 0);
+	VkDeviceSize unaliasedSize = 0;
+	for (auto& image : physicalImages)
+	{
+		heapSizes[image.memoryType] = max(heapSizes[image.memoryType], image.offset + image.memoryRequirements.size);
+		unaliasedSize += image.memoryRequirements.size;
+	}
+
+	VkDeviceSize aliasedSize = 0;
+	for (uint32_t type = 0; type < heapSizes.size(); ++type)
+	{
+		if (heapSizes[type] == 0)
+			continue;
+
+		VkMemoryAllocateInfo memoryAllocInfo{};
+		memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		memoryAllocInfo.pNext = nullptr;
+		memoryAllocInfo.allocationSize = heapSizes[type];
+		memoryAllocInfo.memoryTypeIndex = type;
+
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		auto err = vkAllocateMemory(device, &memoryAllocInfo, nullptr, &memory);
+		if (err != VK_SUCCESS)
+		{
+			Debug::Log("Allocate render graph transient memory", DebugLevel::Error);
+			return false;
+		}
+		transientMemory.push_back(memory);
+		aliasedSize += heapSizes[type];
+
+		for (auto& image : physicalImages)
+		{
+			if (image.memoryType != type)
+				continue;
+
+			err = vkBindImageMemory(device, image.image, memory, image.offset);
+			if (err != VK_SUCCESS)
+			{
+				Debug::Log("Bind render graph transient image", DebugLevel::Error);
+				return false;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < physicalImages.size(); ++i)
+	{
+		VkImageViewCreateInfo imageViewCreateInfo{};
+		imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		imageViewCreateInfo.pNext = nullptr;
+		imageViewCreateInfo.flags = 0;
+		imageViewCreateInfo.image = physicalImages[i].image;
+		imageViewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		imageViewCreateInfo.format = physicalImages[i].description.format;
+		imageViewCreateInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+		imageViewCreateInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+		imageViewCreateInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+		imageViewCreateInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+		imageViewCreateInfo.subresourceRange.aspectMask = physicalImages[i].description.aspect;
+		imageViewCreateInfo.subresourceRange.baseMipLevel = 0;
+		imageViewCreateInfo.subresourceRange.levelCount = 1;
+		imageViewCreateInfo.subresourceRange.baseArrayLayer = 0;
+		imageViewCreateInfo.subresourceRange.layerCount = 1;
+
+		auto err = vkCreateImageView(device, &imageViewCreateInfo, nullptr, &physicalImages[i].imageView);
+		if (err != VK_SUCCESS)
+		{
+			Debug::Log(string("Create render graph image view for ") + owners[i]->name, DebugLevel::Error);
+			return false;
+		}
+	}
+
+	if (!physicalImages.empty())
+		Debug::Log(string("Render graph: ") + to_string(physicalImages.size()) + " transient images in " + to_string(aliasedSize / 1024) + " KB, " +
+			to_string(unaliasedSize / 1024) + " KB without aliasing");
+	return true;
+}
+
+bool RenderGraph::CreatePhysicalImage(PhysicalImage& physicalImage)
+{
+	const TransientImageDescription& description = physicalImage.description;
+
+	VkImageCreateInfo imageCreateInfo{};
+	imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageCreateInfo.pNext = nullptr;
+	imageCreateInfo.flags = 0;
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageCreateInfo.format = description.format;
+	imageCreateInfo.extent.width = description.extent.width;
+	imageCreateInfo.extent.height = description.extent.height;
+	imageCreateInfo.extent.depth = 1;
+	imageCreateInfo.mipLevels = 1;
+	imageCreateInfo.arrayLayers = 1;
+	imageCreateInfo.samples = description.samples;
+	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageCreateInfo.usage = description.usage;
+	imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageCreateInfo.queueFamilyIndexCount = 0;
+	imageCreateInfo.pQueueFamilyIndices = nullptr;
+	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	auto err = vkCreateImage(device, &imageCreateInfo, nullptr, &physicalImage.image);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create render graph transient image", DebugLevel::Error);
+		return false;
+	}
+	vkGetImageMemoryRequirements(device, physicalImage.image, &physicalImage.memoryRequirements);
+
+	//Device local, lazily allocated for attachments that never leave the tile where there is such memory
+	VkMemoryPropertyFlags preferred[2] = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT };
+	if (description.usage & VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT)
+		preferred[0] |= VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+
+	for (auto properties : preferred)
+	{
+		for (uint32_t i = 0; i < memoryProperties.memoryTypeCount && physicalImage.memoryType == invalidIndex; i++)
+		{
+			if ((physicalImage.memoryRequirements.memoryTypeBits & (1 << i)) &&
+				(memoryProperties.memoryTypes[i].propertyFlags & properties) == properties)
+			{
+				physicalImage.memoryType = i;
+			}
+		}
+	}
+
+	if (physicalImage.memoryType == invalidIndex)
+	{
+		Debug::Log("No memory type for render graph transient image", DebugLevel::Error);
+		return false;
+	}
+
+	return true;
+}
+
+void RenderGraph::PlaceTransients(const vector<ResourceNode*>& owners)
+{
+	//Biggest first, each at the lowest offset clear of everything already placed that it is alive alongside
+	vector<uint32_t> order(physicalImages.size());
+	for (uint32_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b)
+	{
+		return physicalImages[a].memoryRequirements.size > physicalImages[b].memoryRequirements.size;
+	});
+
+	vector<uint32_t> placed;
+	for (auto i : order)
+	{
+		PhysicalImage& image = physicalImages[i];
+		VkDeviceSize size = image.memoryRequirements.size;
+		VkDeviceSize alignment = image.memoryRequirements.alignment;
+
+		vector<uint32_t> conflicts;
+		for (auto j : placed)
+		{
+			if (physicalImages[j].memoryType == image.memoryType &&
+				LifetimesOverlap(owners[i]->firstPass, owners[i]->lastPass, owners[j]->firstPass, owners[j]->lastPass))
+			{
+				conflicts.push_back(j);
+			}
+		}
+
+		//Candidates are the start of memory and the end of each conflicting image
+		VkDeviceSize best = ~VkDeviceSize(0);
+		for (size_t c = 0; c <= conflicts.size(); ++c)
+		{
+			VkDeviceSize offset = c == 0 ? 0 : AlignUp(physicalImages[conflicts[c - 1]].offset + physicalImages[conflicts[c - 1]].memoryRequirements.size, alignment);
+			if (offset >= best)
+				continue;
+
+			bool clear = true;
+			for (auto j : conflicts)
+			{
+				const PhysicalImage& other = physicalImages[j];
+				clear = clear && (offset + size <= other.offset || other.offset + other.memoryRequirements.size <= offset);
+			}
+			if (clear)
+				best = offset;
+		}
+
+		image.offset = best;
+		placed.push_back(i);
+	}
+}
+
+void RenderGraph::BuildBarriers()
+{
+	vector<ResourceState> states(resources.size());
+	for (uint32_t r = 0; r < resources.size(); ++r)
+	{
+		states[r] = resources[r].initialState;
+	}
+
+	for (auto& pass : passes)
+	{
+		pass.memoryBarrier = VkMemoryBarrier2KHR{};
+		pass.memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2_KHR;
+		pass.memoryBarrier.pNext = nullptr;
+		pass.imageBarriers.clear();
+		if (!pass.live)
+			continue;
+
+		for (auto& access : pass.accesses)
+		{
+			const ResourceNode& resource = resources[access.resource];
+			ResourceState& state = states[access.resource];
+			bool isImage = resource.image != VK_NULL_HANDLE;
+			bool transition = isImage && access.layout != VK_IMAGE_LAYOUT_UNDEFINED && access.layout != state.layout;
+			VkAccessFlags2KHR readAccess = access.access & ~writeAccessMask;
+
+			VkPipelineStageFlags2KHR srcStage = 0;
+			VkAccessFlags2KHR srcAccess = 0;
+			bool barrier = false;
+			if (access.write || transition)
+			{
+				//Write after write and write after read. A layout transition is a write too.
+				srcStage = state.writeStages | state.readStages;
+				srcAccess = state.writeAccess;
+				barrier = srcStage != 0 || transition;
+			}
+			else if (state.writeStages != 0)
+			{
+				//Read after write, unless an earlier barrier already made the write visible here
+				barrier = (access.stage & ~state.visibleStages) != 0 || (readAccess & ~state.visibleAccess) != 0;
+				srcStage = state.writeStages;
+				srcAccess = state.writeAccess;
+			}
+
+			if (barrier && transition)
+			{
+				VkImageMemoryBarrier2KHR imageBarrier{};
+				imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR;
+				imageBarrier.pNext = nullptr;
+				imageBarrier.srcStageMask = srcStage;
+				imageBarrier.srcAccessMask = srcAccess;
+				imageBarrier.dstStageMask = access.stage;
+				imageBarrier.dstAccessMask = access.access;
+				imageBarrier.oldLayout = state.layout;
+				imageBarrier.newLayout = access.layout;
+				imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+				imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+				imageBarrier.image = resource.image;
+				imageBarrier.subresourceRange.aspectMask = resource.aspect;
+				imageBarrier.subresourceRange.baseMipLevel = 0;
+				imageBarrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+				imageBarrier.subresourceRange.baseArrayLayer = 0;
+				imageBarrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+				pass.imageBarriers.push_back(imageBarrier);
+			}
+			else if (barrier)
+			{
+				//Everything without a layout change shares the pass's one memory barrier
+				pass.memoryBarrier.srcStageMask |= srcStage;
+				pass.memoryBarrier.srcAccessMask |= srcAccess;
+				pass.memoryBarrier.dstStageMask |= access.stage;
+				pass.memoryBarrier.dstAccessMask |= access.access;
+			}
+
+			if (access.write)
+			{
+				state.writeStages = access.stage;
+				state.writeAccess = access.access & writeAccessMask;
+				state.readStages = 0;
+				state.visibleStages = 0;
+				state.visibleAccess = 0;
+			}
+			else if (transition)
+			{
+				//The transition is ordered before, and visible to, everything later in this stage
+				state.writeStages = access.stage;
+				state.writeAccess = 0;
+				state.readStages = access.stage;
+				state.visibleStages = access.stage;
+				state.visibleAccess = readAccess;
+			}
+			else
+			{
+				state.readStages |= access.stage;
+				if (barrier)
+				{
+					state.visibleStages |= access.stage;
+					state.visibleAccess |= readAccess;
+				}
+			}
+
+			if (isImage && access.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED)
+				state.layout = access.finalLayout;
+		}
+	}
+
+	//Outputs are left how their owner expects them, used this frame or not. What happens next is up to
+	//the submission's semaphores, so nothing later in this command buffer waits.
+	for (uint32_t r = 0; r < resources.size(); ++r)
+	{
+		const ResourceNode& resource = resources[r];
+		const ResourceState& state = states[r];
+		if (!resource.output || state.layout == resource.finalLayout)
+			continue;
+
+		VkImageMemoryBarrier2KHR imageBarrier{};
+		imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR;
+		imageBarrier.pNext = nullptr;
+		imageBarrier.srcStageMask = state.writeStages | state.readStages;
+		imageBarrier.srcAccessMask = state.writeAccess;
+		imageBarrier.dstStageMask = 0;
+		imageBarrier.dstAccessMask = 0;
+		imageBarrier.oldLayout = state.layout;
+		imageBarrier.newLayout = resource.finalLayout;
+		imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.image = resource.image;
+		imageBarrier.subresourceRange.aspectMask = resource.aspect;
+		imageBarrier.subresourceRange.baseMipLevel = 0;
+		imageBarrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+		imageBarrier.subresourceRange.baseArrayLayer = 0;
+		imageBarrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+		finalBarriers.push_back(imageBarrier);
+	}
+}
+
+void RenderGraph::Execute(VkCommandBuffer cmdBuffer)
+{
+	planSubmissionValue = submissionValue;
+	for (auto& pass : passes)
+	{
+		if (!pass.live)
+			continue;
+
+		RecordBarriers(cmdBuffer, pass.memoryBarrier, pass.imageBarriers);
+		pass.execute(cmdBuffer);
+	}
+
+	VkMemoryBarrier2KHR noMemoryBarrier{};
+	RecordBarriers(cmdBuffer, noMemoryBarrier, finalBarriers);
+}
+
+void RenderGraph::RecordBarriers(VkCommandBuffer cmdBuffer, const VkMemoryBarrier2KHR& memoryBarrier, const vector<VkImageMemoryBarrier2KHR>& imageBarriers)
+{
+	bool hasMemoryBarrier = memoryBarrier.srcStageMask != 0 || memoryBarrier.dstStageMask != 0;
+	if (!hasMemoryBarrier && imageBarriers.empty())
+		return;
+
+	if (pfnCmdPipelineBarrier2)
+	{
+		VkDependencyInfoKHR dependencyInfo{};
+		dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+		dependencyInfo.pNext = nullptr;
+		dependencyInfo.dependencyFlags = 0;
+		dependencyInfo.memoryBarrierCount = hasMemoryBarrier ? 1 : 0;
+		dependencyInfo.pMemoryBarriers = &memoryBarrier;
+		dependencyInfo.bufferMemoryBarrierCount = 0;
+		dependencyInfo.pBufferMemoryBarriers = nullptr;
+		dependencyInfo.imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size());
+		dependencyInfo.pImageMemoryBarriers = imageBarriers.data();
+		pfnCmdPipelineBarrier2(cmdBuffer, &dependencyInfo);
+		return;
+	}
+
+	//Without synchronization2 the stages are shared by every barrier in the call, and none is not a stage
+	VkPipelineStageFlags srcStage = static_cast<VkPipelineStageFlags>(memoryBarrier.srcStageMask);
+	VkPipelineStageFlags dstStage = static_cast<VkPipelineStageFlags>(memoryBarrier.dstStageMask);
+
+	VkMemoryBarrier legacyMemoryBarrier{};
+	legacyMemoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	legacyMemoryBarrier.pNext = nullptr;
+	legacyMemoryBarrier.srcAccessMask = static_cast<VkAccessFlags>(memoryBarrier.srcAccessMask);
+	legacyMemoryBarrier.dstAccessMask = static_cast<VkAccessFlags>(memoryBarrier.dstAccessMask);
+
+	vector<VkImageMemoryBarrier> legacyImageBarriers(imageBarriers.size());
+	for (size_t i = 0; i < imageBarriers.size(); ++i)
+	{
+		const VkImageMemoryBarrier2KHR& imageBarrier = imageBarriers[i];
+		srcStage |= static_cast<VkPipelineStageFlags>(imageBarrier.srcStageMask);
+		dstStage |= static_cast<VkPipelineStageFlags>(imageBarrier.dstStageMask);
+
+		legacyImageBarriers[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		legacyImageBarriers[i].pNext = nullptr;
+		legacyImageBarriers[i].srcAccessMask = static_cast<VkAccessFlags>(imageBarrier.srcAccessMask);
+		legacyImageBarriers[i].dstAccessMask = static_cast<VkAccessFlags>(imageBarrier.dstAccessMask);
+		legacyImageBarriers[i].oldLayout = imageBarrier.oldLayout;
+		legacyImageBarriers[i].newLayout = imageBarrier.newLayout;
+		legacyImageBarriers[i].srcQueueFamilyIndex = imageBarrier.srcQueueFamilyIndex;
+		legacyImageBarriers[i].dstQueueFamilyIndex = imageBarrier.dstQueueFamilyIndex;
+		legacyImageBarriers[i].image = imageBarrier.image;
+		legacyImageBarriers[i].subresourceRange = imageBarrier.subresourceRange;
+	}
+
+	if (srcStage == 0)
+		srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+	if (dstStage == 0)
+		dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+	vkCmdPipelineBarrier(cmdBuffer, srcStage, dstStage, 0, hasMemoryBarrier ? 1 : 0, &legacyMemoryBarrier, 0, nullptr,
+		static_cast<uint32_t>(legacyImageBarriers.size()), legacyImageBarriers.data());
+}
+
+VkImage RenderGraph::GetImage(Resource resource) const
+{
+	return resources[resource].image;
+}
+
+VkImageView RenderGraph::GetImageView(Resource resource) const
+{
+	return resources[resource].imageView;
+}
+
+void RenderGraph::DestroyImages(vector<PhysicalImage>& images, vector<VkDeviceMemory>& memory)
+{
+	for (auto& image : images)
+	{
+		vkDestroyImageView(device, image.imageView, nullptr);
+		vkDestroyImage(device, image.image, nullptr);
+	}
+	images.clear();
+
+	for (auto deviceMemory : memory)
+	{
+		vkFreeMemory(device, deviceMemory, nullptr);
+	}
+	memory.clear();
+}
@@ -0,0 +1,172 @@
+#pragma once
+#include "vulkan\vulkan.h"
+#include <functional>
+#include <string>
+#include <vector>
+using namespace std;
+
+//A frame described as passes and the resources they read and write. Passes are declared in execution order each
+//frame, then Compile works out what the hand-written barriers used to:
+//	Passes nothing consumes are culled. Consumers are later live passes, output resources and passes with side effects.
+//	Each live pass gets one batched barrier, only for real hazards: read after read needs nothing unless the layout changes,
+//	and a write made visible to a stage once is not made visible again.
+//	Transient images whose lifetimes (first to last live pass using them) don't overlap share memory.
+//Barriers use vkCmdPipelineBarrier2 (VK_KHR_synchronization2) when it is available. Stage and access masks are given with
+//the legacy bits, which have the same values in the 2 flags, so the fallback to vkCmdPipelineBarrier is a truncation.
+//Not thread safe, declared and executed by the thread recording the primary command buffer.
+class RenderGraph
+{
+public:
+	typedef uint32_t Resource;
+	typedef uint32_t Pass;
+	static const uint32_t invalidIndex { 0xffffffff };
+
+	struct TransientImageDescription
+	{
+		VkFormat				format;
+		VkExtent2D				extent;
+		VkImageUsageFlags		usage;
+		VkSampleCountFlagBits	samples;
+		VkImageAspectFlags		aspect;
+	};
+
+	RenderGraph();
+	~RenderGraph();
+
+	//pfnCmdPipelineBarrier2 is null without synchronization2
+	void		Init(VkDevice device, VkPhysicalDevice physicalDevice, PFN_vkCmdPipelineBarrier2KHR pfnCmdPipelineBarrier2);
+	void		Destroy();
+
+	//Starts declaring a frame, with the submission queue's value it will be submitted as and the completed value
+	void		Reset(uint64_t submissionValue, uint64_t completedValue);
+
+	//Resources owned elsewhere, with the stage and access that last used them (the previous frame's, or a semaphore wait's stage).
+	//An image with a finalLayout is an output, left in that layout at the end of the frame.
+	Resource	ImportBuffer(const char* name, VkBuffer buffer, VkPipelineStageFlags stage, VkAccessFlags access);
+	Resource	ImportImage(const char* name, VkImage image, VkImageAspectFlags aspect, VkImageLayout layout, VkPipelineStageFlags stage, VkAccessFlags access,
+		VkImageLayout finalLayout);
+
+	//Created by the graph, contents undefined at the first pass using it and discarded after the last
+	Resource	CreateTransientImage(const char* name, const TransientImageDescription& description);
+
+	Pass		AddPass(const char* name, function<void(VkCommandBuffer)> execute);
+	void		SetSideEffects(Pass pass);	//kept even if nothing reads what it writes
+
+	//layout is what the pass needs the image in, VK_IMAGE_LAYOUT_UNDEFINED for one that transitions it itself (a render pass),
+	//finalLayout where it leaves it. Buffers ignore both. Declaring the same resource twice in a pass merges the two.
+	void		Read(Pass pass, Resource resource, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED,
+		VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED);
+	void		Write(Pass pass, Resource resource, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED,
+		VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED);
+
+	bool		Compile();
+	void		Execute(VkCommandBuffer cmdBuffer);
+
+	//Valid after Compile, for the passes' execute functions
+	VkImage		GetImage(Resource resource) const;
+	VkImageView	GetImageView(Resource resource) const;
+
+	uint32_t	GetLivePassCount() const { return livePassCount; }
+
+private:
+	struct Access
+	{
+		Resource				resource;
+		VkPipelineStageFlags2KHR	stage;
+		VkAccessFlags2KHR		access;
+		VkImageLayout			layout;
+		VkImageLayout			finalLayout;
+		bool					write;
+	};
+
+	struct PassNode
+	{
+		const char*				name { nullptr };
+		function<void(VkCommandBuffer)>	execute;
+		vector<Access>			accesses;
+		bool					sideEffects { false };
+		bool					live { false };
+
+		//Computed by Compile, recorded before execute
+		VkMemoryBarrier2KHR		memoryBarrier;
+		vector<VkImageMemoryBarrier2KHR>	imageBarriers;
+	};
+
+	//Hazard tracking, whole resource at a time
+	struct ResourceState
+	{
+		VkPipelineStageFlags2KHR	writeStages;	//the last write, or layout transition
+		VkAccessFlags2KHR		writeAccess;
+		VkPipelineStageFlags2KHR	readStages;		//reads since then
+		VkPipelineStageFlags2KHR	visibleStages;	//what the last write has been made visible to
+		VkAccessFlags2KHR		visibleAccess;
+		VkImageLayout			layout;
+	};
+
+	struct ResourceNode
+	{
+		const char*				name { nullptr };
+		VkBuffer				buffer { VK_NULL_HANDLE };
+		VkImage					image { VK_NULL_HANDLE };
+		VkImageView				imageView { VK_NULL_HANDLE };
+		VkImageAspectFlags		aspect { 0 };
+		ResourceState			initialState;
+		VkImageLayout			finalLayout { VK_IMAGE_LAYOUT_UNDEFINED };
+		bool					output { false };
+
+		bool					transient { false };
+		TransientImageDescription	description;
+		uint32_t				firstPass { invalidIndex };	//lifetime in live passes
+		uint32_t				lastPass { invalidIndex };
+		uint32_t				physical { invalidIndex };	//into physicalImages
+	};
+
+	//A transient's image, bound at its offset into the memory it shares with others
+	struct PhysicalImage
+	{
+		TransientImageDescription	description;
+		VkImage					image { VK_NULL_HANDLE };
+		VkImageView				imageView { VK_NULL_HANDLE };
+		VkMemoryRequirements	memoryRequirements;
+		uint32_t				memoryType { invalidIndex };
+		VkDeviceSize			offset { 0 };
+		VkPipelineStageFlags2KHR	stages { 0 };	//every use, which the next occupant of its memory waits for
+		VkAccessFlags2KHR		writeAccess { 0 };
+	};
+
+	//Transient images and memory from an aliasing plan that has been replaced, destroyed once the last submission using them has completed
+	struct Retired
+	{
+		vector<PhysicalImage>	images;
+		vector<VkDeviceMemory>	memory;
+		uint64_t				submissionValue;
+	};
+
+	VkDevice				device { VK_NULL_HANDLE };
+	VkPhysicalDeviceMemoryProperties	memoryProperties;
+	PFN_vkCmdPipelineBarrier2KHR	pfnCmdPipelineBarrier2 { nullptr };
+	uint64_t				submissionValue { 0 };
+
+	vector<PassNode>		passes;
+	vector<ResourceNode>	resources;
+	uint32_t				livePassCount { 0 };
+
+	//The current aliasing plan, rebuilt only when the transients or their lifetimes change
+	uint64_t				planHash { 0 };
+	uint64_t				planSubmissionValue { 0 };	//the last submission the plan's images were executed in
+	vector<PhysicalImage>	physicalImages;
+	vector<VkDeviceMemory>	transientMemory;
+	vector<Retired>			retired;
+
+	//Barriers for outputs not already in their final layout
+	vector<VkImageMemoryBarrier2KHR>	finalBarriers;
+
+	void		AddAccess(Pass pass, Resource resource, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout, VkImageLayout finalLayout, bool write);
+	void		CullPasses();
+	bool		AllocateTransients(const vector<ResourceNode*>& owners);	//owners[i] is physicalImages[i]
+	bool		CreatePhysicalImage(PhysicalImage& physicalImage);
+	void		PlaceTransients(const vector<ResourceNode*>& owners);
+	void		BuildBarriers();
+	void		RecordBarriers(VkCommandBuffer cmdBuffer, const VkMemoryBarrier2KHR& memoryBarrier, const vector<VkImageMemoryBarrier2KHR>& imageBarriers);
+	void		DestroyImages(vector<PhysicalImage>& images, vector<VkDeviceMemory>& memory);
+};
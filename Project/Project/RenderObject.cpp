@@ -2,11 +2,30 @@
 
 
 
-RenderObject::RenderObject()
+RenderObject::RenderObject(MeshObject* mesh, ManagedPipeline* pipeline)
+	: mesh(mesh), pipeline(pipeline)
 {
+	for (int i = 0; i < 16; ++i)
+	{
+		instance.transform[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+	}
 }
 
 
 RenderObject::~RenderObject()
 {
 }
+
+void RenderObject::SetPosition(float x, float y, float z)
+{
+	instance.transform[12] = x;
+	instance.transform[13] = y;
+	instance.transform[14] = z;
+}
+
+void RenderObject::SetScale(float scale)
+{
+	instance.transform[0] = scale;
+	instance.transform[5] = scale;
+	instance.transform[10] = scale;
+}
@@ -1,8 +1,26 @@
 #pragma once
+#include "vulkan\vulkan.h"
+
+class MeshObject;
+struct ManagedPipeline;
+
+//Per-instance vertex data, column major to match mat4 in the shader
+struct InstanceData
+{
+	float transform[16];
+};
+
 class RenderObject
 {
 public:
-	RenderObject();
+	RenderObject(MeshObject* mesh, ManagedPipeline* pipeline);
 	~RenderObject();
+
+	void SetPosition(float x, float y, float z);
+	void SetScale(float scale);
+
+	MeshObject*			mesh		{ nullptr };
+	ManagedPipeline*	pipeline	{ nullptr };
+	InstanceData		instance;
 };
 
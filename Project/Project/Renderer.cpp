@@ -2,10 +2,12 @@
 #include "Debug.h"
 
 #include <memory>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 
 Renderer::Renderer()
 {
@@ -15,12 +17,44 @@ Renderer::Renderer()
 Renderer::~Renderer()
 {
 	//TD move to cleanup function
-	vkDeviceWaitIdle(defaultDevice);
+#ifdef BUILD_ENABLE_SHADER_HOT_RELOAD
+	shaderWatcher.Stop();
+#endif
+	pipelineManager.WaitIdle();
+	jobSystem.Stop();
+	submissionQueue.WaitIdle();
+	submissionQueue.Stop();
 	//vkDestroySemaphore(defaultDevice, semaphore, nullptr);
 
-	VkCommandBuffer commandBuffers[1] = { commandBuffer };
-	vkFreeCommandBuffers(defaultDevice, commandPool, bufferCount, commandBuffers);
-	vkDestroyCommandPool(defaultDevice, commandPool, nullptr);
+	DestroyFrameResources();
+	DestroyAttachments();
+
+	if (instanceBuffer != VK_NULL_HANDLE)
+	{
+		vkDestroyBuffer(defaultDevice, instanceBuffer, nullptr);
+		vkFreeMemory(defaultDevice, instanceMemory, nullptr);
+	}
+	DestroyMesh(triMesh);
+	DestroyMesh(quantizedTriMesh);
+	DestroyCullBuffers();
+	DestroyBatchUniforms();
+	DestroyLightClusterBuffers();
+	renderGraph.Destroy();
+	descriptorAllocator.Destroy();
+	bindlessHeap.Destroy();
+	pipelineManager.LogStatistics();
+	pipelineManager.SaveManifest(pipelineManifestFilename);
+	pipelineManager.Destroy();
+	shaderLibrary.Destroy();
+	SavePipelineCache();
+	vkDestroyPipelineCache(defaultDevice, pipelineCache, nullptr);
+	vkDestroyPipeline(defaultDevice, cullPipeline, nullptr);
+	vkDestroyPipelineLayout(defaultDevice, cullPipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(defaultDevice, cullSetLayout, nullptr);
+	vkDestroyPipeline(defaultDevice, lightCullPipeline, nullptr);
+	vkDestroyPipelineLayout(defaultDevice, lightCullPipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(defaultDevice, lightCullSetLayout, nullptr);
+
 	vkDestroySwapchainKHR(defaultDevice, swapchain, nullptr);
 	vkDestroyDevice(defaultDevice, nullptr);
 	vkDestroySurfaceKHR(instance, surface, VK_NULL_HANDLE);
@@ -314,13 +348,284 @@ bool Renderer::CreateDevice()
 	//deviceCreateInfo.enabledExtensionCount = globalExtensionCount;		//TODO: get this programatically
 	//deviceCreateInfo.ppEnabledExtensionNames = globalExtensionNames;
 
-	deviceCreateInfo.enabledExtensionCount = 1;		//TODO: get this programatically
-	char* deviceExtensions[] = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
-	deviceCreateInfo.ppEnabledExtensionNames = deviceExtensions;
+	uint32_t extensionCount = 0;
+	auto err = vkEnumerateDeviceExtensionProperties(defaultPhysicalDevice, nullptr, &extensionCount, nullptr);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Enumerate device extensions failed", DebugLevel::Error);
+		return false;
+	}
+	availableDeviceExtensions.resize(extensionCount);
+	err = vkEnumerateDeviceExtensionProperties(defaultPhysicalDevice, nullptr, &extensionCount, availableDeviceExtensions.data());
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Enumerate device extensions failed while retrieving extensions", DebugLevel::Error);
+		return false;
+	}
+
+	vector<const char*> deviceExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+
+	drawIndirectCountSupported = HasDeviceExtension(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+	if (drawIndirectCountSupported)
+	{
+		deviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+	}
+
+	//Graphics pipeline library, so pipeline variants can be fast-linked from shared parts
+	VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT graphicsPipelineLibraryFeatures{};
+	graphicsPipelineLibraryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+	graphicsPipelineLibraryFeatures.pNext = nullptr;
+
+	auto pfnGetPhysicalDeviceFeatures2 = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>(vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR"));
+	auto pfnGetPhysicalDeviceProperties2 = reinterpret_cast<PFN_vkGetPhysicalDeviceProperties2KHR>(vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2KHR"));
+	if (enableGraphicsPipelineLibrary && pfnGetPhysicalDeviceFeatures2 && pfnGetPhysicalDeviceProperties2 &&
+		HasDeviceExtension(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) && HasDeviceExtension(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME))
+	{
+		VkPhysicalDeviceFeatures2KHR features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+		features2.pNext = &graphicsPipelineLibraryFeatures;
+		pfnGetPhysicalDeviceFeatures2(defaultPhysicalDevice, &features2);
+
+		VkPhysicalDeviceGraphicsPipelineLibraryPropertiesEXT graphicsPipelineLibraryProperties{};
+		graphicsPipelineLibraryProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_PROPERTIES_EXT;
+		graphicsPipelineLibraryProperties.pNext = nullptr;
+
+		VkPhysicalDeviceProperties2KHR properties2{};
+		properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+		properties2.pNext = &graphicsPipelineLibraryProperties;
+		pfnGetPhysicalDeviceProperties2(defaultPhysicalDevice, &properties2);
+
+		//Without fast linking, linking costs about as much as a whole compile
+		graphicsPipelineLibrarySupported = graphicsPipelineLibraryFeatures.graphicsPipelineLibrary && graphicsPipelineLibraryProperties.graphicsPipelineLibraryFastLinking;
+	}
+
+	if (graphicsPipelineLibrarySupported)
+	{
+		deviceExtensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+		deviceExtensions.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+		graphicsPipelineLibraryFeatures.graphicsPipelineLibrary = VK_TRUE;
+		graphicsPipelineLibraryFeatures.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+		deviceCreateInfo.pNext = &graphicsPipelineLibraryFeatures;
+	}
+
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(defaultPhysicalDevice, &supportedFeatures);
+
+	//Descriptor indexing, for the bindless heap. Only what the heap needs: runtime sized arrays, partially bound and
+	//updated while in use. Indices come from push constants, so non-uniform indexing is not required, but indexing
+	//the buffer array at all with them is the core dynamic indexing feature.
+	VkPhysicalDeviceDescriptorIndexingFeaturesEXT descriptorIndexingFeatures{};
+	descriptorIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+	descriptorIndexingFeatures.pNext = nullptr;
+	if (enableBindless && pfnGetPhysicalDeviceFeatures2 && pfnGetPhysicalDeviceProperties2 &&
+		HasDeviceExtension(VK_KHR_MAINTENANCE3_EXTENSION_NAME) && HasDeviceExtension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME))
+	{
+		VkPhysicalDeviceFeatures2KHR features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+		features2.pNext = &descriptorIndexingFeatures;
+		pfnGetPhysicalDeviceFeatures2(defaultPhysicalDevice, &features2);
+
+		VkPhysicalDeviceDescriptorIndexingPropertiesEXT descriptorIndexingProperties{};
+		descriptorIndexingProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+		descriptorIndexingProperties.pNext = nullptr;
+
+		VkPhysicalDeviceProperties2KHR properties2{};
+		properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+		properties2.pNext = &descriptorIndexingProperties;
+		pfnGetPhysicalDeviceProperties2(defaultPhysicalDevice, &properties2);
+
+		bindlessSupported = descriptorIndexingFeatures.runtimeDescriptorArray && descriptorIndexingFeatures.descriptorBindingPartiallyBound &&
+			descriptorIndexingFeatures.descriptorBindingStorageBufferUpdateAfterBind && descriptorIndexingFeatures.descriptorBindingSampledImageUpdateAfterBind &&
+			supportedFeatures.shaderStorageBufferArrayDynamicIndexing;
+
+		//Every stage sees the whole heap, and a combined image sampler counts as both a sampler and an image.
+		//Some of the per stage budget is left for the classic sets used alongside it.
+		const uint32_t maxHeapSlots = 65536;
+		const uint32_t reservedResources = 64;
+		bindlessBufferCapacity = std::min(maxHeapSlots, std::min(descriptorIndexingProperties.maxDescriptorSetUpdateAfterBindStorageBuffers, descriptorIndexingProperties.maxPerStageDescriptorUpdateAfterBindStorageBuffers));
+		bindlessImageCapacity = std::min(maxHeapSlots, std::min(descriptorIndexingProperties.maxDescriptorSetUpdateAfterBindSampledImages, descriptorIndexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages));
+		bindlessImageCapacity = std::min(bindlessImageCapacity, std::min(descriptorIndexingProperties.maxDescriptorSetUpdateAfterBindSamplers, descriptorIndexingProperties.maxPerStageDescriptorUpdateAfterBindSamplers));
+		uint32_t resourceBudget = descriptorIndexingProperties.maxPerStageUpdateAfterBindResources > reservedResources ? descriptorIndexingProperties.maxPerStageUpdateAfterBindResources - reservedResources : 0;
+		if (bindlessBufferCapacity + bindlessImageCapacity > resourceBudget)
+		{
+			bindlessBufferCapacity = std::min(bindlessBufferCapacity, resourceBudget / 2);
+			bindlessImageCapacity = std::min(bindlessImageCapacity, resourceBudget - bindlessBufferCapacity);
+		}
+		bindlessSupported = bindlessSupported && bindlessBufferCapacity > 0 && bindlessImageCapacity > 0;
+	}
+
+	if (bindlessSupported)
+	{
+		deviceExtensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+		deviceExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+
+		VkPhysicalDeviceDescriptorIndexingFeaturesEXT supported = descriptorIndexingFeatures;
+		descriptorIndexingFeatures = VkPhysicalDeviceDescriptorIndexingFeaturesEXT{};
+		descriptorIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+		descriptorIndexingFeatures.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+		descriptorIndexingFeatures.runtimeDescriptorArray = supported.runtimeDescriptorArray;
+		descriptorIndexingFeatures.descriptorBindingPartiallyBound = supported.descriptorBindingPartiallyBound;
+		descriptorIndexingFeatures.descriptorBindingStorageBufferUpdateAfterBind = supported.descriptorBindingStorageBufferUpdateAfterBind;
+		descriptorIndexingFeatures.descriptorBindingSampledImageUpdateAfterBind = supported.descriptorBindingSampledImageUpdateAfterBind;
+		deviceCreateInfo.pNext = &descriptorIndexingFeatures;
+	}
+	else if (enableBindless)
+	{
+		Debug::Log("Bindless disabled: descriptor indexing not supported", DebugLevel::Warning);
+	}
+
+	//Dynamic rendering, and the extensions it depends on
+	const char* dynamicRenderingExtensions[] = {
+		VK_KHR_MULTIVIEW_EXTENSION_NAME,
+		VK_KHR_MAINTENANCE2_EXTENSION_NAME,
+		VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
+		VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME,
+		VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
+	};
+	VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures{};
+	dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+	dynamicRenderingFeatures.pNext = nullptr;
+	//Deferred shading's subpasses and input attachments need a render pass
+	if (enableDynamicRendering && !enableDeferred && pfnGetPhysicalDeviceFeatures2)
+	{
+		dynamicRenderingSupported = true;
+		for (auto extensionName : dynamicRenderingExtensions)
+		{
+			dynamicRenderingSupported = dynamicRenderingSupported && HasDeviceExtension(extensionName);
+		}
+	}
+
+	if (dynamicRenderingSupported)
+	{
+		VkPhysicalDeviceFeatures2KHR features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+		features2.pNext = &dynamicRenderingFeatures;
+		pfnGetPhysicalDeviceFeatures2(defaultPhysicalDevice, &features2);
+		dynamicRenderingSupported = dynamicRenderingFeatures.dynamicRendering == VK_TRUE;
+	}
+
+	if (dynamicRenderingSupported)
+	{
+		deviceExtensions.insert(deviceExtensions.end(), std::begin(dynamicRenderingExtensions), std::end(dynamicRenderingExtensions));
+		dynamicRenderingFeatures.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+		deviceCreateInfo.pNext = &dynamicRenderingFeatures;
+	}
+	else if (enableDynamicRendering)
+	{
+		Debug::Log("Dynamic rendering not supported, using render pass objects", DebugLevel::Warning);
+	}
+
+	//Extended dynamic state, with blend enable from extended_dynamic_state3 where that is supported too
+	VkPhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures{};
+	extendedDynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+	extendedDynamicStateFeatures.pNext = nullptr;
+	VkPhysicalDeviceExtendedDynamicState3FeaturesEXT extendedDynamicState3Features{};
+	extendedDynamicState3Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT;
+	extendedDynamicState3Features.pNext = nullptr;
+	if (enableExtendedDynamicState && pfnGetPhysicalDeviceFeatures2 && HasDeviceExtension(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME))
+	{
+		bool hasExtendedDynamicState3 = HasDeviceExtension(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME);
+		extendedDynamicStateFeatures.pNext = hasExtendedDynamicState3 ? &extendedDynamicState3Features : nullptr;
+
+		VkPhysicalDeviceFeatures2KHR features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+		features2.pNext = &extendedDynamicStateFeatures;
+		pfnGetPhysicalDeviceFeatures2(defaultPhysicalDevice, &features2);
+
+		extendedDynamicStateSupported = extendedDynamicStateFeatures.extendedDynamicState == VK_TRUE;
+		dynamicBlendEnableSupported = extendedDynamicStateSupported && hasExtendedDynamicState3 && extendedDynamicState3Features.extendedDynamicState3ColorBlendEnable == VK_TRUE;
+	}
+
+	if (extendedDynamicStateSupported)
+	{
+		deviceExtensions.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+		extendedDynamicStateFeatures = VkPhysicalDeviceExtendedDynamicStateFeaturesEXT{};
+		extendedDynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+		extendedDynamicStateFeatures.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+		extendedDynamicStateFeatures.extendedDynamicState = VK_TRUE;
+		deviceCreateInfo.pNext = &extendedDynamicStateFeatures;
+	}
+	else if (enableExtendedDynamicState)
+	{
+		Debug::Log("Extended dynamic state not supported, pipelines bake all fixed function state", DebugLevel::Warning);
+	}
+
+	if (dynamicBlendEnableSupported)
+	{
+		deviceExtensions.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME);
+		extendedDynamicState3Features = VkPhysicalDeviceExtendedDynamicState3FeaturesEXT{};
+		extendedDynamicState3Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT;
+		extendedDynamicState3Features.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+		extendedDynamicState3Features.extendedDynamicState3ColorBlendEnable = VK_TRUE;
+		deviceCreateInfo.pNext = &extendedDynamicState3Features;
+	}
+
+	//Timeline semaphores, so every submission signals an increasing value on its queue's semaphore
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineSemaphoreFeatures{};
+	timelineSemaphoreFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+	timelineSemaphoreFeatures.pNext = nullptr;
+	if (enableTimelineSemaphores && pfnGetPhysicalDeviceFeatures2 && HasDeviceExtension(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+	{
+		VkPhysicalDeviceFeatures2KHR features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+		features2.pNext = &timelineSemaphoreFeatures;
+		pfnGetPhysicalDeviceFeatures2(defaultPhysicalDevice, &features2);
+		timelineSemaphoresSupported = timelineSemaphoreFeatures.timelineSemaphore == VK_TRUE;
+	}
+
+	if (timelineSemaphoresSupported)
+	{
+		deviceExtensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+		timelineSemaphoreFeatures.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+		deviceCreateInfo.pNext = &timelineSemaphoreFeatures;
+	}
+
+	//Synchronization2, so the render graph's barriers carry their own stage masks
+	VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2Features{};
+	synchronization2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+	synchronization2Features.pNext = nullptr;
+	if (enableSynchronization2 && pfnGetPhysicalDeviceFeatures2 && HasDeviceExtension(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME))
+	{
+		VkPhysicalDeviceFeatures2KHR features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+		features2.pNext = &synchronization2Features;
+		pfnGetPhysicalDeviceFeatures2(defaultPhysicalDevice, &features2);
+		synchronization2Supported = synchronization2Features.synchronization2 == VK_TRUE;
+	}
+
+	if (synchronization2Supported)
+	{
+		deviceExtensions.push_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+		synchronization2Features.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+		deviceCreateInfo.pNext = &synchronization2Features;
+	}
+	else if (enableSynchronization2)
+	{
+		Debug::Log("Synchronization2 not supported, render graph barriers use vkCmdPipelineBarrier", DebugLevel::Warning);
+	}
+
+	//Push descriptors, for per draw buffers too big for push constants. Needs no features, only the extension.
+	pushDescriptorSupported = pfnGetPhysicalDeviceProperties2 && HasDeviceExtension(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+	if (pushDescriptorSupported)
+	{
+		deviceExtensions.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+	}
+
+	deviceCreateInfo.enabledExtensionCount = deviceExtensions.size();
+	deviceCreateInfo.ppEnabledExtensionNames = deviceExtensions.data();
+
+	//GPU culling writes one indirect draw per object, with firstInstance selecting its transform
+	VkPhysicalDeviceFeatures enabledFeatures{};
+	enabledFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+	enabledFeatures.drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance;
+	enabledFeatures.shaderStorageBufferArrayDynamicIndexing = bindlessSupported ? VK_TRUE : VK_FALSE;
+	deviceCreateInfo.pEnabledFeatures = &enabledFeatures;
+
+	gpuCulling = supportedFeatures.multiDrawIndirect && supportedFeatures.drawIndirectFirstInstance;
 
 	Debug::Log("Creating default logical device");
 
-	auto err = vkCreateDevice(defaultPhysicalDevice, &deviceCreateInfo, nullptr, &defaultDevice);
+	err = vkCreateDevice(defaultPhysicalDevice, &deviceCreateInfo, nullptr, &defaultDevice);
 	
 	if (err != VK_SUCCESS)
 	{
@@ -330,9 +635,47 @@ bool Renderer::CreateDevice()
 
 	vkGetDeviceQueue(defaultDevice, defaultQueueFamilyIndex, 0, &primaryQueue);
 
+	if (drawIndirectCountSupported)
+	{
+		pfnCmdDrawIndexedIndirectCount = reinterpret_cast<PFN_vkCmdDrawIndexedIndirectCountKHR>(vkGetDeviceProcAddr(defaultDevice, "vkCmdDrawIndexedIndirectCountKHR"));
+		drawIndirectCountSupported = pfnCmdDrawIndexedIndirectCount != nullptr;
+	}
+
+	if (dynamicRenderingSupported)
+	{
+		pfnCmdBeginRendering = reinterpret_cast<PFN_vkCmdBeginRenderingKHR>(vkGetDeviceProcAddr(defaultDevice, "vkCmdBeginRenderingKHR"));
+		pfnCmdEndRendering = reinterpret_cast<PFN_vkCmdEndRenderingKHR>(vkGetDeviceProcAddr(defaultDevice, "vkCmdEndRenderingKHR"));
+		dynamicRenderingSupported = pfnCmdBeginRendering != nullptr && pfnCmdEndRendering != nullptr;
+	}
+	Debug::Log(dynamicRenderingSupported ? "Rendering with dynamic rendering" : "Rendering with render pass objects");
+
+	if (pushDescriptorSupported)
+	{
+		pfnCmdPushDescriptorSet = reinterpret_cast<PFN_vkCmdPushDescriptorSetKHR>(vkGetDeviceProcAddr(defaultDevice, "vkCmdPushDescriptorSetKHR"));
+		pushDescriptorSupported = pfnCmdPushDescriptorSet != nullptr;
+	}
+
+	if (synchronization2Supported)
+	{
+		pfnCmdPipelineBarrier2 = reinterpret_cast<PFN_vkCmdPipelineBarrier2KHR>(vkGetDeviceProcAddr(defaultDevice, "vkCmdPipelineBarrier2KHR"));
+		synchronization2Supported = pfnCmdPipelineBarrier2 != nullptr;
+	}
+
 	return true;
 }
 
+bool Renderer::HasDeviceExtension(const char* extensionName)
+{
+	for (auto& extension : availableDeviceExtensions)
+	{
+		if (strcmp(extension.extensionName, extensionName) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 bool Renderer::CreateAppWindow()
 {
 	WNDCLASSEX wc = {};
@@ -357,39 +700,6 @@ bool Renderer::CreateAppWindow()
 	return true;
 }
 
-bool Renderer::CreateCommandBuffers()
-{
-	VkCommandPoolCreateInfo cmd_pool_info{};
-	cmd_pool_info.sType		= VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	cmd_pool_info.queueFamilyIndex = defaultQueueFamilyIndex;
-	cmd_pool_info.flags		= VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
-	cmd_pool_info.pNext		= nullptr;
-
-	auto err = vkCreateCommandPool(defaultDevice, &cmd_pool_info, nullptr, &commandPool);
-	if (err != VK_SUCCESS)
-	{
-		Debug::Log("Create command pool", DebugLevel::Error);
-		return false;
-	}
-
-	VkCommandBufferAllocateInfo bufferAllocInfo {};
-	bufferAllocInfo.sType		= VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	bufferAllocInfo.commandBufferCount = bufferCount;
-	bufferAllocInfo.commandPool = commandPool;
-	bufferAllocInfo.level		= VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	bufferAllocInfo.pNext		= nullptr;
-
-	err = vkAllocateCommandBuffers(defaultDevice, &bufferAllocInfo, &commandBuffer);
-
-	if (err != VK_SUCCESS)
-	{
-		Debug::Log("Allocate command buffer", DebugLevel::Error);
-		return false;
-	}
-
-	return true;
-}
-
 bool Renderer::CreateSwapchain()
 {
 	VkSurfaceCapabilitiesKHR surfaceCapabilities;
@@ -606,118 +916,61 @@ void Renderer::DestroyDebug()
 	vkDestroyDebugReportCallbackEXT(instance, vulkanDebugReportCallbackHandle, nullptr);
 }
 
-bool Renderer::RenderClearScreen()
+bool Renderer::CreateRenderPass()
 {
-	uint32_t timeout = 30; // ms
-	VkSemaphore semaphore;
-	VkSemaphoreCreateInfo semaphoreCreatInfo{};
-	semaphoreCreatInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	semaphoreCreatInfo.pNext = nullptr;
-	semaphoreCreatInfo.flags = 0;
-	auto err = vkCreateSemaphore(defaultDevice, &semaphoreCreatInfo, nullptr, &semaphore);
-	uint32_t imageIndex;
-	
-	err = vkAcquireNextImageKHR(defaultDevice, swapchain, timeout, semaphore, nullptr, &imageIndex);
-
-	VkCommandBufferBeginInfo cmdBufferBeginInfo{};
-	cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	cmdBufferBeginInfo.pNext = nullptr;
-	cmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-	cmdBufferBeginInfo.pInheritanceInfo = nullptr;
-
-	VkClearColorValue clearColour = { 1.0f, 0.8f, 0.4f, 0.0f };
-
-	VkImageSubresourceRange imageSubresourceRange{};
-	imageSubresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	imageSubresourceRange.baseMipLevel = 0;
-	imageSubresourceRange.levelCount = 1;
-	imageSubresourceRange.baseArrayLayer = 0;
-	imageSubresourceRange.layerCount = 1;
-
-	VkImageMemoryBarrier barrier{};
-	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	barrier.pNext = nullptr;
-	barrier.srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-	barrier.srcQueueFamilyIndex = defaultQueueFamilyIndex;
-	barrier.dstQueueFamilyIndex = defaultQueueFamilyIndex;
-	barrier.image = swapchainImages[imageIndex];
-	barrier.subresourceRange = imageSubresourceRange;
-	
-	VkImageMemoryBarrier barrier2 = barrier;
-	barrier2.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-	barrier2.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	barrier2.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-	barrier2.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	
-	//Begin 
-	err = vkBeginCommandBuffer(commandBuffer, &cmdBufferBeginInfo);
-	if (err != VK_SUCCESS)
-	{
-		Debug::Log("Begin Command buffer", DebugLevel::Error);
-		return false;
-	}
-
-	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-	
-	vkCmdClearColorImage(commandBuffer, swapchainImages[imageIndex] , VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColour, 1, &imageSubresourceRange);
-
-	//End
-	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier2);
-
-	err = vkEndCommandBuffer(commandBuffer);
-
-	VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-	VkSubmitInfo submitInfo{};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pNext = nullptr;
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &semaphore;
-	submitInfo.pWaitDstStageMask = &waitStageMask;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffer;
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &semaphore; //TODO: we need different semaphores here
-	
-	err = vkQueueSubmit(primaryQueue, 1, &submitInfo, nullptr);
-	
-	VkPresentInfoKHR presentInfo{};
-	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-	presentInfo.pNext = nullptr;
-	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = &semaphore;
-	presentInfo.swapchainCount = 1;
-	presentInfo.pSwapchains = &swapchain;
-	presentInfo.pImageIndices = &imageIndex;
-	presentInfo.pResults = nullptr;
-	
-	err = vkQueuePresentKHR(primaryQueue, &presentInfo);
+	if (enableDeferred)
+		return CreateDeferredRenderPass();
 
-	return true;
-}
+	bool multisampled = sampleCount != VK_SAMPLE_COUNT_1_BIT;
 
-bool Renderer::CreateRenderPass()
-{
-	VkAttachmentDescription attachmentDescription{};
+	VkAttachmentDescription attachmentDescriptions[3]{};
+	VkAttachmentDescription& attachmentDescription = attachmentDescriptions[0];
 	attachmentDescription.flags = 0;
 	attachmentDescription.format = currentFormat;		//Get SwapChain Format
-	attachmentDescription.samples = VK_SAMPLE_COUNT_1_BIT;
+	attachmentDescription.samples = sampleCount;
 	attachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-	attachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	attachmentDescription.storeOp = multisampled ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;	//only the resolve is kept
 	attachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	attachmentDescription.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	attachmentDescription.initialLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	attachmentDescription.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; 
-
-	//attachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	//attachmentDescription.finalLayout = VK_IMAGE_LAYOUT_UNDEFINED; 
+	attachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;	//cleared, so whatever was there is discarded
+	attachmentDescription.finalLayout = multisampled ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; 
+
+	//Depth is only needed while the pass runs, so it is never written back to memory
+	VkAttachmentDescription& depthAttachmentDescription = attachmentDescriptions[1];
+	depthAttachmentDescription.flags = 0;
+	depthAttachmentDescription.format = depthFormat;
+	depthAttachmentDescription.samples = sampleCount;
+	depthAttachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	depthAttachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	depthAttachmentDescription.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	depthAttachmentDescription.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
 	VkAttachmentReference colourAttachmentReference{};
 	colourAttachmentReference.attachment = 0;
 	colourAttachmentReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
+	VkAttachmentReference depthAttachmentReference{};
+	depthAttachmentReference.attachment = 1;
+	depthAttachmentReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	//With MSAA the swapchain image is the resolve target, written as the subpass ends rather than by a separate blit
+	VkAttachmentDescription& resolveAttachmentDescription = attachmentDescriptions[2];
+	resolveAttachmentDescription.flags = 0;
+	resolveAttachmentDescription.format = currentFormat;
+	resolveAttachmentDescription.samples = VK_SAMPLE_COUNT_1_BIT;
+	resolveAttachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;	//every pixel is resolved over
+	resolveAttachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	resolveAttachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	resolveAttachmentDescription.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	resolveAttachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	resolveAttachmentDescription.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+	VkAttachmentReference resolveAttachmentReference{};
+	resolveAttachmentReference.attachment = 2;
+	resolveAttachmentReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
 	VkSubpassDescription subpassDescription{};
 	subpassDescription.flags = 0; 
 	subpassDescription.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
@@ -725,26 +978,28 @@ bool Renderer::CreateRenderPass()
 	subpassDescription.pInputAttachments = nullptr;
 	subpassDescription.colorAttachmentCount = 1;
 	subpassDescription.pColorAttachments = &colourAttachmentReference;
-	subpassDescription.pResolveAttachments = nullptr;
-	subpassDescription.pDepthStencilAttachment = nullptr;
+	subpassDescription.pResolveAttachments = multisampled ? &resolveAttachmentReference : nullptr;
+	subpassDescription.pDepthStencilAttachment = &depthAttachmentReference;
 	subpassDescription.preserveAttachmentCount = 0;
 	subpassDescription.pPreserveAttachments = nullptr;
 
 	VkSubpassDependency dependencies[2];
 	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
 	dependencies[0].dstSubpass = 0;
-	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+	//The layout transition waits for the acquire semaphore, which is waited on at colour output.
+	//Depth and MSAA colour are shared between frames, so their clears also wait for the previous frame's writes.
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+	dependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 	dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
 	dependencies[1].srcSubpass = 0;
 	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
 	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;	//presentation waits on a semaphore
 	dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-	dependencies[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+	dependencies[1].dstAccessMask = 0;
 	dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
 
 
@@ -752,8 +1007,8 @@ bool Renderer::CreateRenderPass()
 	renderPassCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
 	renderPassCreateInfo.pNext = nullptr;
 	renderPassCreateInfo.flags = 0;
-	renderPassCreateInfo.attachmentCount = 1;
-	renderPassCreateInfo.pAttachments = &attachmentDescription;
+	renderPassCreateInfo.attachmentCount = multisampled ? 3 : 2;
+	renderPassCreateInfo.pAttachments = attachmentDescriptions;
 	renderPassCreateInfo.subpassCount = 1;
 	renderPassCreateInfo.pSubpasses = &subpassDescription;
 
@@ -773,20 +1028,183 @@ bool Renderer::CreateRenderPass()
 	return true;
 }
 
-bool Renderer::CreateFrameBuffer(uint32_t imageIndex)
+bool Renderer::CreateDeferredRenderPass()
+{
+	//Swapchain, depth, then the G-buffer. Only the swapchain image is stored, the rest live and die in the pass.
+	VkAttachmentDescription attachmentDescriptions[2 + gBufferCount]{};
+	VkAttachmentDescription& colourAttachmentDescription = attachmentDescriptions[0];
+	colourAttachmentDescription.flags = 0;
+	colourAttachmentDescription.format = currentFormat;
+	colourAttachmentDescription.samples = VK_SAMPLE_COUNT_1_BIT;
+	colourAttachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;	//lighting writes every pixel
+	colourAttachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	colourAttachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	colourAttachmentDescription.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	colourAttachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	colourAttachmentDescription.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+	VkAttachmentDescription& depthAttachmentDescription = attachmentDescriptions[1];
+	depthAttachmentDescription.flags = 0;
+	depthAttachmentDescription.format = depthFormat;
+	depthAttachmentDescription.samples = VK_SAMPLE_COUNT_1_BIT;
+	depthAttachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	depthAttachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	depthAttachmentDescription.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	depthAttachmentDescription.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+	for (uint32_t i = 0; i < gBufferCount; ++i)
+	{
+		VkAttachmentDescription& gBufferAttachmentDescription = attachmentDescriptions[2 + i];
+		gBufferAttachmentDescription.flags = 0;
+		gBufferAttachmentDescription.format = gBufferFormats[i];
+		gBufferAttachmentDescription.samples = VK_SAMPLE_COUNT_1_BIT;
+		gBufferAttachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		gBufferAttachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		gBufferAttachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		gBufferAttachmentDescription.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		gBufferAttachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		gBufferAttachmentDescription.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	}
+
+	//Subpass 0 fills the G-buffer
+	VkAttachmentReference gBufferAttachmentReferences[gBufferCount];
+	for (uint32_t i = 0; i < gBufferCount; ++i)
+	{
+		gBufferAttachmentReferences[i].attachment = 2 + i;
+		gBufferAttachmentReferences[i].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	}
+
+	VkAttachmentReference depthAttachmentReference{};
+	depthAttachmentReference.attachment = 1;
+	depthAttachmentReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	//Subpass 1 reads it back at the pixel being shaded, in DeferredLighting.frag's input_attachment_index order
+	VkAttachmentReference inputAttachmentReferences[gBufferCount + 1];
+	for (uint32_t i = 0; i < gBufferCount; ++i)
+	{
+		inputAttachmentReferences[i].attachment = 2 + i;
+		inputAttachmentReferences[i].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	}
+	inputAttachmentReferences[gBufferCount].attachment = 1;
+	inputAttachmentReferences[gBufferCount].layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+	VkAttachmentReference colourAttachmentReference{};
+	colourAttachmentReference.attachment = 0;
+	colourAttachmentReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+	VkSubpassDescription subpassDescriptions[2]{};
+	subpassDescriptions[0].flags = 0;
+	subpassDescriptions[0].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpassDescriptions[0].inputAttachmentCount = 0;
+	subpassDescriptions[0].pInputAttachments = nullptr;
+	subpassDescriptions[0].colorAttachmentCount = gBufferCount;
+	subpassDescriptions[0].pColorAttachments = gBufferAttachmentReferences;
+	subpassDescriptions[0].pResolveAttachments = nullptr;
+	subpassDescriptions[0].pDepthStencilAttachment = &depthAttachmentReference;
+	subpassDescriptions[0].preserveAttachmentCount = 0;
+	subpassDescriptions[0].pPreserveAttachments = nullptr;
+
+	subpassDescriptions[1].flags = 0;
+	subpassDescriptions[1].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpassDescriptions[1].inputAttachmentCount = gBufferCount + 1;
+	subpassDescriptions[1].pInputAttachments = inputAttachmentReferences;
+	subpassDescriptions[1].colorAttachmentCount = 1;
+	subpassDescriptions[1].pColorAttachments = &colourAttachmentReference;
+	subpassDescriptions[1].pResolveAttachments = nullptr;
+	subpassDescriptions[1].pDepthStencilAttachment = nullptr;
+	subpassDescriptions[1].preserveAttachmentCount = 0;
+	subpassDescriptions[1].pPreserveAttachments = nullptr;
+
+	VkSubpassDependency dependencies[4];
+	//Depth and the G-buffer are shared between frames, so their clears wait for the previous frame's writes and lighting's reads
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass = 0;
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+	dependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+	//The swapchain image is first used by the lighting subpass, so that is where its transition waits for the acquire semaphore
+	dependencies[1].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[1].dstSubpass = 1;
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[1].srcAccessMask = 0;
+	dependencies[1].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dependencyFlags = 0;
+
+	//By region: lighting reads only its own pixel, so a tiler keeps the G-buffer in tile memory between the two
+	dependencies[2].srcSubpass = 0;
+	dependencies[2].dstSubpass = 1;
+	dependencies[2].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[2].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[2].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[2].dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+	dependencies[2].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+	dependencies[3].srcSubpass = 1;
+	dependencies[3].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[3].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[3].dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;	//presentation waits on a semaphore
+	dependencies[3].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[3].dstAccessMask = 0;
+	dependencies[3].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+	VkRenderPassCreateInfo renderPassCreateInfo{};
+	renderPassCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassCreateInfo.pNext = nullptr;
+	renderPassCreateInfo.flags = 0;
+	renderPassCreateInfo.attachmentCount = 2 + gBufferCount;
+	renderPassCreateInfo.pAttachments = attachmentDescriptions;
+	renderPassCreateInfo.subpassCount = 2;
+	renderPassCreateInfo.pSubpasses = subpassDescriptions;
+	renderPassCreateInfo.dependencyCount = 4;
+	renderPassCreateInfo.pDependencies = dependencies;
+
+	auto err = vkCreateRenderPass(defaultDevice, &renderPassCreateInfo, nullptr, &renderPass);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create deferred render pass", DebugLevel::Error);
+		return false;
+	}
+
+	return true;
+}
+
+bool Renderer::CreateFrameBuffer(uint32_t imageIndex, VkFramebuffer& outFrameBuffer)
 {
 	VkFramebufferCreateInfo framebufferCreateInfo{};
 	framebufferCreateInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
 	framebufferCreateInfo.pNext = nullptr;
 	framebufferCreateInfo.flags = 0;
 	framebufferCreateInfo.renderPass = renderPass;
-	framebufferCreateInfo.attachmentCount = 1;// imageViews.size();
-	framebufferCreateInfo.pAttachments = &imageViews[imageIndex]; //.data();
+	//The render pass's attachment order, the swapchain image last as the resolve target with MSAA
+	VkImageView attachments[2 + gBufferCount] = { imageViews[imageIndex], depthImageView, VK_NULL_HANDLE };
+	framebufferCreateInfo.attachmentCount = 2;
+	if (sampleCount != VK_SAMPLE_COUNT_1_BIT)
+	{
+		attachments[0] = msaaColourImageView;
+		attachments[2] = imageViews[imageIndex];
+		framebufferCreateInfo.attachmentCount = 3;
+	}
+	else if (enableDeferred)
+	{
+		for (uint32_t i = 0; i < gBufferCount; ++i)
+		{
+			attachments[2 + i] = gBufferImageViews[i];
+		}
+		framebufferCreateInfo.attachmentCount = 2 + gBufferCount;
+	}
+
+	framebufferCreateInfo.pAttachments = attachments;
 	framebufferCreateInfo.width = width;
 	framebufferCreateInfo.height = height;
 	framebufferCreateInfo.layers = 1;
 
-	auto err = vkCreateFramebuffer(defaultDevice, &framebufferCreateInfo, nullptr, &frameBuffer);
+	auto err = vkCreateFramebuffer(defaultDevice, &framebufferCreateInfo, nullptr, &outFrameBuffer);
 	if (err != VK_SUCCESS)
 	{
 		Debug::Log("Create Frame buffer", DebugLevel::Error);
@@ -796,635 +1214,2434 @@ bool Renderer::CreateFrameBuffer(uint32_t imageIndex)
 	return true;
 }
 
-bool Renderer::CreateShader(const char* filename, VkShaderModule& shaderModule)
+bool Renderer::ChooseDepthFormat()
 {
-	FILE* shaderFile = fopen(filename, "r");
-	if (shaderFile == nullptr)
+	//Only depth is tested, so the formats without stencil come first. One of D32_SFLOAT and X8_D24_UNORM_PACK32 is always supported.
+	const VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_X8_D24_UNORM_PACK32, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D16_UNORM };
+	for (auto candidate : candidates)
 	{
-		Debug::Log(string("Open file: ") + filename, DebugLevel::Error);
-		return false;
-	}
+		//Deferred lighting reads depth as an input attachment through the framebuffer's view, which can then only have the one aspect
+		bool hasStencil = candidate == VK_FORMAT_D32_SFLOAT_S8_UINT || candidate == VK_FORMAT_D24_UNORM_S8_UINT;
+		if (enableDeferred && hasStencil)
+			continue;
 
-	struct stat fileStat;
-	if (stat(filename, &fileStat) != 0)
-	{
-		Debug::Log("Get file stat", DebugLevel::Error);
-		return false;
+		VkFormatProperties formatProperties;
+		vkGetPhysicalDeviceFormatProperties(defaultPhysicalDevice, candidate, &formatProperties);
+		if (formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
+		{
+			depthFormat = candidate;
+			depthAspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+			if (hasStencil)
+				depthAspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+			return true;
+		}
 	}
 
-	vector<uint32_t> code(fileStat.st_size / sizeof(uint32_t));
-	fread((void*) code.data(), fileStat.st_size, 1, shaderFile);
+	Debug::Log("No depth attachment format", DebugLevel::Error);
+	return false;
+}
 
-	fclose(shaderFile);
+bool Renderer::ChooseSampleCount()
+{
+	//A multisampled G-buffer would have to be lit per sample
+	if (enableDeferred)
+	{
+		if (msaaSamples > 1)
+		{
+			Debug::Log(std::string("MSAA: ") + std::to_string(msaaSamples) + "x requested, deferred shading uses 1x", DebugLevel::Warning);
+		}
+		sampleCount = VK_SAMPLE_COUNT_1_BIT;
+		return true;
+	}
 
-	VkShaderModuleCreateInfo shaderModuleCreateInfo{};
-	shaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-	shaderModuleCreateInfo.pNext = nullptr;
-	shaderModuleCreateInfo.flags = 0;
-	shaderModuleCreateInfo.codeSize = code.size() * sizeof(uint32_t);
-	shaderModuleCreateInfo.pCode = code.data();
+	//The colour and depth attachments are multisampled together, so both must support the count
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(defaultPhysicalDevice, &properties);
+	VkSampleCountFlags supported = properties.limits.framebufferColorSampleCounts & properties.limits.framebufferDepthSampleCounts;
 
-	auto err = vkCreateShaderModule(defaultDevice, &shaderModuleCreateInfo, nullptr, &shaderModule);
-	if (err != VK_SUCCESS)
+	sampleCount = VK_SAMPLE_COUNT_1_BIT;
+	const VkSampleCountFlagBits candidates[] = { VK_SAMPLE_COUNT_8_BIT, VK_SAMPLE_COUNT_4_BIT, VK_SAMPLE_COUNT_2_BIT };
+	for (auto candidate : candidates)
 	{
-		Debug::Log("Create shader module", DebugLevel::Error);
-		return false;
+		if (uint32_t(candidate) <= msaaSamples && (supported & candidate))
+		{
+			sampleCount = candidate;
+			break;
+		}
 	}
 
+	if (uint32_t(sampleCount) != msaaSamples)
+	{
+		Debug::Log(std::string("MSAA: ") + std::to_string(msaaSamples) + "x requested, using " + std::to_string(uint32_t(sampleCount)) + "x", DebugLevel::Warning);
+	}
 	return true;
-
-	/*
-	VkPipelineShaderStageCreateInfo pipelineVertexShaderStageCreateInfo{};
-	pipelineVertexShaderStageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	pipelineVertexShaderStageCreateInfo.pNext = nullptr;
-	pipelineVertexShaderStageCreateInfo.flags = 0;
-	pipelineVertexShaderStageCreateInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-	pipelineVertexShaderStageCreateInfo.module = shaderModule;
-	pipelineVertexShaderStageCreateInfo.pName = "main";
-	pipelineVertexShaderStageCreateInfo.pSpecializationInfo = nullptr;
-	*/
 }
 
-bool Renderer::CreatePipeline()
+bool Renderer::CreateTransientAttachment(VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect, VkImage& outImage, VkDeviceMemory& outMemory, VkImageView& outImageView)
 {
-	//	const char* vertexShaderFilename = "FlatColour.vert.spv.txt";
-	//	const char* fragmentShaderFilename = "FlatColour.frag.spv.txt";
+	VkImageCreateInfo imageCreateInfo{};
+	imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageCreateInfo.pNext = nullptr;
+	imageCreateInfo.flags = 0;
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageCreateInfo.format = format;
+	imageCreateInfo.extent.width = width;
+	imageCreateInfo.extent.height = height;
+	imageCreateInfo.extent.depth = 1;
+	imageCreateInfo.mipLevels = 1;
+	imageCreateInfo.arrayLayers = 1;
+	imageCreateInfo.samples = sampleCount;
+	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageCreateInfo.usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+	imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageCreateInfo.queueFamilyIndexCount = 0;
+	imageCreateInfo.pQueueFamilyIndices = nullptr;
+	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	auto err = vkCreateImage(defaultDevice, &imageCreateInfo, nullptr, &outImage);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create attachment image", DebugLevel::Error);
+		return false;
+	}
 
-	const char* fragmentShaderFilename = "frag.spv";
-	VkShaderModule fragmentShaderModule = VK_NULL_HANDLE;
-	if (!CreateShader(fragmentShaderFilename, fragmentShaderModule))
-		return false;
-
-	const char* vertexShaderFilename = "vert.spv";
-	VkShaderModule vertexShaderModule = VK_NULL_HANDLE;
-	if (!CreateShader(vertexShaderFilename, vertexShaderModule))
-		return false;
-
-	VkPipelineShaderStageCreateInfo pipelineVertexShaderStageCreateInfo{};
-	pipelineVertexShaderStageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	pipelineVertexShaderStageCreateInfo.pNext = nullptr;
-	pipelineVertexShaderStageCreateInfo.flags = 0;
-	pipelineVertexShaderStageCreateInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-	pipelineVertexShaderStageCreateInfo.module = vertexShaderModule;
-	pipelineVertexShaderStageCreateInfo.pName = "main";
-	pipelineVertexShaderStageCreateInfo.pSpecializationInfo = nullptr;
-	VkPipelineShaderStageCreateInfo pipelineFragmentShaderStageCreateInfo = pipelineVertexShaderStageCreateInfo;
-	pipelineFragmentShaderStageCreateInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-	pipelineFragmentShaderStageCreateInfo.module = fragmentShaderModule;
-
-	vector<VkPipelineShaderStageCreateInfo> pipelineStages = { pipelineVertexShaderStageCreateInfo, pipelineFragmentShaderStageCreateInfo };
-
-	VkVertexInputBindingDescription vertexBindingDescription{};
-	vertexBindingDescription.binding = 0;
-	vertexBindingDescription.stride = sizeof(float) * 4;
-	vertexBindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-
-	VkVertexInputAttributeDescription vertexAttributeDescription{};
-	vertexAttributeDescription.location = 0;
-	vertexAttributeDescription.binding = 0;
-	vertexAttributeDescription.format = VK_FORMAT_R32G32B32A32_SFLOAT;
-	vertexAttributeDescription.offset = 0;
-	vertexAttributeDescription.binding = 0;
-
-	VkPipelineVertexInputStateCreateInfo pipelineVertexInputStateCreateInfo{};
-	pipelineVertexInputStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	pipelineVertexInputStateCreateInfo.pNext = nullptr;
-	pipelineVertexInputStateCreateInfo.flags = 0;
-	//pipelineVertexInputStateCreateInfo.vertexAttributeDescriptionCount = 0;
-	//pipelineVertexInputStateCreateInfo.vertexBindingDescriptionCount = 0;
-	//pipelineVertexInputStateCreateInfo.pVertexBindingDescriptions = nullptr;
-	//pipelineVertexInputStateCreateInfo.pVertexAttributeDescriptions = nullptr;
-
-	pipelineVertexInputStateCreateInfo.vertexAttributeDescriptionCount = 1;
-	pipelineVertexInputStateCreateInfo.vertexBindingDescriptionCount = 1;
-	pipelineVertexInputStateCreateInfo.pVertexBindingDescriptions = &vertexBindingDescription;
-	pipelineVertexInputStateCreateInfo.pVertexAttributeDescriptions = &vertexAttributeDescription;
-	
-	VkPipelineInputAssemblyStateCreateInfo pipelineInputAssemblyStateCreateInfo{};
-	pipelineInputAssemblyStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	pipelineInputAssemblyStateCreateInfo.pNext = nullptr;
-	pipelineInputAssemblyStateCreateInfo.flags = 0;
-	pipelineInputAssemblyStateCreateInfo.primitiveRestartEnable = VK_FALSE;
-	pipelineInputAssemblyStateCreateInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	VkMemoryRequirements memRequirements;
+	vkGetImageMemoryRequirements(defaultDevice, outImage, &memRequirements);
 
-	VkViewport viewport;
-	viewport.x = viewport.y = 0;
-	viewport.width = width;
-	viewport.height = height;
-	viewport.minDepth = 0;
-	viewport.maxDepth = 1.0f;
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	vkGetPhysicalDeviceMemoryProperties(defaultPhysicalDevice, &memoryProperties);
 
-	VkRect2D scissors{};
-	scissors.offset.x = scissors.offset.y = 0;
-	scissors.extent.width = width;
-	scissors.extent.height = height;
+	//Lazily allocated memory where there is any (tile based GPUs), plain device local memory otherwise
+	const VkMemoryPropertyFlags preferences[] = { VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0 };
+	uint32_t memoryType = UINT32_MAX;
+	for (uint32_t p = 0; p < 3 && memoryType == UINT32_MAX; ++p)
+	{
+		for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+		{
+			if ((memRequirements.memoryTypeBits & (1 << i)) &&
+				(memoryProperties.memoryTypes[i].propertyFlags & preferences[p]) == preferences[p])
+			{
+				memoryType = i;
+				break;
+			}
+		}
+	}
 
-	VkPipelineViewportStateCreateInfo pipelineViewportStateCreateInfo{};
-	pipelineViewportStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-	pipelineViewportStateCreateInfo.pNext = nullptr;
-	pipelineViewportStateCreateInfo.flags = 0;
+	VkMemoryAllocateInfo memoryAllocInfo{};
+	memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	memoryAllocInfo.pNext = nullptr;
+	memoryAllocInfo.allocationSize = memRequirements.size;
+	memoryAllocInfo.memoryTypeIndex = memoryType;
 
-	if (enabledDynamicState)
+	err = memoryType != UINT32_MAX ? vkAllocateMemory(defaultDevice, &memoryAllocInfo, nullptr, &outMemory) : VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	if (err == VK_SUCCESS)
 	{
-		pipelineViewportStateCreateInfo.viewportCount = 1;
-		pipelineViewportStateCreateInfo.pViewports = nullptr;
-		pipelineViewportStateCreateInfo.scissorCount = 1;
-		pipelineViewportStateCreateInfo.pScissors = nullptr;
+		err = vkBindImageMemory(defaultDevice, outImage, outMemory, 0);
 	}
-	else
-	{
-		pipelineViewportStateCreateInfo.viewportCount = 1;
-		pipelineViewportStateCreateInfo.pViewports = &viewport;
-		pipelineViewportStateCreateInfo.scissorCount = 1;
-		pipelineViewportStateCreateInfo.pScissors = &scissors;
-	}
-	VkDynamicState dynamicStates [] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
-
-	VkPipelineDynamicStateCreateInfo pipelineDynamicStateCreateInfo{};
-	pipelineDynamicStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-	pipelineDynamicStateCreateInfo.pNext = nullptr;
-	pipelineDynamicStateCreateInfo.flags = 0;
-	pipelineDynamicStateCreateInfo.dynamicStateCount = 2;
-	pipelineDynamicStateCreateInfo.pDynamicStates = dynamicStates;
-
-	VkPipelineRasterizationStateCreateInfo pipelineRasterizationCreateInfo{};
-	pipelineRasterizationCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-	pipelineRasterizationCreateInfo.pNext = nullptr;
-	pipelineRasterizationCreateInfo.flags = 0;
-	pipelineRasterizationCreateInfo.depthClampEnable = VK_FALSE;
-	pipelineRasterizationCreateInfo.rasterizerDiscardEnable = VK_FALSE;
-	pipelineRasterizationCreateInfo.polygonMode = VK_POLYGON_MODE_FILL;
-	pipelineRasterizationCreateInfo.cullMode = VK_CULL_MODE_BACK_BIT;
-	pipelineRasterizationCreateInfo.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-	pipelineRasterizationCreateInfo.depthBiasEnable = VK_FALSE;
-	pipelineRasterizationCreateInfo.depthBiasConstantFactor = 0.0f;
-	pipelineRasterizationCreateInfo.depthBiasClamp = 0.0f;
-	pipelineRasterizationCreateInfo.depthBiasSlopeFactor = 0.0f;
-	pipelineRasterizationCreateInfo.lineWidth = 1.0f;
-
-	VkPipelineMultisampleStateCreateInfo pipelineMultisampleStateCreateInfo{};
-	pipelineMultisampleStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-	pipelineMultisampleStateCreateInfo.pNext = nullptr;
-	pipelineMultisampleStateCreateInfo.flags = 0;
-	pipelineMultisampleStateCreateInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-	pipelineMultisampleStateCreateInfo.sampleShadingEnable = VK_FALSE;
-	pipelineMultisampleStateCreateInfo.minSampleShading = 1.0f;
-	pipelineMultisampleStateCreateInfo.pSampleMask = nullptr;
-	pipelineMultisampleStateCreateInfo.alphaToCoverageEnable = VK_FALSE;
-	pipelineMultisampleStateCreateInfo.alphaToOneEnable = VK_FALSE;
-
-	VkPipelineColorBlendAttachmentState pipelineColourBlendAttachmentState{};
-	pipelineColourBlendAttachmentState.blendEnable = VK_FALSE;
-	pipelineColourBlendAttachmentState.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-	pipelineColourBlendAttachmentState.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO;
-	pipelineColourBlendAttachmentState.colorBlendOp = VK_BLEND_OP_ADD;
-	pipelineColourBlendAttachmentState.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-	pipelineColourBlendAttachmentState.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
-	pipelineColourBlendAttachmentState.alphaBlendOp = VK_BLEND_OP_ADD;
-	pipelineColourBlendAttachmentState.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-
-	VkPipelineColorBlendStateCreateInfo pipelineColourBlendStateCreateInfo{};
-	pipelineColourBlendStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-	pipelineColourBlendStateCreateInfo.pNext = nullptr;
-	pipelineColourBlendStateCreateInfo.flags = 0;
-	pipelineColourBlendStateCreateInfo.attachmentCount = 1;
-	pipelineColourBlendStateCreateInfo.pAttachments = &pipelineColourBlendAttachmentState;
-	pipelineColourBlendStateCreateInfo.logicOpEnable = VK_FALSE;
-	pipelineColourBlendStateCreateInfo.logicOp = VK_LOGIC_OP_COPY;
-	pipelineColourBlendStateCreateInfo.blendConstants[0] = 0.0f;
-	pipelineColourBlendStateCreateInfo.blendConstants[1] = 0.0f;
-	pipelineColourBlendStateCreateInfo.blendConstants[2] = 0.0f;
-	pipelineColourBlendStateCreateInfo.blendConstants[3] = 0.0f;
-	
-	VkPipelineLayoutCreateInfo layoutCreateInfo{};
-	layoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	layoutCreateInfo.pNext = nullptr;
-	layoutCreateInfo.flags = 0;
-	layoutCreateInfo.setLayoutCount = 0;
-	layoutCreateInfo.pSetLayouts = nullptr;
-	layoutCreateInfo.pushConstantRangeCount = 0;
-	layoutCreateInfo.pPushConstantRanges = nullptr;
-
-	VkPipelineLayout pipelineLayout;
-	auto err = vkCreatePipelineLayout(defaultDevice, &layoutCreateInfo, nullptr, &pipelineLayout);
 	if (err != VK_SUCCESS)
 	{
-		Debug::Log("Create Pipeline Layout", DebugLevel::Error);
+		Debug::Log("Allocate attachment memory", DebugLevel::Error);
 		return false;
 	}
 
-	
-	VkGraphicsPipelineCreateInfo graphicsCreatePipelineInfo{};
-	graphicsCreatePipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	graphicsCreatePipelineInfo.pNext = nullptr;
-	graphicsCreatePipelineInfo.flags = 0;
-	graphicsCreatePipelineInfo.stageCount = pipelineStages.size();
-	graphicsCreatePipelineInfo.pStages = pipelineStages.data();
-	graphicsCreatePipelineInfo.pVertexInputState = &pipelineVertexInputStateCreateInfo;
-	graphicsCreatePipelineInfo.pInputAssemblyState = &pipelineInputAssemblyStateCreateInfo;
-	graphicsCreatePipelineInfo.pTessellationState = nullptr;
-	graphicsCreatePipelineInfo.pViewportState = &pipelineViewportStateCreateInfo;
-	graphicsCreatePipelineInfo.pRasterizationState = &pipelineRasterizationCreateInfo;
-	graphicsCreatePipelineInfo.pMultisampleState = &pipelineMultisampleStateCreateInfo;
-	graphicsCreatePipelineInfo.pDepthStencilState = nullptr;
-	graphicsCreatePipelineInfo.pColorBlendState = &pipelineColourBlendStateCreateInfo;
-	graphicsCreatePipelineInfo.pDynamicState = enabledDynamicState ? &pipelineDynamicStateCreateInfo : nullptr;
-	graphicsCreatePipelineInfo.layout = pipelineLayout;
-	graphicsCreatePipelineInfo.renderPass = renderPass;
-	graphicsCreatePipelineInfo.subpass = 0;
-	graphicsCreatePipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
-	graphicsCreatePipelineInfo.basePipelineIndex = -1;
-
-	err = vkCreateGraphicsPipelines(defaultDevice, VK_NULL_HANDLE, 1, &graphicsCreatePipelineInfo, nullptr, &pipeline);
+	VkImageViewCreateInfo imageViewCreateInfo{};
+	imageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	imageViewCreateInfo.pNext = nullptr;
+	imageViewCreateInfo.flags = 0;
+	imageViewCreateInfo.image = outImage;
+	imageViewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	imageViewCreateInfo.format = format;
+	imageViewCreateInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+	imageViewCreateInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+	imageViewCreateInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+	imageViewCreateInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+	imageViewCreateInfo.subresourceRange.aspectMask = aspect;
+	imageViewCreateInfo.subresourceRange.baseMipLevel = 0;
+	imageViewCreateInfo.subresourceRange.levelCount = 1;
+	imageViewCreateInfo.subresourceRange.baseArrayLayer = 0;
+	imageViewCreateInfo.subresourceRange.layerCount = 1;
+
+	err = vkCreateImageView(defaultDevice, &imageViewCreateInfo, nullptr, &outImageView);
 	if (err != VK_SUCCESS)
 	{
-		Debug::Log("Create graphics pipeline", DebugLevel::Error);
+		Debug::Log("Create attachment image view", DebugLevel::Error);
 		return false;
 	}
 
 	return true;
 }
 
-bool Renderer::AllocateMemory(VkBuffer& buffer, VkDeviceMemory& devMem)
+bool Renderer::CreateAttachments()
 {
-	VkMemoryRequirements memRequirements;
-	vkGetBufferMemoryRequirements(defaultDevice, buffer, &memRequirements);
+	VkImageUsageFlags depthUsage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | (enableDeferred ? VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT : 0);
+	if (!CreateTransientAttachment(depthFormat, depthUsage, depthAspect, depthImage, depthMemory, depthImageView))
+		return false;
+
+	for (uint32_t i = 0; enableDeferred && i < gBufferCount; ++i)
+	{
+		if (!CreateTransientAttachment(gBufferFormats[i], VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT,
+			gBufferImages[i], gBufferMemory[i], gBufferImageViews[i]))
+			return false;
+	}
+
+	//Without MSAA the scene draws straight into the swapchain image
+	if (sampleCount != VK_SAMPLE_COUNT_1_BIT &&
+		!CreateTransientAttachment(currentFormat, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT, msaaColourImage, msaaColourMemory, msaaColourImageView))
+		return false;
+
+	return true;
+}
+
+void Renderer::DestroyAttachments()
+{
+	vkDestroyImageView(defaultDevice, depthImageView, nullptr);
+	vkDestroyImage(defaultDevice, depthImage, nullptr);
+	vkFreeMemory(defaultDevice, depthMemory, nullptr);
+	depthImageView = VK_NULL_HANDLE;
+	depthImage = VK_NULL_HANDLE;
+	depthMemory = VK_NULL_HANDLE;
+
+	vkDestroyImageView(defaultDevice, msaaColourImageView, nullptr);
+	vkDestroyImage(defaultDevice, msaaColourImage, nullptr);
+	vkFreeMemory(defaultDevice, msaaColourMemory, nullptr);
+	msaaColourImageView = VK_NULL_HANDLE;
+	msaaColourImage = VK_NULL_HANDLE;
+	msaaColourMemory = VK_NULL_HANDLE;
+
+	for (uint32_t i = 0; i < gBufferCount; ++i)
+	{
+		vkDestroyImageView(defaultDevice, gBufferImageViews[i], nullptr);
+		vkDestroyImage(defaultDevice, gBufferImages[i], nullptr);
+		vkFreeMemory(defaultDevice, gBufferMemory[i], nullptr);
+		gBufferImageViews[i] = VK_NULL_HANDLE;
+		gBufferImages[i] = VK_NULL_HANDLE;
+		gBufferMemory[i] = VK_NULL_HANDLE;
+	}
+}
+
+uint32_t Renderer::GetClearValues(VkClearValue* outClearValues) const
+{
+	//Nothing is cleared into an MSAA resolve, so only the deferred pass has more than colour and depth
+	outClearValues[0].color = { 1.0f, 0.8f, 0.4f, 0.0f };
+	outClearValues[1].depthStencil = { 1.0f, 0 };
+	if (!enableDeferred)
+		return 2;
+
+	outClearValues[2].color = outClearValues[0].color;	//albedo, where nothing is drawn lighting passes it through
+	outClearValues[3].color = { 0.0f, 0.0f, 0.0f, 0.0f };
+	return 2 + gBufferCount;
+}
+
+bool Renderer::CreatePipelineCache()
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(defaultPhysicalDevice, &properties);
+
+	vector<uint8_t> cacheData;
+	FILE* cacheFile = fopen(pipelineCacheFilename, "rb");
+	if (cacheFile != nullptr)
+	{
+		fseek(cacheFile, 0, SEEK_END);
+		long size = ftell(cacheFile);
+		fseek(cacheFile, 0, SEEK_SET);
+		if (size > 0)
+		{
+			cacheData.resize(size);
+			if (fread(cacheData.data(), size, 1, cacheFile) != 1)
+			{
+				cacheData.clear();
+			}
+		}
+		fclose(cacheFile);
+	}
+
+	//Data from another driver or device is ignored, rather than trusting the driver to reject it
+	if (!cacheData.empty())
+	{
+		struct CacheHeader
+		{
+			uint32_t	headerLength;
+			uint32_t	headerVersion;
+			uint32_t	vendorID;
+			uint32_t	deviceID;
+			uint8_t		pipelineCacheUUID[VK_UUID_SIZE];
+		} header;
+
+		bool valid = cacheData.size() >= sizeof(header);
+		if (valid)
+		{
+			memcpy(&header, cacheData.data(), sizeof(header));
+			valid = header.headerLength >= sizeof(header) &&
+				header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+				header.vendorID == properties.vendorID &&
+				header.deviceID == properties.deviceID &&
+				memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+		}
+
+		if (!valid)
+		{
+			Debug::Log("Pipeline cache on disk does not match this device, starting cold", DebugLevel::Warning);
+			cacheData.clear();
+		}
+	}
+
+	pipelineCacheWarm = !cacheData.empty();
+
+	VkPipelineCacheCreateInfo cacheCreateInfo{};
+	cacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheCreateInfo.pNext = nullptr;
+	cacheCreateInfo.flags = 0;
+	cacheCreateInfo.initialDataSize = cacheData.size();
+	cacheCreateInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
+
+	auto err = vkCreatePipelineCache(defaultDevice, &cacheCreateInfo, nullptr, &pipelineCache);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create pipeline cache", DebugLevel::Error);
+		return false;
+	}
+
+	return true;
+}
+
+bool Renderer::SavePipelineCache()
+{
+	if (pipelineCache == VK_NULL_HANDLE)
+		return false;
+
+	//Read first: pipelines finishing while the data is copied leave the cache dirty for the next save
+	uint64_t createdCount = pipelineManager.GetCreatedCount();
+	size_t size = 0;
+	auto err = vkGetPipelineCacheData(defaultDevice, pipelineCache, &size, nullptr);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Get pipeline cache size", DebugLevel::Error);
+		return false;
+	}
+
+	vector<uint8_t> cacheData(size);
+	err = vkGetPipelineCacheData(defaultDevice, pipelineCache, &size, cacheData.data());
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Get pipeline cache data", DebugLevel::Error);
+		return false;
+	}
+
+	//Write then rename, so a crash mid-write never leaves a truncated cache behind
+	std::string tempFilename = std::string(pipelineCacheFilename) + ".tmp";
+	FILE* cacheFile = fopen(tempFilename.c_str(), "wb");
+	if (cacheFile == nullptr)
+	{
+		Debug::Log(std::string("Open file: ") + tempFilename, DebugLevel::Error);
+		return false;
+	}
+
+	bool written = fwrite(cacheData.data(), size, 1, cacheFile) == 1;
+	written = fflush(cacheFile) == 0 && written;
+	fclose(cacheFile);
+
+	if (!written || !MoveFileExA(tempFilename.c_str(), pipelineCacheFilename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		Debug::Log("Write pipeline cache", DebugLevel::Error);
+		DeleteFileA(tempFilename.c_str());
+		return false;
+	}
+
+	pipelineCacheDirty = false;
+	pipelineCreatedCountSaved = createdCount;
+	return true;
+}
+
+bool Renderer::CreatePipeline()
+{
+	//	const char* vertexShaderFilename = "FlatColour.vert.spv.txt";
+	//	const char* fragmentShaderFilename = "FlatColour.frag.spv.txt";
+
+	pipelineManager.Init(defaultDevice, pipelineCache, [this](const char* filename, VkShaderModule& shaderModule, shared_ptr<const ShaderReflection>& reflection)
+	{
+		return shaderLibrary.GetShaderModule(filename, shaderModule, reflection);
+	}, &jobSystem);
+	pipelineManager.EnableGraphicsPipelineLibrary(graphicsPipelineLibrarySupported);
+	pipelineManager.SetDynamicUniformSets(1u << batchSetIndex);
+	if (bindlessSupported)
+		pipelineManager.SetBindlessSet(bindlessSetIndex, bindlessHeap.GetSetLayout());
+	if (pushDescriptorSupported)
+		pipelineManager.SetPushDescriptorSet(pushDescriptorSetIndex);
+	pipelineManager.EnableExtendedDynamicState(extendedDynamicStateSupported, dynamicBlendEnableSupported);
+	uint8_t renderPassIndex = dynamicRenderingSupported ? pipelineManager.RegisterRenderingFormats(currentFormat, depthFormat, sampleCount) :
+		pipelineManager.RegisterRenderPass(renderPass, sampleCount);
+
+	//Everything used last run starts compiling now, before the scene asks for it
+	pipelineManager.Prewarm(pipelineManifestFilename);
+
+	//Deferred, the scene fills the G-buffer in the first subpass rather than shading. Forward, RenderObjects are lit
+	//from the clustered light lists.
+	const char* sceneFragmentShader = enableDeferred ? "GBuffer.frag.spv" : "frag.spv";
+	const char* litFragmentShader = UsesClusteredLighting() ? "FlatColourLit.frag.spv" : sceneFragmentShader;
+
+	//Vertex attributes and the pipeline layout are reflected from the shaders
+	PipelineDescription description;
+	description.SetShaders("vert.spv", sceneFragmentShader);
+	description.AddVertexBinding(0, sizeof(float) * 4, VK_VERTEX_INPUT_RATE_VERTEX);
+	description.renderPass = renderPassIndex;
+	description.colourAttachmentCount = enableDeferred ? gBufferCount : 1;
+
+	//With a pre-pass depth is already final by the colour pass, which tests against it without writing.
+	//LESS_OR_EQUAL rather than EQUAL, so the two pipelines need not produce bit identical depths.
+	description.depthTestEnable = VK_TRUE;
+	description.depthWriteEnable = enableDepthPrepass ? VK_FALSE : VK_TRUE;
+	description.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	sceneDescription = description;
+
+	prepassDescription = description;
+	prepassDescription.depthWriteEnable = VK_TRUE;
+	prepassDescription.depthCompareOp = VK_COMPARE_OP_LESS;
+	prepassDescription.colourWriteMask = 0;
+
+	//Instanced variant, used for all RenderObjects. The transform fills the per instance binding. Shader features are
+	//picked per pipeline with specialization constants rather than branched on at runtime, see RequestQuantizedPipeline.
+	PipelineDescription instancedDescription = description;
+	instancedDescription.SetShaders("FlatColourInstanced.vert.spv", litFragmentShader);
+	instancedDescription.AddVertexBinding(1, sizeof(InstanceData), VK_VERTEX_INPUT_RATE_INSTANCE);
+	instancedDescription.SetSpecialization(ShaderConstantUniformColour, uint32_t(VK_TRUE));
+
+	instancedPipeline = pipelineManager.RequestPipeline(instancedDescription);
+
+	//Both vertex shaders declare the same batch uniforms, so every graphics pipeline shares this layout
+	batchPipelineLayout = pipelineManager.GetPipelineLayout(instancedDescription);
+	batchSetLayout = pipelineManager.GetDescriptorSetLayout(instancedDescription, batchSetIndex);
+	if (batchPipelineLayout == VK_NULL_HANDLE || batchSetLayout == VK_NULL_HANDLE)
+	{
+		Debug::Log("Get batch pipeline layout", DebugLevel::Error);
+		return false;
+	}
+
+	if (UsesClusteredLighting())
+	{
+		clusterSetLayout = pipelineManager.GetDescriptorSetLayout(instancedDescription, clusterSetIndex);
+		if (clusterSetLayout == VK_NULL_HANDLE)
+		{
+			Debug::Log("Get cluster descriptor set layout", DebugLevel::Error);
+			return false;
+		}
+	}
+
+	//Bindless variant, transforms and colours come from the heap so only the mesh is a vertex input
+	if (bindlessSupported)
+	{
+		PipelineDescription bindlessDescription = description;
+		bindlessDescription.SetShaders("FlatColourBindless.vert.spv", litFragmentShader);
+		bindlessPipeline = pipelineManager.RequestPipeline(bindlessDescription);
+
+		bindlessPipelineLayout = pipelineManager.GetPipelineLayout(bindlessDescription);
+		if (bindlessPipelineLayout == VK_NULL_HANDLE)
+		{
+			Debug::Log("Get bindless pipeline layout", DebugLevel::Error);
+			return false;
+		}
+	}
+
+	//Per draw variants, one for each way of getting DrawData to the shader
+	const char* drawDataShaders[DrawDataPathCount] = { "FlatColourPushConstants.vert.spv", "FlatColourPushDescriptor.vert.spv", "FlatColourDynamicUniform.vert.spv" };
+	for (uint32_t path = 0; path < DrawDataPathCount; ++path)
+	{
+		if (path == DrawDataPushDescriptor && !pushDescriptorSupported)
+			continue;
+
+		PipelineDescription drawDataDescription = description;
+		drawDataDescription.SetShaders(drawDataShaders[path], sceneFragmentShader);
+		drawDataPipelines[path] = pipelineManager.RequestPipeline(drawDataDescription);
+		drawDataPipelineLayouts[path] = pipelineManager.GetPipelineLayout(drawDataDescription);
+		if (drawDataPipelineLayouts[path] == VK_NULL_HANDLE)
+		{
+			Debug::Log("Get draw data pipeline layout", DebugLevel::Error);
+			return false;
+		}
+
+		if (path == DrawDataDynamicUniform)
+			drawDataSetLayout = pipelineManager.GetDescriptorSetLayout(drawDataDescription, batchSetIndex);
+	}
+
+	if (enableDeferred && !CreateLightingPipeline(renderPassIndex))
+		return false;
+
+	return true;
+}
+
+bool Renderer::CreateLightingPipeline(uint8_t renderPassIndex)
+{
+	//A fullscreen triangle with no vertex input, so each pixel is lit once however many triangles covered it
+	lightingDescription.SetShaders("Fullscreen.vert.spv", "DeferredLighting.frag.spv");
+	lightingDescription.renderPass = renderPassIndex;
+	lightingDescription.subpass = 1;
+	lightingDescription.cullMode = VK_CULL_MODE_NONE;
+	lightingDescription.depthTestEnable = VK_FALSE;
+	lightingDescription.depthWriteEnable = VK_FALSE;
+	lightingPipeline = pipelineManager.RequestPipeline(lightingDescription);
+
+	lightingPipelineLayout = pipelineManager.GetPipelineLayout(lightingDescription);
+	lightingSetLayout = pipelineManager.GetDescriptorSetLayout(lightingDescription, 0);
+	if (lightingPipelineLayout == VK_NULL_HANDLE || lightingSetLayout == VK_NULL_HANDLE)
+	{
+		Debug::Log("Get lighting pipeline layout", DebugLevel::Error);
+		return false;
+	}
+
+	//A few coloured lights just in front of the grid
+	const float lightPositions[deferredLightCount][4] = { { -0.5f, -0.5f, -0.25f, 1.0f }, { 0.5f, -0.25f, -0.25f, 1.0f }, { 0.0f, 0.5f, -0.25f, 1.2f } };
+	const float lightColours[deferredLightCount][4] = { { 1.0f, 0.6f, 0.3f, 1.0f }, { 0.3f, 0.6f, 1.0f, 1.0f }, { 0.8f, 0.8f, 0.8f, 1.0f } };
+	for (uint32_t i = 0; i < deferredLightCount; ++i)
+	{
+		memcpy(deferredLighting.lights[i].position, lightPositions[i], sizeof(lightPositions[i]));
+		memcpy(deferredLighting.lights[i].colour, lightColours[i], sizeof(lightColours[i]));
+	}
+	const float ambient[4] = { 0.15f, 0.15f, 0.15f, 0.0f };
+	memcpy(deferredLighting.ambient, ambient, sizeof(ambient));
+
+	return true;
+}
+
+void Renderer::RecordDeferredLighting(VkCommandBuffer cmdBuffer)
+{
+	//Still compiling, the frame is left unlit rather than stalled
+	VkPipeline pipelineHandle = lightingPipeline->Get();
+	if (pipelineHandle == VK_NULL_HANDLE)
+		return;
+
+	//The views only change with the attachments, so after the first frame this is a cache lookup
+	DescriptorSetBindings bindings(lightingSetLayout);
+	for (uint32_t i = 0; i < gBufferCount; ++i)
+	{
+		bindings.BindImage(i, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, gBufferImageViews[i], VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_NULL_HANDLE);
+	}
+	bindings.BindImage(gBufferCount, VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, depthImageView, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_NULL_HANDLE);
+	VkDescriptorSet lightingSet = descriptorAllocator.GetCachedSet(bindings);
+	if (lightingSet == VK_NULL_HANDLE)
+		return;
+
+	VkViewport viewport;
+	viewport.x = viewport.y = 0;
+	viewport.width = width;
+	viewport.height = height;
+	viewport.minDepth = 0;
+	viewport.maxDepth = 1.0f;
+
+	VkRect2D scissors{};
+	scissors.offset.x = scissors.offset.y = 0;
+	scissors.extent.width = width;
+	scissors.extent.height = height;
+	if (enabledDynamicState)
+	{
+		vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+		vkCmdSetScissor(cmdBuffer, 0, 1, &scissors);
+	}
+	pipelineManager.SetDynamicState(cmdBuffer, lightingDescription);
+
+	deferredLighting.viewportSize[0] = float(width);
+	deferredLighting.viewportSize[1] = float(height);
+
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineHandle);
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, lightingPipelineLayout, 0, 1, &lightingSet, 0, nullptr);
+	vkCmdPushConstants(cmdBuffer, lightingPipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(deferredLighting), &deferredLighting);
+	vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+}
+
+#ifdef BUILD_ENABLE_SHADER_HOT_RELOAD
+bool Renderer::StartShaderHotReload()
+{
+	//glslangValidator names SPIR-V after the stage unless told otherwise, hence vert.spv and frag.spv
+	shaderWatcher.Watch("FlatColour.vert", "vert.spv");
+	shaderWatcher.Watch("FlatColour.frag", "frag.spv");
+	shaderWatcher.Watch("FlatColourLit.frag", "FlatColourLit.frag.spv");
+	shaderWatcher.Watch("FlatColourInstanced.vert", "FlatColourInstanced.vert.spv");
+	shaderWatcher.Watch("FlatColourBindless.vert", "FlatColourBindless.vert.spv");
+	shaderWatcher.Watch("FlatColourPushConstants.vert", "FlatColourPushConstants.vert.spv");
+	shaderWatcher.Watch("FlatColourPushDescriptor.vert", "FlatColourPushDescriptor.vert.spv");
+	shaderWatcher.Watch("FlatColourDynamicUniform.vert", "FlatColourDynamicUniform.vert.spv");
+	shaderWatcher.Watch("GBuffer.frag", "GBuffer.frag.spv");
+	shaderWatcher.Watch("Fullscreen.vert", "Fullscreen.vert.spv");
+	shaderWatcher.Watch("DeferredLighting.frag", "DeferredLighting.frag.spv");
+
+	//Nothing here waits on the GPU: rebuilds run on the job system and BeginFrame swaps them in
+	return shaderWatcher.Start([this](const char* spirvFilename)
+	{
+		if (shaderLibrary.ReloadShader(spirvFilename))
+			pipelineManager.ReloadShader(spirvFilename);
+	});
+}
+#endif
+
+bool Renderer::AllocateMemory(VkBuffer& buffer, VkDeviceMemory& devMem, VkMemoryPropertyFlags properties)
+{
+	VkMemoryRequirements memRequirements;
+	vkGetBufferMemoryRequirements(defaultDevice, buffer, &memRequirements);
 
 	VkPhysicalDeviceMemoryProperties memoryProperties;
 	vkGetPhysicalDeviceMemoryProperties(defaultPhysicalDevice, &memoryProperties);
 
-	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
-	{
-		if ((memRequirements.memoryTypeBits & (1 << i)) &&
-			(memoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+	{
+		if ((memRequirements.memoryTypeBits & (1 << i)) &&
+			(memoryProperties.memoryTypes[i].propertyFlags & properties) == properties)
+		{
+			VkMemoryAllocateInfo memoryAllocInfo{};
+			memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+			memoryAllocInfo.pNext = nullptr;
+			memoryAllocInfo.allocationSize = memRequirements.size;
+			memoryAllocInfo.memoryTypeIndex = i;
+
+			auto err = vkAllocateMemory(defaultDevice, &memoryAllocInfo, nullptr, &devMem);
+			if (err == VK_SUCCESS)
+			{
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool Renderer::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& devMem)
+{
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.pNext = nullptr;
+	bufferInfo.flags = 0;
+	bufferInfo.size = size;
+	bufferInfo.usage = usage;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	bufferInfo.queueFamilyIndexCount = 0;
+	bufferInfo.pQueueFamilyIndices = nullptr;
+
+	auto err = vkCreateBuffer(defaultDevice, &bufferInfo, nullptr, &buffer);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create buffer", DebugLevel::Error);
+		return false;
+	}
+
+	if (!AllocateMemory(buffer, devMem, properties))
+	{
+		Debug::Log("Allocate memory for buffer", DebugLevel::Error);
+		return false;
+	}
+
+	err = vkBindBufferMemory(defaultDevice, buffer, devMem, 0);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Bind memory for buffer", DebugLevel::Error);
+		return false;
+	}
+
+	return true;
+}
+
+bool Renderer::UploadBuffer(VkDeviceMemory devMem, const void* data, VkDeviceSize size)
+{
+	void* memPtr = nullptr;
+	auto err = vkMapMemory(defaultDevice, devMem, 0, VK_WHOLE_SIZE, 0, &memPtr);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Map buffer memory", DebugLevel::Error);
+		return false;
+	}
+
+	memcpy(memPtr, data, size);
+
+	VkMappedMemoryRange memoryRange{};
+	memoryRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+	memoryRange.pNext = nullptr;
+	memoryRange.memory = devMem;
+	memoryRange.offset = 0;
+	memoryRange.size = VK_WHOLE_SIZE;
+	vkFlushMappedMemoryRanges(defaultDevice, 1, &memoryRange);
+
+	vkUnmapMemory(defaultDevice, devMem);
+
+	return true;
+}
+
+bool Renderer::CreateTri()
+{
+	float vertices[] = {
+		0, -1, 0, 1,
+		-1, 1, 0, 1,
+		1, 1,  0, 1
+	};
+
+	VkBufferCreateInfo vbInfo = {};
+	vbInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	vbInfo.pNext = nullptr;
+	vbInfo.flags = 0;
+	vbInfo.size = sizeof(vertices);
+	vbInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+	vbInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	vbInfo.queueFamilyIndexCount = 0;
+	vbInfo.pQueueFamilyIndices = nullptr; // &defaultQueueFamilyIndex;
+
+	auto err = vkCreateBuffer(defaultDevice, &vbInfo, nullptr, &vertexBuffer);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create Vertex buffer", DebugLevel::Error);
+		return false;
+	}
+	
+	VkDeviceMemory devMem;
+	if (!AllocateMemory(vertexBuffer, devMem))
+	{
+		Debug::Log("Allocate memory for vertex buffer", DebugLevel::Error);
+		return false;
+	}
+
+	err = vkBindBufferMemory(defaultDevice, vertexBuffer, devMem, 0);
+	if(err != VK_SUCCESS)
+	{
+		Debug::Log("Allocate memory for vertex buffer", DebugLevel::Error);
+		return false;
+	}
+
+	void* memPtr = nullptr;
+
+	err = vkMapMemory(defaultDevice, devMem, 0, VK_WHOLE_SIZE, 0, &memPtr);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Map vertex memory", DebugLevel::Error);
+		return false;
+	}
+
+	memcpy(memPtr, vertices, sizeof(vertices));
+	
+	VkMappedMemoryRange memoryRange{};
+	memoryRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+	memoryRange.pNext = nullptr;
+	memoryRange.memory = devMem;
+	memoryRange.offset = 0;
+	memoryRange.size = VK_WHOLE_SIZE;
+	vkFlushMappedMemoryRanges(defaultDevice, 1, &memoryRange);
+
+	vkUnmapMemory(defaultDevice, devMem);
+
+	triMesh.vertexBuffer = vertexBuffer;
+	triMesh.vertexMemory = devMem;
+	triMesh.vertexCount = 3;
+
+	//Bounding sphere around the origin, used for culling
+	for (uint32_t i = 0; i < triMesh.vertexCount; ++i)
+	{
+		const float* v = &vertices[i * 4];
+		float radius = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+		triMesh.boundingRadius = std::max(triMesh.boundingRadius, radius);
+	}
+
+	uint32_t indices[] = { 0, 1, 2 };
+	if (!CreateBuffer(sizeof(indices), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, triMesh.indexBuffer, triMesh.indexMemory))
+		return false;
+	if (!UploadBuffer(triMesh.indexMemory, indices, sizeof(indices)))
+		return false;
+	triMesh.indexCount = 3;
+
+	//Quantized copy, a quarter the size: positions over the largest extent, rounded to 16 bit SNORM.
+	//w stays 1, the shader scales only xyz back up.
+	float extent = 0.0f;
+	for (uint32_t i = 0; i < sizeof(vertices) / sizeof(float); ++i)
+	{
+		if (i % 4 != 3)
+			extent = std::max(extent, fabsf(vertices[i]));
+	}
+	quantizedTriMesh.positionScale = extent > 0.0f ? extent : 1.0f;
+
+	int16_t quantizedVertices[sizeof(vertices) / sizeof(float)];
+	for (uint32_t i = 0; i < sizeof(vertices) / sizeof(float); ++i)
+	{
+		float value = i % 4 == 3 ? vertices[i] : vertices[i] / quantizedTriMesh.positionScale;
+		quantizedVertices[i] = static_cast<int16_t>(lroundf(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f));
+	}
+	if (!CreateBuffer(sizeof(quantizedVertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, quantizedTriMesh.vertexBuffer, quantizedTriMesh.vertexMemory))
+		return false;
+	if (!UploadBuffer(quantizedTriMesh.vertexMemory, quantizedVertices, sizeof(quantizedVertices)))
+		return false;
+	if (!CreateBuffer(sizeof(indices), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, quantizedTriMesh.indexBuffer, quantizedTriMesh.indexMemory))
+		return false;
+	if (!UploadBuffer(quantizedTriMesh.indexMemory, indices, sizeof(indices)))
+		return false;
+	quantizedTriMesh.vertexCount = triMesh.vertexCount;
+	quantizedTriMesh.indexCount = triMesh.indexCount;
+	quantizedTriMesh.boundingRadius = triMesh.boundingRadius;
+	quantizedTriMesh.colour[0] = 0.0f;
+	quantizedTriMesh.colour[1] = 1.0f;
+	quantizedTriMesh.colour[2] = 1.0f;
+
+	return true;
+}
+
+void Renderer::DestroyMesh(MeshObject& mesh)
+{
+	vkDestroyBuffer(defaultDevice, mesh.vertexBuffer, nullptr);
+	vkFreeMemory(defaultDevice, mesh.vertexMemory, nullptr);
+	vkDestroyBuffer(defaultDevice, mesh.indexBuffer, nullptr);
+	vkFreeMemory(defaultDevice, mesh.indexMemory, nullptr);
+	mesh = MeshObject();
+}
+
+bool Renderer::CreateScene()
+{
+	//Grid of copies of the same triangle, alternately full precision and quantized, merged into one instanced draw of each.
+	//Spread over a few depths, so sorting front to back within and between the draws has something to order.
+	const uint32_t gridSize = 100;
+	const float cellSize = 2.0f / gridSize;
+	ManagedPipeline* scenePipeline = bindlessPipeline ? bindlessPipeline : instancedPipeline;
+	quantizedPipeline = RequestQuantizedPipeline(scenePipeline, quantizedTriMesh.positionScale);
+
+	renderObjects.reserve(gridSize * gridSize);
+	for (uint32_t y = 0; y < gridSize; ++y)
+	{
+		for (uint32_t x = 0; x < gridSize; ++x)
+		{
+			bool quantized = (x + y) % 2 == 1;
+			RenderObject renderObject(quantized ? &quantizedTriMesh : &triMesh, quantized ? quantizedPipeline : scenePipeline);
+			renderObject.SetScale(cellSize * 0.4f);
+			renderObject.SetPosition(-1.0f + cellSize * (x + 0.5f), -1.0f + cellSize * (y + 0.5f), 0.05f * ((x * 7 + y * 3) % 8));
+			renderObjects.push_back(renderObject);
+		}
+	}
+
+	//Thousands of small lights through the grid's depths, scattered the same way every run
+	const uint32_t lightCount = 2048;
+	uint32_t seed = 1;
+	auto random = [&seed]()
+	{
+		seed = seed * 1664525u + 1013904223u;
+		return float(seed >> 8) / float(1 << 24);
+	};
+	clusterLights.resize(lightCount);
+	for (auto& light : clusterLights)
+	{
+		light.position[0] = random() * 2.0f - 1.0f;
+		light.position[1] = random() * 2.0f - 1.0f;
+		light.position[2] = random() * 0.4f - 0.05f;
+		light.position[3] = 0.05f + random() * 0.1f;
+		light.colour[0] = random() * 0.5f;
+		light.colour[1] = random() * 0.5f;
+		light.colour[2] = random() * 0.5f;
+		light.colour[3] = 1.0f;
+	}
+
+	return true;
+}
+
+bool Renderer::BuildInstanceBatches()
+{
+	instanceBatches.clear();
+	if (renderObjects.empty())
+	{
+		return true;
+	}
+
+	//Group objects sharing a pipeline and mesh, so each group is a single draw, nearest first within it
+	vector<uint32_t> order(renderObjects.size());
+	for (uint32_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b)
+	{
+		const RenderObject& left = renderObjects[a];
+		const RenderObject& right = renderObjects[b];
+		if (left.pipeline != right.pipeline)
+			return left.pipeline < right.pipeline;
+		if (left.mesh != right.mesh)
+			return left.mesh < right.mesh;
+		return GetViewDepth(left) < GetViewDepth(right);
+	});
+
+	//Then the groups front to back by their nearest object, so early depth testing rejects as much of what is drawn later
+	//as it can. Coarse, a group's far objects still come before the next group's near ones, but draws stay merged.
+	//Everything in the scene is opaque, blended draws would go last and back to front.
+	struct Group
+	{
+		uint32_t	begin;
+		uint32_t	end;
+	};
+	vector<Group> groups;
+	for (uint32_t i = 0; i < order.size(); ++i)
+	{
+		const RenderObject& renderObject = renderObjects[order[i]];
+		if (groups.empty() || renderObjects[order[groups.back().begin]].pipeline != renderObject.pipeline || renderObjects[order[groups.back().begin]].mesh != renderObject.mesh)
+		{
+			groups.push_back({ i, i });
+		}
+		groups.back().end = i + 1;
+	}
+	std::stable_sort(groups.begin(), groups.end(), [&](const Group& a, const Group& b)
+	{
+		return GetViewDepth(renderObjects[order[a.begin]]) < GetViewDepth(renderObjects[order[b.begin]]);
+	});
+	vector<uint32_t> groupOrder;
+	groupOrder.reserve(order.size());
+	for (auto& group : groups)
+	{
+		groupOrder.insert(groupOrder.end(), order.begin() + group.begin, order.begin() + group.end);
+	}
+	order.swap(groupOrder);
+
+	VkDeviceSize requiredSize = sizeof(InstanceData) * renderObjects.size();
+	if (requiredSize > instanceBufferSize)
+	{
+		if (instanceBuffer != VK_NULL_HANDLE)
+		{
+			bindlessHeap.ReleaseBuffer(instanceBufferIndex);
+			instanceBufferIndex = BindlessHeap::invalidIndex;
+			vkDestroyBuffer(defaultDevice, instanceBuffer, nullptr);
+			vkFreeMemory(defaultDevice, instanceMemory, nullptr);
+			instanceBuffer = VK_NULL_HANDLE;
+			instanceMemory = VK_NULL_HANDLE;
+		}
+
+		//Read as vertex input by the classic pipelines, from the heap by bindless ones, and by the cull pass
+		VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | (bindlessSupported || gpuCulling ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT : 0);
+		if (!CreateBuffer(requiredSize, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, instanceBuffer, instanceMemory))
+		{
+			Debug::Log("Create Instance buffer", DebugLevel::Error);
+			return false;
+		}
+
+		if (bindlessSupported)
+		{
+			instanceBufferIndex = bindlessHeap.AddBuffer(instanceBuffer, 0, VK_WHOLE_SIZE);
+			if (instanceBufferIndex == BindlessHeap::invalidIndex)
+				return false;
+		}
+
+		instanceBufferSize = requiredSize;
+	}
+
+	void* memPtr = nullptr;
+	auto err = vkMapMemory(defaultDevice, instanceMemory, 0, VK_WHOLE_SIZE, 0, &memPtr);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Map instance memory", DebugLevel::Error);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < order.size(); ++i)
+	{
+		const RenderObject& renderObject = renderObjects[order[i]];
+		if (instanceBatches.empty() || instanceBatches.back().pipeline != renderObject.pipeline || instanceBatches.back().mesh != renderObject.mesh)
+		{
+			InstanceBatch batch{};
+			batch.mesh = renderObject.mesh;
+			batch.pipeline = renderObject.pipeline;
+			batch.prepassPipeline = enableDepthPrepass ? RequestPrepassPipeline(renderObject.pipeline) : nullptr;
+			batch.firstInstance = i;
+			batch.instanceCount = 0;
+			instanceBatches.push_back(batch);
+		}
+		instanceBatches.back().instanceCount++;
+	}
+
+	vector<CullObject> cullObjects;
+	cullDraws.clear();
+	if (gpuCulling)
+	{
+		cullObjects.resize(order.size());
+
+		//Batches split where the recording ranges split them, so a range draws with counts of only its own objects
+		uint32_t rangeCount = jobSystem.GetThreadCount();
+		uint32_t range = 0;
+		for (auto& batch : instanceBatches)
+		{
+			batch.firstCullDraw = cullDraws.size();
+			uint32_t batchEnd = batch.firstInstance + batch.instanceCount;
+			for (uint32_t first = batch.firstInstance; first < batchEnd;)
+			{
+				while (GetRecordRangeBegin(range + 1, rangeCount) <= first)
+					++range;
+
+				CullDraw cullDraw;
+				cullDraw.firstObject = first;
+				cullDraw.objectCount = std::min(batchEnd, GetRecordRangeBegin(range + 1, rangeCount)) - first;
+				cullDraw.indexCount = batch.mesh->indexCount;
+				cullDraw.firstIndex = 0;
+				cullDraw.vertexOffset = 0;
+				cullDraws.push_back(cullDraw);
+				first += cullDraw.objectCount;
+			}
+			batch.cullDrawCount = cullDraws.size() - batch.firstCullDraw;
+		}
+	}
+
+	//Transform upload, split across the job system
+	InstanceData* instances = static_cast<InstanceData*>(memPtr);
+	jobSystem.ParallelFor(order.size(), [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			const RenderObject& renderObject = renderObjects[order[i]];
+			instances[i] = renderObject.instance;
+
+			if (!gpuCulling)
+				continue;
+
+			//Bounding spheres in the same order as the instances, the cull draws say which batch each belongs to
+			const float* transform = renderObject.instance.transform;
+			CullObject& cullObject = cullObjects[i];
+			cullObject.boundingSphere[0] = transform[12];
+			cullObject.boundingSphere[1] = transform[13];
+			cullObject.boundingSphere[2] = transform[14];
+			cullObject.boundingSphere[3] = renderObject.mesh->boundingRadius * std::max(transform[0], std::max(transform[5], transform[10]));
+		}
+	});
+
+	VkMappedMemoryRange memoryRange{};
+	memoryRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+	memoryRange.pNext = nullptr;
+	memoryRange.memory = instanceMemory;
+	memoryRange.offset = 0;
+	memoryRange.size = VK_WHOLE_SIZE;
+	vkFlushMappedMemoryRanges(defaultDevice, 1, &memoryRange);
+
+	vkUnmapMemory(defaultDevice, instanceMemory);
+
+	if (gpuCulling && !UpdateCullBuffers(cullObjects))
+		return false;
+
+	if (!CreateBatchUniforms())
+		return false;
+
+	Debug::Log(std::string("Instancing: ") + ToString(renderObjects.size()) + " objects in " + ToString(instanceBatches.size()) + " draws");
+
+	return true;
+}
+
+ManagedPipeline* Renderer::RequestPrepassPipeline(ManagedPipeline* colourPipeline)
+{
+	//The same shaders and permutation, so positions match the colour pass. The fragment shader's output is masked off.
+	PipelineDescription description = colourPipeline->description;
+	description.depthTestEnable = prepassDescription.depthTestEnable;
+	description.depthWriteEnable = prepassDescription.depthWriteEnable;
+	description.depthCompareOp = prepassDescription.depthCompareOp;
+	description.colourWriteMask = prepassDescription.colourWriteMask;
+	return pipelineManager.RequestPipeline(description);
+}
+
+ManagedPipeline* Renderer::RequestQuantizedPipeline(ManagedPipeline* scenePipeline, float positionScale)
+{
+	//The position attribute's format is not the vec4 the shader declares, so the layout is given rather than reflected.
+	//A second binding is the per instance transform.
+	PipelineDescription description = scenePipeline->description;
+	description.bindings[0].stride = sizeof(int16_t) * 4;
+	description.AddVertexAttribute(0, description.bindings[0].binding, VK_FORMAT_R16G16B16A16_SNORM, 0);
+	for (uint32_t column = 0; column < 4 && description.bindingCount > 1; ++column)
+	{
+		description.AddVertexAttribute(1 + column, description.bindings[1].binding, VK_FORMAT_R32G32B32A32_SFLOAT, sizeof(float) * 4 * column);
+	}
+	description.SetSpecialization(ShaderConstantQuantizedPositions, uint32_t(VK_TRUE));
+	description.SetSpecialization(ShaderConstantPositionScale, positionScale);
+	return pipelineManager.RequestPipeline(description);
+}
+
+bool Renderer::CreateBatchUniforms()
+{
+	//Dynamic offsets must be multiples of the device's alignment
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(defaultPhysicalDevice, &properties);
+	VkDeviceSize alignment = properties.limits.minUniformBufferOffsetAlignment;
+	batchUniformStride = (sizeof(BatchUniforms) + alignment - 1) / alignment * alignment;
+
+	VkDeviceSize frameSize = batchUniformStride * std::max<size_t>(instanceBatches.size(), 1);
+	if (frameSize <= batchUniformFrameSize)
+		return true;
+
+	DestroyBatchUniforms();
+	VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | (bindlessSupported ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT : 0);
+	if (!CreateBuffer(frameSize * framesInFlight, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, batchUniformBuffer, batchUniformMemory))
+	{
+		Debug::Log("Create batch uniform buffer", DebugLevel::Error);
+		return false;
+	}
+
+	if (bindlessSupported)
+	{
+		batchUniformBufferIndex = bindlessHeap.AddBuffer(batchUniformBuffer, 0, VK_WHOLE_SIZE);
+		if (batchUniformBufferIndex == BindlessHeap::invalidIndex)
+			return false;
+	}
+
+	void* memPtr = nullptr;
+	auto err = vkMapMemory(defaultDevice, batchUniformMemory, 0, VK_WHOLE_SIZE, 0, &memPtr);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Map batch uniform memory", DebugLevel::Error);
+		return false;
+	}
+
+	batchUniformData = static_cast<uint8_t*>(memPtr);
+	batchUniformFrameSize = frameSize;
+	return true;
+}
+
+void Renderer::DestroyBatchUniforms()
+{
+	if (batchUniformBuffer == VK_NULL_HANDLE)
+		return;
+
+	//The cached set would otherwise outlive the buffer it points at
+	descriptorAllocator.EvictCachedSets(batchUniformBuffer);
+	batchDescriptorSet = VK_NULL_HANDLE;
+	bindlessHeap.ReleaseBuffer(batchUniformBufferIndex);
+	batchUniformBufferIndex = BindlessHeap::invalidIndex;
+
+	if (batchUniformData)
+		vkUnmapMemory(defaultDevice, batchUniformMemory);
+	vkDestroyBuffer(defaultDevice, batchUniformBuffer, nullptr);
+	vkFreeMemory(defaultDevice, batchUniformMemory, nullptr);
+	batchUniformBuffer = VK_NULL_HANDLE;
+	batchUniformMemory = VK_NULL_HANDLE;
+	batchUniformData = nullptr;
+	batchUniformFrameSize = 0;
+}
+
+bool Renderer::UpdateBatchUniforms(uint32_t frame)
+{
+	if (batchUniformBuffer == VK_NULL_HANDLE)
+		return true;
+
+	//Only this frame's region, the GPU may still be reading the others
+	batchUniformFrameOffset = static_cast<uint32_t>(batchUniformFrameSize * frame);
+	for (uint32_t i = 0; i < instanceBatches.size(); ++i)
+	{
+		BatchUniforms* uniforms = reinterpret_cast<BatchUniforms*>(batchUniformData + batchUniformFrameOffset + batchUniformStride * i);
+		memcpy(uniforms->colour, instanceBatches[i].mesh->colour, sizeof(uniforms->colour));
+	}
+
+	VkMappedMemoryRange memoryRange{};
+	memoryRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+	memoryRange.pNext = nullptr;
+	memoryRange.memory = batchUniformMemory;
+	memoryRange.offset = 0;
+	memoryRange.size = VK_WHOLE_SIZE;
+	vkFlushMappedMemoryRanges(defaultDevice, 1, &memoryRange);
+
+	//Described every frame, after the first it is only a cache lookup
+	DescriptorSetBindings bindings(batchSetLayout);
+	bindings.BindBuffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, batchUniformBuffer, 0, sizeof(BatchUniforms));
+	batchDescriptorSet = descriptorAllocator.GetCachedSet(bindings);
+	return batchDescriptorSet != VK_NULL_HANDLE;
+}
+
+void Renderer::RecordInstanceRange(VkCommandBuffer cmdBuffer, uint32_t rangeBegin, uint32_t rangeEnd, bool depthPrepass)
+{
+	VkPipeline boundPipeline = VK_NULL_HANDLE;
+	bool heapBound = false;
+	VkPipelineLayout clusterBoundLayout = VK_NULL_HANDLE;
+	for (uint32_t batchIndex = 0; batchIndex < instanceBatches.size(); ++batchIndex)
+	{
+		auto& batch = instanceBatches[batchIndex];
+
+		//The part of the batch in this range
+		uint32_t firstInstance = std::max(batch.firstInstance, rangeBegin);
+		uint32_t lastInstance = std::min(batch.firstInstance + batch.instanceCount, rangeEnd);
+		if (firstInstance >= lastInstance)
+			continue;
+
+		//Culled, the cull draws starting in this range. They match the recording split, and when benchmarking with another
+		//one each is still recorded exactly once, in order.
+		uint32_t firstDraw = batch.firstCullDraw;
+		uint32_t lastDraw = batch.firstCullDraw + batch.cullDrawCount;
+		if (gpuCulling)
+		{
+			while (firstDraw < lastDraw && cullDraws[firstDraw].firstObject < rangeBegin)
+				++firstDraw;
+			while (lastDraw > firstDraw && cullDraws[lastDraw - 1].firstObject >= rangeEnd)
+				--lastDraw;
+			if (firstDraw == lastDraw)
+				continue;
+		}
+
+		//Still compiling, skip it rather than stall the frame
+		VkPipeline batchPipeline = depthPrepass ? batch.prepassPipeline->Get() : batch.pipeline->Get();
+		if (batchPipeline == VK_NULL_HANDLE)
+			continue;
+
+		if (batchPipeline != boundPipeline)
+		{
+			vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, batchPipeline);
+			boundPipeline = batchPipeline;
+		}
+
+		//Culled, instances are read from the packed visible ones instead
+		VkBuffer buffers[2] = { batch.mesh->vertexBuffer, gpuCulling ? visibleInstanceBuffer : instanceBuffer };
+		VkDeviceSize offsets[2] = { 0, 0 };
+		uint32_t uniformOffset = batchUniformFrameOffset + static_cast<uint32_t>(batchUniformStride) * batchIndex;
+		if (IsBindless(batch.pipeline))
+		{
+			//Bound once, all that changes per draw is which slots are read
+			if (!heapBound)
+			{
+				VkDescriptorSet heapSet = bindlessHeap.GetSet();
+				vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, bindlessPipelineLayout, bindlessSetIndex, 1, &heapSet, 0, nullptr);
+				heapBound = true;
+			}
+
+			BindlessDrawConstants constants;
+			constants.instanceBuffer = gpuCulling ? visibleInstanceBufferIndex : instanceBufferIndex;
+			constants.colourBuffer = batchUniformBufferIndex;
+			constants.colourIndex = uniformOffset / sizeof(BatchUniforms::colour);
+			vkCmdPushConstants(cmdBuffer, bindlessPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants), &constants);
+			vkCmdBindVertexBuffers(cmdBuffer, 0, 1, buffers, offsets);
+		}
+		else
+		{
+			vkCmdBindVertexBuffers(cmdBuffer, 0, 2, buffers, offsets);
+
+			//One set for every batch, only the offset into this frame's uniforms moves. The layouts differ
+			//in set 0, so this disturbs the heap binding.
+			vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, batchPipelineLayout, batchSetIndex, 1, &batchDescriptorSet, 1, &uniformOffset);
+			heapBound = false;
+		}
+
+		//The light lists, bound again only when the layout changes, as the batch and heap sets' layouts differ below it
+		VkPipelineLayout batchLayout = IsBindless(batch.pipeline) ? bindlessPipelineLayout : batchPipelineLayout;
+		if (clusterDescriptorSet != VK_NULL_HANDLE && batchLayout != clusterBoundLayout)
+		{
+			vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, batchLayout, clusterSetIndex, 1, &clusterDescriptorSet, 0, nullptr);
+			clusterBoundLayout = batchLayout;
+		}
+
+		if (!gpuCulling)
+		{
+			vkCmdDraw(cmdBuffer, batch.mesh->vertexCount, lastInstance - firstInstance, 0, firstInstance);
+			continue;
+		}
+
+		//One instanced draw per cull draw, of its visible objects in the batch's order. The count drops it when none are.
+		vkCmdBindIndexBuffer(cmdBuffer, batch.mesh->indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+		VkDeviceSize drawOffset = sizeof(VkDrawIndexedIndirectCommand) * firstDraw;
+		if (drawIndirectCountSupported)
+		{
+			for (uint32_t drawIndex = firstDraw; drawIndex < lastDraw; ++drawIndex, drawOffset += sizeof(VkDrawIndexedIndirectCommand))
+			{
+				pfnCmdDrawIndexedIndirectCount(cmdBuffer, drawCommandBuffer, drawOffset, drawCountBuffer, sizeof(uint32_t) * drawIndex, 1, sizeof(VkDrawIndexedIndirectCommand));
+			}
+		}
+		else
+		{
+			//A cull draw with nothing visible has no instances, and draws nothing
+			vkCmdDrawIndexedIndirect(cmdBuffer, drawCommandBuffer, drawOffset, lastDraw - firstDraw, sizeof(VkDrawIndexedIndirectCommand));
+		}
+	}
+}
+
+bool Renderer::CreateCullPipeline()
+{
+	if (!gpuCulling)
+	{
+		Debug::Log("GPU culling disabled: multiDrawIndirect or drawIndirectFirstInstance not supported", DebugLevel::Warning);
+		return true;
+	}
+
+	VkShaderModule computeShaderModule = VK_NULL_HANDLE;
+	if (!shaderLibrary.GetShaderModule("Cull.comp.spv", computeShaderModule))
+		return false;
+
+	//Objects, cull draws, instances, visible instances, draw commands, draw counts
+	VkDescriptorSetLayoutBinding bindings[6]{};
+	for (uint32_t i = 0; i < 6; ++i)
+	{
+		bindings[i].binding = i;
+		bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		bindings[i].pImmutableSamplers = nullptr;
+	}
+
+	VkDescriptorSetLayoutCreateInfo setLayoutCreateInfo{};
+	setLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setLayoutCreateInfo.pNext = nullptr;
+	setLayoutCreateInfo.flags = 0;
+	setLayoutCreateInfo.bindingCount = 6;
+	setLayoutCreateInfo.pBindings = bindings;
+
+	auto err = vkCreateDescriptorSetLayout(defaultDevice, &setLayoutCreateInfo, nullptr, &cullSetLayout);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create cull descriptor set layout", DebugLevel::Error);
+		return false;
+	}
+
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(CullParams);
+
+	VkPipelineLayoutCreateInfo layoutCreateInfo{};
+	layoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutCreateInfo.pNext = nullptr;
+	layoutCreateInfo.flags = 0;
+	layoutCreateInfo.setLayoutCount = 1;
+	layoutCreateInfo.pSetLayouts = &cullSetLayout;
+	layoutCreateInfo.pushConstantRangeCount = 1;
+	layoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+
+	err = vkCreatePipelineLayout(defaultDevice, &layoutCreateInfo, nullptr, &cullPipelineLayout);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create cull pipeline layout", DebugLevel::Error);
+		return false;
+	}
+
+	VkComputePipelineCreateInfo computePipelineCreateInfo{};
+	computePipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computePipelineCreateInfo.pNext = nullptr;
+	computePipelineCreateInfo.flags = 0;
+	computePipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	computePipelineCreateInfo.stage.pNext = nullptr;
+	computePipelineCreateInfo.stage.flags = 0;
+	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	computePipelineCreateInfo.stage.module = computeShaderModule;
+	computePipelineCreateInfo.stage.pName = "main";
+	computePipelineCreateInfo.stage.pSpecializationInfo = nullptr;
+	computePipelineCreateInfo.layout = cullPipelineLayout;
+	computePipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
+	computePipelineCreateInfo.basePipelineIndex = -1;
+
+	err = vkCreateComputePipelines(defaultDevice, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &cullPipeline);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create cull compute pipeline", DebugLevel::Error);
+		return false;
+	}
+
+	return true;
+}
+
+bool Renderer::UpdateCullBuffers(const vector<CullObject>& cullObjects)
+{
+	cullObjectCount = cullObjects.size();
+	if (cullObjectCount > cullBufferCapacity)
+	{
+		DestroyCullBuffers();
+
+		//Objects and cull draws are written by the CPU, the rest only ever by the GPU. Every cull draw has an object,
+		//so the per draw buffers are sized by objects too.
+		if (!CreateBuffer(sizeof(CullObject) * cullObjectCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, cullObjectBuffer, cullObjectMemory))
+			return false;
+		if (!CreateBuffer(sizeof(CullDraw) * cullObjectCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, cullDrawBuffer, cullDrawMemory))
+			return false;
+		if (!CreateBuffer(sizeof(InstanceData) * cullObjectCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, visibleInstanceBuffer, visibleInstanceMemory))
+			return false;
+		if (!CreateBuffer(sizeof(VkDrawIndexedIndirectCommand) * cullObjectCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, drawCommandBuffer, drawCommandMemory))
+			return false;
+		if (!CreateBuffer(sizeof(uint32_t) * cullObjectCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, drawCountBuffer, drawCountMemory))
+			return false;
+
+		if (bindlessSupported)
+		{
+			visibleInstanceBufferIndex = bindlessHeap.AddBuffer(visibleInstanceBuffer, 0, VK_WHOLE_SIZE);
+			if (visibleInstanceBufferIndex == BindlessHeap::invalidIndex)
+				return false;
+		}
+
+		cullBufferCapacity = cullObjectCount;
+	}
+
+	if (cullObjectCount > 0 && !UploadBuffer(cullObjectMemory, cullObjects.data(), sizeof(CullObject) * cullObjectCount))
+		return false;
+	if (!cullDraws.empty() && !UploadBuffer(cullDrawMemory, cullDraws.data(), sizeof(CullDraw) * cullDraws.size()))
+		return false;
+
+	return true;
+}
+
+void Renderer::DestroyCullBuffers()
+{
+	if (visibleInstanceBufferIndex != BindlessHeap::invalidIndex)
+	{
+		bindlessHeap.ReleaseBuffer(visibleInstanceBufferIndex);
+		visibleInstanceBufferIndex = BindlessHeap::invalidIndex;
+	}
+
+	VkBuffer* buffers[] = { &cullObjectBuffer, &cullDrawBuffer, &visibleInstanceBuffer, &drawCommandBuffer, &drawCountBuffer };
+	VkDeviceMemory* memories[] = { &cullObjectMemory, &cullDrawMemory, &visibleInstanceMemory, &drawCommandMemory, &drawCountMemory };
+	for (uint32_t i = 0; i < 5; ++i)
+	{
+		if (*buffers[i] != VK_NULL_HANDLE)
+		{
+			vkDestroyBuffer(defaultDevice, *buffers[i], nullptr);
+			vkFreeMemory(defaultDevice, *memories[i], nullptr);
+			*buffers[i] = VK_NULL_HANDLE;
+			*memories[i] = VK_NULL_HANDLE;
+		}
+	}
+	cullBufferCapacity = 0;
+}
+
+void Renderer::RecordCulling(VkCommandBuffer cmdBuffer)
+{
+	//Written fresh from this frame's pools, so growing the buffers never touches a set the GPU may be reading
+	DescriptorSetBindings bindings(cullSetLayout);
+	bindings.BindBuffer(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, cullObjectBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, cullDrawBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, instanceBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, visibleInstanceBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, drawCommandBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, drawCountBuffer, 0, VK_WHOLE_SIZE);
+	VkDescriptorSet cullDescriptorSet = descriptorAllocator.AllocateFrameSet(bindings);
+	if (cullDescriptorSet == VK_NULL_HANDLE)
+		return;
+
+	//Clip space frustum, there is no camera yet
+	CullParams params{};
+	float planes[6][4] = {
+		{  1,  0,  0, 1 },
+		{ -1,  0,  0, 1 },
+		{  0,  1,  0, 1 },
+		{  0, -1,  0, 1 },
+		{  0,  0,  1, 0 },
+		{  0,  0, -1, 1 },
+	};
+	memcpy(params.frustumPlanes, planes, sizeof(planes));
+	params.drawCount = cullDraws.size();
+
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &cullDescriptorSet, 0, nullptr);
+	vkCmdPushConstants(cmdBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullParams), &params);
+	//A workgroup per cull draw, its invocations stepping through the objects cullGroupSize at a time
+	vkCmdDispatch(cmdBuffer, params.drawCount, 1, 1);
+}
+
+void Renderer::AddCullPasses(RenderGraph::Resource& outVisibleInstances, RenderGraph::Resource& outDrawCommands, RenderGraph::Resource& outDrawCounts)
+{
+	outVisibleInstances = outDrawCommands = outDrawCounts = RenderGraph::invalidIndex;
+	if (!gpuCulling || cullObjectCount == 0)
+		return;
+
+	//Objects and instances are written by the host before submission, the previous frame in flight last drew from the rest
+	RenderGraph::Resource cullObjects = renderGraph.ImportBuffer("Cull objects", cullObjectBuffer, 0, 0);
+	RenderGraph::Resource cullDrawInput = renderGraph.ImportBuffer("Cull draws", cullDrawBuffer, 0, 0);
+	RenderGraph::Resource instances = renderGraph.ImportBuffer("Instances", instanceBuffer, 0, 0);
+	outVisibleInstances = renderGraph.ImportBuffer("Visible instances", visibleInstanceBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+		VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+	outDrawCommands = renderGraph.ImportBuffer("Draw commands", drawCommandBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	outDrawCounts = renderGraph.ImportBuffer("Draw counts", drawCountBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+
+	//Visible instances packed in order to the front of their cull draw's region, and a draw of them for each
+	RenderGraph::Pass cullPass = renderGraph.AddPass("Cull", [this](VkCommandBuffer cmdBuffer)
+	{
+		RecordCulling(cmdBuffer);
+	});
+	renderGraph.Read(cullPass, cullObjects, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	renderGraph.Read(cullPass, cullDrawInput, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	renderGraph.Read(cullPass, instances, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	renderGraph.Write(cullPass, outVisibleInstances, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+	renderGraph.Write(cullPass, outDrawCommands, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+	renderGraph.Write(cullPass, outDrawCounts, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+}
+
+bool Renderer::CreateLightCullPipeline()
+{
+	if (!UsesClusteredLighting() || hostLightBinning)
+		return true;
+
+	VkShaderModule computeShaderModule = VK_NULL_HANDLE;
+	if (!shaderLibrary.GetShaderModule("LightCull.comp.spv", computeShaderModule))
+		return false;
+
+	//Parameters, lights, grid, indices
+	VkDescriptorSetLayoutBinding bindings[4]{};
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		bindings[i].binding = i;
+		bindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		bindings[i].pImmutableSamplers = nullptr;
+	}
+
+	VkDescriptorSetLayoutCreateInfo setLayoutCreateInfo{};
+	setLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setLayoutCreateInfo.pNext = nullptr;
+	setLayoutCreateInfo.flags = 0;
+	setLayoutCreateInfo.bindingCount = 4;
+	setLayoutCreateInfo.pBindings = bindings;
+
+	auto err = vkCreateDescriptorSetLayout(defaultDevice, &setLayoutCreateInfo, nullptr, &lightCullSetLayout);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create light cull descriptor set layout", DebugLevel::Error);
+		return false;
+	}
+
+	VkPipelineLayoutCreateInfo layoutCreateInfo{};
+	layoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutCreateInfo.pNext = nullptr;
+	layoutCreateInfo.flags = 0;
+	layoutCreateInfo.setLayoutCount = 1;
+	layoutCreateInfo.pSetLayouts = &lightCullSetLayout;
+	layoutCreateInfo.pushConstantRangeCount = 0;
+	layoutCreateInfo.pPushConstantRanges = nullptr;
+
+	err = vkCreatePipelineLayout(defaultDevice, &layoutCreateInfo, nullptr, &lightCullPipelineLayout);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create light cull pipeline layout", DebugLevel::Error);
+		return false;
+	}
+
+	VkComputePipelineCreateInfo computePipelineCreateInfo{};
+	computePipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computePipelineCreateInfo.pNext = nullptr;
+	computePipelineCreateInfo.flags = 0;
+	computePipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	computePipelineCreateInfo.stage.pNext = nullptr;
+	computePipelineCreateInfo.stage.flags = 0;
+	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	computePipelineCreateInfo.stage.module = computeShaderModule;
+	computePipelineCreateInfo.stage.pName = "main";
+	computePipelineCreateInfo.stage.pSpecializationInfo = nullptr;
+	computePipelineCreateInfo.layout = lightCullPipelineLayout;
+	computePipelineCreateInfo.basePipelineHandle = VK_NULL_HANDLE;
+	computePipelineCreateInfo.basePipelineIndex = -1;
+
+	err = vkCreateComputePipelines(defaultDevice, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &lightCullPipeline);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create light cull compute pipeline", DebugLevel::Error);
+		return false;
+	}
+
+	return true;
+}
+
+bool Renderer::CreateLightClusterBuffers()
+{
+	if (!UsesClusteredLighting())
+		return true;
+
+	//Parameters and lights are written by the CPU, the lists by the GPU, or the CPU too with hostLightBinning
+	uint32_t clusterCount = lightClusters.GetClusterCount();
+	VkMemoryPropertyFlags listMemoryFlags = hostLightBinning ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	lightIndexCapacity = clusterCount * averageClusterLights;
+	VkDeviceSize gridSize = sizeof(uint32_t) * 2 * clusterCount;
+	VkDeviceSize indexSize = sizeof(uint32_t) * (1 + lightIndexCapacity);
+	if (!CreateBuffer(sizeof(ClusterParams), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, clusterParamsBuffer, clusterParamsMemory))
+		return false;
+	if (!CreateBuffer(sizeof(ClusterLight) * std::max<size_t>(clusterLights.size(), 1), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+		lightBuffer, lightMemory))
+		return false;
+	if (!CreateBuffer(gridSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, listMemoryFlags, lightGridBuffer, lightGridMemory))
+		return false;
+	if (!CreateBuffer(indexSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		listMemoryFlags, lightIndexBuffer, lightIndexMemory))
+		return false;
+	//Host binned lists would only be checked against themselves
+	if (validateLightClusters && !hostLightBinning && !CreateBuffer(gridSize + indexSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, clusterReadbackBuffer, clusterReadbackMemory))
+		return false;
+
+	ClusterParams params{};
+	memcpy(params.gridSize, lightClusters.GetSize(), sizeof(uint32_t) * 3);
+	params.gridSize[3] = static_cast<uint32_t>(clusterLights.size());
+	params.viewportSize[0] = float(width);
+	params.viewportSize[1] = float(height);
+	if (!UploadBuffer(clusterParamsMemory, &params, sizeof(params)))
+		return false;
+	if (!clusterLights.empty() && !UploadBuffer(lightMemory, clusterLights.data(), sizeof(ClusterLight) * clusterLights.size()))
+		return false;
+	if (hostLightBinning && !UploadLightClusters())
+		return false;
+
+	DescriptorSetBindings bindings(clusterSetLayout);
+	bindings.BindBuffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, clusterParamsBuffer, 0, sizeof(ClusterParams));
+	bindings.BindBuffer(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lightBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lightGridBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lightIndexBuffer, 0, VK_WHOLE_SIZE);
+	clusterDescriptorSet = descriptorAllocator.GetCachedSet(bindings);
+	if (clusterDescriptorSet == VK_NULL_HANDLE)
+		return false;
+
+	Debug::Log(std::string("Clustered lighting: ") + std::to_string(clusterLights.size()) + " lights in " + std::to_string(clusterCount) + " clusters" +
+		(hostLightBinning ? ", binned on the host" : ""));
+	return true;
+}
+
+bool Renderer::UploadLightClusters()
+{
+	vector<uint32_t> grid;
+	vector<uint32_t> indices;
+	lightClusters.Bin(clusterLights, lightIndexCapacity, grid, indices);
+
+	//Laid out as LightCull.comp writes them: the index buffer starts with the count
+	indices.insert(indices.begin(), static_cast<uint32_t>(indices.size()));
+	if (!UploadBuffer(lightGridMemory, grid.data(), sizeof(uint32_t) * grid.size()))
+		return false;
+	if (!UploadBuffer(lightIndexMemory, indices.data(), sizeof(uint32_t) * indices.size()))
+		return false;
+
+	return true;
+}
+
+void Renderer::DestroyLightClusterBuffers()
+{
+	if (lightBuffer != VK_NULL_HANDLE)
+	{
+		//The cached set would otherwise outlive the buffers it points at
+		descriptorAllocator.EvictCachedSets(lightBuffer);
+		clusterDescriptorSet = VK_NULL_HANDLE;
+	}
+
+	VkBuffer* buffers[5] = { &clusterParamsBuffer, &lightBuffer, &lightGridBuffer, &lightIndexBuffer, &clusterReadbackBuffer };
+	VkDeviceMemory* memory[5] = { &clusterParamsMemory, &lightMemory, &lightGridMemory, &lightIndexMemory, &clusterReadbackMemory };
+	for (uint32_t i = 0; i < 5; ++i)
+	{
+		vkDestroyBuffer(defaultDevice, *buffers[i], nullptr);
+		vkFreeMemory(defaultDevice, *memory[i], nullptr);
+		*buffers[i] = VK_NULL_HANDLE;
+		*memory[i] = VK_NULL_HANDLE;
+	}
+	lightIndexCapacity = 0;
+}
+
+void Renderer::RecordLightCulling(VkCommandBuffer cmdBuffer)
+{
+	DescriptorSetBindings bindings(lightCullSetLayout);
+	bindings.BindBuffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, clusterParamsBuffer, 0, sizeof(ClusterParams));
+	bindings.BindBuffer(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lightBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lightGridBuffer, 0, VK_WHOLE_SIZE);
+	bindings.BindBuffer(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lightIndexBuffer, 0, VK_WHOLE_SIZE);
+	VkDescriptorSet lightCullDescriptorSet = descriptorAllocator.GetCachedSet(bindings);
+	if (lightCullDescriptorSet == VK_NULL_HANDLE)
+		return;
+
+	//One invocation per cluster
+	uint32_t groupSize = 64;	//LightCull.comp's local_size_x
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lightCullPipeline);
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lightCullPipelineLayout, 0, 1, &lightCullDescriptorSet, 0, nullptr);
+	vkCmdDispatch(cmdBuffer, (lightClusters.GetClusterCount() + groupSize - 1) / groupSize, 1, 1);
+}
+
+void Renderer::AddLightCullPasses(RenderGraph::Resource& outLightGrid, RenderGraph::Resource& outLightIndices)
+{
+	outLightGrid = outLightIndices = RenderGraph::invalidIndex;
+	if (clusterDescriptorSet == VK_NULL_HANDLE)
+		return;
+
+	//Host binned lists were uploaded before the first submission and never change, so there is nothing to run
+	if (hostLightBinning)
+	{
+		outLightGrid = renderGraph.ImportBuffer("Light grid", lightGridBuffer, 0, 0);
+		outLightIndices = renderGraph.ImportBuffer("Light indices", lightIndexBuffer, 0, 0);
+		return;
+	}
+
+	//Lights are written by the host before submission, the previous frame in flight last shaded with the lists
+	RenderGraph::Resource lights = renderGraph.ImportBuffer("Lights", lightBuffer, 0, 0);
+	outLightGrid = renderGraph.ImportBuffer("Light grid", lightGridBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	outLightIndices = renderGraph.ImportBuffer("Light indices", lightIndexBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+	//Only the count needs resetting, every list is rewritten
+	RenderGraph::Pass clearPass = renderGraph.AddPass("Clear light lists", [this](VkCommandBuffer cmdBuffer)
+	{
+		vkCmdFillBuffer(cmdBuffer, lightIndexBuffer, 0, sizeof(uint32_t), 0);
+	});
+	renderGraph.Write(clearPass, outLightIndices, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	RenderGraph::Pass cullPass = renderGraph.AddPass("Light cull", [this](VkCommandBuffer cmdBuffer)
+	{
+		RecordLightCulling(cmdBuffer);
+	});
+	renderGraph.Read(cullPass, lights, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	renderGraph.Write(cullPass, outLightGrid, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+	renderGraph.Write(cullPass, outLightIndices, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+}
+
+void Renderer::AddLightClusterReadback(RenderGraph::Resource lightGrid, RenderGraph::Resource lightIndices)
+{
+	if (lightGrid == RenderGraph::invalidIndex || clusterReadbackBuffer == VK_NULL_HANDLE)
+		return;
+
+	//Copied out for ValidateLightClusters, which reads it once the frame has completed
+	RenderGraph::Pass readbackPass = renderGraph.AddPass("Read back light clusters", [this](VkCommandBuffer cmdBuffer)
+	{
+		VkBufferCopy regions[2]{};
+		regions[0].srcOffset = 0;
+		regions[0].dstOffset = 0;
+		regions[0].size = sizeof(uint32_t) * 2 * lightClusters.GetClusterCount();
+		regions[1].srcOffset = 0;
+		regions[1].dstOffset = regions[0].size;
+		regions[1].size = sizeof(uint32_t) * (1 + lightIndexCapacity);
+		vkCmdCopyBuffer(cmdBuffer, lightGridBuffer, clusterReadbackBuffer, 1, &regions[0]);
+		vkCmdCopyBuffer(cmdBuffer, lightIndexBuffer, clusterReadbackBuffer, 1, &regions[1]);
+
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.pNext = nullptr;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	});
+	renderGraph.SetSideEffects(readbackPass);
+	renderGraph.Read(readbackPass, lightGrid, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	renderGraph.Read(readbackPass, lightIndices, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+}
+
+bool Renderer::ValidateLightClusters()
+{
+	void* memPtr = nullptr;
+	auto err = vkMapMemory(defaultDevice, clusterReadbackMemory, 0, VK_WHOLE_SIZE, 0, &memPtr);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Map light cluster readback", DebugLevel::Error);
+		return false;
+	}
+
+	VkMappedMemoryRange memoryRange{};
+	memoryRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+	memoryRange.pNext = nullptr;
+	memoryRange.memory = clusterReadbackMemory;
+	memoryRange.offset = 0;
+	memoryRange.size = VK_WHOLE_SIZE;
+	vkInvalidateMappedMemoryRanges(defaultDevice, 1, &memoryRange);
+
+	//The grid, then the index buffer's count and lists
+	const uint32_t* grid = static_cast<const uint32_t*>(memPtr);
+	const uint32_t* indexData = grid + 2 * lightClusters.GetClusterCount();
+	uint32_t indexCount = std::min(indexData[0], lightIndexCapacity);
+	bool valid = lightClusters.Validate(clusterLights, lightIndexCapacity, grid, indexData + 1, indexCount);
+	vkUnmapMemory(defaultDevice, clusterReadbackMemory);
+
+	if (valid)
+	{
+		Debug::Log(std::string("Light clusters match the CPU reference, ") + std::to_string(indexCount) + " indices");
+	}
+	return valid;
+}
+
+bool Renderer::CreateFrameBuffers()
+{
+	frameBuffers.resize(imageViews.size());
+	for (uint32_t i = 0; i < frameBuffers.size(); ++i)
+	{
+		if (!CreateFrameBuffer(i, frameBuffers[i]))
+			return false;
+	}
+
+	return true;
+}
+
+bool Renderer::CreateFrameResources()
+{
+	recordThreadCount = jobSystem.GetThreadCount();
+
+	VkCommandPoolCreateInfo cmdPoolInfo{};
+	cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	cmdPoolInfo.pNext = nullptr;
+	cmdPoolInfo.queueFamilyIndex = defaultQueueFamilyIndex;
+	cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;	//pools are reset wholesale each frame
+
+	VkSemaphoreCreateInfo semaphoreCreatInfo{};
+	semaphoreCreatInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreCreatInfo.pNext = nullptr;
+	semaphoreCreatInfo.flags = 0;
+
+	for (auto& frame : frames)
+	{
+		auto err = vkCreateSemaphore(defaultDevice, &semaphoreCreatInfo, nullptr, &frame.imageAvailableSemaphore);
+		if (err == VK_SUCCESS)
+		{
+			err = vkCreateSemaphore(defaultDevice, &semaphoreCreatInfo, nullptr, &frame.renderingFinishedSemaphore);
+		}
+		if (err != VK_SUCCESS)
+		{
+			Debug::Log("Create frame semaphores", DebugLevel::Error);
+			return false;
+		}
+
+		err = vkCreateCommandPool(defaultDevice, &cmdPoolInfo, nullptr, &frame.commandPool);
+		if (err != VK_SUCCESS)
+		{
+			Debug::Log("Create frame command pool", DebugLevel::Error);
+			return false;
+		}
+
+		VkCommandBufferAllocateInfo bufferAllocInfo{};
+		bufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		bufferAllocInfo.pNext = nullptr;
+		bufferAllocInfo.commandPool = frame.commandPool;
+		bufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		bufferAllocInfo.commandBufferCount = 1;
+
+		err = vkAllocateCommandBuffers(defaultDevice, &bufferAllocInfo, &frame.commandBuffer);
+		if (err != VK_SUCCESS)
+		{
+			Debug::Log("Allocate frame command buffer", DebugLevel::Error);
+			return false;
+		}
+
+		//Command pools are externally synchronised, so each recording thread gets its own
+		frame.workerCommandPools.resize(recordThreadCount);
+		frame.workerCommandBuffers.resize(recordThreadCount);
+		frame.workerPrepassCommandBuffers.resize(enableDepthPrepass ? recordThreadCount : 0);
+		for (uint32_t t = 0; t < recordThreadCount; ++t)
 		{
-			VkMemoryAllocateInfo memoryAllocInfo{};
-			memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-			memoryAllocInfo.pNext = nullptr;
-			memoryAllocInfo.allocationSize = memRequirements.size;
-			memoryAllocInfo.memoryTypeIndex = i;
+			err = vkCreateCommandPool(defaultDevice, &cmdPoolInfo, nullptr, &frame.workerCommandPools[t]);
+			if (err != VK_SUCCESS)
+			{
+				Debug::Log("Create worker command pool", DebugLevel::Error);
+				return false;
+			}
 
-			auto err = vkAllocateMemory(defaultDevice, &memoryAllocInfo, nullptr, &devMem);
-			if (err == VK_SUCCESS)
+			bufferAllocInfo.commandPool = frame.workerCommandPools[t];
+			bufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+			err = vkAllocateCommandBuffers(defaultDevice, &bufferAllocInfo, &frame.workerCommandBuffers[t]);
+			if (err == VK_SUCCESS && enableDepthPrepass)
 			{
-				return true;
+				err = vkAllocateCommandBuffers(defaultDevice, &bufferAllocInfo, &frame.workerPrepassCommandBuffers[t]);
+			}
+			if (err != VK_SUCCESS)
+			{
+				Debug::Log("Allocate secondary command buffer", DebugLevel::Error);
+				return false;
 			}
 		}
 	}
 
-	return false;
+	return true;
 }
 
-bool Renderer::CreateTri()
+void Renderer::DestroyFrameResources()
 {
-	float vertices[] = {
-		0, -1, 0, 1,
-		-1, 1, 0, 1,
-		1, 1,  0, 1
-	};
+	for (auto& frame : frames)
+	{
+		for (auto workerPool : frame.workerCommandPools)
+		{
+			vkDestroyCommandPool(defaultDevice, workerPool, nullptr);
+		}
+		frame.workerCommandPools.clear();
+		frame.workerCommandBuffers.clear();
+		frame.workerPrepassCommandBuffers.clear();
+		vkDestroyCommandPool(defaultDevice, frame.commandPool, nullptr);
+		vkDestroySemaphore(defaultDevice, frame.imageAvailableSemaphore, nullptr);
+		vkDestroySemaphore(defaultDevice, frame.renderingFinishedSemaphore, nullptr);
+	}
 
-	VkBufferCreateInfo vbInfo = {};
-	vbInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	vbInfo.pNext = nullptr;
-	vbInfo.flags = 0;
-	vbInfo.size = sizeof(vertices);
-	vbInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-	vbInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	vbInfo.queueFamilyIndexCount = 0;
-	vbInfo.pQueueFamilyIndices = nullptr; // &defaultQueueFamilyIndex;
+	for (auto framebuffer : frameBuffers)
+	{
+		vkDestroyFramebuffer(defaultDevice, framebuffer, nullptr);
+	}
+	frameBuffers.clear();
+}
 
-	auto err = vkCreateBuffer(defaultDevice, &vbInfo, nullptr, &vertexBuffer);
+bool Renderer::BeginSecondaryCommandBuffer(VkCommandPool pool, VkCommandBuffer cmdBuffer, VkFramebuffer framebuffer)
+{
+	//Null when the pool has already been reset for another of its buffers
+	if (pool != VK_NULL_HANDLE)
+		vkResetCommandPool(defaultDevice, pool, 0);
+
+	//Without a render pass the secondary is told the attachment formats instead
+	VkCommandBufferInheritanceRenderingInfoKHR inheritanceRenderingInfo{};
+	inheritanceRenderingInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO_KHR;
+	inheritanceRenderingInfo.pNext = nullptr;
+	inheritanceRenderingInfo.flags = 0;
+	inheritanceRenderingInfo.viewMask = 0;
+	inheritanceRenderingInfo.colorAttachmentCount = 1;
+	inheritanceRenderingInfo.pColorAttachmentFormats = &currentFormat;
+	inheritanceRenderingInfo.depthAttachmentFormat = depthFormat;
+	inheritanceRenderingInfo.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
+	inheritanceRenderingInfo.rasterizationSamples = sampleCount;
+
+	VkCommandBufferInheritanceInfo inheritanceInfo{};
+	inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritanceInfo.pNext = dynamicRenderingSupported ? &inheritanceRenderingInfo : nullptr;
+	inheritanceInfo.renderPass = dynamicRenderingSupported ? VK_NULL_HANDLE : renderPass;
+	inheritanceInfo.subpass = 0;
+	inheritanceInfo.framebuffer = framebuffer;
+	inheritanceInfo.occlusionQueryEnable = VK_FALSE;
+
+	VkCommandBufferBeginInfo cmdBufferBeginInfo{};
+	cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	cmdBufferBeginInfo.pNext = nullptr;
+	cmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	cmdBufferBeginInfo.pInheritanceInfo = &inheritanceInfo;
+
+	auto err = vkBeginCommandBuffer(cmdBuffer, &cmdBufferBeginInfo);
 	if (err != VK_SUCCESS)
 	{
-		Debug::Log("Create Vertex buffer", DebugLevel::Error);
+		Debug::Log("Begin secondary command buffer", DebugLevel::Error);
 		return false;
 	}
-	
-	VkDeviceMemory devMem;
-	if (!AllocateMemory(vertexBuffer, devMem))
+
+	//Dynamic state is not inherited from the primary
+	VkViewport viewport;
+	viewport.x = viewport.y = 0;
+	viewport.width = width;
+	viewport.height = height;
+	viewport.minDepth = 0;
+	viewport.maxDepth = 1.0f;
+
+	VkRect2D scissors{};
+	scissors.offset.x = scissors.offset.y = 0;
+	scissors.extent.width = width;
+	scissors.extent.height = height;
+	if (enabledDynamicState)
 	{
-		Debug::Log("Allocate memory for vertex buffer", DebugLevel::Error);
-		return false;
+		vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+		vkCmdSetScissor(cmdBuffer, 0, 1, &scissors);
 	}
+	pipelineManager.SetDynamicState(cmdBuffer, sceneDescription);
 
-	err = vkBindBufferMemory(defaultDevice, vertexBuffer, devMem, 0);
-	if(err != VK_SUCCESS)
+	return true;
+}
+
+bool Renderer::RecordSecondaryCommandBuffer(VkCommandPool pool, VkCommandBuffer cmdBuffer, VkCommandBuffer prepassCmdBuffer, VkFramebuffer framebuffer, uint32_t rangeBegin, uint32_t rangeEnd)
+{
+	//The pre-pass's draws go in their own buffer, executed ahead of every thread's colour draws
+	if (prepassCmdBuffer != VK_NULL_HANDLE)
 	{
-		Debug::Log("Allocate memory for vertex buffer", DebugLevel::Error);
-		return false;
+		if (!BeginSecondaryCommandBuffer(pool, prepassCmdBuffer, framebuffer))
+			return false;
+		pipelineManager.SetDynamicState(prepassCmdBuffer, prepassDescription);
+
+		RecordInstanceRange(prepassCmdBuffer, rangeBegin, rangeEnd, true);
+
+		auto err = vkEndCommandBuffer(prepassCmdBuffer);
+		if (err != VK_SUCCESS)
+		{
+			Debug::Log("End secondary command buffer", DebugLevel::Error);
+			return false;
+		}
+		pool = VK_NULL_HANDLE;	//both buffers are from it, reset once
 	}
 
-	void* memPtr = nullptr;
+	if (!BeginSecondaryCommandBuffer(pool, cmdBuffer, framebuffer))
+		return false;
 
-	err = vkMapMemory(defaultDevice, devMem, 0, VK_WHOLE_SIZE, 0, &memPtr);
+	RecordInstanceRange(cmdBuffer, rangeBegin, rangeEnd);
+
+	auto err = vkEndCommandBuffer(cmdBuffer);
 	if (err != VK_SUCCESS)
 	{
-		Debug::Log("Map vertex memory", DebugLevel::Error);
+		Debug::Log("End secondary command buffer", DebugLevel::Error);
 		return false;
 	}
 
-	memcpy(memPtr, vertices, sizeof(vertices));
-	
-	VkMappedMemoryRange memoryRange{};
-	memoryRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-	memoryRange.pNext = nullptr;
-	memoryRange.memory = devMem;
-	memoryRange.offset = 0;
-	memoryRange.size = VK_WHOLE_SIZE;
-	vkFlushMappedMemoryRanges(defaultDevice, 1, &memoryRange);
+	return true;
+}
 
-	vkUnmapMemory(defaultDevice, devMem);
+bool Renderer::RecordSecondaryCommandBuffers(FrameResources& frame, VkFramebuffer framebuffer, uint32_t threadCount)
+{
+	//Each job takes an equal slice of the instances, and owns the pool for that slice
+	std::atomic<bool> success { true };
+	JobCounter counter { 0 };
+	for (uint32_t t = 0; t < threadCount; ++t)
+	{
+		uint32_t rangeBegin = GetRecordRangeBegin(t, threadCount);
+		uint32_t rangeEnd = GetRecordRangeBegin(t + 1, threadCount);
+		VkCommandPool pool = frame.workerCommandPools[t];
+		VkCommandBuffer cmdBuffer = frame.workerCommandBuffers[t];
+		VkCommandBuffer prepassCmdBuffer = enableDepthPrepass ? frame.workerPrepassCommandBuffers[t] : VK_NULL_HANDLE;
+		jobSystem.Run([=, &success]()
+		{
+			if (!RecordSecondaryCommandBuffer(pool, cmdBuffer, prepassCmdBuffer, framebuffer, rangeBegin, rangeEnd))
+				success = false;
+		}, &counter);
+	}
+	jobSystem.Wait(counter);
 
-	return true;
+	return success;
 }
 
-bool Renderer::RenderWithRenderPass()
+bool Renderer::RenderParallel()
 {
-	uint32_t timeout = 30; // ms
-	VkSemaphore imageAvailableSemaphore, renderingFinishedSemaphore;
-	VkSemaphoreCreateInfo semaphoreCreatInfo{};
-	semaphoreCreatInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	semaphoreCreatInfo.pNext = nullptr;
-	semaphoreCreatInfo.flags = 0;
-	auto err = vkCreateSemaphore(defaultDevice, &semaphoreCreatInfo, nullptr, &imageAvailableSemaphore);
-	vkCreateSemaphore(defaultDevice, &semaphoreCreatInfo, nullptr, &renderingFinishedSemaphore);
-	uint32_t imageIndex;
-	
-	err = vkAcquireNextImageKHR(defaultDevice, swapchain, timeout, imageAvailableSemaphore, nullptr, &imageIndex);
-	if (err != VK_SUCCESS)
+	FrameResources& frame = frames[frameIndex];
+
+	//Wait for the GPU to finish with this frame's pools before resetting them
+	if (!submissionQueue.Wait(frame.submissionValue))
 	{
+		Debug::Log("Wait for frame submission", DebugLevel::Error);
 		return false;
 	}
 
-	if (!CreateFrameBuffer(imageIndex))
+	//Anything released while recording is freed once this frame's submission has completed
+	uint64_t submissionValue = submissionQueue.GetNextValue();
+	uint64_t completedValue = submissionQueue.GetCompletedValue();
+	pipelineManager.BeginFrame(submissionValue, completedValue);
+	descriptorAllocator.BeginFrame(frameIndex);
+	bindlessHeap.BeginFrame(submissionValue, completedValue);
+	renderGraph.Reset(submissionValue, completedValue);
+	if (!UpdateBatchUniforms(frameIndex))
 		return false;
-	
-	//VkFenceCreateInfo fenceCreateInfo{};
-	//fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	//fenceCreateInfo.pNext = nullptr;
-	//fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-	//VkFence fence{};
-	//err = vkCreateFence(defaultDevice, &fenceCreateInfo, nullptr, &fence);
+	uint32_t imageIndex;
+	auto err = vkAcquireNextImageKHR(defaultDevice, swapchain, UINT64_MAX, frame.imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+	if (err != VK_SUCCESS && err != VK_SUBOPTIMAL_KHR)
+	{
+		Debug::Log("Acquire next image", DebugLevel::Error);
+		return false;
+	}
+
+	vkResetCommandPool(defaultDevice, frame.commandPool, 0);
 
+	if (!RecordSecondaryCommandBuffers(frame, GetFrameBuffer(imageIndex), recordThreadCount))
+		return false;
 
 	VkCommandBufferBeginInfo cmdBufferBeginInfo{};
 	cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 	cmdBufferBeginInfo.pNext = nullptr;
-	cmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+	cmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 	cmdBufferBeginInfo.pInheritanceInfo = nullptr;
 
-	err = vkBeginCommandBuffer(commandBuffer, &cmdBufferBeginInfo);
+	err = vkBeginCommandBuffer(frame.commandBuffer, &cmdBufferBeginInfo);
 	if (err != VK_SUCCESS)
 	{
 		Debug::Log("Begin Command buffer", DebugLevel::Error);
 		return false;
 	}
 
-	VkClearValue clearColour = { 1.0f, 0.8f, 0.4f, 0.0f };
-
-	/*
-	VkImageSubresourceRange imageSubresourceRange{};
-	imageSubresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	imageSubresourceRange.baseMipLevel = 0;
-	imageSubresourceRange.levelCount = 1;
-	imageSubresourceRange.baseArrayLayer = 0;
-	imageSubresourceRange.layerCount = 1;
-
-	VkImageMemoryBarrier barrier{};
-	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	barrier.pNext = nullptr;
-	barrier.srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-	barrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	barrier.srcQueueFamilyIndex = defaultQueueFamilyIndex;
-	barrier.dstQueueFamilyIndex = defaultQueueFamilyIndex;
-	barrier.image = swapchainImages[imageIndex];
-	barrier.subresourceRange = imageSubresourceRange;
-	
-	VkImageMemoryBarrier barrier2 = barrier;
-	barrier2.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
-	barrier2.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	barrier2.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	barrier2.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	
-	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT , VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-	*/
-
-	VkRect2D renderArea{};
-	renderArea.offset.x = renderArea.offset.y = 0;
-	renderArea.extent.width = width;
-	renderArea.extent.height = height;
-
-	VkRenderPassBeginInfo renderPassBeginInfo{
-		VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-		nullptr,
-		renderPass,
-		frameBuffer,
-		renderArea,
-		1, &clearColour
-	};
+	RenderGraph::Resource visibleInstances, drawCommands, drawCounts;
+	AddCullPasses(visibleInstances, drawCommands, drawCounts);
+	RenderGraph::Resource lightGrid, lightIndices;
+	AddLightCullPasses(lightGrid, lightIndices);
+	bool validatingLightClusters = validateLightClusters && !lightClustersValidated;
+	if (validatingLightClusters)
+		AddLightClusterReadback(lightGrid, lightIndices);
+
+	//Usable from the acquire semaphore's wait stage, presented once the frame is done
+	RenderGraph::Resource swapchainImage = renderGraph.ImportImage("Swapchain", swapchainImages[imageIndex], VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+
+	//Last written by the previous frame's depth tests (and read by its lighting, deferred), its contents are never kept
+	RenderGraph::Resource depthBuffer = renderGraph.ImportImage("Depth", depthImage, depthAspect, VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | (enableDeferred ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT : 0), VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+		VK_IMAGE_LAYOUT_UNDEFINED);
+	RenderGraph::Resource msaaColour = RenderGraph::invalidIndex;
+	if (sampleCount != VK_SAMPLE_COUNT_1_BIT)
+	{
+		msaaColour = renderGraph.ImportImage("MSAA colour", msaaColourImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED);
+	}
+	RenderGraph::Resource gBuffer[gBufferCount];
+	for (uint32_t i = 0; enableDeferred && i < gBufferCount; ++i)
+	{
+		//Last read by the previous frame's lighting
+		gBuffer[i] = renderGraph.ImportImage(i == 0 ? "G-buffer albedo" : "G-buffer normal", gBufferImages[i], VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED);
+	}
+
+	RenderGraph::Pass scenePass = renderGraph.AddPass("Scene", [&](VkCommandBuffer cmdBuffer)
+	{
+		VkClearValue clearValues[2 + gBufferCount]{};
+		uint32_t clearValueCount = GetClearValues(clearValues);
+
+		VkRect2D renderArea{};
+		renderArea.offset.x = renderArea.offset.y = 0;
+		renderArea.extent.width = width;
+		renderArea.extent.height = height;
 
-	//Begin 
-	vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+		if (dynamicRenderingSupported)
+		{
+			VkRenderingAttachmentInfoKHR colourAttachment{};
+			colourAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+			colourAttachment.pNext = nullptr;
+			colourAttachment.imageView = imageViews[imageIndex];
+			colourAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+			colourAttachment.resolveMode = VK_RESOLVE_MODE_NONE_KHR;
+			colourAttachment.resolveImageView = VK_NULL_HANDLE;
+			colourAttachment.resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			colourAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+			colourAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+			if (sampleCount != VK_SAMPLE_COUNT_1_BIT)
+			{
+				//Resolved into the swapchain image as rendering ends, the samples themselves are discarded
+				colourAttachment.imageView = msaaColourImageView;
+				colourAttachment.resolveMode = VK_RESOLVE_MODE_AVERAGE_BIT_KHR;
+				colourAttachment.resolveImageView = imageViews[imageIndex];
+				colourAttachment.resolveImageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+				colourAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+			}
+			colourAttachment.clearValue = clearValues[0];
+
+			VkRenderingAttachmentInfoKHR depthAttachment{};
+			depthAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+			depthAttachment.pNext = nullptr;
+			depthAttachment.imageView = depthImageView;
+			depthAttachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+			depthAttachment.resolveMode = VK_RESOLVE_MODE_NONE_KHR;
+			depthAttachment.resolveImageView = VK_NULL_HANDLE;
+			depthAttachment.resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+			depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+			depthAttachment.clearValue = clearValues[1];
+
+			VkRenderingInfoKHR renderingInfo{};
+			renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+			renderingInfo.pNext = nullptr;
+			renderingInfo.flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT_KHR;
+			renderingInfo.renderArea = renderArea;
+			renderingInfo.layerCount = 1;
+			renderingInfo.viewMask = 0;
+			renderingInfo.colorAttachmentCount = 1;
+			renderingInfo.pColorAttachments = &colourAttachment;
+			renderingInfo.pDepthAttachment = &depthAttachment;
+			renderingInfo.pStencilAttachment = nullptr;
+
+			pfnCmdBeginRendering(cmdBuffer, &renderingInfo);
+			if (enableDepthPrepass)
+				vkCmdExecuteCommands(cmdBuffer, recordThreadCount, frame.workerPrepassCommandBuffers.data());
+			vkCmdExecuteCommands(cmdBuffer, recordThreadCount, frame.workerCommandBuffers.data());
+			pfnCmdEndRendering(cmdBuffer);
+		}
+		else
+		{
+			VkRenderPassBeginInfo renderPassBeginInfo{
+				VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+				nullptr,
+				renderPass,
+				frameBuffers[imageIndex],
+				renderArea,
+				clearValueCount, clearValues
+			};
+
+			vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+			if (enableDepthPrepass)
+				vkCmdExecuteCommands(cmdBuffer, recordThreadCount, frame.workerPrepassCommandBuffers.data());
+			vkCmdExecuteCommands(cmdBuffer, recordThreadCount, frame.workerCommandBuffers.data());
+			if (enableDeferred)
+			{
+				vkCmdNextSubpass(cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
+				RecordDeferredLighting(cmdBuffer);
+			}
+			vkCmdEndRenderPass(cmdBuffer);
+		}
+	});
+	if (drawCommands != RenderGraph::invalidIndex)
+	{
+		renderGraph.Read(scenePass, drawCommands, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+		renderGraph.Read(scenePass, visibleInstances, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+			VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_SHADER_READ_BIT);
+		if (drawIndirectCountSupported)
+		{
+			renderGraph.Read(scenePass, drawCounts, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+		}
+	}
+	if (lightGrid != RenderGraph::invalidIndex)
+	{
+		renderGraph.Read(scenePass, lightGrid, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+		renderGraph.Read(scenePass, lightIndices, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	}
 
-	vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+	//The previous contents are cleared, so the image is taken from whatever layout it is in. The render pass
+	//does its own transitions, dynamic rendering needs the graph to. A resolve writes at colour output too.
+	VkPipelineStageFlags depthStages = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	VkAccessFlags depthAccess = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	if (dynamicRenderingSupported)
+	{
+		renderGraph.Write(scenePass, swapchainImage, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+		renderGraph.Write(scenePass, depthBuffer, depthStages, depthAccess, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+		if (msaaColour != RenderGraph::invalidIndex)
+			renderGraph.Write(scenePass, msaaColour, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+	}
+	else
+	{
+		renderGraph.Write(scenePass, swapchainImage, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+		if (msaaColour != RenderGraph::invalidIndex)
+		{
+			renderGraph.Write(scenePass, msaaColour, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+				VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+		}
 
-	vkCmdEndRenderPass(commandBuffer);
+		//Deferred, depth and the G-buffer are also read back as input attachments by the lighting subpass
+		if (enableDeferred)
+		{
+			renderGraph.Write(scenePass, depthBuffer, depthStages | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, depthAccess | VK_ACCESS_INPUT_ATTACHMENT_READ_BIT,
+				VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+			for (uint32_t i = 0; i < gBufferCount; ++i)
+			{
+				renderGraph.Write(scenePass, gBuffer[i], VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+					VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_INPUT_ATTACHMENT_READ_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+			}
+		}
+		else
+		{
+			renderGraph.Write(scenePass, depthBuffer, depthStages, depthAccess, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+		}
+	}
 
-	//End
-	//vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier2);
+	if (!renderGraph.Compile())
+		return false;
+	renderGraph.Execute(frame.commandBuffer);
 
-	err = vkEndCommandBuffer(commandBuffer);
+	err = vkEndCommandBuffer(frame.commandBuffer);
 	if (err != VK_SUCCESS)
 	{
 		Debug::Log("End command buffer", DebugLevel::Error);
 		return false;
 	}
 
-	//VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-	VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-	VkSubmitInfo submitInfo{};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pNext = nullptr;
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &imageAvailableSemaphore;
-	submitInfo.pWaitDstStageMask = &waitStageMask;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffer;
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &renderingFinishedSemaphore;
-	
-	err = vkQueueSubmit(primaryQueue, 1, &submitInfo, nullptr);
-	if (err != VK_SUCCESS)
+	if (!SubmitFrame(frame, frame.commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, imageIndex))
+		return false;
+
+	//Checked once, stalling for this one frame
+	if (validatingLightClusters && clusterReadbackBuffer != VK_NULL_HANDLE)
+	{
+		lightClustersValidated = true;
+		if (!submissionQueue.Wait(frame.submissionValue))
+			return false;
+		ValidateLightClusters();
+	}
+	return true;
+}
+
+bool Renderer::SubmitFrame(FrameResources& frame, VkCommandBuffer cmdBuffer, VkPipelineStageFlags acquireWaitStage, uint32_t imageIndex)
+{
+	//Submitted and presented by the submission thread, errors come back on a later frame
+	if (submissionQueue.GetLastError() != VK_SUCCESS)
 	{
 		Debug::Log("Submit queue", DebugLevel::Error);
 		return false;
 	}
-
-	VkPresentInfoKHR presentInfo{};
-	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-	presentInfo.pNext = nullptr;
-	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = &renderingFinishedSemaphore;
-	presentInfo.swapchainCount = 1;
-	presentInfo.pSwapchains = &swapchain;
-	presentInfo.pImageIndices = &imageIndex;
-	presentInfo.pResults = nullptr;
-	
-	err = vkQueuePresentKHR(primaryQueue, &presentInfo);
-	if (err != VK_SUCCESS)
+	auto err = submissionQueue.GetLastPresentResult();
+	if (err != VK_SUCCESS && err != VK_SUBOPTIMAL_KHR)
 	{
 		Debug::Log("Present Queue", DebugLevel::Error);
 		return false;
 	}
 
+	SubmitBatch* batch = new SubmitBatch();
+	batch->commandBuffers.push_back(cmdBuffer);
+	batch->waitSemaphores.push_back(frame.imageAvailableSemaphore);
+	batch->waitStages.push_back(acquireWaitStage);
+	batch->signalSemaphores.push_back(frame.renderingFinishedSemaphore);
+	batch->swapchain = swapchain;
+	batch->imageIndex = imageIndex;
+	frame.submissionValue = submissionQueue.Submit(batch);
+
+	frameIndex = (frameIndex + 1) % framesInFlight;
+
 	return true;
 }
 
-bool Renderer::RenderVertices()
+void Renderer::BenchmarkRecording()
 {
-	uint32_t timeout = 30; // ms
-	VkSemaphore imageAvailableSemaphore, renderingFinishedSemaphore;
-	VkSemaphoreCreateInfo semaphoreCreatInfo{};
-	semaphoreCreatInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	semaphoreCreatInfo.pNext = nullptr;
-	semaphoreCreatInfo.flags = 0;
-	auto err = vkCreateSemaphore(defaultDevice, &semaphoreCreatInfo, nullptr, &imageAvailableSemaphore);
-	vkCreateSemaphore(defaultDevice, &semaphoreCreatInfo, nullptr, &renderingFinishedSemaphore);
-	uint32_t imageIndex;
+	const uint32_t iterations = 50;
 
-	VkFenceCreateInfo fenceCreateInfo{};
-	fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	fenceCreateInfo.pNext = nullptr;
-	fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-	VkFence fence{};
-	err = vkCreateFence(defaultDevice, &fenceCreateInfo, nullptr, &fence);
-
-	err = vkAcquireNextImageKHR(defaultDevice, swapchain, timeout, imageAvailableSemaphore, nullptr, &imageIndex);
-
-	if (!CreateFrameBuffer(imageIndex))
-		return false;
+	submissionQueue.WaitIdle();
+	UpdateBatchUniforms(0);
+	for (uint32_t threadCount = 1; threadCount <= recordThreadCount; ++threadCount)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < iterations; ++i)
+		{
+			RecordSecondaryCommandBuffers(frames[0], GetFrameBuffer(0), threadCount);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
 
-	VkCommandBufferBeginInfo cmdBufferBeginInfo{};
-	cmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	cmdBufferBeginInfo.pNext = nullptr;
-	cmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-	cmdBufferBeginInfo.pInheritanceInfo = nullptr;
+		double milliseconds = std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+		Debug::Log(std::string("Record benchmark: ") + ToString(threadCount) + " threads, " + std::to_string(milliseconds) + " ms per frame");
+	}
+}
 
-	err = vkBeginCommandBuffer(commandBuffer, &cmdBufferBeginInfo);
-	if (err != VK_SUCCESS)
+void Renderer::BenchmarkDrawData()
+{
+	const uint32_t iterations = 50;
+	const char* pathNames[DrawDataPathCount] = { "push constants", "push descriptors", "dynamic uniform buffer" };
+
+	submissionQueue.WaitIdle();
+	uint32_t drawCount = renderObjects.size();
+	if (drawCount == 0)
+		return;
+
+	//Every draw gets its own slice of uniform data, as objects moving independently would
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(defaultPhysicalDevice, &properties);
+	VkDeviceSize alignment = properties.limits.minUniformBufferOffsetAlignment;
+	VkDeviceSize drawStride = (sizeof(DrawData) + alignment - 1) / alignment * alignment;
+
+	VkBuffer drawBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory drawMemory = VK_NULL_HANDLE;
+	if (!CreateBuffer(drawStride * drawCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, drawBuffer, drawMemory))
 	{
-		Debug::Log("Begin Command buffer", DebugLevel::Error);
-		return false;
+		Debug::Log("Create draw data buffer", DebugLevel::Error);
+		return;
 	}
-	
-	VkClearValue clearColour = { 1.0f, 0.8f, 0.4f, 0.0f };
 
-	VkImageSubresourceRange imageSubresourceRange{};
-	imageSubresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	imageSubresourceRange.baseMipLevel = 0;
-	imageSubresourceRange.levelCount = 1;
-	imageSubresourceRange.baseArrayLayer = 0;
-	imageSubresourceRange.layerCount = 1;
+	void* memPtr = nullptr;
+	auto err = vkMapMemory(defaultDevice, drawMemory, 0, VK_WHOLE_SIZE, 0, &memPtr);
+	if (err == VK_SUCCESS)
+	{
+		uint8_t* drawBufferData = static_cast<uint8_t*>(memPtr);
+
+		DescriptorSetBindings bindings(drawDataSetLayout);
+		bindings.BindBuffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, drawBuffer, 0, sizeof(DrawData));
+		VkDescriptorSet drawDescriptorSet = drawDataSetLayout != VK_NULL_HANDLE ? descriptorAllocator.GetCachedSet(bindings) : VK_NULL_HANDLE;
 
-	
-	//VkImageMemoryBarrier barrier{};
-	//barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	//barrier.pNext = nullptr;
-	//barrier.srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	//barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-	//barrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	//barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	//barrier.srcQueueFamilyIndex = defaultQueueFamilyIndex;
-	//barrier.dstQueueFamilyIndex = defaultQueueFamilyIndex;
-	//barrier.image = swapchainImages[imageIndex];
-	//barrier.subresourceRange = imageSubresourceRange;
-	//
-	//VkImageMemoryBarrier barrier2 = barrier;
-	//barrier2.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
-	//barrier2.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	//barrier2.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	//barrier2.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	//
-	//vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT , VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-	
+		//Only the CPU cost of recording is measured: the command buffer is never submitted, so this says nothing about
+		//how fast the GPU consumes each path's draws
+		VkCommandPool pool = frames[0].workerCommandPools[0];
+		VkCommandBuffer cmdBuffer = frames[0].workerCommandBuffers[0];
+		for (uint32_t path = 0; path < DrawDataPathCount; ++path)
+		{
+			VkPipeline drawPipeline = drawDataPipelines[path] ? pipelineManager.WaitForPipeline(drawDataPipelines[path]) : VK_NULL_HANDLE;
+			if (drawPipeline == VK_NULL_HANDLE || (path == DrawDataDynamicUniform && drawDescriptorSet == VK_NULL_HANDLE))
+			{
+				Debug::Log(std::string("Draw data benchmark: ") + pathNames[path] + " unavailable", DebugLevel::Warning);
+				continue;
+			}
 
-	VkRect2D renderArea{};
-	renderArea.offset.x = renderArea.offset.y = 0;
-	renderArea.extent.width = width;
-	renderArea.extent.height = height;
-
-	VkRenderPassBeginInfo renderPassBeginInfo{
-		VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-		nullptr,
-		renderPass,
-		frameBuffer,
-		renderArea,
-		1, &clearColour
-	};
+			VkPipelineLayout layout = drawDataPipelineLayouts[path];
+			auto start = std::chrono::high_resolution_clock::now();
+			for (uint32_t i = 0; i < iterations; ++i)
+			{
+				if (!BeginSecondaryCommandBuffer(pool, cmdBuffer, GetFrameBuffer(0)))
+					break;
+
+				vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, drawPipeline);
+				MeshObject* boundMesh = nullptr;
+				for (uint32_t d = 0; d < drawCount; ++d)
+				{
+					const RenderObject& object = renderObjects[d];
+					DrawData drawData;
+					memcpy(drawData.transform, object.instance.transform, sizeof(drawData.transform));
+					memcpy(drawData.colour, object.mesh->colour, sizeof(drawData.colour));
+
+					VkDeviceSize drawOffset = drawStride * d;
+					if (path == DrawDataPushConstants)
+					{
+						vkCmdPushConstants(cmdBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(drawData), &drawData);
+					}
+					else if (path == DrawDataPushDescriptor)
+					{
+						memcpy(drawBufferData + drawOffset, &drawData, sizeof(drawData));
+
+						VkDescriptorBufferInfo bufferInfo{};
+						bufferInfo.buffer = drawBuffer;
+						bufferInfo.offset = drawOffset;
+						bufferInfo.range = sizeof(DrawData);
+
+						VkWriteDescriptorSet write{};
+						write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+						write.pNext = nullptr;
+						write.dstSet = VK_NULL_HANDLE;	//ignored, the set is the command buffer's
+						write.dstBinding = 0;
+						write.dstArrayElement = 0;
+						write.descriptorCount = 1;
+						write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+						write.pBufferInfo = &bufferInfo;
+						pfnCmdPushDescriptorSet(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, pushDescriptorSetIndex, 1, &write);
+					}
+					else
+					{
+						memcpy(drawBufferData + drawOffset, &drawData, sizeof(drawData));
+
+						uint32_t dynamicOffset = static_cast<uint32_t>(drawOffset);
+						vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, batchSetIndex, 1, &drawDescriptorSet, 1, &dynamicOffset);
+					}
+
+					if (object.mesh != boundMesh)
+					{
+						VkDeviceSize offset = 0;
+						vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &object.mesh->vertexBuffer, &offset);
+						boundMesh = object.mesh;
+					}
+					vkCmdDraw(cmdBuffer, object.mesh->vertexCount, 1, 0, 0);
+				}
+
+				vkEndCommandBuffer(cmdBuffer);
+			}
+			auto end = std::chrono::high_resolution_clock::now();
 
-	//Begin 
-	vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+			double nanoseconds = std::chrono::duration<double, std::nano>(end - start).count();
+			double nanosecondsPerDraw = nanoseconds / (double(drawCount) * iterations);
+			Debug::Log(std::string("Draw data benchmark: ") + pathNames[path] + ", " + std::to_string(nanosecondsPerDraw) + " ns CPU recording per draw, not submitted");
+		}
 
-	VkViewport viewport;
-	viewport.x = viewport.y = 0;
-	viewport.width = width;
-	viewport.height = height;
-	viewport.minDepth = 0;
-	viewport.maxDepth = 1.0f;
+		vkUnmapMemory(defaultDevice, drawMemory);
+	}
+	else
+	{
+		Debug::Log("Map draw data memory", DebugLevel::Error);
+	}
 
-	VkRect2D scissors{};
-	scissors.offset.x = scissors.offset.y = 0;
-	scissors.extent.width = width;
-	scissors.extent.height = height;
-	if (enabledDynamicState)
+	//The cached set would otherwise outlive the buffer it points at
+	descriptorAllocator.EvictCachedSets(drawBuffer);
+	vkDestroyBuffer(defaultDevice, drawBuffer, nullptr);
+	vkFreeMemory(defaultDevice, drawMemory, nullptr);
+}
+
+void Renderer::BenchmarkPipelinePermutations()
+{
+	//Every combination of the state extended dynamic state covers, for one pair of shaders
+	const uint8_t cullModes[] = { VK_CULL_MODE_NONE, VK_CULL_MODE_FRONT_BIT, VK_CULL_MODE_BACK_BIT };
+	const uint8_t frontFaces[] = { VK_FRONT_FACE_COUNTER_CLOCKWISE, VK_FRONT_FACE_CLOCKWISE };
+	const uint8_t topologies[] = { VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP };
+	const uint8_t depthCompareOps[] = { VK_COMPARE_OP_LESS, VK_COMPARE_OP_LESS_OR_EQUAL };
+
+	vector<ManagedPipeline*> permutations;
+	size_t pipelinesBefore = pipelineManager.GetPipelineCount();
+	auto start = std::chrono::high_resolution_clock::now();
+	for (auto cullMode : cullModes)
+		for (auto frontFace : frontFaces)
+			for (auto topology : topologies)
+				for (auto depthCompareOp : depthCompareOps)
+					for (uint8_t depthTest = 0; depthTest < 2; ++depthTest)
+						for (uint8_t depthWrite = 0; depthWrite < 2; ++depthWrite)
+							for (uint8_t blend = 0; blend < 2; ++blend)
+							{
+								PipelineDescription permutation = sceneDescription;
+								permutation.SetShaders("vert.spv", "frag.spv");
+								permutation.cullMode = cullMode;
+								permutation.frontFace = frontFace;
+								permutation.topology = topology;
+								permutation.depthCompareOp = depthCompareOp;
+								permutation.depthTestEnable = depthTest;
+								permutation.depthWriteEnable = depthWrite;
+								permutation.blendEnable = blend;
+								permutations.push_back(pipelineManager.RequestPipeline(permutation));
+							}
+
+	for (auto permutation : permutations)
 	{
-		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-		vkCmdSetScissor(commandBuffer, 0, 1, &scissors);
+		pipelineManager.WaitForPipeline(permutation);
 	}
+	double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
 
-	VkDeviceSize offset;
-	vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffer, &offset);
-	vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+	size_t built = pipelineManager.GetPipelineCount() - pipelinesBefore;
+	Debug::Log(std::string("Permutation benchmark: ") + std::to_string(permutations.size()) + " descriptions needed " + std::to_string(built) + " new pipelines, " + std::to_string(milliseconds) + " ms");
+	pipelineManager.LogStatistics();
+}
+
+int Renderer::Run()
+{
+	auto lastCacheSave = std::chrono::steady_clock::now();
 
-	vkCmdEndRenderPass(commandBuffer);
+	MSG msg{};
+	while (msg.message != WM_QUIT)
+	{
+		if (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE))
+		{
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+			continue;
+		}
 
-	//End
-	//vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier2); 
-	err = vkEndCommandBuffer(commandBuffer);
+		if (!RenderParallel())
+			break;
 
-	VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
-	VkSubmitInfo submitInfo{};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pNext = nullptr;
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &imageAvailableSemaphore;
-	submitInfo.pWaitDstStageMask = &waitStageMask;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &commandBuffer;
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &renderingFinishedSemaphore; //TODO: we need different semaphores here
-	
-	err = vkQueueSubmit(primaryQueue, 1, &submitInfo, nullptr);
-	
-	VkPresentInfoKHR presentInfo{};
-	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-	presentInfo.pNext = nullptr;
-	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = &renderingFinishedSemaphore;
-	presentInfo.swapchainCount = 1;
-	presentInfo.pSwapchains = &swapchain;
-	presentInfo.pImageIndices = &imageIndex;
-	presentInfo.pResults = nullptr;
-	
-	err = vkQueuePresentKHR(primaryQueue, &presentInfo);
+		//Also saved at shutdown, this covers crashes after new pipelines were built
+		if (pipelineManager.GetCreatedCount() != pipelineCreatedCountSaved)
+			pipelineCacheDirty = true;
+		auto now = std::chrono::steady_clock::now();
+		if (pipelineCacheDirty && now - lastCacheSave > std::chrono::seconds(pipelineCacheSaveInterval))
+		{
+			SavePipelineCache();
+			lastCacheSave = now;
+		}
+	}
 
-	return true;
+	return static_cast<int>(msg.wParam);
 }
 
 LRESULT CALLBACK Renderer::WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
@@ -1444,6 +3661,12 @@ LRESULT CALLBACK Renderer::WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lP
 bool Renderer::Init(HINSTANCE hInstance)
 {
 	winAppInstance = hInstance;
+
+#ifdef BUILD_ENABLE_RENDER_BENCHMARKS
+	JobSystem::Benchmark();
+#endif
+	jobSystem.Start(std::thread::hardware_concurrency());
+
 	//TODO Error checking
 	if (!GetInstanceLayers())
 		return false;
@@ -1462,26 +3685,71 @@ bool Renderer::Init(HINSTANCE hInstance)
 	if(!CreateDevice())
 		return false;
 
+	//From here on only the submission thread touches primaryQueue
+	if (!submissionQueue.Start(defaultDevice, primaryQueue, timelineSemaphoresSupported))
+		return false;
+
 	if(!CreateSwapchain())
 		return false; 
-	if(!CreateCommandBuffers())
-		return false;
 	if(!CreateImageView())
 		return false;
+	if (!ChooseDepthFormat() || !ChooseSampleCount() || !CreateAttachments())
+		return false;
 
-	//RenderClearScreen();
-
-	if(!CreateRenderPass())
+	//Dynamic rendering has no render pass or framebuffers to create
+	if (!dynamicRenderingSupported && !CreateRenderPass())
 		return false;
 	
+	if (!CreatePipelineCache())
+		return false;
+	if (!shaderLibrary.Init(defaultDevice, shaderPackFilename))
+		return false;
+
+	descriptorAllocator.Init(defaultDevice, framesInFlight);
+	renderGraph.Init(defaultDevice, defaultPhysicalDevice, pfnCmdPipelineBarrier2);
+	if (bindlessSupported && !bindlessHeap.Init(defaultDevice, bindlessBufferCapacity, bindlessImageCapacity))
+		return false;
+
+	auto pipelineStart = std::chrono::high_resolution_clock::now();
 	if(!CreatePipeline())
 		return false;
+	if (!CreateCullPipeline())
+		return false;
+	if (!CreateLightCullPipeline())
+		return false;
+	//Requests only queue compiles, so wait for the graphics pipelines requested so far for the time to cover them.
+	//Only here, pipelines requested later still compile in the background.
+	pipelineManager.WaitIdle();
+	double pipelineMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - pipelineStart).count();
+	Debug::Log(std::string("Pipeline setup took ") + std::to_string(pipelineMilliseconds) + " ms with a " + (pipelineCacheWarm ? "warm" : "cold") + " cache, including the graphics pipelines it prewarmed");
+	//The compute pipelines above went through the cache too, graphics pipelines are picked up from the PipelineManager's count
+	pipelineCacheDirty = true;
+
+#ifdef BUILD_ENABLE_SHADER_HOT_RELOAD
+	StartShaderHotReload();
+#endif
 
 	if(!CreateTri())
 		return false;
 
-	RenderWithRenderPass();
-	//RenderVertices();
+	if (!CreateScene())
+		return false;
+	if (!BuildInstanceBatches())
+		return false;
+	if (!CreateLightClusterBuffers())
+		return false;
+
+	if (!dynamicRenderingSupported && !CreateFrameBuffers())
+		return false;
+	if (!CreateFrameResources())
+		return false;
+
+#ifdef BUILD_ENABLE_RENDER_BENCHMARKS
+	BenchmarkRecording();
+	BenchmarkDrawData();
+	BenchmarkPipelinePermutations();
+#endif
+
 	return true;
 }
 
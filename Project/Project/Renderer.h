@@ -1,8 +1,22 @@
 #pragma once
 #define BUILD_ENABLE_VULKABN_DEBUG
+//#define BUILD_ENABLE_RENDER_BENCHMARKS
+#define BUILD_ENABLE_SHADER_HOT_RELOAD
 #define VK_USE_PLATFORM_WIN32_KHR
 //#include "vulkan\vk_cpp.hpp"
 #include "vulkan\vulkan.h"
+#include "BindlessHeap.h"
+#include "DescriptorAllocator.h"
+#include "JobSystem.h"
+#include "LightClusters.h"
+#include "MeshObject.h"
+#include "PipelineManager.h"
+#include "RenderGraph.h"
+#include "RenderObject.h"
+#include "ShaderConstants.h"
+#include "ShaderLibrary.h"
+#include "ShaderWatcher.h"
+#include "SubmissionQueue.h"
 #include <vector>
 using namespace std;
 
@@ -43,7 +57,14 @@ protected:
 	
 	VkDevice			defaultDevice { VK_NULL_HANDLE };
 	bool				CreateDevice();
+	vector<VkExtensionProperties> availableDeviceExtensions;
+	bool				HasDeviceExtension(const char* extensionName);
 	VkQueue				primaryQueue{ VK_NULL_HANDLE };
+	SubmissionQueue		submissionQueue;	//owns primaryQueue once started
+
+	//VK_KHR_timeline_semaphore, the submission queue falls back to fences without it
+	bool				enableTimelineSemaphores { true };	//used when the device supports it
+	bool				timelineSemaphoresSupported { false };
 
 	HINSTANCE			winAppInstance;
 	HWND				wnd;
@@ -62,39 +83,347 @@ protected:
 	vector<VkImageView> imageViews;
 	bool				CreateImageView();
 
-	VkCommandPool		commandPool { VK_NULL_HANDLE };
-	const uint32_t		bufferCount { 1 };
-	VkCommandBuffer		commandBuffer { VK_NULL_HANDLE };
-	bool CreateCommandBuffers();
-
 	bool RecreateSwapChainAndBuffers();
 
 	VkRenderPass renderPass;
 	bool CreateRenderPass();
 
-	VkFramebuffer frameBuffer;
-	bool CreateFrameBuffer(uint32_t imageIndex);
+	bool CreateFrameBuffer(uint32_t imageIndex, VkFramebuffer& outFrameBuffer);
+	vector<VkFramebuffer> frameBuffers;	//one per swapchain image
+	bool CreateFrameBuffers();
+	VkFramebuffer GetFrameBuffer(uint32_t imageIndex) const { return imageIndex < frameBuffers.size() ? frameBuffers[imageIndex] : VK_NULL_HANDLE; }
+
+	//One depth buffer for every frame in flight, their passes run one after another on the one queue. It is cleared
+	//on load and never stored, so it can live in lazily allocated memory that a tiler never backs.
+	VkFormat			depthFormat { VK_FORMAT_UNDEFINED };
+	VkImageAspectFlags	depthAspect { 0 };
+	VkImage				depthImage { VK_NULL_HANDLE };
+	VkDeviceMemory		depthMemory { VK_NULL_HANDLE };
+	VkImageView			depthImageView { VK_NULL_HANDLE };
+	bool ChooseDepthFormat();
+
+	//MSAA: the scene is drawn into multisampled colour and depth, and the colour resolved into the swapchain image as
+	//the pass ends. Both are transient like the depth buffer, so on a tiler the samples never leave tile memory.
+	uint32_t			msaaSamples { 4 };	//2, 4 or 8, lowered to what the device supports. 1 for none.
+	VkSampleCountFlagBits	sampleCount { VK_SAMPLE_COUNT_1_BIT };
+	VkImage				msaaColourImage { VK_NULL_HANDLE };
+	VkDeviceMemory		msaaColourMemory { VK_NULL_HANDLE };
+	VkImageView			msaaColourImageView { VK_NULL_HANDLE };
+	bool ChooseSampleCount();
+
+	bool CreateTransientAttachment(VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect, VkImage& outImage, VkDeviceMemory& outMemory, VkImageView& outImageView);
+	bool CreateAttachments();	//depth, multisampled colour with MSAA and the G-buffer when deferred
+	void DestroyAttachments();
+	uint32_t GetClearValues(VkClearValue* outClearValues) const;	//in the render pass's attachment order, up to 4
+
+	//Depth pre-pass: every draw first lays down depth with colour writes off, then the colour pass tests against it
+	//without writing, so each pixel is shaded once. Worth it when fragments are expensive and the scene overlaps.
+	bool				enableDepthPrepass { false };
+	PipelineDescription	prepassDescription;	//the fixed function state the pre-pass is requested with
+
+	//Deferred shading: the scene writes albedo, normal and depth in one subpass, and a second lights each pixel once
+	//with a fullscreen triangle that reads them as input attachments. The G-buffer never leaves tile memory on a tiler,
+	//so it is transient like depth. Needs a render pass, so dynamic rendering and MSAA are off while it is on.
+	struct DeferredLight
+	{
+		float		position[4];	//clip space, w is the radius
+		float		colour[4];
+	};
+	static const uint32_t	deferredLightCount { 3 };
+	struct DeferredLightingConstants	//push constants, matches DeferredLighting.frag
+	{
+		DeferredLight	lights[deferredLightCount];
+		float		ambient[4];
+		float		viewportSize[2];
+	};
+	static const uint32_t	gBufferCount { 2 };	//albedo, normal
+	const VkFormat			gBufferFormats[gBufferCount] { VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_A2B10G10R10_UNORM_PACK32 };
+	bool					enableDeferred { false };
+	VkImage					gBufferImages[gBufferCount] {};
+	VkDeviceMemory			gBufferMemory[gBufferCount] {};
+	VkImageView				gBufferImageViews[gBufferCount] {};
+	PipelineDescription		lightingDescription;
+	ManagedPipeline*		lightingPipeline { nullptr };
+	VkPipelineLayout		lightingPipelineLayout { VK_NULL_HANDLE };
+	VkDescriptorSetLayout	lightingSetLayout { VK_NULL_HANDLE };	//the input attachments
+	DeferredLightingConstants	deferredLighting;
+	bool CreateDeferredRenderPass();
+	bool CreateLightingPipeline(uint8_t renderPassIndex);
+	void RecordDeferredLighting(VkCommandBuffer cmdBuffer);	//the second subpass, inline
 
-	bool CreateShader(const char* filename, VkShaderModule& shaderModule);
-	VkPipeline pipeline;
+	//VK_KHR_dynamic_rendering, chosen at init: passes render straight to the swapchain's image views with the
+	//layout transitions recorded explicitly, so no render pass or framebuffers are created
+	bool				enableDynamicRendering { true };	//used when the device supports it
+	bool				dynamicRenderingSupported { false };
+	PFN_vkCmdBeginRenderingKHR	pfnCmdBeginRendering { nullptr };
+	PFN_vkCmdEndRenderingKHR	pfnCmdEndRendering { nullptr };
+
+	//Barriers and layout transitions are worked out by the render graph from what each pass declares it uses,
+	//recorded with VK_KHR_synchronization2 where the device has it
+	bool				enableSynchronization2 { true };	//used when the device supports it
+	bool				synchronization2Supported { false };
+	PFN_vkCmdPipelineBarrier2KHR	pfnCmdPipelineBarrier2 { nullptr };
+	RenderGraph			renderGraph;
+
+	//Persisted between runs, so pipelines are not compiled from scratch on every launch
+	const char*			pipelineCacheFilename { "pipeline.cache" };
+	const uint32_t		pipelineCacheSaveInterval { 60 };	//seconds
+	VkPipelineCache		pipelineCache { VK_NULL_HANDLE };
+	bool				pipelineCacheWarm { false };
+	bool				pipelineCacheDirty { false };
+	uint64_t			pipelineCreatedCountSaved { 0 };	//the PipelineManager's created count when the cache was last saved
+	bool CreatePipelineCache();
+	bool SavePipelineCache();
+
+	//Every shader module comes from here, mapped from a pack or loose SPIR-V
+	const char*			shaderPackFilename { "shaders.pack" };
+	ShaderLibrary		shaderLibrary;
+
+	const char*			pipelineManifestFilename { "pipelines.manifest" };	//descriptions to prewarm next run
+	PipelineManager		pipelineManager;
+	bool				enableGraphicsPipelineLibrary { true };		//used when the device supports fast linking
+	bool				graphicsPipelineLibrarySupported { false };
+	DescriptorAllocator	descriptorAllocator;
+	ManagedPipeline*	instancedPipeline { nullptr };
 	bool CreatePipeline();
 
-	bool enabledDynamicState{ true };
+	//Bindless (VK_EXT_descriptor_indexing): every buffer and image sits in one heap, bound once per command buffer,
+	//and draws pass the indices of what they read in push constants. Pipelines with the classic per-batch set still work alongside.
+	struct BindlessDrawConstants	//push constants, matches FlatColourBindless.vert
+	{
+		uint32_t	instanceBuffer;
+		uint32_t	colourBuffer;
+		uint32_t	colourIndex;	//in vec4s
+	};
+	bool				enableBindless { true };	//used when the device supports it
+	bool				bindlessSupported { false };
+	uint32_t			bindlessBufferCapacity { 0 };
+	uint32_t			bindlessImageCapacity { 0 };
+	const uint32_t		bindlessSetIndex { 1 };		//after the batch set, so a pipeline can use both
+	BindlessHeap		bindlessHeap;
+	VkPipelineLayout	bindlessPipelineLayout { VK_NULL_HANDLE };
+	ManagedPipeline*	bindlessPipeline { nullptr };
+
+	//Per draw data for objects drawn one at a time. It fits in push constants, the fast path; bigger data can have its
+	//buffer range pushed with VK_KHR_push_descriptor rather than allocating a set, the classic path is a dynamic uniform buffer.
+	struct DrawData	//matches the FlatColourPush*.vert and FlatColourDynamicUniform.vert shaders, std140
+	{
+		float		transform[16];
+		float		colour[4];
+	};
+	enum DrawDataPath
+	{
+		DrawDataPushConstants,
+		DrawDataPushDescriptor,
+		DrawDataDynamicUniform,
+		DrawDataPathCount
+	};
+	bool				pushDescriptorSupported { false };
+	const uint32_t		pushDescriptorSetIndex { 2 };	//after the batch and bindless sets
+	PFN_vkCmdPushDescriptorSetKHR pfnCmdPushDescriptorSet { nullptr };
+	ManagedPipeline*	drawDataPipelines[DrawDataPathCount] {};
+	VkPipelineLayout	drawDataPipelineLayouts[DrawDataPathCount] {};
+	VkDescriptorSetLayout	drawDataSetLayout { VK_NULL_HANDLE };	//the dynamic uniform buffer's set
+
+#ifdef BUILD_ENABLE_SHADER_HOT_RELOAD
+	//Edited shaders are recompiled, and pipelines using them rebuilt and swapped in between frames
+	ShaderWatcher		shaderWatcher;
+	bool StartShaderHotReload();
+#endif
+
+	bool enabledDynamicState{ true };	//pipelines from pipelineManager always expect dynamic viewport and scissor
+
+	//VK_EXT_extended_dynamic_state(3): rasterization, depth and blend enable are set while recording, so pipelines
+	//differing only in them are built once. The scene's state is recorded into every secondary command buffer.
+	bool				enableExtendedDynamicState { true };	//used when the device supports it
+	bool				extendedDynamicStateSupported { false };
+	bool				dynamicBlendEnableSupported { false };
+	PipelineDescription	sceneDescription;	//the fixed function state every scene pipeline is requested with
 
 
-	bool AllocateMemory(VkBuffer& buffer, VkDeviceMemory& deviceMemory);
+	bool AllocateMemory(VkBuffer& buffer, VkDeviceMemory& deviceMemory, VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+	bool CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& deviceMemory);
+	bool UploadBuffer(VkDeviceMemory deviceMemory, const void* data, VkDeviceSize size);
 	VkBuffer vertexBuffer;
+	MeshObject triMesh;
+	MeshObject quantizedTriMesh;	//the same triangle with R16G16B16A16_SNORM positions
 	bool CreateTri();
+	void DestroyMesh(MeshObject& mesh);
+
+	//Automatic instancing: RenderObjects sharing a mesh and pipeline become one draw
+	struct InstanceBatch
+	{
+		MeshObject*			mesh;
+		ManagedPipeline*	pipeline;
+		ManagedPipeline*	prepassPipeline;	//depth only variant, with enableDepthPrepass
+		uint32_t			firstInstance;
+		uint32_t			instanceCount;
+		uint32_t			firstCullDraw;		//with gpuCulling
+		uint32_t			cullDrawCount;
+	};
+	vector<RenderObject>	renderObjects;
+	vector<InstanceBatch>	instanceBatches;
+	float					GetViewDepth(const RenderObject& renderObject) const { return renderObject.instance.transform[14]; }	//no camera, transforms are to clip space
+	ManagedPipeline*		RequestPrepassPipeline(ManagedPipeline* colourPipeline);
+	ManagedPipeline*		RequestQuantizedPipeline(ManagedPipeline* scenePipeline, float positionScale);
+	ManagedPipeline*		quantizedPipeline { nullptr };	//the scene pipeline's permutation for quantizedTriMesh
+	bool					IsBindless(const ManagedPipeline* scenePipeline) const { return bindlessPipeline != nullptr && (scenePipeline == bindlessPipeline || scenePipeline == quantizedPipeline); }
+	VkBuffer				instanceBuffer { VK_NULL_HANDLE };
+	VkDeviceMemory			instanceMemory { VK_NULL_HANDLE };
+	VkDeviceSize			instanceBufferSize { 0 };
+	uint32_t				instanceBufferIndex { BindlessHeap::invalidIndex };	//in the bindless heap
+
+	//Per batch uniforms, a region per frame in flight. Every batch draws with the same cached set,
+	//picking its uniforms with a dynamic offset.
+	struct BatchUniforms	//matches BatchData in the vertex shaders, std140
+	{
+		float		colour[4];
+	};
+	const uint32_t			batchSetIndex { 0 };	//set index, uniform buffers in it are dynamic
+	VkPipelineLayout		batchPipelineLayout { VK_NULL_HANDLE };	//shared by the graphics pipelines
+	VkDescriptorSetLayout	batchSetLayout { VK_NULL_HANDLE };
+	VkBuffer				batchUniformBuffer { VK_NULL_HANDLE };
+	VkDeviceMemory			batchUniformMemory { VK_NULL_HANDLE };
+	uint8_t*				batchUniformData { nullptr };	//persistently mapped
+	VkDeviceSize			batchUniformStride { 0 };
+	VkDeviceSize			batchUniformFrameSize { 0 };
+	VkDescriptorSet			batchDescriptorSet { VK_NULL_HANDLE };	//for the frame being recorded
+	uint32_t				batchUniformFrameOffset { 0 };
+	uint32_t				batchUniformBufferIndex { BindlessHeap::invalidIndex };	//in the bindless heap
+	bool CreateScene();
+	bool BuildInstanceBatches();
+	bool CreateBatchUniforms();
+	void DestroyBatchUniforms();
+	bool UpdateBatchUniforms(uint32_t frame);
+	void RecordInstanceRange(VkCommandBuffer cmdBuffer, uint32_t rangeBegin, uint32_t rangeEnd, bool depthPrepass = false);
+
+	//GPU culling: per cull draw, a compute pass packs the visible objects' instance data in their sorted order and writes
+	//one instanced indexed indirect draw of them. Batches are split into cull draws where the recording ranges split them,
+	//so every range draws only its own, each with its own count.
+	struct CullObject	//matches Cull.comp, std430, in the same order as the instances
+	{
+		float		boundingSphere[4];
+	};
+	struct CullDraw		//matches Cull.comp, std430
+	{
+		uint32_t	firstObject;	//also where its instances start in the visible instance buffer
+		uint32_t	objectCount;
+		uint32_t	indexCount;
+		uint32_t	firstIndex;
+		int32_t		vertexOffset;
+	};
+	struct CullParams	//push constants
+	{
+		float		frustumPlanes[6][4];
+		uint32_t	drawCount;
+	};
+	const uint32_t			cullGroupSize { 64 };
+	bool					gpuCulling { false };
+	bool					drawIndirectCountSupported { false };
+	PFN_vkCmdDrawIndexedIndirectCountKHR pfnCmdDrawIndexedIndirectCount { nullptr };
+	VkDescriptorSetLayout	cullSetLayout { VK_NULL_HANDLE };
+	VkPipelineLayout		cullPipelineLayout { VK_NULL_HANDLE };
+	VkPipeline				cullPipeline { VK_NULL_HANDLE };
+	VkBuffer				cullObjectBuffer { VK_NULL_HANDLE };
+	VkDeviceMemory			cullObjectMemory { VK_NULL_HANDLE };
+	vector<CullDraw>		cullDraws;
+	VkBuffer				cullDrawBuffer { VK_NULL_HANDLE };
+	VkDeviceMemory			cullDrawMemory { VK_NULL_HANDLE };
+	VkBuffer				visibleInstanceBuffer { VK_NULL_HANDLE };	//read in place of instanceBuffer when culling
+	VkDeviceMemory			visibleInstanceMemory { VK_NULL_HANDLE };
+	uint32_t				visibleInstanceBufferIndex { BindlessHeap::invalidIndex };	//in the bindless heap
+	VkBuffer				drawCommandBuffer { VK_NULL_HANDLE };	//one draw per cull draw
+	VkDeviceMemory			drawCommandMemory { VK_NULL_HANDLE };
+	VkBuffer				drawCountBuffer { VK_NULL_HANDLE };	//one count per cull draw, 0 or 1
+	VkDeviceMemory			drawCountMemory { VK_NULL_HANDLE };
+	uint32_t				cullObjectCount { 0 };
+	uint32_t				cullBufferCapacity { 0 };	//in objects, which cull draws never outnumber
+	bool CreateCullPipeline();
+	bool UpdateCullBuffers(const vector<CullObject>& cullObjects);
+	void DestroyCullBuffers();
+	void RecordCulling(VkCommandBuffer cmdBuffer);
+	void AddCullPasses(RenderGraph::Resource& outVisibleInstances, RenderGraph::Resource& outDrawCommands, RenderGraph::Resource& outDrawCounts);	//invalidIndex without GPU culling
+
+	//Clustered forward lighting (see LightClusters.h): a compute pass bins the lights into froxels every frame and
+	//RenderObjects are drawn with FlatColourLit.frag, which loops over only its froxel's lights. Deferred lights its own way.
+	//With hostLightBinning the lists are binned on the CPU once and uploaded instead, as the lights never move.
+	struct ClusterParams	//matches LightCull.comp and FlatColourLit.frag, std140
+	{
+		uint32_t	gridSize[4];	//tiles across, down, depth slices, then the light count
+		float		viewportSize[4];
+	};
+	bool					enableClusteredLighting { true };
+	bool					validateLightClusters { false };	//reads the first frame's lists back and checks them against the CPU reference
+	bool					hostLightBinning { false };	//no light cull pass, LightClusters::Bin's lists are uploaded
+	bool					lightClustersValidated { false };
+	const uint32_t			clusterSetIndex { 3 };	//after the batch, bindless and push descriptor sets
+	const uint32_t			averageClusterLights { 32 };	//sizes the index list
+	LightClusters			lightClusters { 16, 9, 24 };
+	vector<ClusterLight>	clusterLights;
+	VkDescriptorSetLayout	lightCullSetLayout { VK_NULL_HANDLE };
+	VkPipelineLayout		lightCullPipelineLayout { VK_NULL_HANDLE };
+	VkPipeline				lightCullPipeline { VK_NULL_HANDLE };
+	VkBuffer				clusterParamsBuffer { VK_NULL_HANDLE };
+	VkDeviceMemory			clusterParamsMemory { VK_NULL_HANDLE };
+	VkBuffer				lightBuffer { VK_NULL_HANDLE };
+	VkDeviceMemory			lightMemory { VK_NULL_HANDLE };
+	VkBuffer				lightGridBuffer { VK_NULL_HANDLE };
+	VkDeviceMemory			lightGridMemory { VK_NULL_HANDLE };
+	VkBuffer				lightIndexBuffer { VK_NULL_HANDLE };	//the count, then the lists
+	VkDeviceMemory			lightIndexMemory { VK_NULL_HANDLE };
+	uint32_t				lightIndexCapacity { 0 };
+	VkBuffer				clusterReadbackBuffer { VK_NULL_HANDLE };	//the grid then the index buffer, with validateLightClusters
+	VkDeviceMemory			clusterReadbackMemory { VK_NULL_HANDLE };
+	VkDescriptorSetLayout	clusterSetLayout { VK_NULL_HANDLE };	//FlatColourLit.frag's
+	VkDescriptorSet			clusterDescriptorSet { VK_NULL_HANDLE };	//its buffers never change, so one cached set serves every frame
+	bool UsesClusteredLighting() const { return enableClusteredLighting && !enableDeferred; }
+	bool CreateLightCullPipeline();
+	bool CreateLightClusterBuffers();
+	bool UploadLightClusters();
+	void DestroyLightClusterBuffers();
+	void RecordLightCulling(VkCommandBuffer cmdBuffer);
+	void AddLightCullPasses(RenderGraph::Resource& outLightGrid, RenderGraph::Resource& outLightIndices);	//invalidIndex without clustered lighting
+	void AddLightClusterReadback(RenderGraph::Resource lightGrid, RenderGraph::Resource lightIndices);
+	bool ValidateLightClusters();
+
+
+	JobSystem jobSystem;
+
+	//Frames in flight, each with its own semaphores and command pools
+	struct FrameResources
+	{
+		uint64_t				submissionValue { 0 };	//its last submission, which must complete before the frame is reused
+		VkSemaphore				imageAvailableSemaphore { VK_NULL_HANDLE };
+		VkSemaphore				renderingFinishedSemaphore { VK_NULL_HANDLE };
+		VkCommandPool			commandPool { VK_NULL_HANDLE };
+		VkCommandBuffer			commandBuffer { VK_NULL_HANDLE };
+		vector<VkCommandPool>	workerCommandPools;		//one per recording thread
+		vector<VkCommandBuffer>	workerCommandBuffers;	//secondary, one per recording thread
+		vector<VkCommandBuffer>	workerPrepassCommandBuffers;	//secondary, the depth pre-pass's, with enableDepthPrepass
+	};
+	static const uint32_t	framesInFlight { 2 };
+	FrameResources			frames[framesInFlight];
+	uint32_t				frameIndex { 0 };
+	uint32_t				recordThreadCount { 1 };
+	bool CreateFrameResources();
+	void DestroyFrameResources();
 
-	bool RenderClearScreen();
-	bool RenderWithRenderPass();
-	bool RenderVertices();
+	bool BeginSecondaryCommandBuffer(VkCommandPool pool, VkCommandBuffer cmdBuffer, VkFramebuffer framebuffer);
+	bool RecordSecondaryCommandBuffer(VkCommandPool pool, VkCommandBuffer cmdBuffer, VkCommandBuffer prepassCmdBuffer, VkFramebuffer framebuffer, uint32_t rangeBegin, uint32_t rangeEnd);
+	bool RecordSecondaryCommandBuffers(FrameResources& frame, VkFramebuffer framebuffer, uint32_t threadCount);
+	uint32_t GetRecordRangeBegin(uint32_t range, uint32_t rangeCount) const { return uint64_t(renderObjects.size()) * range / rangeCount; }	//equal slices of the instances
+	bool RenderParallel();
+	bool SubmitFrame(FrameResources& frame, VkCommandBuffer cmdBuffer, VkPipelineStageFlags acquireWaitStage, uint32_t imageIndex);	//and presents
+	void BenchmarkRecording();
+	void BenchmarkDrawData();	//CPU recording cost per draw of each draw data path, nothing is submitted
+	void BenchmarkPipelinePermutations();
 
 public:
 	Renderer();
 	~Renderer();
 
 	bool Init(HINSTANCE hInstance);
+	int Run();
 
 	static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam);
 };
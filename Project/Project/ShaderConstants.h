@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+//Specialization constant ids, matching the layout(constant_id = N) declarations in the shaders.
+//One id space for every shader, so a single set of values can specialise both stages of a pipeline.
+enum ShaderConstant : uint32_t
+{
+	ShaderConstantQuantizedPositions	= 0,	//bool: positions are SNORM, scaled by ShaderConstantPositionScale
+	ShaderConstantPositionScale			= 1,	//float
+	ShaderConstantColourR				= 2,	//float, constant colour
+	ShaderConstantColourG				= 3,
+	ShaderConstantColourB				= 4,
+	ShaderConstantColourA				= 5,
+	ShaderConstantUniformColour			= 6,	//bool: colour from the per draw uniform buffer, ahead of ShaderConstantColour
+	ShaderConstantCount
+};
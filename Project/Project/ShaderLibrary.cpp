@@ -0,0 +1,468 @@
+#include <Windows.h>
+#include "ShaderLibrary.h"
+#include "Debug.h"
+#include "EmbeddedShaders.h"
+#include "Hash.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+	const uint32_t spirvMagic { 0x07230203 };
+	const uint32_t spirvHeaderSize { 5 * sizeof(uint32_t) };
+
+	const uint32_t packMagic { 0x4b415053 };	//"SPAK"
+	const uint32_t packVersion { 1 };
+	const uint32_t maxPackName { 64 };
+
+	struct PackHeader
+	{
+		uint32_t	magic;
+		uint32_t	version;
+		uint32_t	count;
+		uint32_t	padding;
+	};
+
+	struct PackEntry
+	{
+		char		name[maxPackName];
+		uint64_t	hash;
+		uint64_t	writeTime;
+		uint32_t	offset;		//from the start of the file, 4 byte aligned
+		uint32_t	size;
+	};
+
+	uint64_t ToUInt64(const FILETIME& fileTime)
+	{
+		return (uint64_t(fileTime.dwHighDateTime) << 32) | fileTime.dwLowDateTime;
+	}
+}
+
+ShaderLibrary::ShaderLibrary()
+{
+}
+
+ShaderLibrary::~ShaderLibrary()
+{
+	Destroy();
+}
+
+bool ShaderLibrary::Init(VkDevice shaderDevice, const char* shaderPackFilename)
+{
+	device = shaderDevice;
+	packFilename = shaderPackFilename ? shaderPackFilename : "";
+	if (packFilename.empty())
+		return true;
+
+	return LoadPack();
+}
+
+void ShaderLibrary::Destroy()
+{
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	for (auto& entry : modules)
+	{
+		vkDestroyShaderModule(device, entry.second.module, nullptr);
+	}
+	modules.clear();
+
+	//The pack is still mapped while the new one is written, so write it alongside and swap
+	if (packDirty && !packFilename.empty())
+	{
+		string tempFilename = packFilename + ".tmp";
+		bool written = WritePack(tempFilename.c_str());
+		UnmapFile(pack);
+		if (written && !MoveFileExA(tempFilename.c_str(), packFilename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		{
+			Debug::Log("Replace shader pack", DebugLevel::Error);
+			written = false;
+		}
+		//A partly written pack is never left lying around
+		if (!written)
+			DeleteFileA(tempFilename.c_str());
+	}
+	UnmapFile(pack);
+
+	blobs.clear();
+	packDirty = false;
+	device = VK_NULL_HANDLE;
+}
+
+bool ShaderLibrary::GetShaderModule(const char* filename, VkShaderModule& shaderModule)
+{
+	shared_ptr<const ShaderReflection> reflection;
+	return GetShaderModule(filename, shaderModule, reflection);
+}
+
+bool ShaderLibrary::GetShaderModule(const char* filename, VkShaderModule& shaderModule, shared_ptr<const ShaderReflection>& reflection)
+{
+	lock_guard<mutex> lock(shadersMutex);
+
+	auto found = blobs.find(filename);
+	if (found != blobs.end())
+	{
+		//Loose blobs always have a module and reflection already, pack blobs get them on first use
+		if (!CreateModule(found->second, found->second.code, shaderModule) || !Reflect(found->second, found->second.code, filename))
+			return false;
+
+		reflection = found->second.reflection;
+		return true;
+	}
+
+	//Built into the executable, so a cold start reads no files at all
+	ShaderBlob blob;
+	if (FindEmbeddedShader(filename, blob.code, blob.size))
+	{
+		blob.hash = HashBytes(blob.code, blob.size);
+		blob.embedded = true;
+		if (!CreateModule(blob, blob.code, shaderModule) || !Reflect(blob, blob.code, filename))
+			return false;
+
+		blobs[filename] = blob;
+		reflection = blob.reflection;
+		return true;
+	}
+
+	if (!LoadLooseFile(filename, shaderModule))
+		return false;
+
+	reflection = blobs[filename].reflection;
+	return true;
+}
+
+bool ShaderLibrary::ReloadShader(const char* filename)
+{
+	lock_guard<mutex> lock(shadersMutex);
+
+	auto found = blobs.find(filename);
+	uint64_t previousHash = found != blobs.end() ? found->second.hash : 0;
+
+	//Modules built from the old contents are kept, pipelines being rebuilt elsewhere may still reference them
+	VkShaderModule shaderModule = VK_NULL_HANDLE;
+	if (!LoadLooseFile(filename, shaderModule))
+		return false;
+
+	//Editors and the compiler can touch a file more than once per change
+	return blobs[filename].hash != previousHash;
+}
+
+bool ShaderLibrary::LoadLooseFile(const char* filename, VkShaderModule& shaderModule)
+{
+	MappedFile mappedFile;
+	if (!MapFile(filename, mappedFile))
+	{
+		Debug::Log(string("Open file: ") + filename, DebugLevel::Error);
+		return false;
+	}
+
+	if (!ValidateSpirv(mappedFile.data, mappedFile.size, filename))
+	{
+		UnmapFile(mappedFile);
+		return false;
+	}
+
+	ShaderBlob blob;
+	blob.size = mappedFile.size;
+	blob.hash = HashBytes(mappedFile.data, mappedFile.size);
+	blob.writeTime = mappedFile.writeTime;
+
+	//Not kept mapped, so the shader compiler can still overwrite the file
+	const uint32_t* code = static_cast<const uint32_t*>(mappedFile.data);
+	bool created = CreateModule(blob, code, shaderModule) && Reflect(blob, code, filename);
+	UnmapFile(mappedFile);
+	if (!created)
+		return false;
+
+	blobs[filename] = blob;
+	packDirty = !packFilename.empty();
+	return true;
+}
+
+size_t ShaderLibrary::GetModuleCount()
+{
+	lock_guard<mutex> lock(shadersMutex);
+	return modules.size();
+}
+
+bool ShaderLibrary::Reflect(ShaderBlob& blob, const uint32_t* code, const char* filename)
+{
+	if (blob.reflection)
+		return true;
+
+	shared_ptr<ShaderReflection> reflection = make_shared<ShaderReflection>();
+	if (!ReflectSpirv(code, blob.size, *reflection))
+	{
+		Debug::Log(string("Reflect shader: ") + filename, DebugLevel::Error);
+		return false;
+	}
+
+	blob.reflection = reflection;
+	return true;
+}
+
+bool ShaderLibrary::CreateModule(const ShaderBlob& blob, const uint32_t* code, VkShaderModule& outShaderModule)
+{
+	//The hash only narrows it down, the code has to match as well
+	auto range = modules.equal_range(blob.hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		const vector<uint32_t>& cachedCode = it->second.code;
+		if (cachedCode.size() * sizeof(uint32_t) == blob.size && memcmp(cachedCode.data(), code, blob.size) == 0)
+		{
+			outShaderModule = it->second.module;
+			return true;
+		}
+	}
+
+	VkShaderModuleCreateInfo shaderModuleCreateInfo{};
+	shaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	shaderModuleCreateInfo.pNext = nullptr;
+	shaderModuleCreateInfo.flags = 0;
+	shaderModuleCreateInfo.codeSize = blob.size;
+	shaderModuleCreateInfo.pCode = code;
+
+	auto err = vkCreateShaderModule(device, &shaderModuleCreateInfo, nullptr, &outShaderModule);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create shader module", DebugLevel::Error);
+		return false;
+	}
+
+	CachedModule cachedModule;
+	cachedModule.module = outShaderModule;
+	cachedModule.code.assign(code, code + blob.size / sizeof(uint32_t));
+	modules.emplace(blob.hash, std::move(cachedModule));
+	return true;
+}
+
+bool ShaderLibrary::MapFile(const char* filename, MappedFile& outMappedFile)
+{
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	FILETIME writeTime;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || !GetFileTime(file, nullptr, nullptr, &writeTime))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	outMappedFile.file = file;
+	outMappedFile.mapping = mapping;
+	outMappedFile.data = data;
+	outMappedFile.size = static_cast<size_t>(size.QuadPart);
+	outMappedFile.writeTime = ToUInt64(writeTime);
+	return true;
+}
+
+void ShaderLibrary::UnmapFile(MappedFile& mappedFile)
+{
+	if (mappedFile.data)
+	{
+		UnmapViewOfFile(mappedFile.data);
+		CloseHandle(mappedFile.mapping);
+		CloseHandle(mappedFile.file);
+	}
+	mappedFile = MappedFile();
+}
+
+bool ShaderLibrary::GetFileInfo(const char* filename, uint64_t& outSize, uint64_t& outWriteTime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &attributes))
+		return false;
+
+	outSize = (uint64_t(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+	outWriteTime = ToUInt64(attributes.ftLastWriteTime);
+	return true;
+}
+
+bool ShaderLibrary::ValidateSpirv(const void* code, size_t size, const char* filename)
+{
+	if (size < spirvHeaderSize || size % sizeof(uint32_t) != 0 || static_cast<const uint32_t*>(code)[0] != spirvMagic)
+	{
+		Debug::Log(string("Not a SPIR-V binary: ") + filename, DebugLevel::Error);
+		return false;
+	}
+	return true;
+}
+
+bool ShaderLibrary::LoadPack()
+{
+	if (!MapFile(packFilename.c_str(), pack))
+	{
+		Debug::Log("No shader pack, loading loose SPIR-V");
+		return true;
+	}
+
+	const uint8_t* packData = static_cast<const uint8_t*>(pack.data);
+	const PackHeader* header = reinterpret_cast<const PackHeader*>(packData);
+	bool valid = pack.size >= sizeof(PackHeader) &&
+		header->magic == packMagic &&
+		header->version == packVersion &&
+		pack.size >= sizeof(PackHeader) + uint64_t(header->count) * sizeof(PackEntry);
+	if (!valid)
+	{
+		Debug::Log("Shader pack is out of date, ignoring it", DebugLevel::Warning);
+		UnmapFile(pack);
+		packDirty = true;
+		return true;
+	}
+
+	const PackEntry* entries = reinterpret_cast<const PackEntry*>(packData + sizeof(PackHeader));
+	uint32_t staleCount = 0;
+	for (uint32_t i = 0; i < header->count; ++i)
+	{
+		const PackEntry& entry = entries[i];
+		string name(entry.name, strnlen(entry.name, maxPackName));
+
+		//Embedded shaders are packed by older builds only, the copy in the executable wins
+		const uint32_t* embeddedCode = nullptr;
+		size_t embeddedSize = 0;
+		if (FindEmbeddedShader(name.c_str(), embeddedCode, embeddedSize))
+		{
+			packDirty = true;
+			continue;
+		}
+
+		if (entry.offset % sizeof(uint32_t) != 0 || uint64_t(entry.offset) + entry.size > pack.size || !ValidateSpirv(packData + entry.offset, entry.size, name.c_str()))
+		{
+			packDirty = true;
+			continue;
+		}
+
+		//A loose file that changed since the pack was built wins, the pack is used as is when there are none
+		uint64_t looseSize = 0;
+		uint64_t looseWriteTime = 0;
+		if (GetFileInfo(name.c_str(), looseSize, looseWriteTime) && (looseSize != entry.size || looseWriteTime != entry.writeTime))
+		{
+			++staleCount;
+			packDirty = true;
+			continue;
+		}
+
+		//The stored hash is only trusted once the contents match it, a damaged entry is loaded loose instead
+		ShaderBlob blob;
+		blob.code = reinterpret_cast<const uint32_t*>(packData + entry.offset);
+		blob.size = entry.size;
+		blob.hash = HashBytes(blob.code, blob.size);
+		blob.writeTime = entry.writeTime;
+		if (blob.hash != entry.hash)
+		{
+			Debug::Log(string("Shader pack entry is damaged: ") + name, DebugLevel::Warning);
+			packDirty = true;
+			continue;
+		}
+		blobs[name] = blob;
+	}
+
+	Debug::Log(string("Shader pack mapped: ") + to_string(blobs.size()) + " shaders, " + to_string(staleCount) + " stale");
+	return true;
+}
+
+bool ShaderLibrary::WritePack(const char* filename)
+{
+	vector<PackEntry> entries;
+	vector<const void*> entryData;
+	vector<MappedFile> looseFiles;
+
+	uint32_t offset = 0;
+	for (auto& named : blobs)
+	{
+		if (named.second.embedded)
+			continue;
+
+		if (named.first.size() >= maxPackName)
+		{
+			Debug::Log(string("Shader name too long for the pack: ") + named.first, DebugLevel::Warning);
+			continue;
+		}
+
+		PackEntry entry{};
+		strncpy(entry.name, named.first.c_str(), maxPackName - 1);
+		entry.hash = named.second.hash;
+		entry.writeTime = named.second.writeTime;
+		entry.size = named.second.size;
+		const void* data = named.second.code;
+
+		//Loose shaders are mapped again, they may have changed since they were loaded
+		if (data == nullptr)
+		{
+			MappedFile mappedFile;
+			if (!MapFile(named.first.c_str(), mappedFile) || !ValidateSpirv(mappedFile.data, mappedFile.size, named.first.c_str()))
+			{
+				UnmapFile(mappedFile);
+				continue;
+			}
+			looseFiles.push_back(mappedFile);
+			data = mappedFile.data;
+			entry.size = mappedFile.size;
+			entry.hash = HashBytes(mappedFile.data, mappedFile.size);
+			entry.writeTime = mappedFile.writeTime;
+		}
+
+		entry.offset = offset;
+		offset += entry.size;
+		entries.push_back(entry);
+		entryData.push_back(data);
+	}
+
+	//Blobs follow the entry table
+	uint32_t dataStart = sizeof(PackHeader) + sizeof(PackEntry) * entries.size();
+	for (auto& entry : entries)
+	{
+		entry.offset += dataStart;
+	}
+
+	PackHeader header{};
+	header.magic = packMagic;
+	header.version = packVersion;
+	header.count = entries.size();
+
+	bool written = false;
+	FILE* packFile = fopen(filename, "wb");
+	if (packFile)
+	{
+		written = fwrite(&header, sizeof(header), 1, packFile) == 1 &&
+			(entries.empty() || fwrite(entries.data(), sizeof(PackEntry), entries.size(), packFile) == entries.size());
+		for (size_t i = 0; written && i < entries.size(); ++i)
+		{
+			written = fwrite(entryData[i], entries[i].size, 1, packFile) == 1;
+		}
+		fclose(packFile);
+	}
+
+	for (auto& mappedFile : looseFiles)
+	{
+		UnmapFile(mappedFile);
+	}
+
+	if (!written)
+	{
+		Debug::Log(string("Write shader pack: ") + filename, DebugLevel::Error);
+		return false;
+	}
+
+	Debug::Log(string("Shader pack written: ") + to_string(entries.size()) + " shaders");
+	return true;
+}
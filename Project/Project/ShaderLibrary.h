@@ -0,0 +1,83 @@
+#pragma once
+#include "vulkan\vulkan.h"
+#include "SpirvReflection.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+//Owns every shader module. SPIR-V is memory mapped and handed straight to vkCreateShaderModule,
+//and identical blobs share one module. Shaders built with the project are embedded in the executable.
+//Others can come from a pack file, mapped once at startup, and the pack is rewritten at shutdown if any
+//loose file was newer. A reloaded loose file replaces either.
+class ShaderLibrary
+{
+public:
+	ShaderLibrary();
+	~ShaderLibrary();
+
+	bool	Init(VkDevice device, const char* packFilename);
+	void	Destroy();
+
+	//Thread safe, the module is created the first time its contents are seen. The reflection is shared,
+	//and stays valid after a reload replaces the shader.
+	bool	GetShaderModule(const char* filename, VkShaderModule& shaderModule);
+	bool	GetShaderModule(const char* filename, VkShaderModule& shaderModule, shared_ptr<const ShaderReflection>& reflection);
+
+	//Reads the loose file again, replacing what was loaded for that name. False if it failed to load, in which
+	//case the old shader is kept, or if the contents are unchanged.
+	bool	ReloadShader(const char* filename);
+
+	size_t	GetModuleCount();
+
+private:
+	struct MappedFile
+	{
+		void*		file		{ nullptr };
+		void*		mapping		{ nullptr };
+		const void*	data		{ nullptr };
+		size_t		size		{ 0 };
+		uint64_t	writeTime	{ 0 };
+	};
+
+	//A named SPIR-V blob, code is only kept for shaders that live in the pack or the executable
+	struct ShaderBlob
+	{
+		const uint32_t*	code		{ nullptr };
+		size_t			size		{ 0 };
+		uint64_t		hash		{ 0 };
+		uint64_t		writeTime	{ 0 };	//of the loose file it was built from
+		bool			embedded	{ false };	//never written to the pack
+		shared_ptr<const ShaderReflection>	reflection;
+	};
+
+	VkDevice		device { VK_NULL_HANDLE };
+	string			packFilename;
+	MappedFile		pack;
+	bool			packDirty { false };
+
+	//A module and a copy of the SPIR-V it was created from, compared before it is shared so a hash collision
+	//can never hand out another shader's module
+	struct CachedModule
+	{
+		VkShaderModule		module { VK_NULL_HANDLE };
+		vector<uint32_t>	code;
+	};
+
+	mutex			shadersMutex;
+	unordered_map<string, ShaderBlob>			blobs;
+	unordered_multimap<uint64_t, CachedModule>	modules;	//by content hash
+
+	static bool	MapFile(const char* filename, MappedFile& outMappedFile);
+	static void	UnmapFile(MappedFile& mappedFile);
+	static bool	GetFileInfo(const char* filename, uint64_t& outSize, uint64_t& outWriteTime);
+	static bool	ValidateSpirv(const void* code, size_t size, const char* filename);
+
+	bool	LoadLooseFile(const char* filename, VkShaderModule& shaderModule);
+	bool	Reflect(ShaderBlob& blob, const uint32_t* code, const char* filename);
+	bool	LoadPack();
+	bool	WritePack(const char* filename);
+	bool	CreateModule(const ShaderBlob& blob, const uint32_t* code, VkShaderModule& outShaderModule);
+};
@@ -0,0 +1,229 @@
+#include <Windows.h>
+#include "ShaderWatcher.h"
+#include "Debug.h"
+
+#include <string.h>
+#include <unordered_set>
+
+namespace
+{
+	string ToUtf8(const WCHAR* name, int length)
+	{
+		int size = WideCharToMultiByte(CP_UTF8, 0, name, length, nullptr, 0, nullptr, nullptr);
+		string utf8(size, '\0');
+		WideCharToMultiByte(CP_UTF8, 0, name, length, &utf8[0], size, nullptr, nullptr);
+		return utf8;
+	}
+}
+
+ShaderWatcher::ShaderWatcher()
+{
+}
+
+ShaderWatcher::~ShaderWatcher()
+{
+	Stop();
+}
+
+void ShaderWatcher::Watch(const char* sourceFilename, const char* spirvFilename)
+{
+	WatchedShader shader;
+	shader.source = sourceFilename ? sourceFilename : "";
+	shader.spirv = spirvFilename;
+	shaders.push_back(shader);
+}
+
+bool ShaderWatcher::Start(ChangeHandler changeHandler)
+{
+	//Shaders are loaded relative to the working directory
+	directory = CreateFileA(".", FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+	if (directory == INVALID_HANDLE_VALUE)
+	{
+		directory = nullptr;
+		Debug::Log("Open shader directory for watching", DebugLevel::Error);
+		return false;
+	}
+
+	stopEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+	if (stopEvent == nullptr)
+	{
+		CloseHandle(directory);
+		directory = nullptr;
+		Debug::Log("Create shader watcher event", DebugLevel::Error);
+		return false;
+	}
+
+	onChanged = changeHandler;
+	running = true;
+	watchThread = thread(&ShaderWatcher::WatchThread, this);
+	Debug::Log(string("Watching ") + to_string(shaders.size()) + " shaders for changes");
+	return true;
+}
+
+void ShaderWatcher::Stop()
+{
+	if (!running)
+		return;
+
+	running = false;
+	SetEvent(stopEvent);
+	watchThread.join();
+
+	CloseHandle(stopEvent);
+	CloseHandle(directory);
+	stopEvent = nullptr;
+	directory = nullptr;
+}
+
+void ShaderWatcher::WatchThread()
+{
+	OVERLAPPED overlapped{};
+	overlapped.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+	HANDLE handles[2] = { overlapped.hEvent, stopEvent };
+
+	//FILE_NOTIFY_INFORMATION needs DWORD alignment
+	DWORD buffer[1024];
+	unordered_set<string> changed;
+
+	while (running)
+	{
+		ResetEvent(overlapped.hEvent);
+		if (!ReadDirectoryChangesW(directory, buffer, sizeof(buffer), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, nullptr, &overlapped, nullptr))
+		{
+			Debug::Log("Watch shader directory", DebugLevel::Error);
+			break;
+		}
+
+		DWORD bytes = 0;
+		if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+		{
+			//The read must finish before buffer goes out of scope
+			CancelIo(directory);
+			GetOverlappedResult(directory, &overlapped, &bytes, TRUE);
+			break;
+		}
+
+		if (!GetOverlappedResult(directory, &overlapped, &bytes, FALSE))
+		{
+			Debug::Log("Read shader directory changes", DebugLevel::Error);
+			break;
+		}
+
+		if (bytes == 0)
+		{
+			//Too many changes to fit, treat every shader as changed
+			for (auto& shader : shaders)
+			{
+				changed.insert(shader.source.empty() ? shader.spirv : shader.source);
+			}
+		}
+		else
+		{
+			const uint8_t* entry = reinterpret_cast<const uint8_t*>(buffer);
+			while (true)
+			{
+				const FILE_NOTIFY_INFORMATION* information = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(entry);
+				//Editors often save to a temporary file and rename it over the original
+				if (information->Action == FILE_ACTION_MODIFIED || information->Action == FILE_ACTION_ADDED || information->Action == FILE_ACTION_RENAMED_NEW_NAME)
+				{
+					changed.insert(ToUtf8(information->FileName, information->FileNameLength / sizeof(WCHAR)));
+				}
+
+				if (information->NextEntryOffset == 0)
+					break;
+				entry += information->NextEntryOffset;
+			}
+		}
+
+		//A save is usually several writes, let them settle. Changes made meanwhile are queued by the system
+		//and picked up by the next read, so at worst a file is handled twice.
+		if (WaitForSingleObject(stopEvent, debounceMilliseconds) == WAIT_OBJECT_0)
+			break;
+
+		for (auto& filename : changed)
+		{
+			OnFileChanged(filename);
+		}
+		changed.clear();
+	}
+
+	CloseHandle(overlapped.hEvent);
+}
+
+void ShaderWatcher::OnFileChanged(const string& filename)
+{
+	for (auto& shader : shaders)
+	{
+		//The new SPIR-V shows up as a change of its own once compiled
+		if (!shader.source.empty() && _stricmp(filename.c_str(), shader.source.c_str()) == 0)
+		{
+			Compile(shader);
+		}
+		else if (_stricmp(filename.c_str(), shader.spirv.c_str()) == 0)
+		{
+			onChanged(shader.spirv.c_str());
+		}
+	}
+}
+
+bool ShaderWatcher::Compile(const WatchedShader& shader)
+{
+	//Same command as the project's build step, with its output captured for the log. Paths are quoted, the watched
+	//directory may have spaces in it.
+	string commandLine = "glslangValidator -V \"" + shader.source + "\" -o \"" + shader.spirv + "\"";
+
+	SECURITY_ATTRIBUTES security{};
+	security.nLength = sizeof(security);
+	security.lpSecurityDescriptor = nullptr;
+	security.bInheritHandle = TRUE;
+
+	HANDLE outputRead = nullptr;
+	HANDLE outputWrite = nullptr;
+	if (!CreatePipe(&outputRead, &outputWrite, &security, 0))
+	{
+		Debug::Log("Create shader compiler pipe", DebugLevel::Error);
+		return false;
+	}
+	SetHandleInformation(outputRead, HANDLE_FLAG_INHERIT, 0);
+
+	STARTUPINFOA startupInfo{};
+	startupInfo.cb = sizeof(startupInfo);
+	startupInfo.dwFlags = STARTF_USESTDHANDLES;
+	startupInfo.hStdInput = nullptr;
+	startupInfo.hStdOutput = outputWrite;
+	startupInfo.hStdError = outputWrite;
+
+	PROCESS_INFORMATION processInformation{};
+	BOOL created = CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, TRUE, CREATE_NO_WINDOW, nullptr, nullptr, &startupInfo, &processInformation);
+	CloseHandle(outputWrite);
+	if (!created)
+	{
+		CloseHandle(outputRead);
+		Debug::Log("Run glslangValidator, is it on the PATH?", DebugLevel::Error);
+		return false;
+	}
+
+	string output;
+	char chunk[256];
+	DWORD bytesRead = 0;
+	while (ReadFile(outputRead, chunk, sizeof(chunk), &bytesRead, nullptr) && bytesRead > 0)
+	{
+		output.append(chunk, bytesRead);
+	}
+	CloseHandle(outputRead);
+
+	WaitForSingleObject(processInformation.hProcess, INFINITE);
+	DWORD exitCode = 1;
+	GetExitCodeProcess(processInformation.hProcess, &exitCode);
+	CloseHandle(processInformation.hThread);
+	CloseHandle(processInformation.hProcess);
+
+	if (exitCode != 0)
+	{
+		Debug::Log("Compile " + shader.source + " failed:\n" + output, DebugLevel::Error);
+		return false;
+	}
+
+	Debug::Log("Compiled " + shader.source);
+	return true;
+}
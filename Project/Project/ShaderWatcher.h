@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+//Watches the working directory for shader edits on its own thread. A changed GLSL source is recompiled with
+//glslangValidator, and a changed SPIR-V file, whether written by that or by the build, is reported.
+class ShaderWatcher
+{
+public:
+	//Called on the watcher thread
+	typedef function<void(const char* spirvFilename)> ChangeHandler;
+
+	ShaderWatcher();
+	~ShaderWatcher();
+
+	//Source may be null for SPIR-V that is only ever rebuilt elsewhere. Call before Start.
+	void	Watch(const char* sourceFilename, const char* spirvFilename);
+
+	bool	Start(ChangeHandler changeHandler);
+	void	Stop();
+
+private:
+	static const uint32_t debounceMilliseconds { 100 };
+
+	struct WatchedShader
+	{
+		string	source;
+		string	spirv;
+	};
+
+	vector<WatchedShader>	shaders;
+	ChangeHandler			onChanged;
+
+	thread					watchThread;
+	atomic<bool>			running { false };
+	void*					directory { nullptr };
+	void*					stopEvent { nullptr };
+
+	void	WatchThread();
+	void	OnFileChanged(const string& filename);
+	bool	Compile(const WatchedShader& shader);
+};
@@ -0,0 +1,486 @@
+#include "SpirvReflection.h"
+#include "Debug.h"
+
+#include <algorithm>
+
+namespace
+{
+	const uint32_t spirvMagic { 0x07230203 };
+	const uint32_t spirvHeaderWords { 5 };
+
+	enum SpirvOp
+	{
+		OpEntryPoint = 15,
+		OpTypeInt = 21,
+		OpTypeFloat = 22,
+		OpTypeVector = 23,
+		OpTypeMatrix = 24,
+		OpTypeImage = 25,
+		OpTypeSampler = 26,
+		OpTypeSampledImage = 27,
+		OpTypeArray = 28,
+		OpTypeRuntimeArray = 29,
+		OpTypeStruct = 30,
+		OpTypePointer = 32,
+		OpConstant = 43,
+		OpVariable = 59,
+		OpDecorate = 71,
+		OpMemberDecorate = 72,
+	};
+
+	enum SpirvDecoration
+	{
+		DecorationBlock = 2,
+		DecorationBufferBlock = 3,
+		DecorationArrayStride = 6,
+		DecorationMatrixStride = 7,
+		DecorationBuiltIn = 11,
+		DecorationLocation = 30,
+		DecorationBinding = 33,
+		DecorationDescriptorSet = 34,
+		DecorationOffset = 35,
+	};
+
+	enum SpirvStorageClass
+	{
+		StorageClassUniformConstant = 0,
+		StorageClassInput = 1,
+		StorageClassUniform = 2,
+		StorageClassPushConstant = 9,
+		StorageClassStorageBuffer = 12,
+	};
+
+	enum SpirvDim
+	{
+		DimBuffer = 5,
+		DimSubpassData = 6,
+	};
+
+	//Everything recorded about one result id. Which fields mean what depends on the opcode.
+	struct SpirvId
+	{
+		uint32_t			opcode			{ 0 };
+		uint32_t			typeId			{ 0 };	//pointee, element, component or column type, or the type of a variable
+		uint32_t			count			{ 0 };	//vector size, matrix columns, array length id, or scalar width
+		uint32_t			storageClass	{ 0 };
+		uint32_t			value			{ 0 };	//constants, and signedness of ints
+		uint32_t			imageDim		{ 0 };
+		uint32_t			imageSampled	{ 0 };
+		vector<uint32_t>	members;
+
+		bool				builtIn			{ false };
+		bool				block			{ false };
+		bool				bufferBlock		{ false };
+		bool				hasLocation		{ false };
+		uint32_t			location		{ 0 };
+		uint32_t			set				{ 0 };
+		uint32_t			binding			{ 0 };
+		uint32_t			arrayStride		{ 0 };
+		vector<uint32_t>	memberOffsets;
+		vector<uint32_t>	memberMatrixStrides;
+	};
+
+	VkShaderStageFlagBits ToStage(uint32_t executionModel)
+	{
+		switch (executionModel)
+		{
+		case 0: return VK_SHADER_STAGE_VERTEX_BIT;
+		case 1: return VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+		case 2: return VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+		case 3: return VK_SHADER_STAGE_GEOMETRY_BIT;
+		case 4: return VK_SHADER_STAGE_FRAGMENT_BIT;
+		default: return VK_SHADER_STAGE_COMPUTE_BIT;
+		}
+	}
+
+	//Operands needed to read what is recorded for each opcode, anything shorter is malformed and skipped
+	uint32_t GetMinimumOperands(uint32_t opcode)
+	{
+		switch (opcode)
+		{
+		case OpTypeFloat:
+		case OpTypeRuntimeArray:
+		case OpTypeSampledImage:
+		case OpDecorate:
+			return 2;
+		case OpTypeInt:
+		case OpTypeVector:
+		case OpTypeMatrix:
+		case OpTypeArray:
+		case OpTypePointer:
+		case OpConstant:
+		case OpVariable:
+		case OpMemberDecorate:
+			return 3;
+		case OpTypeImage:
+			return 8;
+		default:
+			return 1;
+		}
+	}
+
+	void SetMember(vector<uint32_t>& values, uint32_t member, uint32_t value)
+	{
+		if (values.size() <= member)
+			values.resize(member + 1, 0);
+		values[member] = value;
+	}
+
+	uint32_t ArrayLength(const vector<SpirvId>& ids, const SpirvId& array)
+	{
+		if (array.opcode != OpTypeArray || array.count >= ids.size())
+			return 0;
+		return ids[array.count].value;
+	}
+
+	//Size in bytes with the explicit layout the shader declares, used for push constant blocks
+	uint32_t TypeSize(const vector<SpirvId>& ids, uint32_t typeId, uint32_t matrixStride)
+	{
+		if (typeId >= ids.size())
+			return 0;
+
+		const SpirvId& type = ids[typeId];
+		switch (type.opcode)
+		{
+		case OpTypeInt:
+		case OpTypeFloat:
+			return type.count / 8;
+		case OpTypeVector:
+			return type.count * TypeSize(ids, type.typeId, 0);
+		case OpTypeMatrix:
+			return type.count * (matrixStride ? matrixStride : TypeSize(ids, type.typeId, 0));
+		case OpTypeArray:
+			return ArrayLength(ids, type) * (type.arrayStride ? type.arrayStride : TypeSize(ids, type.typeId, matrixStride));
+		case OpTypeStruct:
+		{
+			uint32_t size = 0;
+			for (uint32_t member = 0; member < type.members.size(); ++member)
+			{
+				uint32_t offset = member < type.memberOffsets.size() ? type.memberOffsets[member] : size;
+				uint32_t stride = member < type.memberMatrixStrides.size() ? type.memberMatrixStrides[member] : 0;
+				size = max(size, offset + TypeSize(ids, type.members[member], stride));
+			}
+			return size;
+		}
+		default:
+			return 0;
+		}
+	}
+
+	VkFormat ToVertexFormat(const vector<SpirvId>& ids, uint32_t typeId)
+	{
+		const SpirvId& type = ids[typeId];
+		uint32_t components = 1;
+		const SpirvId* scalar = &type;
+		if (type.opcode == OpTypeVector && type.typeId < ids.size())
+		{
+			components = type.count;
+			scalar = &ids[type.typeId];
+		}
+
+		//Only 32 bit components, narrower vertex data is declared by the application
+		if (scalar->count != 32 || components < 1 || components > 4)
+			return VK_FORMAT_UNDEFINED;
+
+		if (scalar->opcode == OpTypeFloat)
+		{
+			const VkFormat formats[] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT };
+			return formats[components - 1];
+		}
+		if (scalar->opcode == OpTypeInt && scalar->value)
+		{
+			const VkFormat formats[] = { VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT, VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT };
+			return formats[components - 1];
+		}
+		if (scalar->opcode == OpTypeInt)
+		{
+			const VkFormat formats[] = { VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT };
+			return formats[components - 1];
+		}
+		return VK_FORMAT_UNDEFINED;
+	}
+
+	bool AddVertexInputs(const vector<SpirvId>& ids, uint32_t typeId, uint32_t location, vector<ShaderReflection::VertexInput>& inputs)
+	{
+		const SpirvId& type = ids[typeId];
+		uint32_t elements = 1;
+		uint32_t elementType = typeId;
+		if (type.opcode == OpTypeArray)
+		{
+			elements = ArrayLength(ids, type);
+			elementType = type.typeId;
+		}
+
+		//Matrices take a location per column
+		uint32_t columns = 1;
+		uint32_t columnType = elementType;
+		if (elementType < ids.size() && ids[elementType].opcode == OpTypeMatrix)
+		{
+			columns = ids[elementType].count;
+			columnType = ids[elementType].typeId;
+		}
+
+		if (columnType >= ids.size())
+			return false;
+
+		VkFormat format = ToVertexFormat(ids, columnType);
+		if (format == VK_FORMAT_UNDEFINED)
+			return false;
+
+		for (uint32_t i = 0; i < elements * columns; ++i)
+		{
+			ShaderReflection::VertexInput input;
+			input.location = location + i;
+			input.format = format;
+			inputs.push_back(input);
+		}
+		return true;
+	}
+
+	bool ToDescriptorType(const SpirvId& variable, const SpirvId& type, VkDescriptorType& outDescriptorType)
+	{
+		switch (type.opcode)
+		{
+		case OpTypeSampler:
+			outDescriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+			return true;
+		case OpTypeSampledImage:
+			outDescriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			return true;
+		case OpTypeImage:
+			if (type.imageDim == DimSubpassData)
+				outDescriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+			else if (type.imageDim == DimBuffer)
+				outDescriptorType = type.imageSampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+			else
+				outDescriptorType = type.imageSampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+			return true;
+		case OpTypeStruct:
+			//SPIR-V 1.0 marks storage buffers as BufferBlock in the Uniform storage class
+			if (variable.storageClass == StorageClassStorageBuffer || type.bufferBlock)
+				outDescriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			else
+				outDescriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+			return true;
+		default:
+			return false;
+		}
+	}
+}
+
+bool ReflectSpirv(const uint32_t* code, size_t size, ShaderReflection& outReflection)
+{
+	size_t wordCount = size / sizeof(uint32_t);
+	if (wordCount < spirvHeaderWords || code[0] != spirvMagic)
+	{
+		Debug::Log("Reflect: not a SPIR-V binary", DebugLevel::Error);
+		return false;
+	}
+
+	//Every id is below the bound, so ids index straight into this
+	vector<SpirvId> ids(code[3]);
+	vector<uint32_t> variables;
+	bool foundEntryPoint = false;
+
+	for (size_t word = spirvHeaderWords; word < wordCount;)
+	{
+		uint32_t instructionWords = code[word] >> 16;
+		uint32_t opcode = code[word] & 0xffff;
+		if (instructionWords == 0 || word + instructionWords > wordCount)
+		{
+			Debug::Log("Reflect: truncated SPIR-V", DebugLevel::Error);
+			return false;
+		}
+
+		const uint32_t* operands = code + word + 1;
+		uint32_t operandCount = instructionWords - 1;
+		word += instructionWords;
+
+		//Every instruction recorded here has a result or target id as its first operand, bar constants and variables
+		uint32_t resultIndex = (opcode == OpConstant || opcode == OpVariable) ? 1 : 0;
+		if (opcode == OpEntryPoint)
+		{
+			if (!foundEntryPoint && operandCount >= 1)
+			{
+				outReflection.stage = ToStage(operands[0]);
+				foundEntryPoint = true;
+			}
+			continue;
+		}
+		if (operandCount < GetMinimumOperands(opcode) || operandCount <= resultIndex || operands[resultIndex] >= ids.size())
+			continue;
+
+		SpirvId& id = ids[operands[resultIndex]];
+		switch (opcode)
+		{
+		case OpTypeInt:
+			id.opcode = opcode;
+			id.count = operands[1];
+			id.value = operands[2];
+			break;
+		case OpTypeFloat:
+			id.opcode = opcode;
+			id.count = operands[1];
+			break;
+		case OpTypeVector:
+		case OpTypeMatrix:
+		case OpTypeArray:
+			id.opcode = opcode;
+			id.typeId = operands[1];
+			id.count = operands[2];
+			break;
+		case OpTypeRuntimeArray:
+		case OpTypeSampledImage:
+			id.opcode = opcode;
+			id.typeId = operands[1];
+			break;
+		case OpTypeImage:
+			id.opcode = opcode;
+			id.imageDim = operands[2];
+			id.imageSampled = operands[6];
+			break;
+		case OpTypeSampler:
+			id.opcode = opcode;
+			break;
+		case OpTypeStruct:
+			id.opcode = opcode;
+			id.members.assign(operands + 1, operands + operandCount);
+			break;
+		case OpTypePointer:
+			id.opcode = opcode;
+			id.storageClass = operands[1];
+			id.typeId = operands[2];
+			break;
+		case OpConstant:
+			id.opcode = opcode;
+			id.typeId = operands[0];
+			id.value = operands[2];
+			break;
+		case OpVariable:
+			id.opcode = opcode;
+			id.typeId = operands[0];
+			id.storageClass = operands[2];
+			variables.push_back(operands[1]);
+			break;
+		case OpDecorate:
+			if (operandCount < 3 && operands[1] != DecorationBlock && operands[1] != DecorationBufferBlock)
+				break;
+			switch (operands[1])
+			{
+			case DecorationBlock:			id.block = true; break;
+			case DecorationBufferBlock:		id.bufferBlock = true; break;
+			case DecorationBuiltIn:			id.builtIn = true; break;
+			case DecorationArrayStride:		id.arrayStride = operands[2]; break;
+			case DecorationLocation:		id.location = operands[2]; id.hasLocation = true; break;
+			case DecorationBinding:			id.binding = operands[2]; break;
+			case DecorationDescriptorSet:	id.set = operands[2]; break;
+			default: break;
+			}
+			break;
+		case OpMemberDecorate:
+			if (operandCount < 4)
+				break;
+			if (operands[2] == DecorationOffset)
+				SetMember(id.memberOffsets, operands[1], operands[3]);
+			else if (operands[2] == DecorationMatrixStride)
+				SetMember(id.memberMatrixStrides, operands[1], operands[3]);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (!foundEntryPoint)
+	{
+		Debug::Log("Reflect: no entry point", DebugLevel::Error);
+		return false;
+	}
+
+	outReflection.vertexInputs.clear();
+	outReflection.descriptorBindings.clear();
+	outReflection.pushConstantSize = 0;
+
+	for (uint32_t variableId : variables)
+	{
+		const SpirvId& variable = ids[variableId];
+		if (variable.typeId >= ids.size() || ids[variable.typeId].opcode != OpTypePointer || ids[variable.typeId].typeId >= ids.size())
+			continue;
+		uint32_t typeId = ids[variable.typeId].typeId;
+
+		switch (variable.storageClass)
+		{
+		case StorageClassInput:
+			if (outReflection.stage != VK_SHADER_STAGE_VERTEX_BIT || variable.builtIn || !variable.hasLocation)
+				break;
+			if (!AddVertexInputs(ids, typeId, variable.location, outReflection.vertexInputs))
+			{
+				Debug::Log("Reflect: unsupported vertex input type at location " + to_string(variable.location), DebugLevel::Error);
+				return false;
+			}
+			break;
+		case StorageClassPushConstant:
+			outReflection.pushConstantSize = max(outReflection.pushConstantSize, TypeSize(ids, typeId, 0));
+			break;
+		case StorageClassUniformConstant:
+		case StorageClassUniform:
+		case StorageClassStorageBuffer:
+		{
+			ShaderReflection::DescriptorBinding binding;
+			binding.set = variable.set;
+			binding.binding = variable.binding;
+			binding.descriptorCount = 1;
+
+			const SpirvId* type = &ids[typeId];
+			if (type->opcode == OpTypeArray || type->opcode == OpTypeRuntimeArray)
+			{
+				binding.descriptorCount = ArrayLength(ids, *type);
+				if (type->typeId >= ids.size())
+					break;
+				type = &ids[type->typeId];
+			}
+
+			if (!ToDescriptorType(variable, *type, binding.descriptorType))
+				break;
+			outReflection.descriptorBindings.push_back(binding);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	sort(outReflection.vertexInputs.begin(), outReflection.vertexInputs.end(), [](const ShaderReflection::VertexInput& a, const ShaderReflection::VertexInput& b)
+	{
+		return a.location < b.location;
+	});
+	sort(outReflection.descriptorBindings.begin(), outReflection.descriptorBindings.end(), [](const ShaderReflection::DescriptorBinding& a, const ShaderReflection::DescriptorBinding& b)
+	{
+		return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+	});
+	return true;
+}
+
+uint32_t GetVertexFormatSize(VkFormat format)
+{
+	switch (format)
+	{
+	case VK_FORMAT_R32_UINT:
+	case VK_FORMAT_R32_SINT:
+	case VK_FORMAT_R32_SFLOAT:
+		return 4;
+	case VK_FORMAT_R32G32_UINT:
+	case VK_FORMAT_R32G32_SINT:
+	case VK_FORMAT_R32G32_SFLOAT:
+		return 8;
+	case VK_FORMAT_R32G32B32_UINT:
+	case VK_FORMAT_R32G32B32_SINT:
+	case VK_FORMAT_R32G32B32_SFLOAT:
+		return 12;
+	case VK_FORMAT_R32G32B32A32_UINT:
+	case VK_FORMAT_R32G32B32A32_SINT:
+	case VK_FORMAT_R32G32B32A32_SFLOAT:
+		return 16;
+	default:
+		return 0;
+	}
+}
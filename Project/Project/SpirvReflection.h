@@ -0,0 +1,35 @@
+#pragma once
+#include "vulkan\vulkan.h"
+#include <vector>
+using namespace std;
+
+//The parts of a shader's interface that pipelines are built from
+struct ShaderReflection
+{
+	//One per location, a matrix takes one location per column
+	struct VertexInput
+	{
+		uint32_t	location;
+		VkFormat	format;
+	};
+
+	struct DescriptorBinding
+	{
+		uint32_t			set;
+		uint32_t			binding;
+		VkDescriptorType	descriptorType;
+		uint32_t			descriptorCount;	//0 for a runtime sized array
+	};
+
+	VkShaderStageFlagBits		stage { VK_SHADER_STAGE_VERTEX_BIT };
+	vector<VertexInput>			vertexInputs;		//vertex shaders only, sorted by location
+	vector<DescriptorBinding>	descriptorBindings;	//sorted by set, then binding
+	uint32_t					pushConstantSize { 0 };
+};
+
+//A single pass over the instruction stream, no external dependencies. Only the first entry point is
+//considered, which is all glslangValidator emits.
+bool ReflectSpirv(const uint32_t* code, size_t size, ShaderReflection& outReflection);
+
+//Bytes per vertex of an attribute format, 0 for formats reflection does not produce
+uint32_t GetVertexFormatSize(VkFormat format);
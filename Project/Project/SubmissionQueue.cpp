@@ -0,0 +1,343 @@
+#include "SubmissionQueue.h"
+#include "Debug.h"
+
+#include <algorithm>
+#include <chrono>
+
+SubmissionQueue::SubmissionQueue()
+	: head(&stub), tail(&stub)
+{
+}
+
+SubmissionQueue::~SubmissionQueue()
+{
+	Stop();
+}
+
+void SubmitBatch::WaitForTimeline(TimelineSemaphore& timeline, uint64_t value, VkPipelineStageFlags stage)
+{
+	TimelineWait wait;
+	wait.timeline = &timeline;
+	wait.value = value;
+	wait.stage = stage;
+	timelineWaits.push_back(wait);
+}
+
+bool SubmissionQueue::Start(VkDevice device, VkQueue submitQueue, bool timelineSupported)
+{
+	queue = submitQueue;
+	if (!timeline.Init(device, timelineSupported))
+		return false;
+	if (!timeline.IsTimeline())
+	{
+		Debug::Log("Timeline semaphores not supported, submissions are tracked with fences", DebugLevel::Warning);
+	}
+
+	running = true;
+	submitThread = thread(&SubmissionQueue::SubmitThread, this);
+	return true;
+}
+
+void SubmissionQueue::Stop()
+{
+	if (!running)
+		return;
+
+	{
+		lock_guard<mutex> lock(wakeMutex);
+		running = false;
+	}
+	wakeCondition.notify_one();
+	submitThread.join();
+	timeline.Destroy();
+}
+
+void SubmissionQueue::Push(SubmitBatch* batch)
+{
+	batch->next.store(nullptr, memory_order_relaxed);
+	SubmitBatch* previous = head.exchange(batch, memory_order_acq_rel);
+	previous->next.store(batch, memory_order_release);
+}
+
+SubmitBatch* SubmissionQueue::Pop()
+{
+	SubmitBatch* first = tail;
+	SubmitBatch* next = first->next.load(memory_order_acquire);
+	if (first == &stub)
+	{
+		if (next == nullptr)
+			return nullptr;
+		tail = next;
+		first = next;
+		next = next->next.load(memory_order_acquire);
+	}
+
+	if (next)
+	{
+		tail = next;
+		return first;
+	}
+
+	//A producer is between exchanging head and linking its batch
+	if (first != head.load(memory_order_acquire))
+		return nullptr;
+
+	Push(&stub);
+	next = first->next.load(memory_order_acquire);
+	if (next)
+	{
+		tail = next;
+		return first;
+	}
+	return nullptr;
+}
+
+uint64_t SubmissionQueue::Submit(SubmitBatch* batch)
+{
+	uint64_t value = lastValue.fetch_add(1, memory_order_relaxed) + 1;
+	batch->value = value;
+	Push(batch);
+	if (pendingBatches.fetch_add(1, memory_order_release) == 0)
+	{
+		wakeCondition.notify_one();
+	}
+	return value;
+}
+
+bool SubmissionQueue::WaitIdle()
+{
+	return timeline.Wait(lastValue.load(memory_order_relaxed));
+}
+
+void SubmissionQueue::SubmitThread()
+{
+	vector<SubmitBatch*> batches;
+	while (true)
+	{
+		uint32_t popped = 0;
+		while (SubmitBatch* batch = Pop())
+		{
+			heldBatches.push_back(batch);
+			++popped;
+		}
+		if (popped > 0)
+		{
+			pendingBatches.fetch_sub(popped, memory_order_relaxed);
+		}
+
+		if (!heldBatches.empty())
+		{
+			//Everything up to the first gap goes now
+			sort(heldBatches.begin(), heldBatches.end(), [](const SubmitBatch* a, const SubmitBatch* b) { return a->value < b->value; });
+			size_t ready = 0;
+			while (ready < heldBatches.size() && heldBatches[ready]->value == lastSubmittedValue + ready + 1)
+			{
+				++ready;
+			}
+			batches.assign(heldBatches.begin(), heldBatches.begin() + ready);
+			heldBatches.erase(heldBatches.begin(), heldBatches.begin() + ready);
+
+			if (!batches.empty())
+			{
+				Flush(batches);
+				continue;
+			}
+
+			//A producer has taken a value but not pushed its batch yet
+			this_thread::yield();
+			continue;
+		}
+
+		if (!running)
+			break;
+
+		//Timeout covers a wake racing with going to sleep
+		unique_lock<mutex> lock(wakeMutex);
+		wakeCondition.wait_for(lock, chrono::milliseconds(1), [this]()
+		{
+			return !running || pendingBatches.load(memory_order_acquire) > 0;
+		});
+	}
+}
+
+bool SubmissionQueue::SubmitInfos(vector<VkSubmitInfo>& submitInfos, uint64_t value)
+{
+	if (submitInfos.empty())
+		return true;
+
+	//Without timeline semaphores each call gets a fence, which completes every value up to its last
+	VkFence fence = timeline.IsTimeline() ? VK_NULL_HANDLE : timeline.GetFence();
+	auto err = vkQueueSubmit(queue, submitInfos.size(), submitInfos.data(), fence);
+	submitInfos.clear();
+	uint64_t previousValue = lastSubmittedValue;
+	lastSubmittedValue = value;
+
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Submit queue", DebugLevel::Error);
+		lastError = err;
+
+		//Nothing in the call will signal, so anything waiting for its values is let go rather than left to hang
+		if (timeline.IsTimeline())
+		{
+			timeline.Wait(previousValue);
+			timeline.SignalOnHost(value);
+		}
+		else
+			timeline.AddFence(fence, value, false);
+		return false;
+	}
+
+	if (!timeline.IsTimeline())
+	{
+		if (fence == VK_NULL_HANDLE)
+		{
+			//No fence to track the call by
+			vkQueueWaitIdle(queue);
+		}
+		timeline.AddFence(fence, value, fence != VK_NULL_HANDLE);
+	}
+	return true;
+}
+
+void SubmissionQueue::ReleaseWaits(const vector<SubmitBatch*>& batches, const vector<uint32_t>& binaryWaitCounts, size_t begin, size_t end)
+{
+	//Batches whose submit failed leave their binary semaphores (an acquire's) signalled, and signalling one again is invalid.
+	//An empty submission waiting on them unsignals them. Timeline waits are left alone, they need no unsignalling.
+	vector<VkSemaphore> waitSemaphores;
+	vector<VkPipelineStageFlags> waitStages;
+	for (size_t i = begin; i < end; ++i)
+	{
+		waitSemaphores.insert(waitSemaphores.end(), batches[i]->waitSemaphores.begin(), batches[i]->waitSemaphores.begin() + binaryWaitCounts[i]);
+		waitStages.insert(waitStages.end(), batches[i]->waitStages.begin(), batches[i]->waitStages.begin() + binaryWaitCounts[i]);
+	}
+	if (waitSemaphores.empty())
+		return;
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = nullptr;
+	submitInfo.waitSemaphoreCount = waitSemaphores.size();
+	submitInfo.pWaitSemaphores = waitSemaphores.data();
+	submitInfo.pWaitDstStageMask = waitStages.data();
+	submitInfo.commandBufferCount = 0;
+	submitInfo.pCommandBuffers = nullptr;
+	submitInfo.signalSemaphoreCount = 0;
+	submitInfo.pSignalSemaphores = nullptr;
+
+	if (vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+	{
+		Debug::Log("Release wait semaphores of a failed submit", DebugLevel::Error);
+	}
+}
+
+void SubmissionQueue::Flush(vector<SubmitBatch*>& batches)
+{
+	bool timelineSemaphores = timeline.IsTimeline();
+
+	//Sized up front, the submit infos point into these
+	vector<VkSubmitInfo> submitInfos;
+	submitInfos.reserve(batches.size());
+	vector<VkTimelineSemaphoreSubmitInfoKHR> timelineInfos(batches.size());
+	vector<vector<uint64_t>> waitValues(batches.size());
+	vector<vector<uint64_t>> signalValues(batches.size());
+	vector<uint32_t> binaryWaitCounts(batches.size());
+	size_t firstUnsubmitted = 0;
+	size_t firstInfo = 0;	//the batch submitInfos starts at
+
+	for (size_t i = 0; i < batches.size(); ++i)
+	{
+		SubmitBatch* batch = batches[i];
+		uint32_t presentWaitCount = batch->signalSemaphores.size();
+		binaryWaitCounts[i] = batch->waitSemaphores.size();
+
+		//Binary semaphores' values are ignored
+		waitValues[i].resize(batch->waitSemaphores.size(), 0);
+		for (auto& wait : batch->timelineWaits)
+		{
+			if (timelineSemaphores && wait.timeline->IsTimeline())
+			{
+				batch->waitSemaphores.push_back(wait.timeline->GetSemaphore());
+				batch->waitStages.push_back(wait.stage);
+				waitValues[i].push_back(wait.value);
+			}
+			else if (!wait.timeline->IsComplete(wait.value))
+			{
+				//An emulated timeline has no semaphore to wait on, so the wait happens here,
+				//after whatever is ahead of this batch has gone
+				if (!SubmitInfos(submitInfos, batch->value - 1))
+				{
+					ReleaseWaits(batches, binaryWaitCounts, firstInfo, i);
+				}
+				firstInfo = i;
+				wait.timeline->Wait(wait.value);
+			}
+		}
+
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.pNext = nullptr;
+
+		if (timelineSemaphores)
+		{
+			batch->signalSemaphores.push_back(timeline.GetSemaphore());
+			signalValues[i].resize(batch->signalSemaphores.size(), 0);
+			signalValues[i].back() = batch->value;
+
+			VkTimelineSemaphoreSubmitInfoKHR& timelineInfo = timelineInfos[i];
+			timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+			timelineInfo.pNext = nullptr;
+			timelineInfo.waitSemaphoreValueCount = waitValues[i].size();
+			timelineInfo.pWaitSemaphoreValues = waitValues[i].data();
+			timelineInfo.signalSemaphoreValueCount = signalValues[i].size();
+			timelineInfo.pSignalSemaphoreValues = signalValues[i].data();
+			submitInfo.pNext = &timelineInfo;
+		}
+
+		submitInfo.waitSemaphoreCount = batch->waitSemaphores.size();
+		submitInfo.pWaitSemaphores = batch->waitSemaphores.data();
+		submitInfo.pWaitDstStageMask = batch->waitStages.data();
+		submitInfo.commandBufferCount = batch->commandBuffers.size();
+		submitInfo.pCommandBuffers = batch->commandBuffers.data();
+		submitInfo.signalSemaphoreCount = batch->signalSemaphores.size();
+		submitInfo.pSignalSemaphores = batch->signalSemaphores.data();
+		submitInfos.push_back(submitInfo);
+
+		//Presents must follow their submit
+		bool lastBatch = i + 1 == batches.size();
+		if (batch->swapchain == VK_NULL_HANDLE && !lastBatch)
+			continue;
+
+		bool submitted = SubmitInfos(submitInfos, batch->value);
+		if (!submitted)
+		{
+			ReleaseWaits(batches, binaryWaitCounts, firstInfo, i + 1);
+		}
+		firstInfo = i + 1;
+
+		//Nothing will signal the semaphores a present would wait on. The image stays acquired, the error is reported
+		//through GetLastError for the renderer to recreate the swapchain or give up.
+		if (batch->swapchain != VK_NULL_HANDLE && submitted)
+		{
+			//Only the binary semaphores, a present cannot wait on a timeline
+			VkPresentInfoKHR presentInfo{};
+			presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+			presentInfo.pNext = nullptr;
+			presentInfo.waitSemaphoreCount = presentWaitCount;
+			presentInfo.pWaitSemaphores = batch->signalSemaphores.data();
+			presentInfo.swapchainCount = 1;
+			presentInfo.pSwapchains = &batch->swapchain;
+			presentInfo.pImageIndices = &batch->imageIndex;
+			presentInfo.pResults = nullptr;
+
+			lastPresentResult = vkQueuePresentKHR(queue, &presentInfo);
+		}
+
+		for (; firstUnsubmitted <= i; ++firstUnsubmitted)
+		{
+			delete batches[firstUnsubmitted];
+		}
+	}
+
+	batches.clear();
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include "vulkan\vulkan.h"
+#include "TimelineSemaphore.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+//Work for the queue from any thread. Submitted in the order it was queued.
+struct SubmitBatch
+{
+	vector<VkCommandBuffer>			commandBuffers;
+	vector<VkSemaphore>				waitSemaphores;		//binary, such as an acquired swapchain image
+	vector<VkPipelineStageFlags>	waitStages;
+	vector<VkSemaphore>				signalSemaphores;	//binary, such as one a present waits on
+
+	//Values on other queues' timelines to wait for, e.g. graphics waiting on a transfer queue's upload
+	struct TimelineWait
+	{
+		TimelineSemaphore*		timeline;
+		uint64_t				value;
+		VkPipelineStageFlags	stage;
+	};
+	vector<TimelineWait>			timelineWaits;
+	void	WaitForTimeline(TimelineSemaphore& timeline, uint64_t value, VkPipelineStageFlags stage);
+
+	//Optional present once the batch is submitted, waits on signalSemaphores
+	VkSwapchainKHR					swapchain	{ VK_NULL_HANDLE };
+	uint32_t						imageIndex	{ 0 };
+
+	uint64_t						value		{ 0 };	//assigned by Submit, signalled on the queue's timeline
+	atomic<SubmitBatch*>			next		{ nullptr };
+};
+
+//Owns a VkQueue. Producers push batches into a lock-free MPSC queue, and a dedicated thread drains
+//everything available and issues as few vkQueueSubmit calls as presents allow.
+//Every batch signals the next value on the queue's timeline, so CPU waits, other queues' waits and resource
+//retirement all work from the value Submit returns.
+class SubmissionQueue
+{
+public:
+	SubmissionQueue();
+	~SubmissionQueue();
+
+	//timelineSupported once the device was created with VK_KHR_timeline_semaphore's feature
+	bool		Start(VkDevice device, VkQueue queue, bool timelineSupported);
+	void		Stop();
+
+	//Takes ownership of the batch, returns the value it signals
+	uint64_t	Submit(SubmitBatch* batch);
+
+	//The value the next Submit will return, what resources released now are stamped with
+	uint64_t	GetNextValue() const { return lastValue.load(memory_order_relaxed) + 1; }
+	uint64_t	GetCompletedValue() { return timeline.GetCompletedValue(); }
+	bool		Wait(uint64_t value, uint64_t timeout = UINT64_MAX) { return timeline.Wait(value, timeout); }
+	TimelineSemaphore&	GetTimeline() { return timeline; }
+
+	//Blocks until everything queued so far has finished on the GPU
+	bool		WaitIdle();
+
+	VkResult	GetLastError() const { return lastError.load(); }
+	VkResult	GetLastPresentResult() const { return lastPresentResult.load(); }
+
+private:
+	VkQueue					queue { VK_NULL_HANDLE };
+	thread					submitThread;
+	atomic<bool>			running { false };
+	TimelineSemaphore		timeline;
+
+	//Vyukov intrusive MPSC queue, producers only touch head
+	atomic<SubmitBatch*>	head;
+	SubmitBatch*			tail;
+	SubmitBatch				stub;
+	void					Push(SubmitBatch* batch);
+	SubmitBatch*			Pop();
+
+	//Sleep/wake for the submit thread, producers never take the lock
+	atomic<uint32_t>		pendingBatches { 0 };
+	mutex					wakeMutex;
+	condition_variable		wakeCondition;
+
+	//Values are taken before pushing, so batches can arrive out of order. Held back until the gap fills,
+	//as the timeline's signals must increase.
+	atomic<uint64_t>		lastValue { 0 };
+	uint64_t				lastSubmittedValue { 0 };	//submit thread only
+	vector<SubmitBatch*>	heldBatches;
+
+	atomic<VkResult>		lastError { VK_SUCCESS };
+	atomic<VkResult>		lastPresentResult { VK_SUCCESS };
+
+	void	SubmitThread();
+	void	Flush(vector<SubmitBatch*>& batches);
+	bool	SubmitInfos(vector<VkSubmitInfo>& submitInfos, uint64_t value);	//value: the last one they signal
+	void	ReleaseWaits(const vector<SubmitBatch*>& batches, const vector<uint32_t>& binaryWaitCounts, size_t begin, size_t end);
+};
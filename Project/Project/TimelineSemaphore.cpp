@@ -0,0 +1,276 @@
+#include "TimelineSemaphore.h"
+#include "Debug.h"
+
+#include <chrono>
+
+TimelineSemaphore::TimelineSemaphore()
+{
+}
+
+TimelineSemaphore::~TimelineSemaphore()
+{
+	Destroy();
+}
+
+bool TimelineSemaphore::Init(VkDevice timelineDevice, bool timelineSupported)
+{
+	device = timelineDevice;
+	completedValue = 0;
+
+	if (timelineSupported)
+	{
+		pfnGetSemaphoreCounterValue = reinterpret_cast<PFN_vkGetSemaphoreCounterValueKHR>(vkGetDeviceProcAddr(device, "vkGetSemaphoreCounterValueKHR"));
+		pfnWaitSemaphores = reinterpret_cast<PFN_vkWaitSemaphoresKHR>(vkGetDeviceProcAddr(device, "vkWaitSemaphoresKHR"));
+		pfnSignalSemaphore = reinterpret_cast<PFN_vkSignalSemaphoreKHR>(vkGetDeviceProcAddr(device, "vkSignalSemaphoreKHR"));
+		timelineSupported = pfnGetSemaphoreCounterValue != nullptr && pfnWaitSemaphores != nullptr && pfnSignalSemaphore != nullptr;
+	}
+	if (!timelineSupported)
+		return true;
+
+	VkSemaphoreTypeCreateInfoKHR typeCreateInfo{};
+	typeCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+	typeCreateInfo.pNext = nullptr;
+	typeCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+	typeCreateInfo.initialValue = 0;
+
+	VkSemaphoreCreateInfo semaphoreCreateInfo{};
+	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreCreateInfo.pNext = &typeCreateInfo;
+	semaphoreCreateInfo.flags = 0;
+
+	auto err = vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphore);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create timeline semaphore", DebugLevel::Error);
+		semaphore = VK_NULL_HANDLE;
+		return false;
+	}
+	return true;
+}
+
+void TimelineSemaphore::Destroy()
+{
+	if (device == VK_NULL_HANDLE)
+		return;
+
+	vkDestroySemaphore(device, semaphore, nullptr);
+	semaphore = VK_NULL_HANDLE;
+
+	lock_guard<mutex> lock(fenceMutex);
+	for (auto& pending : pendingFences)
+	{
+		vkDestroyFence(device, pending.fence, nullptr);
+	}
+	pendingFences.clear();
+	for (auto fence : freeFences)
+	{
+		vkDestroyFence(device, fence, nullptr);
+	}
+	freeFences.clear();
+	device = VK_NULL_HANDLE;
+}
+
+void TimelineSemaphore::RaiseCompletedValue(uint64_t value)
+{
+	uint64_t completed = completedValue.load(memory_order_relaxed);
+	while (completed < value && !completedValue.compare_exchange_weak(completed, value, memory_order_release, memory_order_relaxed))
+	{
+	}
+}
+
+void TimelineSemaphore::PollFences()
+{
+	//A fence signalling means everything submitted before it has finished too
+	while (!pendingFences.empty())
+	{
+		PendingFence& pending = pendingFences.front();
+		if (pending.fence != VK_NULL_HANDLE)
+		{
+			if (vkGetFenceStatus(device, pending.fence) != VK_SUCCESS)
+				break;
+			if (pending.waiters > 0)
+			{
+				//Retired by a later poll, once the waiters have let go of it
+				RaiseCompletedValue(pending.value);
+				break;
+			}
+			freeFences.push_back(pending.fence);
+		}
+		RaiseCompletedValue(pending.value);
+		pendingFences.pop_front();
+	}
+}
+
+uint64_t TimelineSemaphore::GetCompletedValue()
+{
+	if (IsTimeline())
+	{
+		uint64_t value = 0;
+		if (pfnGetSemaphoreCounterValue(device, semaphore, &value) == VK_SUCCESS)
+		{
+			RaiseCompletedValue(value);
+		}
+	}
+	else
+	{
+		lock_guard<mutex> lock(fenceMutex);
+		PollFences();
+	}
+	return completedValue.load(memory_order_acquire);
+}
+
+bool TimelineSemaphore::Wait(uint64_t value, uint64_t timeout)
+{
+	if (value <= completedValue.load(memory_order_acquire))
+		return true;
+
+	if (IsTimeline())
+	{
+		VkSemaphoreWaitInfoKHR waitInfo{};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+		waitInfo.pNext = nullptr;
+		waitInfo.flags = 0;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &semaphore;
+		waitInfo.pValues = &value;
+
+		auto err = pfnWaitSemaphores(device, &waitInfo, timeout);
+		if (err == VK_SUCCESS)
+		{
+			RaiseCompletedValue(value);
+			return true;
+		}
+		if (err != VK_TIMEOUT)
+		{
+			Debug::Log("Wait for timeline semaphore", DebugLevel::Error);
+		}
+		return false;
+	}
+
+	//The fence is waited on without the lock, so the submitting thread can carry on getting and adding fences.
+	//Its waiter count stops it being recycled meanwhile, and deque references survive pushes at the back.
+	auto deadline = chrono::steady_clock::now() + chrono::nanoseconds(timeout == UINT64_MAX ? 0 : timeout);
+	unique_lock<mutex> lock(fenceMutex);
+	while (true)
+	{
+		PollFences();
+		if (value <= completedValue.load(memory_order_acquire))
+			return true;
+
+		//The fence completing the value, or, if that one was signalled on the host, the earliest real fence ahead of it
+		PendingFence* waited = nullptr;
+		PendingFence* earliest = nullptr;
+		for (auto& pending : pendingFences)
+		{
+			if (earliest == nullptr && pending.fence != VK_NULL_HANDLE)
+				earliest = &pending;
+			if (pending.value >= value)
+			{
+				waited = pending.fence != VK_NULL_HANDLE ? &pending : earliest;
+				break;
+			}
+		}
+
+		if (waited != nullptr)
+		{
+			VkFence fence = waited->fence;
+			++waited->waiters;
+			lock.unlock();
+			auto err = vkWaitForFences(device, 1, &fence, VK_TRUE, timeout);
+			lock.lock();
+			--waited->waiters;
+
+			if (err == VK_SUCCESS)
+				continue;
+			if (err != VK_TIMEOUT)
+			{
+				Debug::Log("Wait for timeline fence", DebugLevel::Error);
+			}
+			return false;
+		}
+
+		//Not submitted yet
+		if (timeout == UINT64_MAX)
+		{
+			fenceSubmitted.wait(lock);
+		}
+		else if (fenceSubmitted.wait_until(lock, deadline) == cv_status::timeout)
+		{
+			return false;
+		}
+	}
+}
+
+void TimelineSemaphore::SignalOnHost(uint64_t value)
+{
+	if (IsTimeline())
+	{
+		if (value <= GetCompletedValue())
+			return;
+
+		VkSemaphoreSignalInfoKHR signalInfo{};
+		signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO_KHR;
+		signalInfo.pNext = nullptr;
+		signalInfo.semaphore = semaphore;
+		signalInfo.value = value;
+
+		if (pfnSignalSemaphore(device, &signalInfo) != VK_SUCCESS)
+		{
+			Debug::Log("Signal timeline semaphore", DebugLevel::Error);
+		}
+		RaiseCompletedValue(value);
+		return;
+	}
+
+	AddFence(VK_NULL_HANDLE, value, false);
+}
+
+VkFence TimelineSemaphore::GetFence()
+{
+	VkFence fence = VK_NULL_HANDLE;
+	{
+		lock_guard<mutex> lock(fenceMutex);
+		PollFences();
+		if (!freeFences.empty())
+		{
+			fence = freeFences.back();
+			freeFences.pop_back();
+		}
+	}
+
+	if (fence != VK_NULL_HANDLE)
+	{
+		vkResetFences(device, 1, &fence);
+		return fence;
+	}
+
+	VkFenceCreateInfo fenceCreateInfo{};
+	fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fenceCreateInfo.pNext = nullptr;
+	fenceCreateInfo.flags = 0;
+
+	auto err = vkCreateFence(device, &fenceCreateInfo, nullptr, &fence);
+	if (err != VK_SUCCESS)
+	{
+		Debug::Log("Create timeline fence", DebugLevel::Error);
+		return VK_NULL_HANDLE;
+	}
+	return fence;
+}
+
+void TimelineSemaphore::AddFence(VkFence fence, uint64_t value, bool submitted)
+{
+	{
+		lock_guard<mutex> lock(fenceMutex);
+		PendingFence pending;
+		pending.fence = submitted ? fence : VK_NULL_HANDLE;
+		pending.value = value;
+		pending.waiters = 0;
+		pendingFences.push_back(pending);
+		if (!submitted && fence != VK_NULL_HANDLE)
+		{
+			freeFences.push_back(fence);	//reset again when handed out
+		}
+	}
+	fenceSubmitted.notify_all();
+}
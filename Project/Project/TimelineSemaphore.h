@@ -0,0 +1,66 @@
+#pragma once
+#include "vulkan\vulkan.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+using namespace std;
+
+//A queue's progress as one increasing value: each submission signals the next value, so "has the GPU finished with
+//this" is a compare against the completed value, and waiting for it needs no object of its own.
+//Uses a VK_KHR_timeline_semaphore semaphore. Without the extension it is emulated with a pool of fences, one per
+//vkQueueSubmit, which the owning queue asks for with GetFence; other queues can then only wait for it on the CPU.
+//Thread safe.
+class TimelineSemaphore
+{
+public:
+	TimelineSemaphore();
+	~TimelineSemaphore();
+
+	//timelineSupported once the device was created with the timelineSemaphore feature
+	bool		Init(VkDevice device, bool timelineSupported);
+	void		Destroy();
+
+	bool		IsTimeline() const { return semaphore != VK_NULL_HANDLE; }
+	VkSemaphore	GetSemaphore() const { return semaphore; }	//VK_NULL_HANDLE when emulated
+
+	//Every value up to this one has been signalled
+	uint64_t	GetCompletedValue();
+	bool		IsComplete(uint64_t value) { return value <= completedValue.load(memory_order_acquire) || value <= GetCompletedValue(); }
+
+	//False on timeout or device loss. Waiting for a value not yet submitted blocks until it is.
+	bool		Wait(uint64_t value, uint64_t timeout = UINT64_MAX);
+
+	//For a submission that did not reach the queue, so nothing waits forever for its value.
+	//A timeline's value must not pass submissions still running, so call once every earlier value has completed.
+	void		SignalOnHost(uint64_t value);
+
+	//Emulation only: a reset fence for the next vkQueueSubmit, handed back once submitted with the value it completes.
+	//A fence that was not submitted is recycled and its value signalled on the host.
+	VkFence		GetFence();
+	void		AddFence(VkFence fence, uint64_t value, bool submitted);
+
+private:
+	VkDevice				device { VK_NULL_HANDLE };
+	VkSemaphore				semaphore { VK_NULL_HANDLE };
+	PFN_vkGetSemaphoreCounterValueKHR	pfnGetSemaphoreCounterValue { nullptr };
+	PFN_vkWaitSemaphoresKHR	pfnWaitSemaphores { nullptr };
+	PFN_vkSignalSemaphoreKHR	pfnSignalSemaphore { nullptr };
+
+	atomic<uint64_t>		completedValue { 0 };	//cached, only ever raised
+	void					RaiseCompletedValue(uint64_t value);
+
+	//Emulation: fences in submission order, each completing every value up to its own. A null fence was signalled on the host.
+	struct PendingFence
+	{
+		VkFence		fence;
+		uint64_t	value;
+		uint32_t	waiters;	//threads in vkWaitForFences on it, which keep it from being recycled
+	};
+	mutex					fenceMutex;
+	condition_variable		fenceSubmitted;
+	deque<PendingFence>		pendingFences;
+	vector<VkFence>			freeFences;
+	void					PollFences();	//fenceMutex held
+};